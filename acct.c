@@ -0,0 +1,379 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		acct.c
+ *
+ * @brief 		Code file for the per EID and per message type accounting of
+ * 				the MCTP transport library
+ *
+ * @details 	Three tables are kept: received traffic by source EID,
+ * 				transmitted traffic by destination EID, and all traffic by
+ * 				message type. A row counts packets, message payload bytes,
+ * 				messages, drops by reason, retries, timeouts, and a
+ * 				histogram of the round trips of requests.
+ *
+ * 				Each thread that updates the tables has its own shard so
+ * 				counters are written by a single thread without a lock.
+ * 				mctp_get_acct() sums the shards. The counts are kept from
+ * 				mctp_init() until mctp_free() and are not reset when a
+ * 				connection is reset.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* errno
+ */
+#include <errno.h>
+
+/* printf()
+ */
+#include <stdio.h>
+
+/* calloc()
+ * free()
+ */
+#include <stdlib.h>
+
+/* memset()
+ */
+#include <string.h>
+
+/* gettid()
+ */
+#include <unistd.h>
+
+/* __u64
+ */
+#include <linux/types.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+//#define MCTP_VERBOSE
+#ifdef MCTP_VERBOSE
+ #define INIT 			unsigned step = 0;
+ #define ENTER 					if (m->verbose & MCTP_VERBOSE_THREADS) 	printf("%d:%s Enter\n", 				gettid(), __FUNCTION__);
+ #define STEP 			step++; if (m->verbose & MCTP_VERBOSE_STEPS) 	printf("%d:%s STEP: %u\n", 				gettid(), __FUNCTION__, step);
+ #define ERR32(k, i)			if (m->verbose & MCTP_VERBOSE_ERROR) 	printf("%d:%s STEP: %u ERR: %s: %d\n",	gettid(), __FUNCTION__, step, k, i);
+ #define EXIT(rc) 				if (m->verbose & MCTP_VERBOSE_THREADS)	printf("%d:%s Exit: %d\n", 				gettid(), __FUNCTION__,rc);
+#else
+ #define INIT
+ #define ENTER
+ #define STEP
+ #define ERR32(k, i)
+ #define EXIT(rc)
+#endif
+
+// Increment a counter that only the owning thread writes. Readers load it relaxed
+#define ADD(x, v) 						__atomic_store_n(&(x), (x) + (v), __ATOMIC_RELAXED)
+
+// Row of a message type. A negative type is not known and is not counted
+#define TYPE_ROW(a, t) 					(((t) < 0) ? NULL : &(a)->type[(t) & 0x7F])
+
+/* PROTOTYPES ================================================================*/
+
+static void mctp_acct_hist(struct mctp_acct_row *row, __u64 ns);
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Allocate the accounting shards of an mctp object
+ *
+ * @return 	0 upon success, 1 otherwise and sets errno
+ *
+ * STEPS
+ * 1: Allocate a shard for each thread that updates the tables
+ */
+int mctp_acct_init(struct mctp *m)
+{
+	INIT
+	int i;
+
+	ENTER
+
+	STEP // 1: Allocate a shard for each thread that updates the tables
+	for ( i = 0 ; i < MCAS_MAX ; i++ )
+	{
+		m->acct[i] = calloc(1, sizeof(struct mctp_acct));
+		if (m->acct[i] == NULL)
+		{
+			ERR32("calloc", i);
+			mctp_acct_free(m);
+			errno = ENOMEM;
+			EXIT(1)
+			return 1;
+		}
+	}
+
+	EXIT(0)
+
+	return 0;
+}
+
+/**
+ * Free the accounting shards of an mctp object
+ */
+void mctp_acct_free(struct mctp *m)
+{
+	int i;
+
+	for ( i = 0 ; i < MCAS_MAX ; i++ )
+	{
+		free(m->acct[i]);
+		m->acct[i] = NULL;
+	}
+}
+
+/**
+ * Count a received packet. Called by the Packet Reader
+ *
+ * @param src 	Source EID of the packet
+ * @param type 	Message type of the packet, or -1 if not known
+ * @param drop 	0 if the packet was accepted, otherwise its drop reason plus 1 (PRD)
+ */
+void mctp_acct_rx_pkt(struct mctp *m, int src, int type, int drop)
+{
+	struct mctp_acct *a;
+	struct mctp_acct_row *row;
+
+	a = m->acct[MCAS_PR];
+	if (a == NULL)
+		return;
+
+	row = &a->src[src & 0xFF];
+	ADD(row->rx_packets, 1);
+	if (drop)
+		ADD(row->dropped[drop - 1], 1);
+
+	row = TYPE_ROW(a, type);
+	if (row == NULL)
+		return;
+
+	ADD(row->rx_packets, 1);
+	if (drop)
+		ADD(row->dropped[drop - 1], 1);
+}
+
+/**
+ * Count a received message that was reassembled. Called by the Packet Reader
+ */
+void mctp_acct_rx_msg(struct mctp *m, struct mctp_msg *mm)
+{
+	struct mctp_acct *a;
+	struct mctp_acct_row *row;
+
+	a = m->acct[MCAS_PR];
+	if (a == NULL)
+		return;
+
+	row = &a->src[mm->src];
+	ADD(row->rx_messages, 1);
+	ADD(row->rx_bytes, mm->len);
+
+	row = TYPE_ROW(a, mm->type);
+	ADD(row->rx_messages, 1);
+	ADD(row->rx_bytes, mm->len);
+}
+
+/**
+ * Count a received message that was dropped
+ *
+ * @param shard 	Thread that dropped it (MCAS)
+ * @param src 		Source EID of the message
+ * @param type 		Message type of the message
+ * @param reason 	Drop reason (MCAD)
+ */
+void mctp_acct_drop(struct mctp *m, int shard, int src, int type, int reason)
+{
+	struct mctp_acct *a;
+	struct mctp_acct_row *row;
+
+	a = m->acct[shard];
+	if (a == NULL)
+		return;
+
+	row = &a->src[src & 0xFF];
+	ADD(row->dropped[reason], 1);
+
+	row = TYPE_ROW(a, type);
+	if (row != NULL)
+		ADD(row->dropped[reason], 1);
+}
+
+/**
+ * Count a message handed to the transport. Called by the Socket Writer
+ *
+ * Must be called before the Socket Writer releases a request, as the action
+ * may be completed and retired as soon as it does
+ *
+ * @param head 	Linked list of the packets of the message
+ */
+void mctp_acct_tx(struct mctp *m, struct mctp_action *ma, struct mctp_pkt_wrapper *head)
+{
+	struct mctp_acct *a;
+	struct mctp_acct_row *row[2];
+	struct mctp_pkt_wrapper *pw;
+	struct mctp_msg *mm;
+	__u64 n;
+	int i;
+
+	a = m->acct[MCAS_SW];
+	if (a == NULL || head == NULL)
+		return;
+
+	// The response is sent if there is one, otherwise the request
+	mm = (ma->rsp != NULL) ? ma->rsp : ma->req;
+
+	n = 0;
+	for ( pw = head ; pw != NULL ; pw = pw->next )
+		n++;
+
+	row[0] = &a->dst[head->pkt.hdr.dest];
+	row[1] = TYPE_ROW(a, mm->type);
+	for ( i = 0 ; i < 2 ; i++ )
+	{
+		ADD(row[i]->tx_packets, n);
+		ADD(row[i]->tx_messages, 1);
+		ADD(row[i]->tx_bytes, mm->len);
+	}
+}
+
+/**
+ * Count a request that is retransmitted. Called by the Submission Thread
+ */
+void mctp_acct_retry(struct mctp *m, struct mctp_action *ma)
+{
+	struct mctp_acct *a;
+
+	a = m->acct[MCAS_ST];
+	if (a == NULL)
+		return;
+
+	ADD(a->dst[ma->req->dst].retries, 1);
+	ADD(TYPE_ROW(a, ma->req->type)->retries, 1);
+}
+
+/**
+ * Count a request that failed after its last transmission timed out. Called by the Submission Thread
+ */
+void mctp_acct_timeout(struct mctp *m, struct mctp_action *ma)
+{
+	struct mctp_acct *a;
+
+	a = m->acct[MCAS_ST];
+	if (a == NULL)
+		return;
+
+	ADD(a->dst[ma->req->dst].timeouts, 1);
+	ADD(TYPE_ROW(a, ma->req->type)->timeouts, 1);
+}
+
+/**
+ * Record the round trip of a request that was matched to its response. Called by the Message Handler
+ *
+ * The round trip runs from the last transmission of the request to the
+ * receipt of the response. It is counted against the EID the request was
+ * sent to
+ */
+void mctp_acct_rtt(struct mctp *m, struct mctp_action *ma, struct mctp_msg *rsp)
+{
+	struct mctp_acct *a;
+	__u64 ns;
+
+	a = m->acct[MCAS_MH];
+	if (a == NULL || ma->submitted == 0 || rsp->ts < ma->submitted)
+		return;
+
+	ns = mctp_ticks_to_ns(rsp->ts - ma->submitted);
+
+	mctp_acct_hist(&a->dst[rsp->src], ns);
+	mctp_acct_hist(TYPE_ROW(a, ma->req->type), ns);
+}
+
+/**
+ * Add a round trip to the histogram of a row
+ */
+static void mctp_acct_hist(struct mctp_acct_row *row, __u64 ns)
+{
+	__u64 us;
+	int i;
+
+	us = ns / 1000;
+	i = (us == 0) ? 0 : 64 - __builtin_clzll(us);
+	if (i >= MCTP_LAT_BUCKETS)
+		i = MCTP_LAT_BUCKETS - 1;
+
+	ADD(row->rtt_hist[i], 1);
+	ADD(row->rtt_sum, ns);
+}
+
+/**
+ * Get an accounting table summed over the shards of an mctp object
+ *
+ * @param table 	Table to get (MCAT)
+ * @param rows 		Array to fill. Row i is EID i or message type i
+ * @param num 		Number of entries in rows. Rows of the table past num are not returned
+ * @return 			0 upon success, 1 otherwise and sets errno
+ *
+ * STEPS
+ * 1: Validate parameters
+ * 2: Sum each row of the table over the shards
+ */
+int mctp_get_acct(struct mctp *m, int table, struct mctp_acct_row *rows, int num)
+{
+	INIT
+	struct mctp_acct_row *src;
+	__u64 *d, *s;
+	unsigned i, j, k, n;
+
+	ENTER
+
+	STEP // 1: Validate parameters
+	if (table < 0 || table >= MCAT_MAX || rows == NULL || num < 0)
+	{
+		ERR32("table", table);
+		errno = EINVAL;
+		EXIT(1)
+		return 1;
+	}
+
+	n = (table == MCAT_TYPE) ? MCTP_ACCT_TYPES : MCTP_NUM_EIDS;
+	if ((unsigned) num < n)
+		n = num;
+
+	memset(rows, 0, n * sizeof(struct mctp_acct_row));
+
+	STEP // 2: Sum each row of the table over the shards
+	for ( k = 0 ; k < MCAS_MAX ; k++ )
+	{
+		if (m->acct[k] == NULL)
+			continue;
+
+		if (table == MCAT_SRC)
+			src = m->acct[k]->src;
+		else if (table == MCAT_DST)
+			src = m->acct[k]->dst;
+		else
+			src = m->acct[k]->type;
+
+		for ( i = 0 ; i < n ; i++ )
+		{
+			d = (__u64*) &rows[i];
+			s = (__u64*) &src[i];
+			for ( j = 0 ; j < sizeof(struct mctp_acct_row) / sizeof(__u64) ; j++ )
+				d[j] += __atomic_load_n(&s[j], __ATOMIC_RELAXED);
+		}
+	}
+
+	EXIT(0)
+
+	return 0;
+}
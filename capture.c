@@ -0,0 +1,652 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		capture.c
+ *
+ * @brief 		Code file for packet capture of the MCTP transport library
+ *
+ * @details 	While capture runs, every packet received by the Packet Reader
+ * 				and every packet handed to the transport is copied with its
+ * 				time stamp into a ring for its direction. A writer thread
+ * 				streams the rings to a pcapng or pcap file with link type
+ * 				LINKTYPE_MCTP, which Wireshark dissects. Set a filter with
+ * 				mctp_set_filter() to record only the packets of interest.
+ *
+ * 				The data path does not wait on the file. Each ring has one
+ * 				producer thread and takes no lock. When a ring is full the
+ * 				packet is not captured and the drop is counted.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* errno
+ */
+#include <errno.h>
+
+/* FILE
+ * fopen()
+ * fwrite()
+ * fflush()
+ * fclose()
+ * setvbuf()
+ */
+#include <stdio.h>
+
+/* calloc()
+ * free()
+ */
+#include <stdlib.h>
+
+/* memset()
+ * memcpy()
+ */
+#include <string.h>
+
+/* usleep()
+ * gettid()
+ */
+#include <unistd.h>
+
+/* pthread_create()
+ * pthread_join()
+ */
+#include <pthread.h>
+
+/* struct timespec
+ * clock_gettime()
+ */
+#include <time.h>
+
+/* __u8
+ * __u16
+ * __u32
+ * __u64
+ */
+#include <linux/types.h>
+
+#include <ptrqueue.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+//#define MCTP_VERBOSE
+#ifdef MCTP_VERBOSE
+ #define INIT 			unsigned step = 0;
+ #define ENTER 					if (m->verbose & MCTP_VERBOSE_THREADS) 	printf("%d:%s Enter\n", 				gettid(), __FUNCTION__);
+ #define STEP 			step++; if (m->verbose & MCTP_VERBOSE_STEPS) 	printf("%d:%s STEP: %u\n", 				gettid(), __FUNCTION__, step);
+ #define ERR32(k, i)			if (m->verbose & MCTP_VERBOSE_ERROR) 	printf("%d:%s STEP: %u ERR: %s: %d\n",	gettid(), __FUNCTION__, step, k, i);
+ #define EXIT(rc) 				if (m->verbose & MCTP_VERBOSE_THREADS)	printf("%d:%s Exit: %d\n", 				gettid(), __FUNCTION__,rc);
+#else
+ #define INIT
+ #define ENTER
+ #define STEP
+ #define ERR32(k, i)
+ #define EXIT(rc)
+#endif
+
+// pcapng block types
+#define PCAPNG_SHB 						0x0A0D0D0A
+#define PCAPNG_IDB 						0x00000001
+#define PCAPNG_EPB 						0x00000006
+#define PCAPNG_BYTE_ORDER 				0x1A2B3C4D
+
+// pcapng option codes
+#define PCAPNG_OPT_END 					0
+#define PCAPNG_OPT_IF_TSRESOL 			9
+#define PCAPNG_OPT_EPB_FLAGS 			2
+
+// epb_flags direction bits
+#define PCAPNG_FLAG_INBOUND 			0x1
+#define PCAPNG_FLAG_OUTBOUND 			0x2
+
+// Magic of a classic pcap file with nanosecond time stamps
+#define PCAP_MAGIC_NSEC 				0xA1B23C4D
+
+// Round up to a multiple of 4 as pcapng requires
+#define PAD4(n) 						(((n) + 3) & ~3u)
+
+/* STRUCTS ===================================================================*/
+
+/**
+ * pcapng Section Header Block
+ */
+struct __attribute__((__packed__)) pcapng_shb
+{
+	__u32 type;
+	__u32 len;
+	__u32 byte_order;
+	__u16 major;
+	__u16 minor;
+	__s64 section_len;
+	__u32 len2;
+};
+
+/**
+ * pcapng Interface Description Block with if_tsresol set to nanoseconds
+ */
+struct __attribute__((__packed__)) pcapng_idb
+{
+	__u32 type;
+	__u32 len;
+	__u16 linktype;
+	__u16 rsvd;
+	__u32 snaplen;
+	__u16 tsresol_code;
+	__u16 tsresol_len;
+	__u8 tsresol;
+	__u8 tsresol_pad[3];
+	__u16 end_code;
+	__u16 end_len;
+	__u32 len2;
+};
+
+/**
+ * pcapng Enhanced Packet Block up to the packet data
+ */
+struct __attribute__((__packed__)) pcapng_epb
+{
+	__u32 type;
+	__u32 len;
+	__u32 interface;
+	__u32 ts_high;
+	__u32 ts_low;
+	__u32 caplen;
+	__u32 origlen;
+};
+
+/**
+ * pcapng Enhanced Packet Block after the padded packet data
+ */
+struct __attribute__((__packed__)) pcapng_epb_tail
+{
+	__u16 flags_code;
+	__u16 flags_len;
+	__u32 flags;
+	__u16 end_code;
+	__u16 end_len;
+	__u32 len;
+};
+
+/**
+ * Classic pcap file header
+ */
+struct __attribute__((__packed__)) pcap_hdr
+{
+	__u32 magic;
+	__u16 major;
+	__u16 minor;
+	__s32 thiszone;
+	__u32 sigfigs;
+	__u32 snaplen;
+	__u32 linktype;
+};
+
+/**
+ * Classic pcap record header
+ */
+struct __attribute__((__packed__)) pcap_rec
+{
+	__u32 ts_sec;
+	__u32 ts_nsec;
+	__u32 caplen;
+	__u32 origlen;
+};
+
+/* PROTOTYPES ================================================================*/
+
+static void *mctp_capture_thread(void *arg);
+static int mctp_capture_drain(struct mctp_capture *cap);
+static int mctp_capture_write_hdr(struct mctp_capture *cap);
+static int mctp_capture_write_rec(struct mctp_capture *cap, int dir, struct mctp_cap_rec *rec);
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Start capturing the packets of an mctp object to a file
+ *
+ * May be called before or after mctp_run()
+ *
+ * @param path 		File to create or truncate
+ * @param format 	enum _MCCF
+ * @param snaplen 	Bytes captured of each packet. 0 for the whole packet
+ * @param ring 		Records in each ring. 0 for MCTP_CAPTURE_RING_SIZE
+ * @return 			0 upon success, 1 otherwise and sets errno
+ *
+ * STEPS
+ * 1: Verify input
+ * 2: Allocate the capture object the first time
+ * 3: Allocate the rings
+ * 4: Open the file and write its header
+ * 5: Start the writer thread
+ * 6: Start capturing
+ */
+int mctp_capture_start(struct mctp *m, const char *path, int format, unsigned snaplen, unsigned ring)
+{
+	INIT
+	struct mctp_capture *cap;
+	struct timespec ts;
+	unsigned size;
+	int rv, i;
+
+	ENTER
+
+	// Initialize variables
+	rv = 1;
+
+	STEP // 1: Verify input
+	if (path == NULL || format < 0 || format >= MCCF_MAX)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	if (m->capture || (m->cap != NULL && m->cap->fp != NULL))
+	{
+		errno = EBUSY;
+		goto end;
+	}
+	if (snaplen == 0 || snaplen > MCLN_PKT)
+		snaplen = MCLN_PKT;
+	if (ring == 0)
+		ring = MCTP_CAPTURE_RING_SIZE;
+	for ( size = 1 ; size < ring ; size <<= 1 );
+
+	STEP // 2: Allocate the capture object the first time
+	if (m->cap == NULL)
+	{
+		m->cap = calloc(1, sizeof(struct mctp_capture));
+		if (m->cap == NULL)
+			goto end;
+	}
+	cap = m->cap;
+
+	STEP // 3: Allocate the rings
+	for ( i = 0 ; i < MCCD_MAX ; i++ )
+	{
+		cap->ring[i].recs = calloc(size, sizeof(struct mctp_cap_rec));
+		if (cap->ring[i].recs == NULL)
+			goto end_rings;
+		cap->ring[i].mask = size - 1;
+		cap->ring[i].head = 0;
+		cap->ring[i].tail = 0;
+		cap->ring[i].dropped = 0;
+	}
+
+	STEP // 4: Open the file and write its header
+	cap->format = format;
+	cap->snaplen = snaplen;
+	cap->stop = 0;
+	cap->error = 0;
+	cap->written = 0;
+
+	cap->fp = fopen(path, "w");
+	if (cap->fp == NULL)
+	{
+		ERR32("fopen", errno);
+		goto end_rings;
+	}
+	setvbuf(cap->fp, NULL, _IOFBF, MCTP_CAPTURE_BUF_SIZE);
+
+	if (mctp_capture_write_hdr(cap) != 0)
+		goto end_file;
+
+	// Pair the packet clock with the wall clock the file is stamped with
+	clock_gettime(CLOCK_REALTIME, &ts);
+	cap->t0 = mctp_now();
+	cap->real0 = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	STEP // 5: Start the writer thread
+	if (pthread_create(&cap->pt, NULL, mctp_capture_thread, cap) != 0)
+		goto end_file;
+
+	STEP // 6: Start capturing
+	__atomic_store_n(&m->capture, 1, __ATOMIC_SEQ_CST);
+
+	rv = 0;
+	goto end;
+
+end_file:
+
+	fclose(cap->fp);
+	cap->fp = NULL;
+	unlink(path);
+
+end_rings:
+
+	for ( i = 0 ; i < MCCD_MAX ; i++ )
+	{
+		free(cap->ring[i].recs);
+		cap->ring[i].recs = NULL;
+	}
+
+end:
+
+	EXIT(rv);
+
+	return rv;
+}
+
+/**
+ * Stop capturing and close the capture file
+ *
+ * Packets already in the rings are written before the file is closed
+ *
+ * @return 		0 upon success, 1 if capture was not running or writing the file failed and sets errno
+ *
+ * STEPS
+ * 1: Verify input
+ * 2: Stop capturing and wait for the data path to leave the rings
+ * 3: Stop the writer thread once it has drained the rings
+ * 4: Close the file and free the rings
+ */
+int mctp_capture_stop(struct mctp *m)
+{
+	INIT
+	struct mctp_capture *cap;
+	int rv, i;
+
+	ENTER
+
+	// Initialize variables
+	rv = 1;
+	cap = m->cap;
+
+	STEP // 1: Verify input
+	if (cap == NULL || cap->fp == NULL)
+		goto end;
+
+	STEP // 2: Stop capturing and wait for the data path to leave the rings
+	__atomic_store_n(&m->capture, 0, __ATOMIC_SEQ_CST);
+	for ( i = 0 ; i < MCCD_MAX ; i++ )
+		while (__atomic_load_n(&cap->ring[i].busy, __ATOMIC_SEQ_CST))
+			usleep(10);
+
+	STEP // 3: Stop the writer thread once it has drained the rings
+	__atomic_store_n(&cap->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(cap->pt, NULL);
+
+	STEP // 4: Close the file and free the rings
+	if (fclose(cap->fp) != 0 && cap->error == 0)
+		cap->error = errno;
+	cap->fp = NULL;
+
+	for ( i = 0 ; i < MCCD_MAX ; i++ )
+	{
+		free(cap->ring[i].recs);
+		cap->ring[i].recs = NULL;
+	}
+
+	if (cap->error != 0)
+	{
+		errno = cap->error;
+		goto end;
+	}
+
+	rv = 0;
+
+end:
+
+	EXIT(rv);
+
+	return rv;
+}
+
+/**
+ * Copy a packet into a capture ring if it matches the filter. Called through MCTP_CAPTURE()
+ *
+ * @param dir 	enum _MCCD
+ * @param type 	Message type of the packet. -1 if unknown
+ * @param ts 	Time the packet was received or transmitted
+ */
+void mctp_capture_pkt(struct mctp *m, int dir, mctp_ticks_t ts, struct mctp_pkt *pkt, int type)
+{
+	struct mctp_capture *cap;
+	struct mctp_cap_ring *r;
+	struct mctp_cap_rec *rec;
+
+	if (!mctp_filter_match(m, pkt, type))
+		return;
+
+	cap = m->cap;
+	r = &cap->ring[dir];
+
+	// mctp_capture_stop() clears capture before it waits for busy to clear
+	__atomic_store_n(&r->busy, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&m->capture, __ATOMIC_SEQ_CST))
+		goto end;
+
+	if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->mask)
+	{
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		goto end;
+	}
+
+	rec = &r->recs[r->head & r->mask];
+	rec->ts = ts;
+	rec->len = cap->snaplen;
+	memcpy(rec->data, pkt, cap->snaplen);
+
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+
+end:
+
+	__atomic_store_n(&r->busy, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Packets not captured because a ring was full since capture last started
+ */
+__u64 mctp_capture_dropped(struct mctp *m)
+{
+	__u64 n;
+	int i;
+
+	if (m->cap == NULL)
+		return 0;
+
+	n = 0;
+	for ( i = 0 ; i < MCCD_MAX ; i++ )
+		n += __atomic_load_n(&m->cap->ring[i].dropped, __ATOMIC_RELAXED);
+
+	return n;
+}
+
+/**
+ * Writer thread. Streams the rings to the file until stopped
+ */
+static void *mctp_capture_thread(void *arg)
+{
+	struct mctp_capture *cap = arg;
+
+	for (;;)
+	{
+		if (mctp_capture_drain(cap) > 0)
+			continue;
+
+		// Nothing more is captured once stop is set. The rings are empty
+		if (__atomic_load_n(&cap->stop, __ATOMIC_ACQUIRE))
+		{
+			if (mctp_capture_drain(cap) == 0)
+				break;
+			continue;
+		}
+
+		if (fflush(cap->fp) != 0 && cap->error == 0)
+			cap->error = errno;
+
+		usleep(MCTP_CAPTURE_POLL_MSEC * 1000);
+	}
+
+	return NULL;
+}
+
+/**
+ * Write the pending records of both rings to the file in time stamp order
+ *
+ * @return 		Number of records written
+ */
+static int mctp_capture_drain(struct mctp_capture *cap)
+{
+	struct mctp_cap_ring *r;
+	struct mctp_cap_rec *rec, *next;
+	int n, i, dir;
+
+	n = 0;
+
+	for (;;)
+	{
+		rec = NULL;
+		dir = 0;
+		for ( i = 0 ; i < MCCD_MAX ; i++ )
+		{
+			r = &cap->ring[i];
+			if (r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+				continue;
+
+			next = &r->recs[r->tail & r->mask];
+			if (rec == NULL || next->ts < rec->ts)
+			{
+				rec = next;
+				dir = i;
+			}
+		}
+
+		if (rec == NULL)
+			break;
+
+		if (mctp_capture_write_rec(cap, dir, rec) != 0 && cap->error == 0)
+			cap->error = errno;
+
+		// Hand the slot back to the data path
+		r = &cap->ring[dir];
+		__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * Write the header of the capture file
+ *
+ * @return 		0 upon success, 1 otherwise and sets errno
+ */
+static int mctp_capture_write_hdr(struct mctp_capture *cap)
+{
+	struct pcapng_shb shb;
+	struct pcapng_idb idb;
+	struct pcap_hdr hdr;
+
+	if (cap->format == MCCF_PCAP)
+	{
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = PCAP_MAGIC_NSEC;
+		hdr.major = 2;
+		hdr.minor = 4;
+		hdr.snaplen = cap->snaplen;
+		hdr.linktype = MCTP_LINKTYPE;
+
+		return fwrite(&hdr, sizeof(hdr), 1, cap->fp) != 1;
+	}
+
+	memset(&shb, 0, sizeof(shb));
+	shb.type = PCAPNG_SHB;
+	shb.len = sizeof(shb);
+	shb.byte_order = PCAPNG_BYTE_ORDER;
+	shb.major = 1;
+	shb.minor = 0;
+	shb.section_len = -1;
+	shb.len2 = sizeof(shb);
+
+	memset(&idb, 0, sizeof(idb));
+	idb.type = PCAPNG_IDB;
+	idb.len = sizeof(idb);
+	idb.linktype = MCTP_LINKTYPE;
+	idb.snaplen = cap->snaplen;
+	idb.tsresol_code = PCAPNG_OPT_IF_TSRESOL;
+	idb.tsresol_len = 1;
+	idb.tsresol = 9;
+	idb.end_code = PCAPNG_OPT_END;
+	idb.len2 = sizeof(idb);
+
+	if (fwrite(&shb, sizeof(shb), 1, cap->fp) != 1)
+		return 1;
+	if (fwrite(&idb, sizeof(idb), 1, cap->fp) != 1)
+		return 1;
+
+	return 0;
+}
+
+/**
+ * Write one packet to the capture file
+ *
+ * @return 		0 upon success, 1 otherwise and sets errno
+ */
+static int mctp_capture_write_rec(struct mctp_capture *cap, int dir, struct mctp_cap_rec *rec)
+{
+	static const __u8 pad[4];
+	struct pcapng_epb epb;
+	struct pcapng_epb_tail tail;
+	struct pcap_rec pr;
+	__u64 ns;
+	unsigned padded;
+
+	// Wall clock time of the packet. Received packets may predate t0
+	if (rec->ts >= cap->t0)
+		ns = cap->real0 + mctp_ticks_to_ns(rec->ts - cap->t0);
+	else
+		ns = cap->real0 - mctp_ticks_to_ns(cap->t0 - rec->ts);
+
+	if (cap->format == MCCF_PCAP)
+	{
+		pr.ts_sec = ns / 1000000000ULL;
+		pr.ts_nsec = ns % 1000000000ULL;
+		pr.caplen = rec->len;
+		pr.origlen = MCLN_PKT;
+
+		if (fwrite(&pr, sizeof(pr), 1, cap->fp) != 1)
+			return 1;
+		if (fwrite(rec->data, rec->len, 1, cap->fp) != 1)
+			return 1;
+		cap->written++;
+		return 0;
+	}
+
+	padded = PAD4(rec->len);
+
+	epb.type = PCAPNG_EPB;
+	epb.len = sizeof(epb) + padded + sizeof(tail);
+	epb.interface = 0;
+	epb.ts_high = ns >> 32;
+	epb.ts_low = ns & 0xFFFFFFFF;
+	epb.caplen = rec->len;
+	epb.origlen = MCLN_PKT;
+
+	tail.flags_code = PCAPNG_OPT_EPB_FLAGS;
+	tail.flags_len = 4;
+	tail.flags = (dir == MCCD_RX) ? PCAPNG_FLAG_INBOUND : PCAPNG_FLAG_OUTBOUND;
+	tail.end_code = PCAPNG_OPT_END;
+	tail.end_len = 0;
+	tail.len = epb.len;
+
+	if (fwrite(&epb, sizeof(epb), 1, cap->fp) != 1)
+		return 1;
+	if (fwrite(rec->data, rec->len, 1, cap->fp) != 1)
+		return 1;
+	if (padded > rec->len && fwrite(pad, padded - rec->len, 1, cap->fp) != 1)
+		return 1;
+	if (fwrite(&tail, sizeof(tail), 1, cap->fp) != 1)
+		return 1;
+
+	cap->written++;
+
+	return 0;
+}
+
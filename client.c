@@ -206,7 +206,7 @@ int test_ctrl_get_endpoint_uuid(struct mctp *m)
 	 */
 
 	// STEP 1: Get an mctp_msg from the queue
-	mm = pq_pop(m->msgs, 1);
+	mm = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (mm == NULL)  {
 		goto end;
 	}
@@ -225,14 +225,14 @@ int test_ctrl_get_endpoint_uuid(struct mctp *m)
 	// STEP 5: Configure command specific fields
 
 	// STEP 6: Put message into send queue
-    pq_push(m->tmq, mm);
+    mctp_pq_push(m, MCPQ_TMQ, mm);
 
 	printf("========== Waiting for response ==========\n");
 
 	// STEP 7: Get response from the server
-	mm = pq_pop(m->rmq, 1);
+	mm = mctp_pq_pop(m, MCPQ_RMQ, 1);
     if (mm == 0) {
-         printf("%s pq_pop() returned an error\n", __FUNCTION__);
+         printf("%s mctp_pq_pop() returned an error\n", __FUNCTION__);
 		 goto end;
 	}
 
@@ -240,7 +240,7 @@ int test_ctrl_get_endpoint_uuid(struct mctp *m)
 	mctp_prnt_msg(mm);	
 
 	// STEP 9: Put the response message back into the recv queue 
-	pq_push(m->msgs, mm);
+	mctp_pq_push(m, MCPQ_MSGS, mm);
 
 	return 0;
 
@@ -271,7 +271,7 @@ int test_ctrl_set_eid(struct mctp *m)
 	 */
 
 	// STEP 1: Get an mctp_msg from the queue
-	mm = pq_pop(m->msgs, 1);
+	mm = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (mm == NULL)  {
 		goto end;
 	}
@@ -295,14 +295,14 @@ int test_ctrl_set_eid(struct mctp *m)
 	mm->len = MCLN_TYPE + mctp_len_ctrl((__u8*)mctp_get_ctrl(mm));
 
 	// STEP 6: Put message into send queue
-    pq_push(m->tmq, mm);
+    mctp_pq_push(m, MCPQ_TMQ, mm);
 
 	printf("========== Waiting for response ==========\n");
 
 	// STEP 7: Get response from the server
-	mm = pq_pop(m->rmq, 1);
+	mm = mctp_pq_pop(m, MCPQ_RMQ, 1);
     if (mm == 0) {
-         printf("%s pq_pop() returned an error\n", __FUNCTION__);
+         printf("%s mctp_pq_pop() returned an error\n", __FUNCTION__);
 		 goto end;
 	}
 
@@ -310,7 +310,7 @@ int test_ctrl_set_eid(struct mctp *m)
 	mctp_prnt_msg(mm);	
 
 	// STEP 9: Put the response message back into the recv queue 
-	pq_push(m->msgs, mm);
+	mctp_pq_push(m, MCPQ_MSGS, mm);
 
 	return 0;
 
@@ -336,7 +336,7 @@ int test_ctrl_get_eid(struct mctp *m)
 	 */
 
 	// STEP 1: Get an mctp_msg from the queue
-	mm = pq_pop(m->msgs, 1);
+	mm = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (mm == NULL)  {
 		goto end;
 	}
@@ -355,14 +355,14 @@ int test_ctrl_get_eid(struct mctp *m)
 	mm->len = MCLN_TYPE + mctp_len_ctrl((__u8*)mctp_get_ctrl(mm));
 
 	// STEP 6: Put message into send queue
-    pq_push(m->tmq, mm);
+    mctp_pq_push(m, MCPQ_TMQ, mm);
 
 	printf("========== Waiting for response ==========\n");
 
 	// STEP 7: Get response from the server
-	mm = pq_pop(m->rmq, 1);
+	mm = mctp_pq_pop(m, MCPQ_RMQ, 1);
     if (mm == 0) {
-         printf("%s pq_pop() returned an error\n", __FUNCTION__);
+         printf("%s mctp_pq_pop() returned an error\n", __FUNCTION__);
 		 goto end;
 	}
 
@@ -370,7 +370,7 @@ int test_ctrl_get_eid(struct mctp *m)
 	mctp_prnt_msg(mm);	
 
 	// STEP 9: Put the response message back into the recv queue 
-	pq_push(m->msgs, mm);
+	mctp_pq_push(m, MCPQ_MSGS, mm);
 
 	return 0;
 	
@@ -395,7 +395,7 @@ int test_ctrl_get_msg_type_support(struct mctp *m)
 	 */
 
 	// STEP 1: Get an mctp_msg from the queue
-	mm = pq_pop(m->msgs, 1);
+	mm = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (mm == NULL)  {
 		goto end;
 	}
@@ -414,14 +414,14 @@ int test_ctrl_get_msg_type_support(struct mctp *m)
 	mm->len = MCLN_TYPE + mctp_len_ctrl((__u8*)mctp_get_ctrl(mm));
 
 	// STEP 6: Put message into send queue
-    pq_push(m->tmq, mm);
+    mctp_pq_push(m, MCPQ_TMQ, mm);
 
 	printf("========== Waiting for response ==========\n");
 
 	// STEP 7: Get response from the server
-	mm = pq_pop(m->rmq, 1);
+	mm = mctp_pq_pop(m, MCPQ_RMQ, 1);
     if (mm == 0) {
-         printf("%s pq_pop() returned an error\n", __FUNCTION__);
+         printf("%s mctp_pq_pop() returned an error\n", __FUNCTION__);
 		 goto end;
 	}
 
@@ -429,7 +429,7 @@ int test_ctrl_get_msg_type_support(struct mctp *m)
 	mctp_prnt_msg(mm);	
 
 	// STEP 9: Put the response message back into the recv queue 
-	pq_push(m->msgs, mm);
+	mctp_pq_push(m, MCPQ_MSGS, mm);
 
 	return 0;
 
@@ -456,7 +456,7 @@ int test_ctrl_get_version_support(struct mctp *m)
 	 */
 
 	// STEP 1: Get an mctp_msg from the queue
-	mm = pq_pop(m->msgs, 1);
+	mm = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (mm == NULL)  {
 		goto end;
 	}
@@ -477,14 +477,14 @@ int test_ctrl_get_version_support(struct mctp *m)
 	mm->len = MCLN_TYPE + mctp_len_ctrl((__u8*)mctp_get_ctrl(mm));
 
 	// STEP 6: Put message into send queue
-    pq_push(m->tmq, mm);
+    mctp_pq_push(m, MCPQ_TMQ, mm);
 
 	printf("========== Waiting for response ==========\n");
 
 	// STEP 7: Get response from the server
-	mm = pq_pop(m->rmq, 1);
+	mm = mctp_pq_pop(m, MCPQ_RMQ, 1);
     if (mm == 0) {
-         printf("%s pq_pop() returned an error\n", __FUNCTION__);
+         printf("%s mctp_pq_pop() returned an error\n", __FUNCTION__);
 		 goto end;
 	}
 
@@ -493,7 +493,7 @@ int test_ctrl_get_version_support(struct mctp *m)
 	mctp_prnt_msg(mm);	
 
 	// STEP 9: Put the response message back into the recv queue 
-	pq_push(m->msgs, mm);
+	mctp_pq_push(m, MCPQ_MSGS, mm);
 
 	return 0;
 end:
@@ -521,7 +521,7 @@ int test_fmapi_identify_switch(struct mctp *m)
 	struct mctp_msg *mm;
 
 	// STEP 1: Get an mctp_msg from the queue
-	mm = pq_pop(m->msgs, 1);
+	mm = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (mm == NULL) 
 		goto end;
 
@@ -547,14 +547,14 @@ int test_fmapi_identify_switch(struct mctp *m)
 	mm->len = FMLN_HDR;
 
 	// STEP 7: Put message into send queue
-    pq_push(m->tmq, mm);
+    mctp_pq_push(m, MCPQ_TMQ, mm);
 
 	printf("========== Waiting for response ==========\n");
 
 	// STEP 8: Get response from the server
-	mm = pq_pop(m->rmq, 1);
+	mm = mctp_pq_pop(m, MCPQ_RMQ, 1);
     if (mm == 0) {
-         printf("%s pq_pop() returned an error\n", __FUNCTION__);
+         printf("%s mctp_pq_pop() returned an error\n", __FUNCTION__);
 		 goto end;
 	}
 
@@ -570,7 +570,7 @@ int test_fmapi_identify_switch(struct mctp *m)
 	}
 
 	// STEP 10: Put the response message back into the recv queue 
-	pq_push(m->msgs, mm);
+	mctp_pq_push(m, MCPQ_MSGS, mm);
 
 	return 0;
 end:
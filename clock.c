@@ -0,0 +1,236 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		clock.c
+ *
+ * @brief 		Code file for the time stamp clock of the MCTP transport library
+ *
+ * @details 	Packets, messages and actions are stamped with a 64 bit tick
+ * 				count read from a clock selected once per process. The
+ * 				invariant TSC is used when the CPU has one. It is read with a
+ * 				single instruction and calibrated against CLOCK_MONOTONIC at
+ * 				startup. Otherwise the ticks are CLOCK_MONOTONIC nanoseconds
+ * 				read through the vDSO.
+ *
+ * 				Ticks are converted to nanoseconds with a fixed point multiply
+ * 				so the hot path never divides.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* clock_gettime()
+ * nanosleep()
+ */
+#include <time.h>
+
+/* __u64
+ */
+#include <linux/types.h>
+
+#if defined(__x86_64__)
+/* __get_cpuid()
+ */
+ #include <cpuid.h>
+#endif
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+#define NSEC_PER_SEC 					1000000000ULL
+
+// CPUID leaf and EDX bit reporting an invariant TSC
+#define CPUID_POWER_LEAF 				0x80000007
+#define CPUID_INVARIANT_TSC 			(1 << 8)
+
+/* PROTOTYPES ================================================================*/
+
+static mctp_ticks_t mctp_clock_mono();
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+/**
+ * Clock of the process. Reads CLOCK_MONOTONIC until mctp_clock_init() is called
+ */
+struct mctp_clock mctp_clock = {
+	.source = MCCK_MONOTONIC,
+	.ready = 0,
+	.hz = NSEC_PER_SEC,
+	.ns_mult = 1ULL << MCTP_CLOCK_SHIFT,
+	.tick_mult = 1ULL << MCTP_CLOCK_SHIFT,
+};
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Read CLOCK_MONOTONIC in nanoseconds
+ */
+static mctp_ticks_t mctp_clock_mono()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (mctp_ticks_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+#if defined(__x86_64__)
+/**
+ * Check if the TSC runs at a constant rate in all power states
+ */
+static int mctp_tsc_invariant()
+{
+	unsigned a, b, c, d;
+
+	if (__get_cpuid(CPUID_POWER_LEAF, &a, &b, &c, &d) == 0)
+		return 0;
+
+	return (d & CPUID_INVARIANT_TSC) != 0;
+}
+
+/**
+ * Measure the TSC frequency against CLOCK_MONOTONIC
+ *
+ * Each clock read is bracketed by two TSC reads and the midpoint is used so a
+ * preemption during the read does not skew the result.
+ *
+ * @return Ticks per second, 0 upon error
+ */
+static __u64 mctp_tsc_calibrate()
+{
+	struct timespec ts, delay;
+	__u64 c0, c1, t0, t1, a, b;
+
+	delay.tv_sec = 0;
+	delay.tv_nsec = MCTP_CLOCK_CALIBRATE_MSEC * 1000000L;
+
+	a = __rdtsc();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	b = __rdtsc();
+	c0 = a + (b - a) / 2;
+	t0 = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+
+	nanosleep(&delay, NULL);
+
+	a = __rdtsc();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	b = __rdtsc();
+	c1 = a + (b - a) / 2;
+	t1 = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+
+	if (t1 <= t0 || c1 <= c0)
+		return 0;
+
+	return (__u64) ((unsigned __int128) (c1 - c0) * NSEC_PER_SEC / (t1 - t0));
+}
+#endif
+
+/**
+ * Select the clock used for time stamps
+ *
+ * Called by the first mctp_init() with MCCK_AUTO. Call it before mctp_init()
+ * to select another clock. Must not be called while any mctp object is
+ * running, as the stamps already taken would not match the new clock.
+ *
+ * @param source 	enum _MCCK
+ * @return 			0 upon success, 1 if invalid or if the clock is not available and CLOCK_MONOTONIC is used instead
+ */
+int mctp_clock_init(int source)
+{
+	__u64 hz;
+	int rv, tsc;
+
+	if (source < 0 || source >= MCCK_MAX)
+		return 1;
+
+	rv = 0;
+	tsc = 0;
+	hz = NSEC_PER_SEC;
+
+#if defined(__x86_64__)
+	if ( (source == MCCK_AUTO || source == MCCK_TSC) && mctp_tsc_invariant() )
+	{
+		hz = mctp_tsc_calibrate();
+		if (hz != 0)
+		{
+			tsc = 1;
+			source = MCCK_TSC;
+		}
+		else
+			hz = NSEC_PER_SEC;
+	}
+#endif
+
+	if (!tsc)
+	{
+		rv = (source == MCCK_TSC);
+		source = MCCK_MONOTONIC;
+	}
+
+	// mctp_now() reads the source, so it is stored once the conversions match it
+	mctp_clock.hz = hz;
+	mctp_clock.ns_mult = (__u64) (((unsigned __int128) NSEC_PER_SEC << MCTP_CLOCK_SHIFT) / hz);
+	mctp_clock.tick_mult = (__u64) (((unsigned __int128) hz << MCTP_CLOCK_SHIFT) / NSEC_PER_SEC);
+	__atomic_store_n(&mctp_clock.source, source, __ATOMIC_RELEASE);
+	mctp_clock.ready = 1;
+
+	return rv;
+}
+
+/**
+ * Convert a number of ticks to nanoseconds
+ */
+__u64 mctp_ticks_to_ns(mctp_ticks_t ticks)
+{
+	return (__u64) (((unsigned __int128) ticks * mctp_clock.ns_mult) >> MCTP_CLOCK_SHIFT);
+}
+
+/**
+ * Convert a number of nanoseconds to ticks
+ */
+mctp_ticks_t mctp_ns_to_ticks(__u64 ns)
+{
+	return (mctp_ticks_t) (((unsigned __int128) ns * mctp_clock.tick_mult) >> MCTP_CLOCK_SHIFT);
+}
+
+/**
+ * Convert a time stamp to CLOCK_MONOTONIC nanoseconds
+ *
+ * CLOCK_MONOTONIC is shared by all processes, which the ticks of the TSC
+ * clock are not guaranteed to be
+ */
+__u64 mctp_ticks_to_mono(mctp_ticks_t ticks)
+{
+	mctp_ticks_t now;
+	__u64 mono, age;
+
+	now = mctp_now();
+	mono = mctp_clock_mono();
+
+	age = (now > ticks) ? mctp_ticks_to_ns(now - ticks) : 0;
+
+	return (mono > age) ? mono - age : 0;
+}
+
+/**
+ * Convert CLOCK_MONOTONIC nanoseconds to a time stamp
+ */
+mctp_ticks_t mctp_mono_to_ticks(__u64 mono)
+{
+	mctp_ticks_t now, age;
+	__u64 cur;
+
+	now = mctp_now();
+	cur = mctp_clock_mono();
+
+	age = (cur > mono) ? mctp_ns_to_ticks(cur - mono) : 0;
+
+	return (now > age) ? now - age : 0;
+}
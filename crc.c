@@ -0,0 +1,163 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		crc.c
+ *
+ * @brief 		Code file for CRC functions of the MCTP transport library
+ *
+ * @details 	CRC-32C (Castagnoli) is used for the MCTP Message Integrity Check.
+ * 				The SSE4.2 crc32 instruction is used when the CPU supports it,
+ * 				otherwise a slicing-by-8 table implementation is used.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+/* size_t
+ */
+#include <stddef.h>
+
+/* memcpy()
+ */
+#include <string.h>
+
+/* pthread_once_t
+ * pthread_once()
+ */
+#include <pthread.h>
+
+/* __u8
+ * __u32
+ * __u64
+ */
+#include <linux/types.h>
+
+#if defined(__x86_64__)
+/* _mm_crc32_u8()
+ * _mm_crc32_u64()
+ */
+ #include <nmmintrin.h>
+#endif
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+// Reflected CRC-32C polynomial
+#define CRC32C_POLY 					0x82F63B78
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+static __u32 crc32c_table[8][256];
+
+static __u32 (*crc32c_fn)(__u32 crc, const __u8 *buf, size_t len) = NULL;
+
+// Builds the tables once, even when the first calls race
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Slicing-by-8 CRC-32C for CPUs without the crc32 instruction
+ */
+static __u32 crc32c_sw(__u32 crc, const __u8 *buf, size_t len)
+{
+	__u64 w;
+
+	while (len >= 8)
+	{
+		memcpy(&w, buf, 8);
+		w ^= crc;
+		crc = crc32c_table[7][ w        & 0xFF] ^ crc32c_table[6][(w >>  8) & 0xFF]
+			^ crc32c_table[5][(w >> 16) & 0xFF] ^ crc32c_table[4][(w >> 24) & 0xFF]
+			^ crc32c_table[3][(w >> 32) & 0xFF] ^ crc32c_table[2][(w >> 40) & 0xFF]
+			^ crc32c_table[1][(w >> 48) & 0xFF] ^ crc32c_table[0][ w >> 56        ];
+		buf += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * CRC-32C using the SSE4.2 crc32 instruction
+ */
+__attribute__((target("sse4.2")))
+static __u32 crc32c_hw(__u32 crc, const __u8 *buf, size_t len)
+{
+	__u64 c, w;
+
+	c = crc;
+	while (len >= 8)
+	{
+		memcpy(&w, buf, 8);
+		c = _mm_crc32_u64(c, w);
+		buf += 8;
+		len -= 8;
+	}
+	crc = (__u32) c;
+
+	while (len--)
+		crc = _mm_crc32_u8(crc, *buf++);
+
+	return crc;
+}
+#endif
+
+/**
+ * Build the lookup tables and select the fastest implementation
+ */
+static void crc32c_init()
+{
+	__u32 crc;
+	int i, j;
+
+	for ( i = 0 ; i < 256 ; i++ )
+	{
+		crc = i;
+		for ( j = 0 ; j < 8 ; j++ )
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : (crc >> 1);
+		crc32c_table[0][i] = crc;
+	}
+
+	for ( i = 0 ; i < 256 ; i++ )
+		for ( j = 1 ; j < 8 ; j++ )
+			crc32c_table[j][i] = crc32c_table[0][crc32c_table[j-1][i] & 0xFF] ^ (crc32c_table[j-1][i] >> 8);
+
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+	{
+		crc32c_fn = crc32c_hw;
+		return;
+	}
+#endif
+
+	crc32c_fn = crc32c_sw;
+}
+
+/**
+ * Compute the CRC-32C of a buffer
+ *
+ * The CRC can be computed incrementally by passing the value returned for
+ * the prior part of the message as crc. Use 0 for the first part.
+ *
+ * @param crc 	CRC of the preceding data, 0 to start
+ * @param buf 	Data to add to the CRC
+ * @param len 	Length of data in bytes
+ * @return 		CRC-32C of all data so far
+ */
+__u32 mctp_crc32c(__u32 crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	return ~crc32c_fn(~crc, (const __u8*) buf, len);
+}
+
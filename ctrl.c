@@ -503,7 +503,7 @@ static int get_eid(struct mctp *m, struct mctp_action *ma)
 	rv = 1;
 
 	STEP // 1: Get response mctp_msg 
-	ma->rsp = pq_pop(m->msgs, 1);
+	ma->rsp = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (ma->rsp == NULL)  
 		goto end;
 
@@ -529,10 +529,12 @@ static int get_eid(struct mctp *m, struct mctp_action *ma)
 	ma->rsp->dst 	= ma->req->src;
 	ma->rsp->src 	= ma->req->dst;
 	ma->rsp->type 	= ma->req->type;
+	ma->rsp->owner 	= 0;
+	ma->rsp->tag 	= ma->req->tag;
 	ma->rsp->len 	= MCLN_CTRL + MCLN_CTRL_GET_EID_RESP;
 
 	STEP // 8: Submit message to Transmit Message Queue
-	pq_push(m->tmq, ma);
+	mctp_pq_push(m, MCPQ_TMQ, ma);
 
 	rv = 0;
 
@@ -572,7 +574,7 @@ static int get_uuid(struct mctp *m, struct mctp_action *ma)
 	rv = 1;
 
 	STEP // 1: Get response mctp_msg
-	ma->rsp = pq_pop(m->msgs, 1);
+	ma->rsp = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (ma->rsp == NULL)  
 		goto end;
 
@@ -596,10 +598,12 @@ static int get_uuid(struct mctp *m, struct mctp_action *ma)
 	ma->rsp->dst 	= ma->req->src;
 	ma->rsp->src 	= ma->req->dst;
 	ma->rsp->type 	= ma->req->type;
+	ma->rsp->owner 	= 0;
+	ma->rsp->tag 	= ma->req->tag;
 	ma->rsp->len 	= MCLN_CTRL + MCLN_CTRL_GET_UUID_RESP;
 
 	STEP // 7: Submit message to Transmit Message Queue
-	pq_push(m->tmq, ma);
+	mctp_pq_push(m, MCPQ_TMQ, ma);
 
 	rv = 0;
 
@@ -639,7 +643,7 @@ static int get_type_support(struct mctp *m, struct mctp_action *ma)
 	rv = 1;
 
 	STEP // 1: Get response mctp_msg 
-	ma->rsp = pq_pop(m->msgs, 1);
+	ma->rsp = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (ma->rsp == NULL)  
 		goto end;
 
@@ -665,10 +669,12 @@ static int get_type_support(struct mctp *m, struct mctp_action *ma)
 	ma->rsp->dst 	= ma->req->src;
 	ma->rsp->src 	= ma->req->dst;
 	ma->rsp->type 	= ma->req->type;
+	ma->rsp->owner 	= 0;
+	ma->rsp->tag 	= ma->req->tag;
 	ma->rsp->len 	= MCLN_CTRL + MCLN_CTRL_GET_MSG_TYPE_SUPPORT_RESP + rsp->obj.get_msg_type_rsp.count;
 
 	STEP // 8: Submit message to Transmit Message Queue
-	pq_push(m->tmq, ma);
+	mctp_pq_push(m, MCPQ_TMQ, ma);
 
 	rv = 0;
 
@@ -712,7 +718,7 @@ static int get_ver_support(struct mctp *m, struct mctp_action *ma)
 	count = 0;
 
 	STEP // 1: Get response mctp_msg
-	ma->rsp = pq_pop(m->msgs, 1);
+	ma->rsp = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (ma->rsp == NULL)  
 		goto end;
 
@@ -772,10 +778,12 @@ static int get_ver_support(struct mctp *m, struct mctp_action *ma)
 	ma->rsp->dst 	= ma->req->src;
 	ma->rsp->src 	= ma->req->dst;
 	ma->rsp->type 	= ma->req->type;
+	ma->rsp->owner 	= 0;
+	ma->rsp->tag 	= ma->req->tag;
 	ma->rsp->len 	= MCLN_CTRL + MCLN_CTRL_GET_VER_SUPPORT_RESP + (count * 4);
 
 	STEP // 8: Submit message to Transmit Message Queue
-	pq_push(m->tmq, ma);
+	mctp_pq_push(m, MCPQ_TMQ, ma);
 
 	rv = 0;
 
@@ -815,7 +823,7 @@ static int set_eid(struct mctp *m, struct mctp_action *ma)
 	rv = 1;
 
 	STEP // 1: Get response mctp_msg
-	ma->rsp = pq_pop(m->msgs, 1);
+	ma->rsp = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (ma->rsp == NULL)  
 		goto end;
 
@@ -857,6 +865,9 @@ static int set_eid(struct mctp *m, struct mctp_action *ma)
 	m->state.eid = req->obj.set_eid_req.eid; 	
 	m->state.bus_owner_eid = ma->req->src;
 
+	// Keep the other shards of a group answering with the same EID
+	mctp_shards_sync_state(m);
+
 	// Print the MCTP endpoint state
 	if (m->verbose & MCTP_VERBOSE_STEPS)
 		mctp_prnt_state(&m->state);
@@ -880,10 +891,12 @@ static int set_eid(struct mctp *m, struct mctp_action *ma)
 	ma->rsp->dst 	= ma->req->src;
 	ma->rsp->src 	= ma->req->dst;
 	ma->rsp->type 	= ma->req->type;
+	ma->rsp->owner 	= 0;
+	ma->rsp->tag 	= ma->req->tag;
 	ma->rsp->len 	= MCLN_CTRL + MCLN_CTRL_SET_EID_RESP;
 
 	STEP // 8: Submit message to Transmit Message Queue
-	pq_push(m->tmq, ma);
+	mctp_pq_push(m, MCPQ_TMQ, ma);
 
 	rv = 0;
 
@@ -0,0 +1,618 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		filter.c
+ *
+ * @brief 		Code file for the packet filters of the MCTP transport library
+ *
+ * @details 	A filter selects the packets that packet capture records and
+ * 				that the verbose packet dump prints. The expression is compiled
+ * 				once to a short program for a stack machine, which is run on
+ * 				each packet without allocating or taking a lock.
+ *
+ * 				expr 		:= and { ("or" | "||") and }
+ * 				and 		:= unary { ("and" | "&&") unary }
+ * 				unary 		:= ("not" | "!") unary | "(" expr ")" | rel
+ * 				rel 		:= operand [ ("==" | "!=" | "<" | "<=" | ">" | ">=") operand ]
+ * 				operand 	:= term [ "&" number ]
+ * 				term 		:= field | number | "payload[" number [ ":" (1 | 2 | 4) ] "]"
+ * 				field 		:= src | dst | tag | owner | seq | som | eom | ver | type
+ *
+ * 				An operand alone is true if it is not zero. The mask binds
+ * 				tighter than the comparison, so "tag & 4 == 4" tests bit 2.
+ * 				payload[n:2] and payload[n:4] are little endian. type is the
+ * 				MCTP message type of the message the packet belongs to, so
+ * 				"type == 7" selects every packet of an FM API message.
+ *
+ * 				Examples: "src == 8", "type == 7 and payload[4:2] == 0x5100",
+ * 				"not (dst == 0 or som)"
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* errno
+ */
+#include <errno.h>
+
+/* calloc()
+ * free()
+ * strtoul()
+ */
+#include <stdlib.h>
+
+/* pthread_mutex_lock()
+ * pthread_mutex_unlock()
+ */
+#include <pthread.h>
+
+/* memset()
+ * strncmp()
+ * strlen()
+ */
+#include <string.h>
+
+/* isspace()
+ * isalpha()
+ * isalnum()
+ * isdigit()
+ */
+#include <ctype.h>
+
+/* __u8
+ * __u16
+ * __u32
+ */
+#include <linux/types.h>
+
+#include <ptrqueue.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+// Values the filter stack holds at most
+#define MCTP_FILTER_STACK 				16
+
+// Right hand side of a comparison: the immediate if size is set, else popped
+#define RHS() 							((in->size != 0) ? in->imm : stack[sp--])
+
+/* ENUMERATIONS ==============================================================*/
+
+/**
+ * MCTP Filter Operation (FO)
+ */
+enum _MCFO
+{
+	MCFO_LOAD 		= 0, 	//!< Push size bytes of the packet at off, little endian, shifted right by shift and masked with imm
+	MCFO_TYPE 		= 1, 	//!< Push the message type
+	MCFO_IMM 		= 2, 	//!< Push imm
+	MCFO_MASK 		= 3, 	//!< Top &= imm
+	MCFO_EQ 		= 4, 	//!< Compare the top two values, or the top with imm if size is set
+	MCFO_NE 		= 5,
+	MCFO_LT 		= 6,
+	MCFO_LE 		= 7,
+	MCFO_GT 		= 8,
+	MCFO_GE 		= 9,
+	MCFO_AND 		= 10, 	//!< Logical
+	MCFO_OR 		= 11, 	//!< Logical
+	MCFO_NOT 		= 12, 	//!< Logical
+	MCFO_MAX
+};
+
+/* STRUCTS ===================================================================*/
+
+/**
+ * Header field known to the compiler
+ */
+struct mctp_filter_field
+{
+	const char *name;
+	__u8 off; 				//!< Byte of the serialized header
+	__u8 shift;
+	__u8 mask;
+};
+
+/**
+ * Compiler state
+ */
+struct mctp_filter_parser
+{
+	struct mctp_filter *f;
+	const char *expr; 		//!< Start of the expression
+	const char *p; 			//!< Next character to parse
+	int depth; 				//!< Values on the stack at this point of the program
+};
+
+/* PROTOTYPES ================================================================*/
+
+static int parse_expr(struct mctp_filter_parser *ps);
+static int parse_and(struct mctp_filter_parser *ps);
+static int parse_unary(struct mctp_filter_parser *ps);
+static int parse_rel(struct mctp_filter_parser *ps);
+static int parse_operand(struct mctp_filter_parser *ps);
+static int parse_term(struct mctp_filter_parser *ps);
+static int parse_number(struct mctp_filter_parser *ps, __u32 *val);
+static int parse_tok(struct mctp_filter_parser *ps, const char *tok);
+static int parse_emit(struct mctp_filter_parser *ps, int op, int size, int shift, int off, __u32 imm, int push);
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+/**
+ * Header fields as the byte of the serialized header, shift and mask
+ */
+static const struct mctp_filter_field mctp_filter_fields[] =
+{
+	{ "src", 	2, 0, 0xFF },
+	{ "dst", 	1, 0, 0xFF },
+	{ "tag", 	3, 0, 0x07 },
+	{ "owner", 	3, 3, 0x01 },
+	{ "seq", 	3, 4, 0x03 },
+	{ "som", 	3, 7, 0x01 },
+	{ "eom", 	3, 6, 0x01 },
+	{ "ver", 	0, 0, 0x0F },
+};
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Compile a filter expression
+ *
+ * @param f 	Filter to fill. f->prev is not changed
+ * @param expr 	Expression. See the grammar at the top of this file
+ * @return 		0 upon success, 1 otherwise and sets errno. f->err is the offset in expr of a syntax error
+ */
+int mctp_filter_compile(struct mctp_filter *f, const char *expr)
+{
+	struct mctp_filter_parser ps;
+
+	f->len = 0;
+	f->err = 0;
+
+	if (expr == NULL)
+	{
+		errno = EINVAL;
+		return 1;
+	}
+
+	memset(&ps, 0, sizeof(ps));
+	ps.f = f;
+	ps.expr = expr;
+	ps.p = expr;
+
+	if (parse_expr(&ps) != 0)
+		goto error;
+
+	while (isspace((unsigned char) *ps.p))
+		ps.p++;
+	if (*ps.p != 0)
+		goto error;
+
+	return 0;
+
+error:
+
+	f->len = 0;
+	f->err = ps.p - expr;
+	errno = EINVAL;
+	return 1;
+}
+
+/**
+ * Run a compiled filter on a packet
+ *
+ * @param f 		Compiled filter. NULL matches every packet
+ * @param type 	Message type of the packet if it is not the SOM packet. -1 if unknown
+ * @return 		1 if the packet matches, 0 otherwise
+ */
+int mctp_filter_run(const struct mctp_filter *f, const struct mctp_pkt *pkt, int type)
+{
+	const struct mctp_filter_insn *in, *end;
+	const __u8 *b;
+	__u32 stack[MCTP_FILTER_STACK];
+	__u32 v;
+	int sp;
+
+	if (f == NULL)
+		return 1;
+
+	b = (const __u8*) pkt;
+	sp = -1;
+
+	for ( in = f->code, end = f->code + f->len ; in < end ; in++ )
+	{
+		switch (in->op)
+		{
+			case MCFO_LOAD:
+				v = b[in->off];
+				if (in->size > 1)
+					v |= (__u32) b[in->off + 1] << 8;
+				if (in->size > 2)
+					v |= (__u32) b[in->off + 2] << 16
+					   | (__u32) b[in->off + 3] << 24;
+				stack[++sp] = (v >> in->shift) & in->imm;
+				break;
+
+			case MCFO_TYPE:
+				if (b[3] & 0x80)
+					stack[++sp] = pkt->payload[0] & 0x7F;
+				else
+					stack[++sp] = (__u32) type;
+				break;
+
+			case MCFO_IMM: 		stack[++sp] = in->imm; 								break;
+			case MCFO_MASK: 	stack[sp] &= in->imm; 								break;
+			case MCFO_EQ: 		v = RHS(); stack[sp] = stack[sp] == v; 			break;
+			case MCFO_NE: 		v = RHS(); stack[sp] = stack[sp] != v; 			break;
+			case MCFO_LT: 		v = RHS(); stack[sp] = stack[sp] <  v; 			break;
+			case MCFO_LE: 		v = RHS(); stack[sp] = stack[sp] <= v; 			break;
+			case MCFO_GT: 		v = RHS(); stack[sp] = stack[sp] >  v; 			break;
+			case MCFO_GE: 		v = RHS(); stack[sp] = stack[sp] >= v; 			break;
+			case MCFO_AND: 		sp--; stack[sp] = stack[sp] && stack[sp + 1]; 		break;
+			case MCFO_OR: 		sp--; stack[sp] = stack[sp] || stack[sp + 1]; 		break;
+			case MCFO_NOT: 		stack[sp] = !stack[sp]; 							break;
+			default: 			return 0;
+		}
+	}
+
+	return (sp >= 0) ? (stack[sp] != 0) : 1;
+}
+
+/**
+ * Select the packets that capture records and the verbose packet dump prints
+ *
+ * Safe while the threads run. The filter being replaced is kept while they 
+ * run because a thread may still be running it, so each call made while the 
+ * threads run holds on to one more filter until they stop or mctp_free()
+ *
+ * @param expr 	Filter expression. NULL or "" to select every packet
+ * @return 		0 upon success, 1 otherwise and sets errno. Upon a syntax error the
+ * 				filter is not changed and the offset of the error is returned in *err if err is not NULL
+ */
+int mctp_set_filter(struct mctp *m, const char *expr, int *err)
+{
+	struct mctp_filter *f;
+
+	if (expr == NULL || expr[0] == 0)
+	{
+		f = NULL;
+	}
+	else
+	{
+		f = calloc(1, sizeof(struct mctp_filter));
+		if (f == NULL)
+			return 1;
+
+		if (mctp_filter_compile(f, expr) != 0)
+		{
+			if (err != NULL)
+				*err = f->err;
+			free(f);
+			errno = EINVAL;
+			return 1;
+		}
+	}
+
+	// Keep every filter installed on the list. The threads are only started with the mutex held
+	pthread_mutex_lock(&m->mtx);
+	if (f != NULL)
+	{
+		f->prev = m->filters;
+		m->filters = f;
+	}
+	__atomic_store_n(&m->filter, f, __ATOMIC_RELEASE);
+	if (!__atomic_load_n(&m->threads_running, __ATOMIC_ACQUIRE))
+		mctp_trim_filters(m);
+	pthread_mutex_unlock(&m->mtx);
+
+	return 0;
+}
+
+/**
+ * Free the filters that were replaced. The threads must be stopped
+ */
+void mctp_trim_filters(struct mctp *m)
+{
+	struct mctp_filter *f, *prev;
+
+	for ( f = m->filters ; f != NULL ; f = prev )
+	{
+		prev = f->prev;
+		if (f != m->filter)
+			free(f);
+	}
+
+	m->filters = m->filter;
+	if (m->filter != NULL)
+		m->filter->prev = NULL;
+}
+
+/**
+ * Free every filter installed on an mctp object. The threads must be stopped
+ */
+void mctp_free_filters(struct mctp *m)
+{
+	struct mctp_filter *f, *prev;
+
+	for ( f = m->filters ; f != NULL ; f = prev )
+	{
+		prev = f->prev;
+		free(f);
+	}
+
+	m->filters = NULL;
+	m->filter = NULL;
+}
+
+/**
+ * expr := and { ("or" | "||") and }
+ */
+static int parse_expr(struct mctp_filter_parser *ps)
+{
+	if (parse_and(ps) != 0)
+		return 1;
+
+	while (parse_tok(ps, "or") || parse_tok(ps, "||"))
+	{
+		if (parse_and(ps) != 0)
+			return 1;
+		if (parse_emit(ps, MCFO_OR, 0, 0, 0, 0, -1) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * and := unary { ("and" | "&&") unary }
+ */
+static int parse_and(struct mctp_filter_parser *ps)
+{
+	if (parse_unary(ps) != 0)
+		return 1;
+
+	while (parse_tok(ps, "and") || parse_tok(ps, "&&"))
+	{
+		if (parse_unary(ps) != 0)
+			return 1;
+		if (parse_emit(ps, MCFO_AND, 0, 0, 0, 0, -1) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * unary := ("not" | "!") unary | "(" expr ")" | rel
+ */
+static int parse_unary(struct mctp_filter_parser *ps)
+{
+	// "!=" is not a negation
+	if (parse_tok(ps, "not") || (strncmp(ps->p, "!=", 2) != 0 && parse_tok(ps, "!")))
+	{
+		if (parse_unary(ps) != 0)
+			return 1;
+		return parse_emit(ps, MCFO_NOT, 0, 0, 0, 0, 0);
+	}
+
+	if (parse_tok(ps, "("))
+	{
+		if (parse_expr(ps) != 0)
+			return 1;
+		if (!parse_tok(ps, ")"))
+			return 1;
+		return 0;
+	}
+
+	return parse_rel(ps);
+}
+
+/**
+ * rel := operand [ relop operand ]
+ */
+static int parse_rel(struct mctp_filter_parser *ps)
+{
+	struct mctp_filter_insn *in;
+	int op;
+
+	if (parse_operand(ps) != 0)
+		return 1;
+
+	// Longer operators first
+	if 		(parse_tok(ps, "==")) 	op = MCFO_EQ;
+	else if (parse_tok(ps, "!=")) 	op = MCFO_NE;
+	else if (parse_tok(ps, "<=")) 	op = MCFO_LE;
+	else if (parse_tok(ps, ">=")) 	op = MCFO_GE;
+	else if (parse_tok(ps, "<")) 	op = MCFO_LT;
+	else if (parse_tok(ps, ">")) 	op = MCFO_GT;
+	else
+		return 0;
+
+	if (parse_operand(ps) != 0)
+		return 1;
+
+	// Compare with an immediate in place of pushing it
+	in = &ps->f->code[ps->f->len - 1];
+	if (in->op == MCFO_IMM)
+	{
+		ps->f->len--;
+		ps->depth--;
+		return parse_emit(ps, op, 1, 0, 0, in->imm, 0);
+	}
+
+	return parse_emit(ps, op, 0, 0, 0, 0, -1);
+}
+
+/**
+ * operand := term [ "&" number ]
+ */
+static int parse_operand(struct mctp_filter_parser *ps)
+{
+	struct mctp_filter_insn *in;
+	const char *save;
+	__u32 mask;
+
+	if (parse_term(ps) != 0)
+		return 1;
+
+	// "&&" is a logical and
+	save = ps->p;
+	if (parse_tok(ps, "&&"))
+	{
+		ps->p = save;
+		return 0;
+	}
+
+	if (!parse_tok(ps, "&"))
+		return 0;
+
+	if (parse_number(ps, &mask) != 0)
+		return 1;
+
+	// Fold the mask into a load
+	in = &ps->f->code[ps->f->len - 1];
+	if (in->op == MCFO_LOAD)
+	{
+		in->imm &= mask;
+		return 0;
+	}
+
+	return parse_emit(ps, MCFO_MASK, 0, 0, 0, mask, 0);
+}
+
+/**
+ * term := field | number | "payload[" number [ ":" size ] "]"
+ */
+static int parse_term(struct mctp_filter_parser *ps)
+{
+	const struct mctp_filter_field *fld;
+	const char *save;
+	__u32 val, off, size;
+	int i;
+
+	if (parse_tok(ps, "payload"))
+	{
+		if (!parse_tok(ps, "["))
+			return 1;
+		while (isspace((unsigned char) *ps->p))
+			ps->p++;
+		save = ps->p;
+		if (parse_number(ps, &off) != 0)
+			return 1;
+
+		size = 1;
+		if (parse_tok(ps, ":") && parse_number(ps, &size) != 0)
+			return 1;
+		if (size != 1 && size != 2 && size != 4)
+			return 1;
+		// Report a range past the payload at its offset. off + size could wrap
+		if (off > MCLN_BTU - size)
+		{
+			ps->p = save;
+			return 1;
+		}
+
+		if (!parse_tok(ps, "]"))
+			return 1;
+
+		return parse_emit(ps, MCFO_LOAD, size, 0, MCLN_HDR + off, 0xFFFFFFFF, 1);
+	}
+
+	if (parse_tok(ps, "type"))
+		return parse_emit(ps, MCFO_TYPE, 0, 0, 0, 0, 1);
+
+	for ( i = 0 ; i < (int) (sizeof(mctp_filter_fields) / sizeof(mctp_filter_fields[0])) ; i++ )
+	{
+		fld = &mctp_filter_fields[i];
+		if (parse_tok(ps, fld->name))
+			return parse_emit(ps, MCFO_LOAD, 1, fld->shift, fld->off, fld->mask, 1);
+	}
+
+	if (parse_number(ps, &val) != 0)
+		return 1;
+
+	return parse_emit(ps, MCFO_IMM, 0, 0, 0, val, 1);
+}
+
+/**
+ * Parse a decimal or 0x prefixed hexadecimal number
+ */
+static int parse_number(struct mctp_filter_parser *ps, __u32 *val)
+{
+	unsigned long v;
+	char *end;
+
+	while (isspace((unsigned char) *ps->p))
+		ps->p++;
+
+	if (!isdigit((unsigned char) *ps->p))
+		return 1;
+
+	errno = 0;
+	v = strtoul(ps->p, &end, 0);
+	if (errno != 0 || v > 0xFFFFFFFFUL || isalnum((unsigned char) *end))
+		return 1;
+
+	*val = v;
+	ps->p = end;
+
+	return 0;
+}
+
+/**
+ * Consume tok if it is next. A word must not be followed by a letter or digit
+ *
+ * @return 		1 if consumed, 0 otherwise
+ */
+static int parse_tok(struct mctp_filter_parser *ps, const char *tok)
+{
+	size_t len;
+
+	while (isspace((unsigned char) *ps->p))
+		ps->p++;
+
+	len = strlen(tok);
+	if (strncmp(ps->p, tok, len) != 0)
+		return 0;
+
+	if (isalpha((unsigned char) tok[0]) && (isalnum((unsigned char) ps->p[len]) || ps->p[len] == '_'))
+		return 0;
+
+	ps->p += len;
+
+	return 1;
+}
+
+/**
+ * Append an instruction
+ *
+ * @param push 	Change in the number of values on the stack
+ * @return 		0 upon success, 1 if the program or its stack would be too large
+ */
+static int parse_emit(struct mctp_filter_parser *ps, int op, int size, int shift, int off, __u32 imm, int push)
+{
+	struct mctp_filter_insn *in;
+
+	if (ps->f->len >= MCTP_FILTER_MAX_INSNS)
+		return 1;
+
+	ps->depth += push;
+	if (ps->depth > MCTP_FILTER_STACK)
+		return 1;
+
+	in = &ps->f->code[ps->f->len++];
+	in->op = op;
+	in->size = size;
+	in->shift = shift;
+	in->off = off;
+	in->imm = imm;
+
+	return 0;
+}
+
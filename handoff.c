@@ -0,0 +1,1120 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		handoff.c
+ *
+ * @brief 		Code file for the hot restart handoff of the MCTP transport library
+ *
+ * @details 	A process being replaced passes its sockets to the process that
+ * 				replaces it so the peer keeps its connection. The old process
+ * 				stops reading, answers everything it has already read and stops
+ * 				its threads without closing the sockets. It then sends the
+ * 				sockets over a Unix socket with SCM_RIGHTS together with the
+ * 				endpoint state, the packet sequence numbers, the messages it
+ * 				was still reassembling and the outstanding actions of its tag
+ * 				table. The new process restores them before its threads start,
+ * 				so a response to an action sent by the old process completes
+ * 				in the new one and unread packets are read by the new one.
+ *
+ * 				The callbacks and user data of the actions cannot cross the
+ * 				process boundary. The new process supplies the callbacks for
+ * 				the actions it adopts.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* errno
+ */
+#include <errno.h>
+
+/* printf()
+ */
+#include <stdio.h>
+
+/* calloc()
+ * realloc()
+ * free()
+ */
+#include <stdlib.h>
+
+/* memset()
+ * memcpy()
+ * strncpy()
+ */
+#include <string.h>
+
+/* close()
+ * unlink()
+ * gettid()
+ */
+#include <unistd.h>
+
+/* pthread_cancel()
+ * pthread_join()
+ */
+#include <pthread.h>
+
+/* AF_UNIX
+ * SOCK_STREAM
+ * SCM_RIGHTS
+ * struct msghdr
+ * struct cmsghdr
+ * socket()
+ * bind()
+ * listen()
+ * accept()
+ * connect()
+ * sendmsg()
+ * recvmsg()
+ */
+#include <sys/socket.h>
+
+/* struct sockaddr_un
+ */
+#include <sys/un.h>
+
+/* struct timeval
+ */
+#include <sys/time.h>
+
+/* struct pollfd
+ * poll()
+ */
+#include <poll.h>
+
+/* __u8
+ * __u16
+ * __u32
+ * __s64
+ */
+#include <linux/types.h>
+
+/* uuid_t
+ */
+#include <uuid/uuid.h>
+
+#include <ptrqueue.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+//#define MCTP_VERBOSE
+#ifdef MCTP_VERBOSE
+ #define INIT 			unsigned step = 0;
+ #define ENTER 					if (m->verbose & MCTP_VERBOSE_THREADS) 	printf("%d:%s Enter\n", 				gettid(), __FUNCTION__);
+ #define STEP 			step++; if (m->verbose & MCTP_VERBOSE_STEPS) 	printf("%d:%s STEP: %u\n", 				gettid(), __FUNCTION__, step);
+ #define ERR32(k, i)			if (m->verbose & MCTP_VERBOSE_ERROR) 	printf("%d:%s STEP: %u ERR: %s: %d\n",	gettid(), __FUNCTION__, step, k, i);
+ #define EXIT(rc) 				if (m->verbose & MCTP_VERBOSE_THREADS)	printf("%d:%s Exit: %d\n", 				gettid(), __FUNCTION__,rc);
+#else
+ #define INIT
+ #define ENTER
+ #define STEP
+ #define ERR32(k, i)
+ #define EXIT(rc)
+#endif
+
+// "MCTH"
+#define MCTP_HANDOFF_MAGIC 				0x4D435448
+// Incremented when the layout of the handoff records changes
+#define MCTP_HANDOFF_VERSION 			2
+// The listening socket and every connection
+#define MCTP_HANDOFF_MAX_FDS 			(MCTP_MAX_CONNS + 1)
+
+/* STRUCTS ===================================================================*/
+
+/**
+ * First record of a handoff. Sent with the sockets attached
+ */
+struct __attribute__((__packed__)) mctp_handoff_hdr
+{
+	__u32 magic;
+	__u32 version;
+	__u32 body_len;						//!< Bytes of records that follow this header
+
+	// Sockets
+	__u8 num_fds;						//!< Number of sockets attached
+	__u8 has_sock;						//!< The first socket is the listening socket, not conns[0]
+	__u8 mode;							//!< [MCRM]
+	__u8 transport; 					//!< [MCTR]
+	__u32 port;
+	__u32 max_conns;
+	__u32 num_conns;
+	__u32 reconnect;
+	__u8 conn_up[MCTP_MAX_CONNS];
+	struct sockaddr_in sa_server;
+	struct sockaddr_in sa_client;
+	__u32 client_len;
+
+	// Endpoint state
+	__u8 eid;
+	__u8 bus_owner_eid;
+	uuid_t uuid;
+
+	// Per connection state
+	__u8 tx_seq[MCTP_MAX_CONNS];		//!< Next packet sequence number to send
+	__u8 rx_seq[MCTP_MAX_CONNS];		//!< Next packet sequence number expected
+	__u8 next_tag[MCTP_NUM_EIDS];
+
+	// Number of records of each kind in the body, in this order
+	__u16 num_versions;
+	__u16 num_partials;
+	__u16 num_actions;
+};
+
+/**
+ * A supported version of a message type
+ */
+struct __attribute__((__packed__)) mctp_handoff_ver
+{
+	__u8 type;
+	__u8 major;
+	__u8 minor;
+	__u8 update;
+	__u8 alpha;
+};
+
+/**
+ * A message. Followed by len bytes of payload
+ */
+struct __attribute__((__packed__)) mctp_handoff_msg
+{
+	__u8 src;
+	__u8 dst;
+	__u8 type;
+	__u8 owner;
+	__u8 tag;
+	__u8 conn;
+	__u16 len;
+	__u64 ts;				//!< CLOCK_MONOTONIC nanoseconds 
+};
+
+/**
+ * A message the Packet Reader was reassembling. Followed by the message
+ */
+struct __attribute__((__packed__)) mctp_handoff_partial
+{
+	__u8 conn;
+	__u8 tag;
+	__u8 ic;
+	__u32 crc;
+};
+
+/**
+ * An outstanding action of the tag table. Followed by its request message
+ *
+ * The time stamps are sent as CLOCK_MONOTONIC nanoseconds, which is shared by 
+ * all processes, so they carry over whichever clock each process uses
+ */
+struct __attribute__((__packed__)) mctp_handoff_action
+{
+	__s32 num;
+	__s32 max;
+	__u64 created;
+	__u64 tagged;
+	__u64 submitted;
+};
+
+/**
+ * State received from the previous process and kept until the threads start
+ */
+struct mctp_handoff
+{
+	struct mctp_handoff_hdr hdr;
+	__u8 *body;
+	size_t off;							//!< Offset of the next record to take from body
+
+	void (*fn_completed)(struct mctp *m, struct mctp_action *a);
+	void (*fn_failed)(struct mctp *m, struct mctp_action *a);
+};
+
+/**
+ * Growable buffer the body of a handoff is built in
+ */
+struct mctp_handoff_buf
+{
+	__u8 *data;
+	size_t len;
+	size_t size;
+};
+
+/* PROTOTYPES ================================================================*/
+
+static int mctp_handoff_put(struct mctp_handoff_buf *b, const void *data, size_t len);
+static int mctp_handoff_put_msg(struct mctp_handoff_buf *b, struct mctp_msg *mm);
+static const void *mctp_handoff_get(struct mctp_handoff *h, size_t len);
+static int mctp_handoff_get_msg(struct mctp_handoff *h, struct mctp_msg *mm);
+static int mctp_handoff_addr(struct sockaddr_un *sa, const char *path);
+static int mctp_handoff_write(struct mctp *m, int fd);
+static int mctp_handoff_read(struct mctp_handoff *h, int fd, int *fds);
+static int mctp_handoff_io(int fd, void *buf, size_t len, int write);
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Append data to a handoff buffer
+ *
+ * @return 0 upon success, 1 if out of memory
+ */
+static int mctp_handoff_put(struct mctp_handoff_buf *b, const void *data, size_t len)
+{
+	__u8 *p;
+	size_t size;
+
+	if (b->len + len > b->size)
+	{
+		size = b->size ? b->size : 4096;
+		while (size < b->len + len)
+			size *= 2;
+
+		p = realloc(b->data, size);
+		if (p == NULL)
+			return 1;
+
+		b->data = p;
+		b->size = size;
+	}
+
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+
+	return 0;
+}
+
+/**
+ * Append a message and its payload to a handoff buffer
+ */
+static int mctp_handoff_put_msg(struct mctp_handoff_buf *b, struct mctp_msg *mm)
+{
+	struct mctp_handoff_msg hm;
+
+	hm.src = mm->src;
+	hm.dst = mm->dst;
+	hm.type = mm->type;
+	hm.owner = mm->owner;
+	hm.tag = mm->tag;
+	hm.conn = mm->conn;
+	hm.len = mm->len;
+	hm.ts = mctp_ticks_to_mono(mm->ts);
+
+	if (mctp_handoff_put(b, &hm, sizeof(hm)) != 0)
+		return 1;
+
+	return mctp_handoff_put(b, mm->payload, mm->len);
+}
+
+/**
+ * Take the next len bytes of the body of a handoff
+ *
+ * @return pointer to the bytes, NULL if the body is too short
+ */
+static const void *mctp_handoff_get(struct mctp_handoff *h, size_t len)
+{
+	const void *p;
+
+	if (h->off + len > h->hdr.body_len)
+		return NULL;
+
+	p = h->body + h->off;
+	h->off += len;
+
+	return p;
+}
+
+/**
+ * Take the next message and its payload from the body of a handoff
+ *
+ * @return 0 upon success, 1 if the record is malformed
+ */
+static int mctp_handoff_get_msg(struct mctp_handoff *h, struct mctp_msg *mm)
+{
+	struct mctp_handoff_msg hm;
+	const void *p;
+
+	p = mctp_handoff_get(h, sizeof(hm));
+	if (p == NULL)
+		return 1;
+	memcpy(&hm, p, sizeof(hm));
+
+	if (hm.len > MCLN_MSG_PAYLOAD)
+		return 1;
+
+	p = mctp_handoff_get(h, hm.len);
+	if (p == NULL)
+		return 1;
+
+	mm->src = hm.src;
+	mm->dst = hm.dst;
+	mm->type = hm.type;
+	mm->owner = hm.owner;
+	mm->tag = hm.tag;
+	mm->conn = hm.conn;
+	mm->len = hm.len;
+	mm->ts = mctp_mono_to_ticks(hm.ts);
+	memcpy(mm->payload, p, hm.len);
+
+	return 0;
+}
+
+/**
+ * Fill the address of a Unix socket
+ *
+ * @return 0 upon success, 1 if the path is too long
+ */
+static int mctp_handoff_addr(struct sockaddr_un *sa, const char *path)
+{
+	memset(sa, 0, sizeof(struct sockaddr_un));
+	sa->sun_family = AF_UNIX;
+
+	if (path == NULL || strlen(path) >= sizeof(sa->sun_path))
+		return 1;
+
+	strncpy(sa->sun_path, path, sizeof(sa->sun_path) - 1);
+
+	return 0;
+}
+
+/**
+ * Read or write all of a buffer on a stream socket
+ *
+ * @return 0 upon success, 1 upon error or timeout
+ */
+static int mctp_handoff_io(int fd, void *buf, size_t len, int write)
+{
+	__u8 *p;
+	ssize_t rv;
+
+	p = (__u8*) buf;
+	while (len > 0)
+	{
+		if (write)
+			rv = send(fd, p, len, MSG_NOSIGNAL);
+		else
+			rv = recv(fd, p, len, 0);
+
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			return 1;
+
+		p += rv;
+		len -= rv;
+	}
+
+	return 0;
+}
+
+/**
+ * Send the sockets and state of a stopped mctp object
+ *
+ * @return 0 upon success, 1 upon error
+ *
+ * STEPS
+ * 1: Collect the sockets
+ * 2: Fill the header
+ * 3: Add the versions
+ * 4: Add the messages being reassembled
+ * 5: Add the outstanding actions
+ * 6: Send the header with the sockets attached, then the body
+ */
+static int mctp_handoff_write(struct mctp *m, int fd)
+{
+	INIT
+	struct mctp_handoff_hdr hdr;
+	struct mctp_handoff_ver hv;
+	struct mctp_handoff_partial hp;
+	struct mctp_handoff_action ha;
+	struct mctp_handoff_buf b;
+	struct mctp_version *type, *entry;
+	struct mctp_action *ma;
+	struct mctp_msg *mm;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int fds[MCTP_HANDOFF_MAX_FDS];
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	int i, j, n, rv;
+	__u64 word;
+
+	ENTER
+
+	rv = 1;
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&b, 0, sizeof(b));
+
+	STEP // 1: Collect the sockets
+	n = 0;
+	if (m->num_conns == 0 || m->sock != m->conns[0])
+	{
+		hdr.has_sock = 1;
+		fds[n++] = m->sock;
+	}
+	for ( i = 0 ; i < m->num_conns ; i++ )
+		fds[n++] = m->conns[i];
+
+	STEP // 2: Fill the header
+	hdr.magic = MCTP_HANDOFF_MAGIC;
+	hdr.version = MCTP_HANDOFF_VERSION;
+	hdr.num_fds = n;
+	hdr.mode = m->mode;
+	hdr.transport = m->transport;
+	hdr.port = m->port;
+	hdr.max_conns = m->max_conns;
+	hdr.num_conns = m->num_conns;
+	hdr.reconnect = m->reconnect;
+	memcpy(hdr.conn_up, m->conn_up, sizeof(hdr.conn_up));
+	memcpy(&hdr.sa_server, &m->sa_server, sizeof(struct sockaddr_in));
+	memcpy(&hdr.sa_client, &m->sa_client, sizeof(struct sockaddr_in));
+	hdr.client_len = m->client_len;
+	hdr.eid = m->state.eid;
+	hdr.bus_owner_eid = m->state.bus_owner_eid;
+	memcpy(hdr.uuid, m->state.uuid, sizeof(uuid_t));
+	memcpy(hdr.tx_seq, m->pw.pkt_seq, sizeof(hdr.tx_seq));
+	memcpy(hdr.rx_seq, m->pr.pkt_seq, sizeof(hdr.rx_seq));
+	memcpy(hdr.next_tag, m->tags.next, sizeof(hdr.next_tag));
+
+	STEP // 3: Add the versions
+	for ( type = m->mctp_versions ; type != NULL ; type = type->next_type )
+	{
+		for ( entry = type ; entry != NULL ; entry = entry->next_entry )
+		{
+			hv.type = entry->type;
+			hv.major = entry->major;
+			hv.minor = entry->minor;
+			hv.update = entry->update;
+			hv.alpha = entry->alpha;
+			if (mctp_handoff_put(&b, &hv, sizeof(hv)) != 0)
+				goto end;
+			hdr.num_versions++;
+		}
+	}
+
+	STEP // 4: Add the messages being reassembled
+	// The rest of their packets are still unread in the sockets
+	for ( i = 0 ; i < MCTP_MAX_CONNS ; i++ )
+	{
+		for ( j = 0 ; j < MCTP_NUM_TAGS ; j++ )
+		{
+			mm = m->pr.tags[i][j];
+			if (mm == NULL)
+				continue;
+
+			hp.conn = i;
+			hp.tag = j;
+			hp.ic = m->pr.ic[i][j];
+			hp.crc = m->pr.crc[i][j];
+			if (mctp_handoff_put(&b, &hp, sizeof(hp)) != 0 || mctp_handoff_put_msg(&b, mm) != 0)
+				goto end;
+			hdr.num_partials++;
+		}
+	}
+
+	STEP // 5: Add the outstanding actions
+	for ( i = 0 ; i < MCTP_TAG_TABLE_SIZE ; i++ )
+	{
+		word = m->tags.slots[i].word;
+		if ( (word & MCTP_TAG_BUSY) == 0 )
+			continue;
+
+		ma = m->tags.slots[i].ma;
+		ha.num = ma->num;
+		ha.max = ma->max;
+		ha.created = mctp_ticks_to_mono(ma->created);
+		ha.tagged = mctp_ticks_to_mono(ma->tagged);
+		ha.submitted = mctp_ticks_to_mono(ma->submitted);
+		if (mctp_handoff_put(&b, &ha, sizeof(ha)) != 0 || mctp_handoff_put_msg(&b, ma->req) != 0)
+			goto end;
+		hdr.num_actions++;
+	}
+	hdr.body_len = b.len;
+
+	STEP // 6: Send the header with the sockets attached, then the body
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = &hdr;
+	iov.iov_len = sizeof(hdr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(hdr))
+	{
+		ERR32("Could not send handoff header. errno", errno);
+		goto end;
+	}
+
+	if (mctp_handoff_io(fd, b.data, b.len, 1) != 0)
+	{
+		ERR32("Could not send handoff body. errno", errno);
+		goto end;
+	}
+
+	rv = 0;
+
+end:
+
+	free(b.data);
+
+	EXIT(rv)
+
+	return rv;
+}
+
+/**
+ * Receive the header, sockets and body of a handoff
+ *
+ * @param fds 	Filled with hdr.num_fds received sockets
+ * @return 		0 upon success, 1 upon error. Received sockets are closed upon error
+ */
+static int mctp_handoff_read(struct mctp_handoff *h, int fd, int *fds)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char cbuf[CMSG_SPACE(sizeof(int) * MCTP_HANDOFF_MAX_FDS)];
+	ssize_t len;
+	int i, n;
+
+	n = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &h->hdr;
+	iov.iov_len = sizeof(h->hdr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	len = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+	if (len < 0)
+		return 1;
+
+	// Take ownership of the sockets before anything else can fail
+	for ( cmsg = CMSG_FIRSTHDR(&msg) ; cmsg != NULL ; cmsg = CMSG_NXTHDR(&msg, cmsg) )
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+	}
+
+	if (len != sizeof(h->hdr) || (msg.msg_flags & MSG_CTRUNC))
+		goto fail;
+
+	if (h->hdr.magic != MCTP_HANDOFF_MAGIC || h->hdr.version != MCTP_HANDOFF_VERSION)
+		goto fail;
+
+	if (h->hdr.num_fds != n || n == 0 || h->hdr.num_conns > MCTP_MAX_CONNS || h->hdr.num_conns + h->hdr.has_sock != (__u32) n)
+		goto fail;
+
+	if (h->hdr.max_conns < 1 || h->hdr.max_conns > MCTP_MAX_CONNS)
+		goto fail;
+
+	h->body = malloc(h->hdr.body_len ? h->hdr.body_len : 1);
+	if (h->body == NULL)
+		goto fail;
+
+	if (mctp_handoff_io(fd, h->body, h->hdr.body_len, 0) != 0)
+		goto fail;
+
+	return 0;
+
+fail:
+
+	for ( i = 0 ; i < n ; i++ )
+		close(fds[i]);
+
+	return 1;
+}
+
+/**
+ * Hand the sockets and outstanding actions of a running mctp object to another process
+ *
+ * The other process must be waiting in mctp_handoff_recv() on the same path.
+ * Submissions are refused from the start. Messages already read from the
+ * sockets are handled and answered by this process. Everything still unread
+ * is left in the sockets for the other process. The threads of this process
+ * then stop without closing the connections, so the peer does not see the
+ * restart.
+ *
+ * The outstanding actions are retired without calling their callbacks. They
+ * complete or fail in the other process. Completed actions not yet reported
+ * are reported here as in mctp_drain().
+ *
+ * If the queues do not flush by the deadline or the state cannot be sent, the
+ * connections are closed and the outstanding actions fail as in mctp_drain().
+ * If the other process cannot be reached nothing is changed.
+ *
+ * This can only be called by an external thread, not by any of the child mctp threads
+ *
+ * @param m 	struct mctp*
+ * @param path 	Path of the Unix socket the other process listens on
+ * @param msec 	Time allowed for the queues to flush and the state to be sent
+ * @return 		0 upon success, -1 if nothing was changed, 1 if the threads were stopped but the handoff failed. Sets errno
+ *
+ * STEPS
+ * 1: Verify the threads are running
+ * 2: Connect to the other process
+ * 3: Refuse new submissions and pass a marker through the TAQ
+ * 4: Stop reading from the sockets
+ * 5: Pass a marker through the receive path so messages already read are handled
+ * 6: Stop the threads and leave the sockets open
+ * 7: Send the sockets and state
+ * 8: Close the sockets of this process
+ * 9: Retire the actions that were handed off
+ * 10: Finish the actions the threads left behind
+ */
+int mctp_handoff_send(struct mctp *m, const char *path, unsigned msec)
+{
+	INIT
+	struct sockaddr_un sa;
+	struct timespec deadline;
+	struct timeval tv;
+	struct mctp_tag_slot *s;
+	pthread_t sr;
+	__u64 word;
+	int fd, rv, i, err, stopped;
+
+	ENTER
+
+	rv = -1;
+	err = 0;
+	fd = -1;
+
+	mctp_drain_deadline(&deadline, msec);
+
+	STEP // 1: Verify the threads are running
+	if ( m->use_threads == 0 || m->all_threads_started == 0 || m->stop_threads != 0 || m->drain != MCDR_NONE || m->group != NULL )
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	STEP // 2: Connect to the other process
+	if (mctp_handoff_addr(&sa, path) != 0)
+	{
+		errno = ENAMETOOLONG;
+		goto end;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto end;
+
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+	{
+		ERR32("Could not connect to the other process. errno", errno);
+		goto end;
+	}
+
+	STEP // 3: Refuse new submissions and pass a marker through the TAQ
+	// Every queued action then has a tag
+	__atomic_store_n(&m->drain, MCDR_DRAIN, __ATOMIC_RELEASE);
+	if (mctp_drain_marker(m, MCPQ_TAQ, &deadline) != 0)
+	{
+		__atomic_store_n(&m->drain, MCDR_NONE, __ATOMIC_RELEASE);
+		errno = ETIMEDOUT;
+		goto end;
+	}
+
+	STEP // 4: Stop reading from the sockets
+	// The Connection Handler skips a Socket Reader that has already been joined
+	pthread_mutex_lock(&m->mtx);
+	{
+		sr = m->pt_sr;
+		m->pt_sr = 0;
+		stopped = m->stop_threads;
+	}
+	pthread_mutex_unlock(&m->mtx);
+
+	pthread_cancel(sr);
+	pthread_join(sr, NULL);
+
+	rv = 1;
+
+	STEP // 5: Pass a marker through the receive path so messages already read are handled
+	// A thread that failed in the meantime has already closed the connections
+	if (stopped != 0 || mctp_drain_marker(m, MCPQ_RPQ, &deadline) != 0 || m->stop_threads != 0)
+	{
+		err = ETIMEDOUT;
+		mctp_stop(m);
+		goto finish;
+	}
+
+	STEP // 6: Stop the threads and leave the sockets open
+	__atomic_store_n(&m->drain, MCDR_HANDOFF, __ATOMIC_RELEASE);
+	mctp_stop(m);
+
+	STEP // 7: Send the sockets and state
+	rv = mctp_handoff_write(m, fd);
+	if (rv != 0)
+		err = errno;
+
+	STEP // 8: Close the sockets of this process
+	// The other process holds its own references. The peer only sees a close if the handoff failed
+	for ( i = 0 ; i < m->num_conns ; i++ )
+		close(m->conns[i]);
+	if (m->num_conns == 0 || m->sock != m->conns[0])
+		close(m->sock);
+	m->num_conns = 0;
+	m->sock = -1;
+	m->conn = -1;
+
+	STEP // 9: Retire the actions that were handed off
+	// Upon failure they are left in the table to fail in the next step
+	for ( i = 0 ; rv == 0 && i < MCTP_TAG_TABLE_SIZE ; i++ )
+	{
+		s = &m->tags.slots[i];
+		word = s->word;
+		if ( (word & MCTP_TAG_BUSY) == 0 )
+			continue;
+
+		mctp_tags_release(m, i, word);
+		mctp_retire(m, s->ma);
+	}
+
+finish:
+
+	STEP // 10: Finish the actions the threads left behind
+	mctp_drain_finish(m);
+
+	if (rv != 0)
+		errno = err;
+
+end:
+
+	if (fd >= 0)
+		close(fd);
+
+	EXIT(rv)
+
+	return rv;
+}
+
+/**
+ * Take over the sockets and outstanding actions of another process and start the threads
+ *
+ * Waits on a Unix socket at path for mctp_handoff_send() to be called by the
+ * process being replaced. The mode, transport, port, connections, endpoint
+ * state and versions of that process replace those of m. The threads are then
+ * started as by mctp_run() using the received sockets.
+ *
+ * Must be called on an mctp object that is not running. Handlers, integrity
+ * check and other settings are not received and must be set before.
+ *
+ * @param m 			struct mctp* 
+ * @param path 			Path of the Unix socket to listen on. Removed when done
+ * @param msec 			Time to wait for the other process. 0 to wait forever
+ * @param fn_completed 	Function to call when a received outstanding action completes
+ * @param fn_failed 	Function to call when a received outstanding action fails
+ * @param dontblock 	As for mctp_run()
+ * @return 				0 upon success, -1 if no state was received, otherwise the return value of mctp_run()
+ *
+ * STEPS
+ * 1: Listen on the Unix socket
+ * 2: Wait for the other process
+ * 3: Receive the sockets and state
+ * 4: Adopt the sockets and settings 
+ * 5: Adopt the endpoint state and versions
+ * 6: Start the threads with the received sockets
+ */
+int mctp_handoff_recv(
+	struct mctp *m, 
+	const char *path, 
+	unsigned msec,
+	void (*fn_completed)(struct mctp *m, struct mctp_action *a),
+	void (*fn_failed)(struct mctp *m, struct mctp_action *a),
+	int dontblock
+)
+{
+	INIT
+	struct mctp_handoff *h;
+	struct mctp_handoff_ver hv;
+	struct sockaddr_un sa;
+	struct pollfd pfd;
+	struct timeval tv;
+	const void *p;
+	int fds[MCTP_HANDOFF_MAX_FDS];
+	int lsock, fd, rv, i;
+
+	ENTER
+
+	rv = -1;
+	fd = -1;
+	lsock = -1;
+	h = NULL;
+
+	if (m->all_threads_started != 0 || m->handoff != NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	STEP // 1: Listen on the Unix socket
+	if (mctp_handoff_addr(&sa, path) != 0)
+	{
+		errno = ENAMETOOLONG;
+		goto end;
+	}
+
+	lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lsock < 0)
+		goto end;
+
+	unlink(path);
+	if (bind(lsock, (struct sockaddr *) &sa, sizeof(sa)) < 0 || listen(lsock, 1) < 0)
+	{
+		ERR32("Could not listen on handoff socket. errno", errno);
+		goto end;
+	}
+
+	STEP // 2: Wait for the other process
+	pfd.fd = lsock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	do 
+		rv = poll(&pfd, 1, msec ? (int) msec : -1);
+	while (rv < 0 && errno == EINTR);
+	if (rv <= 0)
+	{
+		if (rv == 0)
+			errno = ETIMEDOUT;
+		rv = -1;
+		goto end;
+	}
+	rv = -1;
+
+	fd = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		goto end;
+
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	STEP // 3: Receive the sockets and state
+	h = calloc(1, sizeof(struct mctp_handoff));
+	if (h == NULL)
+		goto end;
+
+	if (mctp_handoff_read(h, fd, fds) != 0)
+	{
+		ERR32("Could not receive handoff state. errno", errno);
+		errno = EPROTO;
+		goto end;
+	}
+
+	h->fn_completed = fn_completed;
+	h->fn_failed = fn_failed;
+
+	STEP // 4: Adopt the sockets and settings 
+	mctp_set_transport(m, h->hdr.transport);
+	m->max_conns = h->hdr.max_conns;
+	m->reconnect = h->hdr.reconnect;
+	m->num_conns = h->hdr.num_conns;
+	for ( i = 0 ; i < m->num_conns ; i++ )
+	{
+		m->conns[i] = fds[h->hdr.has_sock + i];
+		m->conn_up[i] = h->hdr.conn_up[i];
+	}
+	m->sock = fds[0];
+	m->conn = h->hdr.num_conns ? m->conns[0] : m->sock;
+	memcpy(&m->sa_server, &h->hdr.sa_server, sizeof(struct sockaddr_in));
+
+	STEP // 5: Adopt the endpoint state and versions
+	m->state.eid = h->hdr.eid;
+	memcpy(m->state.uuid, h->hdr.uuid, sizeof(uuid_t));
+	memcpy(m->uuid, h->hdr.uuid, sizeof(uuid_t));
+
+	mctp_free_versions(m);
+	for ( i = 0 ; i < h->hdr.num_versions ; i++ )
+	{
+		p = mctp_handoff_get(h, sizeof(hv));
+		if (p == NULL)
+			break;
+		memcpy(&hv, p, sizeof(hv));
+		mctp_set_version(m, hv.type, hv.major, hv.minor, hv.update, hv.alpha);
+	}
+
+	// The rest of the body is restored by the Connection Handler once the pools exist
+	m->handoff = h;
+
+	close(fd);
+	fd = -1;
+	close(lsock);
+	lsock = -1;
+	unlink(path);
+
+	STEP // 6: Start the threads with the received sockets
+	rv = mctp_run(m, h->hdr.port, h->hdr.sa_server.sin_addr.s_addr, h->hdr.mode, 1, dontblock);
+	if (rv != 0)
+	{
+		// The threads never started. mctp_run() has closed m->sock 
+		for ( i = 0 ; i < m->num_conns ; i++ )
+			if (m->conns[i] != m->sock)
+				close(m->conns[i]);
+		m->num_conns = 0;
+	}
+
+	// Otherwise the Connection Handler has freed the state 
+	if (m->handoff == NULL)
+		h = NULL;
+	m->handoff = NULL;
+
+end:
+
+	if (h != NULL)
+		free(h->body);
+	free(h);
+
+	if (fd >= 0)
+		close(fd);
+
+	if (lsock >= 0)
+	{
+		close(lsock);
+		unlink(path);
+	}
+
+	EXIT(rv)
+
+	return rv;
+}
+
+/**
+ * Restore the state received from the previous process
+ *
+ * Called by the Connection Handler after the pools and queues have been
+ * created and before the threads start. Frees the received state.
+ *
+ * @return 0 upon success, 1 if the state was malformed or the pools ran out
+ *
+ * STEPS
+ * 1: Restore the state reset by the configuration of the threads 
+ * 2: Restore the messages being reassembled
+ * 3: Restore the outstanding actions
+ * 4: Free the received state
+ */
+int mctp_handoff_restore(struct mctp *m)
+{
+	INIT
+	struct mctp_handoff *h;
+	struct mctp_handoff_partial hp;
+	struct mctp_handoff_action ha;
+	struct mctp_action *ma;
+	struct mctp_msg *mm;
+	const void *p;
+	int i, rv;
+
+	ENTER
+
+	rv = 1;
+	h = m->handoff;
+
+	STEP // 1: Restore the state reset by the configuration of the threads 
+	m->state.bus_owner_eid = h->hdr.bus_owner_eid;
+	memcpy(&m->sa_client, &h->hdr.sa_client, sizeof(struct sockaddr_in));
+	m->client_len = h->hdr.client_len;
+	memcpy(m->pw.pkt_seq, h->hdr.tx_seq, sizeof(m->pw.pkt_seq));
+	memcpy(m->pr.pkt_seq, h->hdr.rx_seq, sizeof(m->pr.pkt_seq));
+	memcpy(m->tags.next, h->hdr.next_tag, sizeof(m->tags.next));
+
+	STEP // 2: Restore the messages being reassembled
+	for ( i = 0 ; i < h->hdr.num_partials ; i++ )
+	{
+		p = mctp_handoff_get(h, sizeof(hp));
+		if (p == NULL)
+			goto end;
+		memcpy(&hp, p, sizeof(hp));
+
+		if (hp.conn >= MCTP_MAX_CONNS || hp.tag >= MCTP_NUM_TAGS || m->pr.tags[hp.conn][hp.tag] != NULL)
+			goto end;
+
+		mm = mctp_pq_pop(m, MCPQ_MSGS, 0);
+		if (mm == NULL)
+			goto end;
+
+		m->pr.tags[hp.conn][hp.tag] = mm;
+		m->pr.ic[hp.conn][hp.tag] = hp.ic;
+		m->pr.crc[hp.conn][hp.tag] = hp.crc;
+
+		if (mctp_handoff_get_msg(h, mm) != 0)
+			goto end;
+	}
+
+	STEP // 3: Restore the outstanding actions
+	// They are sent again only if their response does not arrive in time
+	for ( i = 0 ; i < h->hdr.num_actions ; i++ )
+	{
+		p = mctp_handoff_get(h, sizeof(ha));
+		if (p == NULL)
+			goto end;
+		memcpy(&ha, p, sizeof(ha));
+
+		mm = mctp_pq_pop(m, MCPQ_MSGS, 0);
+		if (mm == NULL)
+			goto end;
+
+		if (mctp_handoff_get_msg(h, mm) != 0)
+		{
+			mctp_pq_push(m, MCPQ_MSGS, mm);
+			goto end;
+		}
+
+		ma = mctp_pq_pop(m, MCPQ_ACTIONS, 0);
+		if (ma == NULL)
+		{
+			mctp_pq_push(m, MCPQ_MSGS, mm);
+			goto end;
+		}
+
+		memset(ma, 0, sizeof(struct mctp_action));
+		ma->valid = 1;
+		ma->req = mm;
+		ma->num = ha.num;
+		ma->max = ha.max;
+		ma->created = mctp_mono_to_ticks(ha.created);
+		ma->tagged = mctp_mono_to_ticks(ha.tagged);
+		ma->submitted = mctp_mono_to_ticks(ha.submitted);
+		ma->fn_completed = h->fn_completed;
+		ma->fn_failed = h->fn_failed;
+		ma->conn = mctp_conn_pick(m, ma);
+
+		if (mctp_tags_insert(m, ma) != 0)
+		{
+			mctp_retire(m, ma);
+			goto end;
+		}
+	}
+
+	rv = 0;
+
+end:
+
+	STEP // 4: Free the received state
+	free(h->body);
+	free(h);
+	m->handoff = NULL;
+
+	EXIT(rv)
+
+	return rv;
+}
@@ -0,0 +1,610 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		log.c
+ *
+ * @brief 		Code file for the binary log rings of the MCTP transport library
+ *
+ * @details 	The verbose output of the pipeline threads goes through a ring
+ * 				owned by the thread instead of printf(). A record is the
+ * 				pointer to the format string plus the raw arguments, or the
+ * 				raw bytes of a packet or message, and a time stamp. Writing
+ * 				one takes no lock and makes no system call. If the ring is
+ * 				full the record is dropped and counted, the thread never
+ * 				waits on the terminal.
+ *
+ * 				A background thread, started with the first ring, prints the
+ * 				records of every ring in time stamp order, then sleeps for
+ * 				MCTP_LOG_DRAIN_MSEC once they are empty. mctp_log_flush()
+ * 				prints what is pending immediately and is also called at exit.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* printf()
+ * fputc()
+ * fwrite()
+ * fflush()
+ */
+#include <stdio.h>
+
+/* calloc()
+ * atexit()
+ */
+#include <stdlib.h>
+
+/* memcpy()
+ * strchr()
+ */
+#include <string.h>
+
+/* gettid()
+ * usleep()
+ */
+#include <unistd.h>
+
+/* pthread_t
+ * pthread_once_t
+ * pthread_key_t
+ * pthread_mutex_t
+ * pthread_create()
+ * pthread_detach()
+ * pthread_once()
+ * pthread_key_create()
+ * pthread_setspecific()
+ */
+#include <pthread.h>
+
+/* __u8
+ * __u64
+ */
+#include <linux/types.h>
+
+#include <ptrqueue.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+#define MCTP_LOG_RING_MASK 				(MCTP_LOG_RING_SIZE - 1)
+
+// Longest conversion specification the decoder copies, e.g. "%-08llx"
+#define MCTP_LOG_SPEC_MAX 				16
+
+/* PROTOTYPES ================================================================*/
+
+static void mctp_log_init();
+static void mctp_log_release(void *arg);
+static struct mctp_log_ring *mctp_log_ring();
+static struct mctp_log_rec *mctp_log_reserve(struct mctp_log_ring *r);
+static void mctp_log_commit(struct mctp_log_ring *r);
+static void *mctp_log_drain(void *arg);
+static void mctp_log_atexit();
+static void mctp_log_prnt(struct mctp_log_rec *rec);
+static void mctp_log_prnt_fmt(struct mctp_log_rec *rec);
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+// Guards the list of rings and serializes printing
+static pthread_mutex_t mctp_log_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+// Every ring ever created. Rings are reused and never freed
+static struct mctp_log_ring *mctp_log_rings;
+
+static pthread_once_t mctp_log_once = PTHREAD_ONCE_INIT;
+
+// Releases the ring of a thread when it exits
+static pthread_key_t mctp_log_key;
+
+// 1 if the drain thread is running
+static int mctp_log_running;
+
+// Ring of the calling thread
+static __thread struct mctp_log_ring *mctp_log_self;
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Append a formatted record to the log ring of the calling thread
+ *
+ * Called through MCTP_LOG()
+ *
+ * @param fmt 	printf() format string. Must outlive the record
+ * @param n 	Number of arguments
+ * @param args 	Arguments converted to __u64
+ */
+void mctp_log(const char *fmt, int n, const __u64 *args)
+{
+	struct mctp_log_ring *r;
+	struct mctp_log_rec *rec;
+
+	r = mctp_log_ring();
+	if (r == NULL)
+		return;
+
+	rec = mctp_log_reserve(r);
+	if (rec == NULL)
+		return;
+
+	if (n > MCTP_LOG_ARGS)
+		n = MCTP_LOG_ARGS;
+
+	rec->fmt = fmt;
+	rec->kind = MCLR_FMT;
+	rec->nargs = n;
+	memcpy(rec->args, args, n * sizeof(__u64));
+
+	mctp_log_commit(r);
+}
+
+/**
+ * Append a copy of a packet to the log ring of the calling thread
+ *
+ * Printed like mctp_prnt_pkt_wrapper()
+ */
+void mctp_log_pkt(struct mctp_pkt_wrapper *pw)
+{
+	struct mctp_log_ring *r;
+	struct mctp_log_rec *rec;
+
+	if (pw == NULL)
+		return;
+
+	r = mctp_log_ring();
+	if (r == NULL)
+		return;
+
+	rec = mctp_log_reserve(r);
+	if (rec == NULL)
+		return;
+
+	rec->fmt = NULL;
+	rec->kind = MCLR_PKT;
+	rec->nargs = 0;
+	rec->pkt.ts = pw->ts;
+	rec->pkt.conn = pw->conn;
+	memcpy(&rec->pkt.pkt, &pw->pkt, sizeof(struct mctp_pkt));
+
+	mctp_log_commit(r);
+}
+
+/**
+ * Append a copy of a message to the log ring of the calling thread
+ *
+ * Printed like mctp_prnt_msg(). Only the first MCTP_LOG_MSG_BYTES of the
+ * payload are kept
+ */
+void mctp_log_msg(struct mctp_msg *mm)
+{
+	struct mctp_log_ring *r;
+	struct mctp_log_rec *rec;
+	unsigned len;
+
+	if (mm == NULL)
+		return;
+
+	r = mctp_log_ring();
+	if (r == NULL)
+		return;
+
+	rec = mctp_log_reserve(r);
+	if (rec == NULL)
+		return;
+
+	len = mm->len;
+	if (len > MCTP_LOG_MSG_BYTES)
+		len = MCTP_LOG_MSG_BYTES;
+
+	rec->fmt = NULL;
+	rec->kind = MCLR_MSG;
+	rec->nargs = 0;
+	rec->msg.src = mm->src;
+	rec->msg.dst = mm->dst;
+	rec->msg.type = mm->type;
+	rec->msg.owner = mm->owner;
+	rec->msg.tag = mm->tag;
+	rec->msg.conn = mm->conn;
+	rec->msg.len = mm->len;
+	memcpy(rec->msg.payload, mm->payload, len);
+
+	mctp_log_commit(r);
+}
+
+/**
+ * Print every pending record of every ring now
+ *
+ * Records are printed in time stamp order across the rings. Safe to call from
+ * any thread, including while the drain thread runs
+ *
+ * @return 		Number of records printed
+ *
+ * STEPS
+ * 1: Print the oldest pending record until no ring has one
+ * 2: Report records that were dropped
+ */
+int mctp_log_flush()
+{
+	struct mctp_log_ring *r, *oldest;
+	struct mctp_log_rec *rec;
+	mctp_ticks_t ts;
+	__u64 dropped;
+	int n;
+
+	n = 0;
+
+	pthread_mutex_lock(&mctp_log_mtx);
+
+	// STEP 1: Print the oldest pending record until no ring has one
+	for (;;)
+	{
+		oldest = NULL;
+		ts = 0;
+		for ( r = mctp_log_rings ; r != NULL ; r = r->next )
+		{
+			if (r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+				continue;
+
+			rec = &r->recs[r->tail & MCTP_LOG_RING_MASK];
+			if (oldest == NULL || rec->ts < ts)
+			{
+				oldest = r;
+				ts = rec->ts;
+			}
+		}
+
+		if (oldest == NULL)
+			break;
+
+		mctp_log_prnt(&oldest->recs[oldest->tail & MCTP_LOG_RING_MASK]);
+
+		// Hand the slot back to the writer
+		__atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+		n++;
+	}
+
+	// STEP 2: Report records that were dropped
+	for ( r = mctp_log_rings ; r != NULL ; r = r->next )
+	{
+		dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+		if (dropped == r->reported)
+			continue;
+
+		printf("%d:%s dropped %llu records\n", r->tid, __FUNCTION__, (unsigned long long) (dropped - r->reported));
+		r->reported = dropped;
+		n++;
+	}
+
+	if (n > 0)
+		fflush(stdout);
+
+	pthread_mutex_unlock(&mctp_log_mtx);
+
+	return n;
+}
+
+/**
+ * Number of records dropped because a ring was full, since the process started
+ */
+__u64 mctp_log_dropped()
+{
+	struct mctp_log_ring *r;
+	__u64 n;
+
+	n = 0;
+
+	pthread_mutex_lock(&mctp_log_mtx);
+	for ( r = mctp_log_rings ; r != NULL ; r = r->next )
+		n += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&mctp_log_mtx);
+
+	return n;
+}
+
+/**
+ * Create the thread key and start the drain thread. Called once per process
+ */
+static void mctp_log_init()
+{
+	pthread_t pt;
+
+	if (pthread_key_create(&mctp_log_key, mctp_log_release) != 0)
+		return;
+
+	if (pthread_create(&pt, NULL, mctp_log_drain, NULL) != 0)
+		return;
+
+	pthread_detach(pt);
+	mctp_log_running = 1;
+
+	atexit(mctp_log_atexit);
+}
+
+/**
+ * Give up the ring of a thread that is exiting
+ *
+ * The ring stays on the list so the drain thread prints what is left in it
+ */
+static void mctp_log_release(void *arg)
+{
+	struct mctp_log_ring *r = arg;
+
+	__atomic_store_n(&r->active, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Ring of the calling thread. Claims one on first use
+ *
+ * @return 		NULL if the logger could not be started or memory is exhausted
+ *
+ * STEPS
+ * 1: Start the drain thread
+ * 2: Reuse a released ring that has been drained
+ * 3: Else create a ring
+ * 4: Claim the ring
+ */
+static struct mctp_log_ring *mctp_log_ring()
+{
+	struct mctp_log_ring *r;
+
+	if (mctp_log_self != NULL)
+		return mctp_log_self;
+
+	// STEP 1: Start the drain thread
+	pthread_once(&mctp_log_once, mctp_log_init);
+	if (!mctp_log_running)
+		return NULL;
+
+	pthread_mutex_lock(&mctp_log_mtx);
+
+	// STEP 2: Reuse a released ring that has been drained
+	for ( r = mctp_log_rings ; r != NULL ; r = r->next )
+		if (!__atomic_load_n(&r->active, __ATOMIC_ACQUIRE) && r->tail == r->head)
+			break;
+
+	// STEP 3: Else create a ring
+	if (r == NULL)
+	{
+		r = calloc(1, sizeof(struct mctp_log_ring));
+		if (r == NULL)
+		{
+			pthread_mutex_unlock(&mctp_log_mtx);
+			return NULL;
+		}
+		r->next = mctp_log_rings;
+		mctp_log_rings = r;
+	}
+
+	// STEP 4: Claim the ring
+	r->tid = gettid();
+	r->active = 1;
+
+	pthread_mutex_unlock(&mctp_log_mtx);
+
+	pthread_setspecific(mctp_log_key, r);
+	mctp_log_self = r;
+
+	return r;
+}
+
+/**
+ * Next free record of a ring, time stamped. NULL and counted if the ring is full
+ */
+static struct mctp_log_rec *mctp_log_reserve(struct mctp_log_ring *r)
+{
+	struct mctp_log_rec *rec;
+
+	if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= MCTP_LOG_RING_SIZE)
+	{
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	rec = &r->recs[r->head & MCTP_LOG_RING_MASK];
+	rec->ts = mctp_now();
+	rec->tid = r->tid;
+
+	return rec;
+}
+
+/**
+ * Publish the record returned by mctp_log_reserve() to the drain thread
+ */
+static void mctp_log_commit(struct mctp_log_ring *r)
+{
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Drain thread. Prints the rings until the process exits
+ */
+static void *mctp_log_drain(void *arg)
+{
+	(void) arg;
+
+	for (;;)
+	{
+		if (mctp_log_flush() == 0)
+			usleep(MCTP_LOG_DRAIN_MSEC * 1000);
+	}
+
+	return NULL;
+}
+
+/**
+ * Print what the threads logged before the process exits
+ */
+static void mctp_log_atexit()
+{
+	mctp_log_flush();
+}
+
+/**
+ * Print one record
+ *
+ * Only called by mctp_log_flush() with the lock held
+ */
+static void mctp_log_prnt(struct mctp_log_rec *rec)
+{
+	static struct mctp_pkt_wrapper pw;
+	static struct mctp_msg mm;
+	unsigned len;
+
+	switch (rec->kind)
+	{
+		case MCLR_FMT:
+			mctp_log_prnt_fmt(rec);
+			break;
+
+		case MCLR_PKT:
+			pw.ts = rec->pkt.ts;
+			pw.next = NULL;
+			pw.conn = rec->pkt.conn;
+			memcpy(&pw.pkt, &rec->pkt.pkt, sizeof(struct mctp_pkt));
+			mctp_prnt_pkt_wrapper(&pw);
+			break;
+
+		case MCLR_MSG:
+			len = rec->msg.len;
+			if (len > MCTP_LOG_MSG_BYTES)
+				len = MCTP_LOG_MSG_BYTES;
+
+			mm.src = rec->msg.src;
+			mm.dst = rec->msg.dst;
+			mm.type = rec->msg.type;
+			mm.owner = rec->msg.owner;
+			mm.tag = rec->msg.tag;
+			mm.conn = rec->msg.conn;
+			mm.len = len;
+			mm.ts = rec->ts;
+			memcpy(mm.payload, rec->msg.payload, len);
+			mctp_prnt_msg(&mm);
+
+			if (len < rec->msg.len)
+				printf("Payload truncated:      %u of %u bytes logged\n", len, rec->msg.len);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/**
+ * Print a format string with the arguments of a record
+ *
+ * Each conversion is printed on its own with the argument cast to the type
+ * it expects. Arguments were widened to 64 bits, so an integer conversion
+ * without an l, j, z or t modifier is narrowed back to int first. Conversions
+ * beyond the stored arguments print as text
+ */
+static void mctp_log_prnt_fmt(struct mctp_log_rec *rec)
+{
+	char spec[MCTP_LOG_SPEC_MAX + 4];
+	const char *p, *start;
+	unsigned i, len;
+	int wide;
+	__u64 v;
+
+	p = rec->fmt;
+	i = 0;
+
+	while (*p != 0)
+	{
+		if (*p != '%')
+		{
+			start = p;
+			while (*p != 0 && *p != '%')
+				p++;
+			fwrite(start, 1, p - start, stdout);
+			continue;
+		}
+
+		if (p[1] == '%')
+		{
+			fputc('%', stdout);
+			p += 2;
+			continue;
+		}
+
+		// Copy the flags, width and precision. Skip length modifiers
+		start = p;
+		len = 0;
+		spec[len++] = *p++;
+		while (*p != 0 && strchr("-+ #0123456789.", *p) != NULL)
+		{
+			if (len < MCTP_LOG_SPEC_MAX)
+				spec[len++] = *p;
+			p++;
+		}
+		wide = 0;
+		while (*p != 0 && strchr("hlLqjzt", *p) != NULL)
+		{
+			if (*p != 'h')
+				wide = 1;
+			p++;
+		}
+
+		if (*p == 0 || i >= rec->nargs)
+		{
+			fwrite(start, 1, (*p == 0) ? (size_t) (p - start) : (size_t) (p + 1 - start), stdout);
+			if (*p != 0)
+				p++;
+			continue;
+		}
+
+		v = rec->args[i++];
+
+		switch (*p)
+		{
+			case 'd':
+			case 'i':
+				spec[len++] = 'l';
+				spec[len++] = 'l';
+				spec[len++] = *p;
+				spec[len] = 0;
+				printf(spec, wide ? (long long) v : (long long) (int) v);
+				break;
+
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+				spec[len++] = 'l';
+				spec[len++] = 'l';
+				spec[len++] = *p;
+				spec[len] = 0;
+				printf(spec, wide ? (unsigned long long) v : (unsigned long long) (unsigned) v);
+				break;
+
+			case 'c':
+				spec[len++] = 'c';
+				spec[len] = 0;
+				printf(spec, (int) v);
+				break;
+
+			case 's':
+				spec[len++] = 's';
+				spec[len] = 0;
+				printf(spec, (v != 0) ? (const char*) (uintptr_t) v : "(null)");
+				break;
+
+			case 'p':
+				spec[len++] = 'p';
+				spec[len] = 0;
+				printf(spec, (void*) (uintptr_t) v);
+				break;
+
+			default:
+				fwrite(start, 1, p + 1 - start, stdout);
+				break;
+		}
+		p++;
+	}
+}
+
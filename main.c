@@ -47,6 +47,15 @@
  */
 #include <pthread.h>
 
+/* fcntl()
+ * O_NONBLOCK
+ */
+#include <fcntl.h>
+
+/* poll()
+ */
+#include <poll.h>
+
 /* __u32
  */
 #include <linux/types.h>
@@ -57,6 +66,11 @@
  */
 #include <semaphore.h>
 
+/* SOF_TIMESTAMPING_RX_SOFTWARE
+ * SOF_TIMESTAMPING_SOFTWARE
+ */
+#include <linux/net_tstamp.h>
+
 /* autl_prnt_buf()
  */
 #include <arrayutils.h>
@@ -100,6 +114,21 @@ const char *STR_MCRM[] = {
 	"Client"	// MCRM_CLIENT 	= 1
 };
 
+/**
+ * String representation of MCTP Watchdog Stages (WS)
+ */
+const char *STR_MCWS[] = {
+	"pr",		// MCWS_PR 		= 0,
+	"mh",		// MCWS_MH 		= 1,
+	"pw",		// MCWS_PW 		= 2,
+	"sw",		// MCWS_SW 		= 3,
+	"st",		// MCWS_ST 		= 4,
+	"ct",		// MCWS_CT 		= 5,
+	"pkts",		// MCWS_PKTS 	= 6,
+	"msgs",		// MCWS_MSGS 	= 7,
+	"actions"	// MCWS_ACTIONS = 8
+};
+
 /* String representation of MCTP Message Type Codes (MT)
  *
  * See DSP0239 v1.9.0 Table 1.
@@ -120,6 +149,10 @@ const char *STR_MCMT[] = {
 
 /* PROTOTYPES ================================================================*/
 
+static void mctp_drain_fail(struct mctp *m, struct mctp_action *ma);
+static void mctp_pq_hwm(struct mctp *m, int q);
+static int mctp_connect_fd(struct mctp *m, int fd);
+
 /* FUNCTIONS =================================================================*/
 
 /**
@@ -157,7 +190,6 @@ void mctp_fill_msg_hdr(
 int mctp_free(struct mctp *m)
 {
 	INIT 
-	struct mctp_version *head, *curr, *next;
 	int rv;
 
 	ENTER
@@ -173,6 +205,18 @@ int mctp_free(struct mctp *m)
 	}
 
 	STEP // 2: Close socket connection
+	mctp_metrics_stop(m);
+	mctp_watchdog_stop(m);
+	free(m->wd);
+	mctp_capture_stop(m);
+	free(m->cap);
+	mctp_free_filters(m);
+	mctp_trace_stop(m);
+	if (m->tr != NULL)
+		free(m->tr->recs);
+	free(m->tr);
+	mctp_acct_free(m);
+	mctp_shm_close(m);
 	if (m->conn != m->sock)
 		close(m->conn);	
 	close(m->sock);	
@@ -180,7 +224,8 @@ int mctp_free(struct mctp *m)
 	STEP // 3: Destroy Mutexes 
 	pthread_mutex_destroy(&m->mtx);
 	pthread_cond_destroy(&m->cond);
-	pthread_mutex_destroy(&m->tags_mtx);
+	pthread_mutex_destroy(&m->drain_mtx);
+	pthread_cond_destroy(&m->drained);
 	
 	STEP // 4: Free queues
 	pq_free(m->rpq);
@@ -192,20 +237,10 @@ int mctp_free(struct mctp *m)
 	pq_free(m->pkts);
 	pq_free(m->msgs);
 	pq_free(m->actions);
+	mctp_pq_track_free(m);
 
 	STEP // 5 Free MCTP Versions array 
-	head = m->mctp_versions;
-	while (head != NULL)
-	{
-		curr = head;
-		head = head->next_type;
-		while (curr != NULL)
-		{
-			next = curr->next_entry;
-			free(curr);
-			curr = next;
-		}
-	}
+	mctp_free_versions(m);
 
 	STEP // 6: Free mctp struct memory
 	free(m);
@@ -249,6 +284,13 @@ struct mctp *mctp_init()
 		return NULL;
 	}
 
+	// Allocate the per EID and per message type accounting shards 
+	if (mctp_acct_init(m) != 0)
+	{
+		free(m);
+		return NULL;
+	}
+
 	// STEP 2: Initialize message handlers
 	m->handlers[MCMT_CONTROL] = mctp_ctrl_handler;
 
@@ -268,7 +310,24 @@ struct mctp *mctp_init()
 	// STEP 5: Initialize mutex variables
 	pthread_mutex_init(&m->mtx, NULL);
 	pthread_cond_init(&m->cond, NULL);
-	pthread_mutex_init(&m->tags_mtx, NULL);
+	pthread_mutex_init(&m->drain_mtx, NULL);
+	pthread_cond_init(&m->drained, NULL);
+
+	// Select the time stamp clock the first time. The TSC is calibrated once per process 
+	if (!mctp_clock.ready)
+		mctp_clock_init(MCCK_AUTO);
+
+	// Do not pin threads to a CPU unless requested
+	m->cpu = -1;
+
+	// Use a single connection unless striping is requested
+	m->max_conns = 1;
+
+	// Count pool and queue use locally until a statistics segment is opened 
+	m->pq_count = m->pq_local;
+
+	// The metrics exporter is started separately 
+	m->metrics_fd = -1;
 
 	// STEP 6: Initialize mctp_versions array
 	m->mctp_versions = NULL;
@@ -279,6 +338,57 @@ struct mctp *mctp_init()
 	return m;
 }
 
+/**
+ * Free the MCTP Versions array of an mctp object 
+ */
+void mctp_free_versions(struct mctp *m)
+{
+	struct mctp_version *head, *curr, *next;
+
+	head = m->mctp_versions;
+	while (head != NULL)
+	{
+		curr = head;
+		head = head->next_type;
+		while (curr != NULL)
+		{
+			next = curr->next_entry;
+			free(curr);
+			curr = next;
+		}
+	}
+
+	m->mctp_versions = NULL;
+}
+
+/**
+ * Fill a statistics object from the counters of the threads 
+ *
+ * The thread counters are reset when a new connection is configured
+ */
+void mctp_get_stats(struct mctp *m, struct mctp_stats *s)
+{
+	memset(s, 0, sizeof(struct mctp_stats));
+
+	s->rx_packets 			= m->sr.packet_count;
+	s->rx_messages 			= m->pr.message_count;
+	s->rx_dropped_packets 	= m->sr.dropped_count 
+							+ m->pr.dropped_version 
+							+ m->pr.dropped_seqnum 
+							+ m->pr.dropped_noeom 
+							+ m->pr.dropped_nosom 
+							+ m->pr.dropped_wrongto 
+							+ m->pr.dropped_ic;
+	s->rx_dropped_responses = m->mh.dropped_unmatched + m->mh.dropped_stale;
+	s->tx_messages 			= m->pw.message_count;
+	s->tx_packets 			= m->sw.packet_count;
+	s->tx_dropped_packets 	= m->sw.dropped_count;
+	s->completed_actions 	= m->ct.completed_actions;
+	s->failed_actions 		= m->ct.failed_actions;
+	s->outstanding_actions 	= mctp_tags_count(m);
+	s->reconnects 			= m->reconnects;
+}
+
 /**
  * Determine the number of packets needed for this MCTP Message
  * 
@@ -360,7 +470,7 @@ void mctp_prnt_pkt_wrapper(struct mctp_pkt_wrapper *pw)
 		return;
 
 	printf("MCTP Packet Wrapper:\n");
-	timespec_print(&pw->ts);
+	printf("TS:       %llu ns\n", (unsigned long long) mctp_ticks_to_ns(pw->ts));
 	printf("Next:     %p\n", pw->next);
 	mctp_prnt_pkt(&pw->pkt);
 }
@@ -412,6 +522,46 @@ void mctp_prnt_msg(struct mctp_msg *mm)
 	autl_prnt_buf(mm->payload, mm->len, 4, 1);
 }
 
+/**
+ * Inject a packet into the Receive Packet Queue as if it had been read from a connection 
+ *
+ * Used to replay captured traffic. The packet is time stamped now 
+ *
+ * @param conn 	Index of the connection the packet appears to arrive on. Responses are sent there 
+ * @return 		0 upon success, 1 otherwise and sets errno. ENOBUFS if the pool or queue is exhausted 
+ */
+int mctp_inject(struct mctp *m, struct mctp_pkt *pkt, int conn)
+{
+	struct mctp_pkt_wrapper *pw;
+
+	if (conn < 0 || conn >= MCTP_MAX_CONNS)
+	{
+		errno = EINVAL;
+		return 1;
+	}
+
+	pw = mctp_pq_pop(m, MCPQ_PKTS, 0);
+	if (pw == NULL)
+	{
+		errno = ENOBUFS;
+		return 1;
+	}
+
+	pw->ts = mctp_now();
+	pw->next = NULL;
+	pw->conn = conn;
+	memcpy(&pw->pkt, pkt, sizeof(struct mctp_pkt));
+
+	if (mctp_pq_push(m, MCPQ_RPQ, pw) != 0)
+	{
+		mctp_pq_push(m, MCPQ_PKTS, pw);
+		errno = ENOBUFS;
+		return 1;
+	}
+
+	return 0;
+}
+
 /**
  * Retire an MCTP action 
  *
@@ -425,9 +575,9 @@ void mctp_retire(struct mctp* m, struct mctp_action *a)
 
 	// Check in msg
 	if (a->req != NULL)
-		pq_push(m->msgs, a->req);
+		mctp_pq_push(m, MCPQ_MSGS, a->req);
 	if (a->rsp != NULL)
-		pq_push(m->msgs, a->rsp);
+		mctp_pq_push(m, MCPQ_MSGS, a->rsp);
 
 	if (a->pw != NULL)
 	{
@@ -436,7 +586,7 @@ void mctp_retire(struct mctp* m, struct mctp_action *a)
 		{
 			next = pw->next;
 			pw->next = NULL;
-			pq_push(m->pkts, pw);
+			mctp_pq_push(m, MCPQ_PKTS, pw);
 			pw = next;
 		} while (pw != NULL);
 	}
@@ -445,7 +595,136 @@ void mctp_retire(struct mctp* m, struct mctp_action *a)
 	memset(a, 0, sizeof(struct mctp_action));
 
 	// Check in action 
-	pq_push(m->actions, a);
+	mctp_pq_push(m, MCPQ_ACTIONS, a);
+}
+
+/**
+ * Get a pool or queue of an mctp object 
+ *
+ * @param q 	enum _MCPQ 
+ */
+struct ptr_queue *mctp_pq(struct mctp *m, int q)
+{
+	switch (q)
+	{
+		case MCPQ_PKTS: 	return m->pkts;
+		case MCPQ_MSGS: 	return m->msgs;
+		case MCPQ_ACTIONS: 	return m->actions;
+		case MCPQ_RPQ: 		return m->rpq;
+		case MCPQ_TPQ: 		return m->tpq;
+		case MCPQ_RMQ: 		return m->rmq;
+		case MCPQ_TMQ: 		return m->tmq;
+		case MCPQ_TAQ: 		return m->taq;
+		case MCPQ_ACQ: 		return m->acq;
+		default: 			return NULL;
+	}
+}
+
+/**
+ * Push an object onto a pool or queue and count it 
+ *
+ * @param q 	enum _MCPQ 
+ * @return 		Return value of pq_push()
+ */
+int mctp_pq_push(struct mctp *m, int q, void *ptr)
+{
+	int rv;
+
+	// Record the holder before the object is visible to the thread that pops it 
+	if (m->pq_track != NULL)
+		mctp_pq_track(m, q, ptr, 0);
+
+	rv = pq_push(mctp_pq(m, q), ptr);
+	if (rv == 0)
+	{
+		__atomic_fetch_add(&m->pq_count[q].push, 1, __ATOMIC_RELAXED);
+		if (q > MCPQ_ACTIONS)
+			mctp_pq_hwm(m, q);
+	}
+
+	return rv;
+}
+
+/**
+ * Pop an object from a pool or queue and count it 
+ *
+ * @param q 	enum _MCPQ 
+ * @param wait 	Passed to pq_pop()
+ * @return 		Return value of pq_pop()
+ */
+void *mctp_pq_pop(struct mctp *m, int q, int wait)
+{
+	void *ptr;
+
+	ptr = pq_pop(mctp_pq(m, q), wait);
+	if (ptr == NULL)
+		return NULL;
+
+	__atomic_fetch_add(&m->pq_count[q].pop, 1, __ATOMIC_RELAXED);
+	if (q <= MCPQ_ACTIONS)
+		mctp_pq_hwm(m, q);
+
+	if (m->pq_track != NULL)
+		mctp_pq_track(m, q, ptr, 1);
+
+	return ptr;
+}
+
+/**
+ * Raise the high-water mark of a pool or queue to its depth 
+ *
+ * @param q 	enum _MCPQ 
+ */
+static void mctp_pq_hwm(struct mctp *m, int q)
+{
+	__u64 n, hwm;
+
+	n = mctp_pq_depth(m, q);
+	hwm = __atomic_load_n(&m->pq_hwm[q], __ATOMIC_RELAXED);
+	while (n > hwm && !__atomic_compare_exchange_n(&m->pq_hwm[q], &hwm, n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/**
+ * Number of objects in a queue, or checked out of a pool 
+ *
+ * Read without locking while the threads run. A push and the pop of the same
+ * object can be counted in either order, so the result is clamped at 0
+ *
+ * @param q 	enum _MCPQ 
+ */
+__u64 mctp_pq_depth(struct mctp *m, int q)
+{
+	__s64 n;
+
+	n = __atomic_load_n(&m->pq_count[q].push, __ATOMIC_RELAXED) 
+	  - __atomic_load_n(&m->pq_count[q].pop, __ATOMIC_RELAXED);
+	if (q <= MCPQ_ACTIONS)
+		n = -n;
+
+	return (n > 0) ? n : 0;
+}
+
+/**
+ * Capacity of a pool or queue 
+ *
+ * @param q 	enum _MCPQ 
+ */
+unsigned mctp_pq_size(int q)
+{
+	switch (q)
+	{
+		case MCPQ_PKTS: 	return MCTP_PKT_POOL_SIZE;
+		case MCPQ_MSGS: 	return MCTP_MSG_POOL_SIZE;
+		case MCPQ_ACTIONS: 	return MCTP_ACTION_POOL_SIZE;
+		case MCPQ_RPQ: 		return MCTP_RPQ_SIZE;
+		case MCPQ_TPQ: 		return MCTP_TPQ_SIZE;
+		case MCPQ_RMQ: 		return MCTP_RMQ_SIZE;
+		case MCPQ_TMQ: 		return MCTP_TMQ_SIZE;
+		case MCPQ_TAQ: 		return MCTP_TAQ_SIZE;
+		case MCPQ_ACQ: 		return MCTP_ACQ_SIZE;
+		default: 			return 0;
+	}
 }
 
 /** 
@@ -468,7 +747,7 @@ void mctp_retire(struct mctp* m, struct mctp_action *a)
 int mctp_run(struct mctp *m, int port, __u32 address, int mode, int use_threads, int dontblock)
 {
 	INIT 
-	int rv;
+	int rv, opt;
 	sem_t sem;
 	struct timespec ts, delta;
 
@@ -484,10 +763,14 @@ int mctp_run(struct mctp *m, int port, __u32 address, int mode, int use_threads,
 	m->mode = mode;
 	m->use_threads = use_threads;
 	m->wait = use_threads;
+	m->drain = MCDR_NONE;
 
 	STEP // 2: Create socket
-	m->sock = socket(AF_INET, SOCK_STREAM, 0);
-	if ( m->sock < 0 ) 
+	// Sockets received from a previous process are already bound or connected 
+	if (m->handoff != NULL)
+		goto start;
+
+	if ( mctp_socket(m) != 0 ) 
 	{
 		ERR32("Could not create socket. rv:", m->sock);
 		rv = -1;
@@ -501,8 +784,29 @@ int mctp_run(struct mctp *m, int port, __u32 address, int mode, int use_threads,
 	m->sa_server.sin_addr.s_addr = address;
 
 	STEP // 4: Configure Socket
-	if ( mode == MCRM_SERVER ) 
+	if ( m->transport == MCTR_SERIAL || m->transport == MCTR_SMBUS ) 
+	{
+		// A serial line or SMBus has no socket address. It is connected as soon as it is open 
+		m->conn = m->sock;
+		m->conns[0] = m->sock;
+		m->conn_up[0] = 1;
+		m->num_conns = 1;
+	}
+	else if ( mode == MCRM_SERVER ) 
 	{
+		// Let the other shards of a group bind the same port. The kernel spreads connections across them
+		if (m->reuseport) 
+		{
+			opt = 1;
+			rv = setsockopt(m->sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+			if ( rv < 0 ) 
+			{
+				ERR32("Could not set SO_REUSEPORT. rv",  rv);
+				rv = -2;
+				goto close;
+			}
+		}
+
 		// Bind to socket
 		rv = bind(m->sock, (struct sockaddr *) &m->sa_server, sizeof(struct sockaddr_in));
 		if ( rv < 0 ) 
@@ -512,25 +816,28 @@ int mctp_run(struct mctp *m, int port, __u32 address, int mode, int use_threads,
 			goto close;
 		}
 
-		// Listen on socket
-		listen(m->sock,5);
+		// Listen on socket. Datagram sockets learn their peer in the Connection Handler
+		if (m->transport == MCTR_TCP)
+			listen(m->sock,5);
 	}
 	else {
 		// Connect to the server as a client
-		rv = connect(m->sock, (struct sockaddr *) &m->sa_server, sizeof(struct sockaddr_in));
+		rv = mctp_connect(m);
 		if ( rv < 0 ) 
 		{
 			ERR32("Socket connect failed. rv:", rv);
 			rv = -3;
 			goto close;
 		}
-		m->conn = m->sock;
 	}
 
+start:
+
 	// Set struct mctp pointer in Connection Handler object
 	m->ch.m = m;
 	m->ch.dontblock = dontblock;
 	m->ch.sem = NULL;
+	m->ch.status = 0;
 
 	STEP // 5: Start Connection Handler Thread
 	// If the user specified dontblock, then start the connection handler thread function as a independent thread and return
@@ -563,10 +870,25 @@ int mctp_run(struct mctp *m, int port, __u32 address, int mode, int use_threads,
 			rv = 2;
 			goto close;
 		}
+
+		// The Connection Handler exits without closing the socket if it could not prepare the threads 
+		if (m->ch.status != 0) 
+		{
+			ERR32("Threads failed to start", m->ch.status);
+			pthread_join(m->pt_ch, NULL);
+			m->pt_ch = 0;
+			rv = 2;
+			goto close;
+		}
 	}
 	else 
 	{
 		mctp_connection_handler(&m->ch);
+		if (m->ch.status != 0) 
+		{
+			rv = 2;
+			goto close;
+		}
 	}
 
 	rv = 0;
@@ -596,6 +918,366 @@ void mctp_set_handler (
 		m->handlers[type] = func;
 }
 
+/**
+ * Enable or disable the Message Integrity Check for transmitted messages of a type
+ *
+ * When enabled the IC bit is set and a CRC-32C of the message type byte and 
+ * body is placed in the last 4 bytes of the last packet of the message. 
+ * Received messages are verified whenever the sender set the IC bit.
+ *
+ * @return 0 upon success, 1 if the type does not allow an integrity check
+ */
+int mctp_set_ic(struct mctp *m, int type, int enable)
+{
+	// MCTP Control messages never carry an integrity check
+	if (type <= MCMT_CONTROL || type >= MCMT_MAX)
+		return 1;
+
+	m->ic[type] = (enable != 0);
+
+	return 0;
+}
+
+/**
+ * Select the transport binding used to carry MCTP packets 
+ *
+ * The UDP transport sends each packet as one datagram and replaces the 
+ * Socket Reader and Socket Writer thread functions. The serial transport is 
+ * selected with mctp_set_serial(), which also sets its device, and the SMBus 
+ * transport with mctp_set_smbus(), which also sets its byte transport. Must 
+ * be called before mctp_run()
+ *
+ * @param m 			struct mctp*
+ * @param transport 	enum _MCTR
+ * @return 				0 upon success, 1 if invalid or already running 
+ */
+int mctp_set_transport(struct mctp *m, int transport)
+{
+	if (m->all_threads_started || transport < 0 || transport >= MCTR_MAX)
+		return 1;
+
+	m->transport = transport;
+
+	switch (transport)
+	{
+		case MCTR_UDP:
+			m->fn_sr = mctp_udp_reader;
+			m->fn_sw = mctp_udp_writer;
+			break;
+
+		case MCTR_SERIAL:
+			m->fn_sr = mctp_serial_reader;
+			m->fn_sw = mctp_serial_writer;
+			m->max_conns = 1;
+			break;
+
+		case MCTR_SMBUS:
+			m->fn_sr = mctp_smbus_reader;
+			m->fn_sw = mctp_smbus_writer;
+			m->max_conns = 1;
+			break;
+
+		case MCTR_TCP:
+		default:
+			m->fn_sr = mctp_socket_reader;
+			m->fn_sw = mctp_socket_writer;
+			break;
+	}
+
+	return 0;
+}
+
+/**
+ * Set the number of TCP connections to stripe actions across 
+ *
+ * A client opens num connections to the server. A server accepts up to num
+ * connections at once and answers each request on the connection it came in
+ * on. Must be called before mctp_run()
+ *
+ * @param m 	struct mctp*
+ * @param num 	Number of connections [1, MCTP_MAX_CONNS]
+ * @return 		0 upon success, 1 if invalid or already running 
+ */
+int mctp_set_connections(struct mctp *m, int num)
+{
+	if (m->all_threads_started || num < 1 || num > MCTP_MAX_CONNS)
+		return 1;
+
+	m->max_conns = num;
+
+	return 0;
+}
+
+/**
+ * Choose the connection to transmit an action on
+ *
+ * Actions are striped by destination EID and tag. If that connection has 
+ * failed the next connection that is still up is used.
+ *
+ * @return index into m->conns
+ */
+int mctp_conn_pick(struct mctp *m, struct mctp_action *ma)
+{
+	int i, c, num, start;
+
+	num = __atomic_load_n(&m->num_conns, __ATOMIC_ACQUIRE);
+	if (num <= 1)
+		return 0;
+
+	start = (ma->req->dst + ma->req->tag) % num;
+	for ( i = 0 ; i < num ; i++ )
+	{
+		c = (start + i) % num;
+		if (__atomic_load_n(&m->conn_up[c], __ATOMIC_ACQUIRE))
+			return c;
+	}
+
+	return start;
+}
+
+/**
+ * Mark a striped connection as failed 
+ *
+ * The socket is shut down so both the reader and the writer see the failure.
+ * It is closed when the threads stop.
+ *
+ * @return the number of connections still up 
+ */
+int mctp_conn_down(struct mctp *m, int i)
+{
+	int c, num, up;
+
+	if (__atomic_exchange_n(&m->conn_up[i], 0, __ATOMIC_ACQ_REL))
+		shutdown(m->conns[i], SHUT_RDWR);
+
+	up = 0;
+	num = __atomic_load_n(&m->num_conns, __ATOMIC_ACQUIRE);
+	for ( c = 0 ; c < num ; c++ )
+		up += __atomic_load_n(&m->conn_up[c], __ATOMIC_ACQUIRE);
+
+	return up;
+}
+
+/**
+ * Send large messages without copying the packets into the kernel 
+ *
+ * Messages of at least threshold bytes on the wire are sent with MSG_ZEROCOPY.
+ * Their packets return to the pool once the kernel reports it is done with 
+ * them. Must be called before mctp_run()
+ *
+ * @param m 			struct mctp*
+ * @param threshold 	Minimum message size in bytes. 0 to disable
+ * @return 				0 upon success, 1 if already running 
+ */
+int mctp_set_zerocopy(struct mctp *m, unsigned threshold)
+{
+	if (m->all_threads_started)
+		return 1;
+
+	m->zerocopy = threshold;
+
+	return 0;
+}
+
+/**
+ * Stamp received packets with the time the kernel received them 
+ *
+ * The kernel software receive timestamp (SO_TIMESTAMPING) of each read is 
+ * taken from its control message instead of reading the clock once the read 
+ * returns. Packet latency then includes the time spent in the socket buffer.
+ * For TCP the stamp is that of the segment holding the start of the packet.
+ * Must be called before mctp_run()
+ *
+ * @param m 		struct mctp*
+ * @param enable 	1 to enable, 0 to disable 
+ * @return 			0 upon success, 1 if already running 
+ */
+int mctp_set_rxts(struct mctp *m, int enable)
+{
+	if (m->all_threads_started)
+		return 1;
+
+	m->rxts = (enable != 0);
+
+	return 0;
+}
+
+/**
+ * Request kernel software receive timestamps on a socket 
+ *
+ * Connections accepted from a listening socket inherit the option 
+ *
+ * @return 0 upon success, 1 upon error 
+ */
+int mctp_rxts_enable(int fd)
+{
+	int opt;
+
+	opt = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+	return (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &opt, sizeof(opt)) != 0);
+}
+
+/**
+ * Reconnect a TCP client automatically when its connection drops
+ *
+ * The first attempt is made after MCTP_RECONNECT_MIN_MSEC and the delay is 
+ * doubled after each failed attempt up to max_msec. Queued and outstanding 
+ * actions are kept and sent on the new connection. Must be called before 
+ * mctp_run()
+ *
+ * @param m 			struct mctp*
+ * @param max_msec 		Maximum delay between attempts in milliseconds. 0 to disable
+ * @return 				0 upon success, 1 if already running 
+ */
+int mctp_set_reconnect(struct mctp *m, unsigned max_msec)
+{
+	if (m->all_threads_started)
+		return 1;
+
+	if (max_msec > 0 && max_msec < MCTP_RECONNECT_MIN_MSEC)
+		max_msec = MCTP_RECONNECT_MIN_MSEC;
+
+	m->reconnect = max_msec;
+
+	return 0;
+}
+
+/**
+ * Create the socket of the mctp object for its transport
+ *
+ * @return 0 upon success, 1 upon error 
+ */
+int mctp_socket(struct mctp *m)
+{
+	int opt;
+
+	if (m->transport == MCTR_SERIAL)
+		return mctp_serial_open(m);
+
+	if (m->transport == MCTR_SMBUS)
+		return mctp_smbus_open(m);
+
+	if (m->transport == MCTR_UDP)
+		m->sock = socket(AF_INET, SOCK_DGRAM, 0);
+	else 
+		m->sock = socket(AF_INET, SOCK_STREAM, 0);
+	if ( m->sock < 0 ) 
+		return 1;
+
+	// Datagrams that do not fit in the receive buffer are lost. Size it to hold a full RPQ
+	if (m->transport == MCTR_UDP)
+	{
+		opt = MCTP_UDP_RCVBUF;
+		setsockopt(m->sock, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+	}
+
+	// The Socket Reader reads the clock itself if the kernel does not stamp packets 
+	if (m->rxts)
+		mctp_rxts_enable(m->sock);
+
+	return 0;
+}
+
+/**
+ * Connect a socket to the server
+ *
+ * The connect is non-blocking so that a call to mctp_stop() ends the wait
+ *
+ * @return 0 upon success, -1 otherwise and sets errno
+ */
+static int mctp_connect_fd(struct mctp *m, int fd)
+{
+	struct pollfd pfd;
+	socklen_t len;
+	int flags, err, rv;
+
+	flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+
+	rv = connect(fd, (struct sockaddr *) &m->sa_server, sizeof(struct sockaddr_in));
+	if (rv < 0 && errno == EINPROGRESS)
+	{
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+
+		// Wait for the connection in slices, checking for mctp_stop() between them
+		while ( (rv = poll(&pfd, 1, MCTP_CONNECT_POLL_MSEC)) == 0 || (rv < 0 && errno == EINTR) )
+		{
+			if (__atomic_load_n(&m->stop_threads, __ATOMIC_ACQUIRE) == 1)
+			{
+				errno = ECANCELED;
+				return -1;
+			}
+		}
+		if (rv < 0)
+			return -1;
+
+		len = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			return -1;
+		if (err != 0)
+		{
+			errno = err;
+			return -1;
+		}
+		rv = 0;
+	}
+	if (rv < 0)
+		return -1;
+
+	// The threads use blocking reads and writes
+	if (fcntl(fd, F_SETFL, flags) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Connect the socket of a client to the server and open the striped connections
+ *
+ * m->sock is not closed upon error. Returns with errno ECANCELED if
+ * mctp_stop() is called while connecting
+ *
+ * @return 0 upon success, -1 upon error 
+ */
+int mctp_connect(struct mctp *m)
+{
+	int rv, fd;
+
+	rv = mctp_connect_fd(m, m->sock);
+	if ( rv < 0 ) 
+		return -1;
+
+	m->conn = m->sock;
+	m->conns[0] = m->sock;
+	m->conn_up[0] = 1;
+	m->num_conns = 1;
+
+	// Open the other connections to stripe actions across
+	while (m->transport == MCTR_TCP && m->num_conns < m->max_conns)
+	{
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd >= 0 && m->rxts)
+			mctp_rxts_enable(fd);
+		if (fd < 0 || mctp_connect_fd(m, fd) < 0)
+		{
+			if (fd >= 0)
+				close(fd);
+			while (--m->num_conns > 0)
+				close(m->conns[m->num_conns]);
+			m->num_conns = 0;
+			return -1;
+		}
+		m->conns[m->num_conns] = fd;
+		m->conn_up[m->num_conns] = 1;
+		m->num_conns++;
+	}
+
+	return 0;
+}
+
 /**
  * Set the function to be called as the message handler thread 
  */
@@ -626,7 +1308,9 @@ void mctp_request_stop(struct mctp *m)
 {
 	pthread_mutex_lock(&m->mtx);
 	{
-		m->stop_threads = 2;
+		// Do not turn a call to mctp_stop() into a reconnect
+		if (m->stop_threads == 0)
+			m->stop_threads = 2;
 		pthread_cond_signal(&m->cond);
 	}
 	pthread_mutex_unlock(&m->mtx);
@@ -667,9 +1351,246 @@ int mctp_stop(struct mctp *m)
 
 
 /**
- * Submit an object for transmission 
+ * Compute an absolute CLOCK_REALTIME deadline msec milliseconds from now
+ */
+void mctp_drain_deadline(struct timespec *ts, unsigned msec)
+{
+	timespec_get(ts, TIME_UTC);
+	ts->tv_sec += msec / 1000;
+	ts->tv_nsec += (msec % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/**
+ * Push the drain marker onto a queue and wait for it to reach the Completion Thread
+ *
+ * Every object queued ahead of the marker has been handled when it arrives.
+ *
+ * @return 0 when the marker arrived, 1 if the deadline passed 
+ */
+int mctp_drain_marker(struct mctp *m, int q, struct timespec *deadline)
+{
+	__u32 markers;
+	int rv;
+
+	rv = 0;
+
+	pthread_mutex_lock(&m->drain_mtx);
+	{
+		markers = m->markers;
+		mctp_pq_push(m, q, &m->marker);
+
+		while (m->markers == markers && rv != ETIMEDOUT)
+			rv = pthread_cond_timedwait(&m->drained, &m->drain_mtx, deadline);
+
+		rv = (m->markers == markers);
+	}
+	pthread_mutex_unlock(&m->drain_mtx);
+
+	return rv;
+}
+
+/**
+ * Fail an action that was not finished by the threads
+ */
+static void mctp_drain_fail(struct mctp *m, struct mctp_action *ma)
+{
+	ma->completion_code = 1;
+	if (ma->fn_failed != NULL) 
+		ma->fn_failed(m, ma);
+	else 
+		mctp_retire(m, ma);
+}
+
+/**
+ * Call the callbacks of the actions left in the queues once the threads have stopped
+ *
+ * Completed actions are finished in order. Outstanding actions, actions still 
+ * waiting for a tag and actions submitted while the drain started are failed. 
+ * Nothing is left if the drain finished before its deadline.
+ */
+void mctp_drain_finish(struct mctp *m)
+{
+	struct mctp_tag_slot *s;
+	struct mctp_action *ma;
+	__u64 word;
+	int i;
+
+	// Requests waiting to be sent are also in the outstanding action table. Responses have no callback to call
+	while ( (ma = mctp_pq_pop(m, MCPQ_TMQ, 0)) != NULL )
+		if (!MCTP_IS_MARKER(m, ma) && ma->rsp != NULL)
+			mctp_retire(m, ma);
+	while ( (ma = mctp_pq_pop(m, MCPQ_TPQ, 0)) != NULL )
+		if (!MCTP_IS_MARKER(m, ma) && ma->rsp != NULL)
+			mctp_retire(m, ma);
+
+	// Actions the Completion Thread did not get to
+	while ( (ma = mctp_pq_pop(m, MCPQ_ACQ, 0)) != NULL )
+	{
+		if (MCTP_IS_MARKER(m, ma))
+			continue;
+
+		if (ma->completion_code != 0 && ma->fn_failed != NULL)
+			ma->fn_failed(m, ma);
+		else if (ma->completion_code == 0 && ma->fn_completed != NULL)
+			ma->fn_completed(m, ma);
+		else 
+			mctp_retire(m, ma);
+	}
+
+	// Outstanding actions 
+	for ( i = 0 ; i < MCTP_TAG_TABLE_SIZE ; i++ )
+	{
+		s = &m->tags.slots[i];
+		word = s->word;
+		if ( (word & MCTP_TAG_BUSY) == 0 )
+			continue;
+
+		ma = s->ma;
+		mctp_tags_release(m, i, word);
+		mctp_drain_fail(m, ma);
+	}
+
+	// The actions waiting for a tag and the actions that never got one
+	for ( i = 0 ; i < MCTP_NUM_EIDS ; i++ )
+	{
+		while ( (ma = m->st.deferred[i]) != NULL )
+		{
+			m->st.deferred[i] = ma->next;
+			mctp_drain_fail(m, ma);
+		}
+		m->st.deferred_tail[i] = NULL;
+	}
+	m->st.deferred_num = 0;
+	m->st.marker = NULL;
+
+	while ( (ma = mctp_pq_pop(m, MCPQ_TAQ, 0)) != NULL )
+		if (!MCTP_IS_MARKER(m, ma))
+			mctp_drain_fail(m, ma);
+}
+
+/**
+ * Stop the threads after the queued and outstanding actions have finished
+ *
+ * New submissions are refused. Queued actions are sent in order and every 
+ * outstanding action completes or fails through its callbacks. Outstanding 
+ * actions that have not completed by the deadline are failed. The threads 
+ * then exit on their own instead of being cancelled. If the queues do not 
+ * flush by the deadline the threads are cancelled as in mctp_stop().
+ *
+ * A message handler set with mctp_set_mh() must pass the drain marker from 
+ * the RMQ on to the TMQ.
+ *
+ * This can only be called by an external thread, not by any of the child mctp threads
+ *
+ * @param m 	struct mctp*
+ * @param msec 	Time allowed for the queues to flush in milliseconds
+ * @return 		0 if everything was flushed, 1 if the threads had to be cancelled 
+ *
+ * STEPS
+ * 1: Refuse new submissions
+ * 2: Pass a marker through the TAQ so every queued action has been assigned a tag
+ * 3: Wait for the outstanding actions to complete or fail
+ * 4: Fail the outstanding actions that did not finish by the deadline 
+ * 5: Pass a marker through the receive path so received messages and completions are handled
+ * 6: Stop the threads 
+ * 7: Finish the actions the threads left behind 
+ */
+int mctp_drain(struct mctp *m, unsigned msec)
+{
+	INIT 
+	struct mctp_tag_slot *s;
+	struct mctp_action *ma;
+	struct timespec deadline;
+	__u64 word;
+	int i, rv;
+
+	ENTER
+
+	rv = 1;
+
+	mctp_drain_deadline(&deadline, msec);
+
+	STEP // 1: Refuse new submissions
+	__atomic_store_n(&m->drain, MCDR_DRAIN, __ATOMIC_RELEASE);
+
+	// Nothing to flush if the threads are not running 
+	if ( (m->use_threads == 0) || (m->all_threads_started == 0) )
+	{
+		rv = 0;
+		goto stop;
+	}
+
+	// The threads have already stopped after an error. They cannot flush anything 
+	if (m->stop_threads != 0)
+		goto stop;
+
+	STEP // 2: Pass a marker through the TAQ so every queued action has been assigned a tag
+	if (mctp_drain_marker(m, MCPQ_TAQ, &deadline) != 0)
+		goto stop;
+
+	STEP // 3: Wait for the outstanding actions to complete or fail
+	while (mctp_tags_count(m) > 0 && timespec_elapsed(&deadline, TIME_UTC) == 0)
+		usleep(MCTP_DRAIN_USLEEP);
+
+	STEP // 4: Fail the outstanding actions that did not finish by the deadline 
+	for ( i = 0 ; i < MCTP_TAG_TABLE_SIZE ; i++ )
+	{
+		s = &m->tags.slots[i];
+		word = __atomic_load_n(&s->word, __ATOMIC_ACQUIRE);
+		if ( (word & MCTP_TAG_BUSY) == 0 )
+			continue;
+
+		if (mctp_tags_lock(m, i, &word) != 0)
+			continue;
+
+		// An action still waiting to be sent belongs to the Socket Writer
+		ma = s->ma;
+		if (__atomic_load_n(&ma->inflight, __ATOMIC_ACQUIRE))
+		{
+			mctp_tags_unlock(m, i, word);
+			continue;
+		}
+
+		mctp_tags_release(m, i, word);
+		ma->completion_code = 1;
+		mctp_pq_push(m, MCPQ_ACQ, ma);
+	}
+
+	STEP // 5: Pass a marker through the receive path so received messages and completions are handled
+	// The failed actions still need time to reach the Completion Thread 
+	if (timespec_elapsed(&deadline, TIME_UTC))
+		mctp_drain_deadline(&deadline, MCTP_DRAIN_FLUSH_MSEC);
+
+	if (mctp_drain_marker(m, MCPQ_RPQ, &deadline) != 0)
+		goto stop;
+
+	// The threads exit when the marker reaches them instead of being cancelled
+	__atomic_store_n(&m->drain, MCDR_STOP, __ATOMIC_RELEASE);
+	rv = 0;
+
+stop:
+
+	STEP // 6: Stop the threads 
+	mctp_stop(m);
+
+	STEP // 7: Finish the actions the threads left behind 
+	mctp_drain_finish(m);
+
+	EXIT(rv)
+
+	return rv;
+}
+
+/**
+ * Submit an object for transmission to an endpoint 
  *
  * @param m 			struct mctp* 
+ * @param dst 			EID of the endpoint to send the request to 
  * @param type  		mctp message type
  * @param obj   		Pointer to serialized data buffer to send 
  * @param len   		Length of object in bytes 
@@ -686,8 +1607,9 @@ int mctp_stop(struct mctp *m)
  * 3. Prepare action 
  * 4. Submit action	
  */ 
-struct mctp_action *mctp_submit(
+struct mctp_action *mctp_submit_to(
 	struct mctp *m, 
+	__u8 dst,
 	int type, 
 	void *obj, 
 	size_t len,
@@ -721,15 +1643,22 @@ struct mctp_action *mctp_submit(
 	if (len == 0) 
 		goto end;
 
+	// Refuse new actions once a drain has started 
+	if (__atomic_load_n(&m->drain, __ATOMIC_ACQUIRE) != MCDR_NONE) 
+	{
+		errno = ESHUTDOWN;
+		goto end;
+	}
+
 	STEP // 2. Prepare Message 
 
 	// Check out msg 
-	mm = pq_pop(m->msgs, 1);
+	mm = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (mm == NULL) 
 		goto end;
 
-	// Fill out msg 
-	mm->owner = 1;
+	// Fill out msg. A pool msg keeps the EIDs of its last use, so both are set 
+	mctp_fill_msg_hdr(mm, dst, m->state.eid, 1, 0);
 	mm->type = type;
 	mm->len = len;
 	memcpy(&mm->payload, obj, len);
@@ -737,7 +1666,7 @@ struct mctp_action *mctp_submit(
 	STEP // 3. Prepare Action 
 
 	// Check out action 
-	ma = pq_pop(m->actions, 1);
+	ma = mctp_pq_pop(m, MCPQ_ACTIONS, 1);
 	if (ma == NULL) 
 		goto end;
 
@@ -751,7 +1680,7 @@ struct mctp_action *mctp_submit(
 	else 
 		ma->max = retry;
 	
-	timespec_get(&ma->created, CLOCK_MONOTONIC); 
+	ma->created = mctp_now();
 
 	ma->user_data = user_data;
 	ma->fn_submitted = fn_submitted;
@@ -770,8 +1699,10 @@ struct mctp_action *mctp_submit(
 	}
 
 	STEP // 4. Submit action	
+	MCTP_PROBE(action_submitted, ma, ma->req->dst, ma->req->type, ma->req->len, ma->created);
+	MCTP_TRACE(m, MCTE_QUEUED, ma, ma->req->dst, 0, 0);
 	
-	rv = pq_push(m->taq, ma);
+	rv = mctp_pq_push(m, MCPQ_TAQ, ma);
 	if (rv != 0)
 	{
 		ma = NULL;
@@ -804,6 +1735,32 @@ end:
 	return ma;
 }
 
+/**
+ * Submit an object for transmission to the bus owner
+ *
+ * Kept for callers written before the destination EID was a parameter. The
+ * request is addressed to the bus owner EID, which is 0 until a Set EID
+ * request or a handoff assigns it. See mctp_submit_to() for the parameters
+ */
+struct mctp_action *mctp_submit(
+	struct mctp *m,
+	int type,
+	void *obj,
+	size_t len,
+	int retry,
+	struct timespec *delta,
+	void *user_data,
+	void (*fn_submitted)(struct mctp *m, struct mctp_action *a),
+	void (*fn_completed)(struct mctp *m, struct mctp_action *a),
+	void (*fn_failed)(struct mctp *m, struct mctp_action *a)
+)
+{
+	if (m == NULL)
+		return NULL;
+
+	return mctp_submit_to(m, m->state.bus_owner_eid, type, obj, len, retry, delta, user_data, fn_submitted, fn_completed, fn_failed);
+}
+
 /* Functions to return a string representation of an object*/
 const char *mcmt(unsigned u)              
 {
@@ -833,3 +1790,10 @@ const char *mcrm(unsigned u)
 	return STR_MCRM[u];
 }
 
+const char *mcws(unsigned u)
+{
+	if (u >= MCWS_MAX)
+		return NULL;
+	return STR_MCWS[u];
+}
+
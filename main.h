@@ -19,6 +19,8 @@
  * MCIT - MCTP Control - Get Endpoint EID - Endpoint ID Type (IT)
  * MCMT - MCTP Message Type Codes (MT)
  * MCRM - Run Mode for the MCTP Threads (RM)
+ * MCTR - Transport binding of the MCTP Threads (TR)
+ * MCDR - Drain state of the MCTP Threads (DR)
  * MCSE - MCTP Control Set EID Operations (SE)
  * MCLN - Message Data Lengths for MCTP Control Messages (LN)
  * 
@@ -53,8 +55,62 @@
  */
 #include <semaphore.h>
 
+/* uintptr_t
+ */
+#include <stdint.h>
+
+/* FILE
+ */
+#include <stdio.h>
+
+/* __rdtsc()
+ */
+#if defined(__x86_64__)
+ #include <x86intrin.h>
+#endif
+
+/* STAP_PROBEV()
+ */
+#if !defined(MCTP_NO_USDT) && defined(__has_include)
+ #if __has_include(<sys/sdt.h>)
+  #include <sys/sdt.h>
+  #define MCTP_USDT
+ #endif
+#endif
+
 /* MACROS ====================================================================*/
 
+/*
+ * USDT probe in the mctp provider. A nop until a tracer attaches. Built when
+ * <sys/sdt.h> is available, unless MCTP_NO_USDT is defined. The arguments are
+ * evaluated even when no tracer is attached, so they only read fields. Bit
+ * fields cannot be passed, so header flags are passed as MCTP_HDR_FLAGS()
+ *
+ * Probe 				Arguments
+ * pkt_rx 				conn, src, dest, flags, ts
+ * msg_rx 				conn, src, dst, tag, owner, type, len, ts
+ * handler_entry 		src, tag, type, len, action
+ * handler_return 		src, tag, type, rv
+ * pkt_tx 				conn, dest, src, flags
+ * action_submitted 	action, dst, type, len, created
+ * action_retried 		action, eid, tag, attempts, created, now
+ * action_completed 	action, eid, tag, type, created, completed
+ * action_failed 		action, eid, tag, attempts, created, now
+ * tag_alloc 			eid, tag, action, tagged
+ * tag_free 			eid, tag
+ * stage_stall 		stage, queue, stalled, loop, backlog, msec
+ *
+ * flags is byte 3 of the MCTP header. Time stamps are mctp_ticks_t
+ */
+#ifdef MCTP_USDT
+ #define MCTP_PROBE(name, ...) 			STAP_PROBEV(mctp, name, __VA_ARGS__)
+#else
+ #define MCTP_PROBE(name, ...) 			do { if (0) mctp_probe_nop(0, __VA_ARGS__); } while (0)
+#endif
+
+// Byte 3 of a serialized MCTP header: [2:0] tag, [3] owner, [5:4] seq, [6] eom, [7] som
+#define MCTP_HDR_FLAGS(h) 				(((__u8*) (h))[3])
+
 // Serialized length of MCTP Header
 #define MCLN_HDR 						4
 // Serialized length of MCTP BTU
@@ -65,6 +121,8 @@
 #define MCLN_TYPE						1
 // Serialized length of MCTP Control UUID 
 #define MCLN_UUID    					16
+// Serialized length of MCTP Message Integrity Check (CRC-32C)
+#define MCLN_IC 						4
 
 #define MCLN_MSG_PAYLOAD 				8192
 #define MCLN_MSG 						(MCLN_HDR + MCLN_TYPE + MCLN_MSG_PAYLOAD)
@@ -75,6 +133,183 @@
 
 #define MCTP_NUM_TAGS  					8
 
+// Outstanding action table. Keyed by (peer EID, tag). Size must be a power of 2
+#define MCTP_TAG_TABLE_BITS 			8
+#define MCTP_TAG_TABLE_SIZE 			(1 << MCTP_TAG_TABLE_BITS)
+#define MCTP_NUM_EIDS 					256
+#define MCTP_TAG_BUSY 					(0x01 << 0)
+#define MCTP_TAG_LOCK 					(0x01 << 1)
+#define MCTP_TAG_USED 					(0x01 << 18)
+
+// Number of packets the Packet Reader takes from the RPQ at once
+#define MCTP_PR_BATCH 					32
+// Number of entries in the Packet Reader decision table
+#define MCTP_PR_TABLE_SIZE 				64
+
+// Number of zero copy messages the Socket Writer can hold until the kernel releases them
+#define MCTP_ZC_RING_SIZE 				128
+// Maximum number of packets sent in one zero copy sendmsg() call
+#define MCTP_ZC_IOV_MAX 				((MCLN_TYPE + MCLN_MSG_PAYLOAD + MCLN_IC + MCLN_BTU - 1) / MCLN_BTU)
+// Milliseconds the Socket Writer waits for a zero copy completion
+#define MCTP_ZC_REAP_MSEC 				1
+
+// Number of datagrams the UDP transport reads or writes per system call
+#define MCTP_UDP_BATCH 					32
+// Maximum number of packets in one UDP_SEGMENT send
+#define MCTP_UDP_GSO_SEGS 				64
+// Requested receive buffer size of a UDP socket. The kernel caps this at net.core.rmem_max
+#define MCTP_UDP_RCVBUF 				(4 << 20)
+
+// Maximum length of the device path of the serial transport
+#define MCTP_SERIAL_PATH_MAX 			108
+// Line rate of the serial transport when none is given
+#define MCTP_SERIAL_DEFAULT_BAUD 		115200
+// Bytes the serial transport reads from the line per system call
+#define MCTP_SERIAL_RX_SIZE 			4096
+// Milliseconds the serial Socket Reader waits for bytes before checking for a stop
+#define MCTP_SERIAL_POLL_MSEC 			100
+
+// Longest SMBus block write. Address, command, count and PEC around 255 bytes
+#define MCTP_SMBUS_FRAME_MAX 			259
+// SCL clock of a simulated SMBus when none is given
+#define MCTP_SMBUS_DEFAULT_HZ 			100000
+// Block writes a device on a simulated SMBus holds before it stops acknowledging
+#define MCTP_SMBUS_RX_FRAMES 			64
+// Maximum number of masters waiting for a simulated SMBus at once
+#define MCTP_SMBUS_MAX_MASTERS 			64
+// Times the SMBus Socket Writer resends a block write that was not acknowledged
+#define MCTP_SMBUS_NACK_RETRY 			3
+// Milliseconds the SMBus Socket Reader waits for a block write before checking for a stop
+#define MCTP_SMBUS_POLL_MSEC 			100
+
+// Fractional bits of the fixed point tick conversion factors
+#define MCTP_CLOCK_SHIFT 				32
+// Time to measure the TSC frequency over at startup
+#define MCTP_CLOCK_CALIBRATE_MSEC 		20
+
+// Control buffer size for the SO_TIMESTAMPING message of one receive
+#define MCTP_RXTS_CMSG_LEN 				64
+// Kernel receive timestamps converted between updates of their offset to the clock of pw->ts
+#define MCTP_RXTS_SYNC 					1024
+
+// Maximum number of shards in a server shard group
+#define MCTP_MAX_SHARDS 				256
+
+// Maximum number of TCP connections one mctp object can stripe across
+#define MCTP_MAX_CONNS 					8
+
+// First delay in milliseconds before a client reconnects. Doubled after each failed attempt
+#define MCTP_RECONNECT_MIN_MSEC 		10
+// Milliseconds a connect() waits between checks for mctp_stop()
+#define MCTP_CONNECT_POLL_MSEC 			10
+// Milliseconds the threads have to exit after a halt before they are cancelled
+#define MCTP_HALT_MSEC 					1000
+
+// Microseconds mctp_drain() sleeps between checks of the outstanding action table
+#define MCTP_DRAIN_USLEEP 				1000
+// Milliseconds mctp_drain() allows for the final flush when the deadline has passed
+#define MCTP_DRAIN_FLUSH_MSEC 			100
+// Test if an object popped from a queue is the drain marker of mctp object m
+#define MCTP_IS_MARKER(m, p) 			((void*) (p) == (void*) &(m)->marker)
+// Test if an object popped from a queue is the halt marker that stops the threads for a reconnect
+#define MCTP_IS_HALT(m, p) 				((void*) (p) == (void*) &(m)->halt)
+
+// Number of log2 microsecond latency buckets kept by the Completion Thread. The last bucket is unbounded
+#define MCTP_LAT_BUCKETS 				25
+// Milliseconds the metrics exporter waits in poll() before checking if it should stop
+#define MCTP_METRICS_POLL_MSEC 			100
+// Milliseconds the metrics exporter waits for a scraper to send its request
+#define MCTP_METRICS_REQ_MSEC 			200
+// Maximum length of the exposition the metrics exporter renders
+#define MCTP_METRICS_BUF_SIZE 			524288
+// Maximum length of the Unix socket path of the metrics exporter
+#define MCTP_METRICS_PATH_MAX 			108
+
+// Records in the log ring of each thread. Must be a power of 2
+#define MCTP_LOG_RING_SIZE 				1024
+// Milliseconds the log drain thread sleeps once every ring is empty
+#define MCTP_LOG_DRAIN_MSEC 			10
+// Arguments a log record holds. MCTP_LOG() passes at most 8
+#define MCTP_LOG_ARGS 					13
+// Bytes of payload a message record holds
+#define MCTP_LOG_MSG_BYTES 				(MCTP_LOG_ARGS * 8 - 8)
+
+/*
+ * Append a record to the log ring of the calling thread instead of printing
+ *
+ * Only the pointer to fmt and the arguments are stored. The drain thread
+ * formats the record later, so fmt and any %s argument must be string
+ * literals or otherwise outlive the record. Arguments are integers, pointers
+ * or strings, 1 to 8 of them. The record is dropped if the ring is full
+ */
+#define MCTP_LOG(fmt, ...) 				mctp_log(fmt, MCTP_LOG_NARGS(__VA_ARGS__), \
+											(const __u64[]) { MCTP_LOG_MAP(MCTP_LOG_NARGS(__VA_ARGS__), __VA_ARGS__) })
+#define MCTP_LOG_NARGS(...) 			MCTP_LOG_NTH(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define MCTP_LOG_NTH(_1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define MCTP_LOG_MAP(n, ...) 			MCTP_LOG_CAT(MCTP_LOG_A, n)(__VA_ARGS__)
+#define MCTP_LOG_CAT(a, b) 				MCTP_LOG_CAT2(a, b)
+#define MCTP_LOG_CAT2(a, b) 			a##b
+#define MCTP_LOG_ARG(x) 				((__u64) (uintptr_t) (x))
+#define MCTP_LOG_A1(a) 					MCTP_LOG_ARG(a)
+#define MCTP_LOG_A2(a, ...) 			MCTP_LOG_ARG(a), MCTP_LOG_A1(__VA_ARGS__)
+#define MCTP_LOG_A3(a, ...) 			MCTP_LOG_ARG(a), MCTP_LOG_A2(__VA_ARGS__)
+#define MCTP_LOG_A4(a, ...) 			MCTP_LOG_ARG(a), MCTP_LOG_A3(__VA_ARGS__)
+#define MCTP_LOG_A5(a, ...) 			MCTP_LOG_ARG(a), MCTP_LOG_A4(__VA_ARGS__)
+#define MCTP_LOG_A6(a, ...) 			MCTP_LOG_ARG(a), MCTP_LOG_A5(__VA_ARGS__)
+#define MCTP_LOG_A7(a, ...) 			MCTP_LOG_ARG(a), MCTP_LOG_A6(__VA_ARGS__)
+#define MCTP_LOG_A8(a, ...) 			MCTP_LOG_ARG(a), MCTP_LOG_A7(__VA_ARGS__)
+
+// pcap link type of packets that begin with the MCTP transport header
+#define MCTP_LINKTYPE 					291
+// Default number of records in each capture ring. Rounded up to a power of 2
+#define MCTP_CAPTURE_RING_SIZE 			4096
+// Milliseconds the capture writer sleeps once both rings are empty
+#define MCTP_CAPTURE_POLL_MSEC 			10
+// Bytes of stdio buffer of the capture file
+#define MCTP_CAPTURE_BUF_SIZE 			65536
+
+/*
+ * Copy a packet into the capture ring of direction dir [MCCD] if capture is
+ * running and the packet matches the filter. type is the message type of the
+ * packet [MCMT], -1 if unknown. Only one thread may capture each direction:
+ * the Packet Reader receives and the thread writing to the transport transmits
+ */
+#define MCTP_CAPTURE(m, dir, ts, pkt, type) \
+	do { if (__atomic_load_n(&(m)->capture, __ATOMIC_RELAXED)) mctp_capture_pkt(m, dir, ts, pkt, type); } while (0)
+
+// Message type in the first payload byte of a SOM packet
+#define MCTP_PKT_TYPE(pkt) 				((pkt)->payload[0] & 0x7F)
+
+// Instructions a compiled filter holds
+#define MCTP_FILTER_MAX_INSNS 			64
+
+// Default milliseconds a stage with input may go without progress before the watchdog reports it stalled
+#define MCTP_WATCHDOG_MSEC 				250
+// Milliseconds between watchdog samples
+#define MCTP_WATCHDOG_POLL_MSEC 		10
+
+// Rows of the per message type accounting table. Message types are 7 bits
+#define MCTP_ACCT_TYPES 				128
+
+// Default number of records in the action trace ring. Rounded up to a power of 2
+#define MCTP_TRACE_RING_SIZE 			65536
+
+/*
+ * Record lifecycle event ev [MCTE] of action ma if tracing is running. ma is
+ * only used as an identifier and is not dereferenced, so it may be retired
+ */
+#define MCTP_TRACE(m, ev, ma, eid, tag, num) \
+	do { if (__atomic_load_n(&(m)->trace, __ATOMIC_RELAXED)) mctp_trace_event(m, ev, ma, eid, tag, num); } while (0)
+
+// "MCSS"
+#define MCTP_SHM_MAGIC 					0x4D435353
+// Incremented when the layout of struct mctp_shm changes
+#define MCTP_SHM_VERSION 				1
+// Maximum length of the name of a statistics segment including the leading '/'
+#define MCTP_SHM_NAME_MAX 				64
+// Prefix of the default segment name. The pid of the process and the number of the mctp object in it are appended
+#define MCTP_SHM_PREFIX 				"/mctp."
+
 #define MCTP_RPQ_SIZE 					1024
 #define MCTP_TPQ_SIZE 					1024
 #define MCTP_RMQ_SIZE 					128
@@ -160,6 +395,175 @@ enum _MCRM
 	MCRM_MAX
 };
 
+/**
+ * MCTP Threads Transport binding (TR)
+ */
+enum _MCTR
+{
+	MCTR_TCP	   	= 0,
+	MCTR_UDP 		= 1,
+	MCTR_SERIAL 	= 2, 	//!< DSP0253 framing over a UART or pty
+	MCTR_SMBUS 		= 3, 	//!< DSP0237 block writes over a struct mctp_smbus_ops
+	MCTR_MAX
+};
+
+/**
+ * MCTP Threads Drain state (DR)
+ */
+enum _MCDR
+{
+	MCDR_NONE	   	= 0, 	//!< Running normally
+	MCDR_DRAIN 		= 1, 	//!< Refusing submissions while the queues flush
+	MCDR_STOP 		= 2, 	//!< Threads exit when the drain marker reaches them
+	MCDR_HANDOFF 	= 3, 	//!< As MCDR_STOP but the connections are left open for another process
+	MCDR_MAX
+};
+
+/**
+ * MCTP Pools and Queues (PQ)
+ */
+enum _MCPQ
+{
+	MCPQ_PKTS	   	= 0, 	//!< Packet pool
+	MCPQ_MSGS 		= 1, 	//!< Message pool
+	MCPQ_ACTIONS 	= 2, 	//!< Action pool
+	MCPQ_RPQ 		= 3, 	//!< Receive Packet Queue
+	MCPQ_TPQ 		= 4, 	//!< Transmit Packet Queue
+	MCPQ_RMQ 		= 5, 	//!< Receive Message Queue
+	MCPQ_TMQ 		= 6, 	//!< Transmit Message Queue
+	MCPQ_TAQ 		= 7, 	//!< Transmit Action Queue
+	MCPQ_ACQ 		= 8, 	//!< Action Completed Queue
+	MCPQ_MAX
+};
+
+/**
+ * MCTP Latency Stage (LS) measured by the Completion Thread
+ */
+enum _MCLS
+{
+	MCLS_QUEUE 		= 0, 	//!< Request created until a tag was assigned
+	MCLS_WIRE 		= 1, 	//!< Last submission of a request until its response arrived
+	MCLS_TOTAL 		= 2, 	//!< Request created until completed
+	MCLS_RESPOND 	= 3, 	//!< Request received until the response was sent
+	MCLS_MAX
+};
+
+/**
+ * MCTP Time stamp Clock source (CK)
+ */
+enum _MCCK
+{
+	MCCK_AUTO	   	= 0, 	//!< Invariant TSC if the CPU has one, else CLOCK_MONOTONIC
+	MCCK_TSC 		= 1, 	//!< Invariant TSC calibrated at startup
+	MCCK_MONOTONIC 	= 2, 	//!< CLOCK_MONOTONIC nanoseconds through the vDSO
+	MCCK_MAX
+};
+
+/**
+ * MCTP Capture Direction (CD)
+ */
+enum _MCCD
+{
+	MCCD_RX 		= 0, 	//!< Received by this endpoint
+	MCCD_TX 		= 1, 	//!< Transmitted by this endpoint
+	MCCD_MAX
+};
+
+/**
+ * MCTP Capture File format (CF)
+ */
+enum _MCCF
+{
+	MCCF_PCAPNG 	= 0, 	//!< pcapng. Records the direction of each packet
+	MCCF_PCAP 		= 1, 	//!< Classic pcap with nanosecond time stamps
+	MCCF_MAX
+};
+
+/**
+ * MCTP Log Record kind (LR)
+ */
+enum _MCLR
+{
+	MCLR_FMT 		= 0, 	//!< Format string and arguments
+	MCLR_PKT 		= 1, 	//!< Packet dump
+	MCLR_MSG 		= 2, 	//!< Message dump
+	MCLR_MAX
+};
+
+/**
+ * MCTP Accounting Table (AT)
+ */
+enum _MCAT
+{
+	MCAT_SRC 		= 0, 	//!< Received traffic by source EID
+	MCAT_DST 		= 1, 	//!< Transmitted traffic, retries, timeouts and round trips by destination EID
+	MCAT_TYPE 		= 2, 	//!< All traffic by message type
+	MCAT_MAX
+};
+
+/**
+ * MCTP Accounting Drop reason (AD) of a received packet or message
+ */
+enum _MCAD
+{
+	MCAD_VERSION 	= 0, 	//!< Unsupported header version
+	MCAD_SEQNUM 	= 1, 	//!< Out of sequence packet
+	MCAD_NOEOM 		= 2, 	//!< New message started before the last one ended
+	MCAD_NOSOM 		= 3, 	//!< Packet of no message in process
+	MCAD_WRONGTO 	= 4, 	//!< Tag owner bit differs from the message in process
+	MCAD_IC 		= 5, 	//!< Message Integrity Check failed
+	MCAD_UNMATCHED 	= 6, 	//!< Response to no outstanding request
+	MCAD_STALE 		= 7, 	//!< Late response to a prior use of the tag
+	MCAD_MAX
+};
+
+/**
+ * MCTP Watchdog Stage (WS) sampled for progress
+ */
+enum _MCWS
+{
+	MCWS_PR 		= 0, 	//!< Packet Reader. Input is the RPQ
+	MCWS_MH 		= 1, 	//!< Message Handler. Input is the RMQ
+	MCWS_PW 		= 2, 	//!< Packet Writer. Input is the TMQ
+	MCWS_SW 		= 3, 	//!< Socket Writer. Input is the TPQ
+	MCWS_ST 		= 4, 	//!< Submission Thread. Input is the TAQ
+	MCWS_CT 		= 5, 	//!< Completion Thread. Input is the ACQ
+	MCWS_PKTS 		= 6, 	//!< Packet pool. Stalls when exhausted
+	MCWS_MSGS 		= 7, 	//!< Message pool. Stalls when exhausted
+	MCWS_ACTIONS 	= 8, 	//!< Action pool. Stalls when exhausted
+	MCWS_MAX
+};
+
+/**
+ * MCTP Accounting Shard (AS). One per thread that updates the tables
+ */
+enum _MCAS
+{
+	MCAS_PR 		= 0, 	//!< Packet Reader
+	MCAS_MH 		= 1, 	//!< Message Handler
+	MCAS_SW 		= 2, 	//!< Socket Writer
+	MCAS_ST 		= 3, 	//!< Submission Thread
+	MCAS_MAX
+};
+
+/**
+ * MCTP Trace Event (TE) in the lifecycle of an action
+ */
+enum _MCTE
+{
+	MCTE_QUEUED 	= 0, 	//!< Put on the Transmit Action Queue by mctp_submit()
+	MCTE_TAGGED 	= 1, 	//!< Tag assigned by the Submission Thread
+	MCTE_SENT 		= 2, 	//!< Queued for transmission. num is the attempt
+	MCTE_WIRE 		= 3, 	//!< Packets handed to the transport. num is 1 for a request
+	MCTE_RESPONSE 	= 4, 	//!< Response matched to the request
+	MCTE_FAILED 	= 5, 	//!< Retries exhausted or the send failed
+	MCTE_CB_BEGIN 	= 6, 	//!< Completion or failure callback called
+	MCTE_CB_END 	= 7, 	//!< Completion or failure callback returned. Ends the action
+	MCTE_HANDLER_BEGIN	= 8, 	//!< Handler of a received request called
+	MCTE_HANDLER_END	= 9, 	//!< Handler of a received request returned
+	MCTE_MAX
+};
+
 /*
  * MCTP Control Completion Codes (CC)
  *
@@ -262,6 +666,176 @@ enum _MCSE
 
 /* STRUCTS ===================================================================*/
 
+/**
+ * Objects pushed onto and popped from a pool or queue
+ *
+ * Each counter has its own cache line so producers and consumers do not
+ * write the same line
+ */
+struct mctp_pq_count
+{
+	__u64 push __attribute__((aligned(64)));
+	__u64 pop __attribute__((aligned(64)));
+};
+
+/**
+ * Counters of the Socket Reader in the statistics segment
+ *
+ * Every section of the segment has one writer thread and is guarded by a
+ * sequence lock. seq is odd while the writer updates the section
+ */
+struct mctp_shm_sr
+{
+	__u32 seq;
+	__u64 packets;
+	__u64 dropped;
+	__u64 stamped;					//!< Packets stamped by the kernel
+} __attribute__((aligned(64)));
+
+/**
+ * Counters of the Packet Reader in the statistics segment
+ */
+struct mctp_shm_pr
+{
+	__u32 seq;
+	__u64 messages;
+	__u64 dropped_version;
+	__u64 dropped_seqnum;
+	__u64 dropped_noeom;
+	__u64 dropped_nosom;
+	__u64 dropped_wrongto;
+	__u64 dropped_ic;
+} __attribute__((aligned(64)));
+
+/**
+ * Counters of the Message Handler in the statistics segment
+ */
+struct mctp_shm_mh
+{
+	__u32 seq;
+	__u64 matched;
+	__u64 dropped_unmatched;
+	__u64 dropped_stale;
+} __attribute__((aligned(64)));
+
+/**
+ * Counters of the Packet Writer in the statistics segment
+ */
+struct mctp_shm_pw
+{
+	__u32 seq;
+	__u64 messages;
+	__u64 packets;
+} __attribute__((aligned(64)));
+
+/**
+ * Counters of the Socket Writer in the statistics segment
+ */
+struct mctp_shm_sw
+{
+	__u32 seq;
+	__u64 packets;
+	__u64 dropped;
+	__u64 zerocopy;
+} __attribute__((aligned(64)));
+
+/**
+ * Counters of the Submission Thread in the statistics segment
+ */
+struct mctp_shm_st
+{
+	__u32 seq;
+	__u64 tags_in_use;
+} __attribute__((aligned(64)));
+
+/**
+ * Counters of the Completion Thread in the statistics segment
+ */
+struct mctp_shm_ct
+{
+	__u32 seq;
+	__u64 completed;
+	__u64 successful;
+	__u64 failed;
+} __attribute__((aligned(64)));
+
+/**
+ * Named shared memory segment with the counters of an mctp object
+ *
+ * The pool and queue counters are updated in place by mctp_pq_push() and
+ * mctp_pq_pop(). Readers map the segment read only
+ */
+struct mctp_shm
+{
+	__u32 magic;					//!< MCTP_SHM_MAGIC
+	__u32 version;					//!< MCTP_SHM_VERSION
+	__u32 size;						//!< sizeof(struct mctp_shm)
+	__s32 pid;						//!< Process that published the segment
+	__u32 pq_size[MCPQ_MAX];		//!< Capacity of each pool and queue
+	struct mctp_pq_count pq_count[MCPQ_MAX];
+	struct mctp_shm_sr sr;
+	struct mctp_shm_pr pr;
+	struct mctp_shm_mh mh;
+	struct mctp_shm_pw pw;
+	struct mctp_shm_sw sw;
+	struct mctp_shm_st st;
+	struct mctp_shm_ct ct;
+};
+
+/* Time stamp in ticks of the clock selected with mctp_clock_init() */
+typedef __u64 mctp_ticks_t;
+
+/**
+ * Time stamp clock of the process
+ */
+struct mctp_clock
+{
+	int source;						//!< enum _MCCK of the clock in use. Stored last by mctp_clock_init()
+	int ready;						//!< mctp_clock_init() has been called
+	__u64 hz;						//!< Ticks per second
+	__u64 ns_mult;					//!< Nanoseconds per tick << MCTP_CLOCK_SHIFT
+	__u64 tick_mult;				//!< Ticks per nanosecond << MCTP_CLOCK_SHIFT
+};
+
+/**
+ * Pool object tracked in debug mode
+ */
+struct mctp_pq_obj
+{
+	void *ptr;
+	pid_t tid; 						//!< Thread that last popped it. 0 if never checked out
+	int q; 							//!< Pool or queue it is in (MCPQ). -1 while a thread holds it
+	mctp_ticks_t ts; 				//!< Time it was last pushed or popped
+};
+
+/**
+ * Objects of each pool sorted by address, built by mctp_pq_track_init()
+ */
+struct mctp_pq_track
+{
+	struct mctp_pq_obj *objs[MCPQ_ACTIONS + 1];
+	unsigned num[MCPQ_ACTIONS + 1];
+};
+
+/**
+ * Memory use of a pool or queue reported by mctp_pq_usage()
+ *
+ * The held counts only apply to pools. They are exact once the threads are
+ * quiescent, e.g. after mctp_drain()
+ */
+struct mctp_pq_usage
+{
+	__u64 size; 					//!< Capacity in objects
+	__u64 bytes; 					//!< Memory of the objects, or of the slots of a queue
+	__u64 depth; 					//!< Objects in a queue, or checked out of a pool
+	__u64 hwm; 						//!< Highest depth since mctp_run()
+	__u64 queued; 					//!< Objects of the pool waiting in a queue
+	__u64 outstanding; 				//!< Objects of the pool held by actions waiting for a response or a tag, or by zero copy sends
+	__u64 reassembly; 				//!< Messages the Packet Reader holds for an incomplete message
+	__u64 reading; 					//!< Empty packets the Socket Reader holds for its next read
+	__u64 unaccounted; 				//!< Objects checked out of the pool and held by none of the above
+};
+
 /*
  * MCTP Transport Header
  *
@@ -300,8 +874,9 @@ struct __attribute__((__packed__)) mctp_pkt
  */
 struct mctp_pkt_wrapper
 {
-	struct timespec ts;				//!< Time when this packet was received 
+	mctp_ticks_t ts;				//!< Time when this packet was received
 	struct mctp_pkt_wrapper* next;	//!< The next mctp_packet in a linked list
+	int conn;						//!< Index of the connection this packet was received on
 	struct mctp_pkt pkt;			//!< The data of this object 
 };
 
@@ -328,11 +903,196 @@ struct mctp_msg
 	__u8 type;
 	__u8 owner;
 	__u8 tag;
+	__u8 conn;			//!< Index of the connection this message was received on
 	__u16 len;
-	struct timespec ts; 
+	mctp_ticks_t ts; 				//!< Time when the first packet was received
 	__u8 payload[MCLN_MSG_PAYLOAD];
 };
 
+/**
+ * Fixed size record in a log ring
+ *
+ * Holds what is needed to print the entry later. Nothing is formatted when
+ * the record is written
+ */
+struct mctp_log_rec
+{
+	mctp_ticks_t ts;				//!< Time the record was written. Records are printed in this order
+	const char *fmt;				//!< Format string of an MCLR_FMT record
+	__u32 tid;						//!< Thread that wrote the record
+	__u16 kind;						//!< enum _MCLR
+	__u16 nargs;					//!< Number of args[] used by an MCLR_FMT record
+	union
+	{
+		__u64 args[MCTP_LOG_ARGS];	//!< MCLR_FMT: Arguments of fmt
+		struct
+		{
+			mctp_ticks_t ts;		//!< Time the packet was received
+			__s32 conn;
+			struct mctp_pkt pkt;
+		} pkt;						//!< MCLR_PKT
+		struct
+		{
+			__u8 src;
+			__u8 dst;
+			__u8 type;
+			__u8 owner;
+			__u8 tag;
+			__u8 conn;
+			__u16 len;				//!< Length of the message. Only MCTP_LOG_MSG_BYTES are kept
+			__u8 payload[MCTP_LOG_MSG_BYTES];
+		} msg;						//!< MCLR_MSG
+	};
+};
+
+/**
+ * Single producer single consumer ring of log records
+ *
+ * One per thread that logs. The thread writes records at head and the drain
+ * thread consumes them at tail. When the thread exits the ring is kept for
+ * the next thread once it has been drained
+ */
+struct mctp_log_ring
+{
+	__u64 head __attribute__((aligned(64)));	//!< Next record to write. Stored by the owner thread
+	__u64 dropped;								//!< Records dropped because the ring was full
+	__u64 tail __attribute__((aligned(64)));	//!< Next record to print. Stored by the drain thread
+	__u64 reported;								//!< Value of dropped last reported by the drain thread
+	__s32 tid;									//!< Thread that owns the ring
+	int active;									//!< A thread owns the ring
+	struct mctp_log_ring *next;					//!< Next ring known to the drain thread
+	struct mctp_log_rec recs[MCTP_LOG_RING_SIZE];
+};
+
+/**
+ * Packet copied by capture
+ */
+struct mctp_cap_rec
+{
+	mctp_ticks_t ts;				//!< Time the packet was received or transmitted
+	__u32 len;						//!< Bytes of data[] captured. At most the snap length
+	__u8 data[MCLN_PKT];
+};
+
+/**
+ * Single producer single consumer ring of captured packets
+ *
+ * One per direction. The capturing thread sets busy while it looks at the
+ * ring so mctp_capture_stop() can wait for it to leave before freeing recs
+ */
+struct mctp_cap_ring
+{
+	__u64 head __attribute__((aligned(64)));	//!< Next record to write. Stored by the capturing thread
+	__u64 dropped;								//!< Packets not captured because the ring was full
+	int busy;									//!< The capturing thread is in mctp_capture_pkt()
+	__u64 tail __attribute__((aligned(64)));	//!< Next record to write to the file. Stored by the writer
+	unsigned mask;								//!< Number of records - 1
+	struct mctp_cap_rec *recs;
+};
+
+/**
+ * Packet capture of an mctp object
+ *
+ * Allocated by the first mctp_capture_start() and kept until mctp_free() so
+ * the data path never reads freed memory
+ */
+struct mctp_capture
+{
+	struct mctp_cap_ring ring[MCCD_MAX];
+	FILE *fp;						//!< Capture file
+	int format;						//!< enum _MCCF
+	unsigned snaplen;				//!< Bytes captured of each packet
+	int stop;						//!< Request the writer thread to exit
+	int error;						//!< errno of the first failed write. 0 if none
+	pthread_t pt;					//!< Writer thread
+	mctp_ticks_t t0;				//!< Time stamp taken with real0
+	__u64 real0;					//!< CLOCK_REALTIME in ns at t0
+	__u64 written;					//!< Packets written to the file
+};
+
+/**
+ * Instruction of a compiled filter
+ */
+struct mctp_filter_insn
+{
+	__u8 op;						//!< Operation
+	__u8 size;						//!< Bytes loaded, or 1 if a comparison is with imm
+	__u8 shift;						//!< Right shift of a load
+	__u8 off;						//!< Offset of a load in the packet
+	__u32 imm;						//!< Immediate value or mask of a load
+};
+
+/**
+ * Traffic of one EID or message type
+ *
+ * All fields must be __u64 so shards can sum them. Bytes count message payload
+ */
+struct mctp_acct_row
+{
+	__u64 rx_packets;
+	__u64 rx_bytes;
+	__u64 rx_messages;
+	__u64 tx_packets;
+	__u64 tx_bytes;
+	__u64 tx_messages;
+	__u64 dropped[MCAD_MAX];		//!< Received packets or messages dropped by reason
+	__u64 retries;					//!< Requests retransmitted after a timeout
+	__u64 timeouts;					//!< Requests failed after the last retry timed out
+	__u64 rtt_hist[MCTP_LAT_BUCKETS];	//!< Round trips from the last transmission of a request to its response. Bucket i holds those below 2^i usec
+	__u64 rtt_sum;					//!< Sum of the round trips in nanoseconds
+};
+
+/**
+ * Accounting tables updated by one thread and merged by mctp_get_acct()
+ */
+struct mctp_acct
+{
+	struct mctp_acct_row src[MCTP_NUM_EIDS];
+	struct mctp_acct_row dst[MCTP_NUM_EIDS];
+	struct mctp_acct_row type[MCTP_ACCT_TYPES];
+};
+
+/**
+ * Action lifecycle event recorded by mctp_trace_event()
+ */
+struct mctp_trace_rec
+{
+	mctp_ticks_t ts;
+	__u64 seq;						//!< Index of the record plus 1. Stored last so readers skip partial records
+	__u64 id;						//!< Address of the action
+	__u32 tid;						//!< Thread that recorded the event
+	__u8 ev;						//!< enum _MCTE
+	__u8 eid;						//!< EID the request was sent to or received from
+	__u8 tag;
+	__u8 num;
+};
+
+/**
+ * Ring of action lifecycle events shared by every thread of an mctp object
+ *
+ * Allocated by the first mctp_trace_start() and kept until mctp_free() so
+ * the data path never writes to freed memory. It is only replaced by a ring
+ * of another size while the threads are stopped. When full the oldest
+ * records are overwritten
+ */
+struct mctp_trace
+{
+	__u64 head;						//!< Next record to claim
+	__u64 mask; 					//!< Records in the ring minus 1
+	struct mctp_trace_rec *recs;
+};
+
+/**
+ * Packet filter compiled by mctp_filter_compile()
+ */
+struct mctp_filter
+{
+	struct mctp_filter *prev;		//!< Filter installed before this one
+	unsigned len;					//!< Instructions in code[]
+	int err;						//!< Offset in the expression of a syntax error
+	struct mctp_filter_insn code[MCTP_FILTER_MAX_INSNS];
+};
+
 /**
  * State of the MCTP endpoint
  *
@@ -519,6 +1279,71 @@ struct __attribute__((__packed__)) mctp_ctrl_msg
 /* Establish there is an mctp object so other objects can have a pointer to it */
 struct mctp;
 
+/* State received from another process. Only used in handoff.c */
+struct mctp_handoff;
+
+/* Simulated SMBus. Only used in smbus.c */
+struct mctp_smbus_bus;
+
+/**
+ * Stage stall passed to the watchdog callback
+ */
+struct mctp_stall
+{
+	int stage; 						//!< enum _MCWS
+	int q; 							//!< Queue the stage takes its input from, or the exhausted pool (MCPQ)
+	int stalled; 					//!< 1 when the stall is detected, 0 once the stage progresses again
+	__u32 loop; 					//!< Loop step the stage thread is at (TLOOP). 0 for a pool
+	pid_t tid; 						//!< Thread of the stage. 0 for a pool
+	__u64 backlog; 					//!< Objects waiting in the queue, or checked out of the pool
+	__u64 msec; 					//!< Time without progress
+};
+
+/**
+ * Watchdog of an mctp object
+ *
+ * Allocated by the first mctp_watchdog_start() and kept until mctp_free() so
+ * the stall counters outlive the thread
+ */
+struct mctp_watchdog
+{
+	unsigned msec;					//!< Time without progress before a stage is stalled
+	int stop;						//!< Request the watchdog thread to exit
+	int running;					//!< The watchdog thread was started and not joined
+	pthread_t pt;					//!< Watchdog thread
+	void (*fn)(struct mctp *m, struct mctp_stall *s);	//!< Called on each stall and recovery. NULL to print them if MCTP_VERBOSE_ERROR is set
+	__u64 seen[MCWS_MAX];			//!< Progress counter of each stage at the last sample
+	mctp_ticks_t since[MCWS_MAX];	//!< Time each stage last progressed or had no input
+	int stalled[MCWS_MAX];			//!< The stage is stalled
+	__u64 stalls[MCWS_MAX];			//!< Stalls detected of each stage
+};
+
+/**
+ * Byte transport of the SMBus transport binding
+ *
+ * Addresses are 7 bit slave addresses. A block write buffer starts with the
+ * destination address byte and ends with the PEC
+ */
+struct mctp_smbus_ops
+{
+	int (*attach)(void *ctx, __u8 addr);		//!< Claim a slave address. 0 upon success
+	void (*detach)(void *ctx, __u8 addr);		//!< Release a slave address
+	int (*write)(void *ctx, __u8 addr, const __u8 *buf, size_t len); 	//!< Send a block write as master. 0 if acknowledged
+	int (*read)(void *ctx, __u8 addr, __u8 *buf, size_t len, int msec); //!< Next block write to a slave address. Length, 0 on timeout, <0 on error
+};
+
+/**
+ * Transfer statistics of a simulated SMBus
+ */
+struct mctp_smbus_stats
+{
+	__u64 frames;			//!< Block writes acknowledged
+	__u64 bytes;			//!< Bytes of acknowledged block writes
+	__u64 nacks;			//!< Block writes not acknowledged
+	__u64 arb_lost;			//!< Times a master lost arbitration
+	__u64 busy_nsec;		//!< Time the bus was driven
+};
+
 /**
  * Submission action object
  */
@@ -528,14 +1353,18 @@ struct mctp_action
 	struct mctp_msg *rsp;		//!< Response Message payload 
 	struct mctp_pkt_wrapper *pw;//!< Linked list of packets
 
-	struct timespec created;	//!< Time stamp when action was created
-	struct timespec submitted;	//!< Time of last submission 
-	struct timespec completed;	//!< Time when response was received 
+	mctp_ticks_t created;		//!< Time stamp when action was created
+	mctp_ticks_t tagged;		//!< Time when a tag was assigned to this action
+	mctp_ticks_t submitted;		//!< Time of last submission
+	mctp_ticks_t completed;		//!< Time when response was received
 
 	int valid;					//!< Bool if this object is 1=valid or 0=not 
 	int completion_code;		//!< 0=Success, Failure Code otherwise
 	int num;					//!< Number of transmission attempted 
 	int max; 					//!< Maximum number of transmission attempts 
+	int inflight;				//!< Request is queued for transmit and not yet handed to the socket
+	int conn;					//!< Index of the connection to transmit this action on
+	struct mctp_action *next;	//!< Next action of the same EID waiting for a free tag
 	void *user_data;			//!< Pointer to user data kept with action until completion
 
 	sem_t *sem;					//!< Semaphore to pend on until action has completed 
@@ -551,6 +1380,15 @@ struct mctp_action
 	void (*fn_failed)(struct mctp *m, struct mctp_action *a);
 };
 
+/**
+ * Packets of a zero copy send held until the kernel releases them
+ */
+struct mctp_zc_pending
+{
+	__u32 id;						//!< Notification id of the last sendmsg() call of the message
+	struct mctp_pkt_wrapper *pw;	//!< Linked list of packets of the message
+};
+
 /**
  * Object passed to Socket Writer thread function 
  */
@@ -568,6 +1406,17 @@ struct socket_writer
 	// State fields
 	__u64 packet_count;
 	__u64 dropped_count;
+	__u64 zerocopy_count;			//!< Messages sent with MSG_ZEROCOPY
+	__u64 zerocopy_copied;			//!< Zero copy sends the kernel copied anyway
+	__u64 copied_count;				//!< Messages sent with a copy
+
+	// Zero copy sends waiting for completion
+	struct mctp_zc_pending zc_ring[MCTP_ZC_RING_SIZE];
+	__u32 zc_head;
+	__u32 zc_tail;
+	__u32 zc_next;					//!< Notification id of the next sendmsg() call
+
+	int gso;						//!< UDP transport may use UDP_SEGMENT
 };
 
 /**
@@ -586,7 +1435,7 @@ struct packet_writer
 	useconds_t sleep_usec;
 
 	// State fields
-	__u8 pkt_seq;
+	__u8 pkt_seq[MCTP_MAX_CONNS];	//!< Next packet sequence number of each connection
 	__u64 packet_count;
 	__u64 message_count;
 };
@@ -605,6 +1454,11 @@ struct message_handler
 	// Thread fields
 	pid_t threadid;
 	useconds_t sleep_usec;
+
+	// State fields
+	__u64 matched;				//!< Responses that completed an outstanding action
+	__u64 dropped_unmatched;	//!< Responses with no outstanding action for (EID, tag)
+	__u64 dropped_stale;		//!< Late responses that belong to a prior user of the tag
 };
 
 /**
@@ -620,7 +1474,7 @@ struct packet_reader
 
 	// State fields
 	__u32 loop;
-	__u8 pkt_seq;
+	__u8 pkt_seq[MCTP_MAX_CONNS];	//!< Expected packet sequence number of each connection
 	__u64 packet_count;
 	__u64 message_count;
 	__u64 dropped_version;
@@ -628,9 +1482,15 @@ struct packet_reader
 	__u64 dropped_noeom;
 	__u64 dropped_nosom;
 	__u64 dropped_wrongto;
+	__u64 dropped_ic;
 
-	// In process Messages 
-	struct mctp_msg *tags[MCTP_NUM_TAGS];
+	// In process Messages of each connection
+	struct mctp_msg *tags[MCTP_MAX_CONNS][MCTP_NUM_TAGS];
+	__u32 crc[MCTP_MAX_CONNS][MCTP_NUM_TAGS];	//!< Running CRC-32C of in process messages with the IC bit set
+	__u8 ic[MCTP_MAX_CONNS][MCTP_NUM_TAGS];		//!< In process message has the IC bit set
+
+	// Action and drop counter for each combination of header checks
+	__u16 actions[MCTP_PR_TABLE_SIZE];
 };
 
 /**
@@ -650,6 +1510,14 @@ struct socket_reader
 	__u64 sleep_count;
 	__u64 packet_count;
 	__u64 dropped_count;
+	int next;						//!< Connection to check first on the next poll
+	__u32 rx_buffers;				//!< Empty packets held for the next read
+
+	// Kernel receive timestamps
+	__u64 rxts_count;				//!< Packets stamped by the kernel
+	__u32 rxts_reads;				//!< Stamps converted. rxts_real and rxts_ref are updated every MCTP_RXTS_SYNC
+	__u64 rxts_real;				//!< CLOCK_REALTIME nanoseconds at rxts_ref
+	mctp_ticks_t rxts_ref;			//!< Time stamp when rxts_real was read
 };
 
 /** 
@@ -662,6 +1530,7 @@ struct connection_handler
 	__u32 loop;
 	int dontblock;
 	sem_t *sem;
+	int status;			//!< Nonzero if the threads could not be prepared. mctp_run() then closes the socket
 };
 
 /**
@@ -673,13 +1542,19 @@ struct submission_thread
 	pid_t threadid; 				//!< Threadid of this thread 
 	__u32 loop;						//!< Thread step / loop counter 
 
-	struct timespec action_delta;	//!< Relative time to wait on an action before resubmitting  	
+	mctp_ticks_t action_delta;		//!< Relative time to wait on an action before resubmitting
 	struct timespec thread_delta;	//!< Relative time for thread to wait when sleeping 
 	struct timespec thread_timeout;	//!< Absolute time when to wake from pthread_cond_wait()
 
 	pthread_mutex_t mtx;			//!< Thread sleep mutex 
 	pthread_cond_t cond;			//!< Thread sleep condition 
 	int wake;						//!< Request to wake the thread 
+
+	struct mctp_action *deferred[MCTP_NUM_EIDS];		//!< Oldest action of each EID popped from the TAQ still waiting for a free tag
+	struct mctp_action *deferred_tail[MCTP_NUM_EIDS];	//!< Newest action of each EID waiting for a free tag
+	unsigned deferred_num;			//!< Actions waiting for a free tag
+	struct mctp_action *marker;		//!< Drain marker held until every action ahead of it has a tag
+	__u64 tags_in_use;				//!< Busy slots of the outstanding action table seen by the last pass
 };
 
 /**
@@ -693,6 +1568,32 @@ struct completion_thread
 	__u64 completed_actions;		//!< Number of actions completed 
 	__u64 successful_actions;		//!< Number of actions that completed successfully 
 	__u64 failed_actions;			//!< Number of actions that failed 
+	__u64 lat_hist[MCLS_MAX][MCTP_LAT_BUCKETS];	//!< Successful actions by latency. Bucket i holds latencies below 2^i usec. Requests are recorded by the Message Handler
+	__u64 lat_sum[MCLS_MAX];		//!< Sum of the latencies in nanoseconds
+};
+
+/**
+ * Slot in the outstanding action table
+ *
+ * word holds the generation, key, lock and busy bits so that a slot can be
+ * claimed with a single compare and swap. ma is only written while the slot
+ * is not busy.
+ */
+struct mctp_tag_slot
+{
+	__u64 word;						//!< [63:32] generation, [18] used, [17:2] key, [1] lock, [0] busy
+	struct mctp_action *ma;			//!< Outstanding action using this (EID, tag)
+};
+
+/**
+ * Open addressed table of outstanding actions keyed by (peer EID, tag)
+ *
+ * Only the Submission Thread inserts. Any thread may look up and claim a slot
+ */
+struct mctp_tag_table
+{
+	struct mctp_tag_slot slots[MCTP_TAG_TABLE_SIZE];
+	__u8 next[MCTP_NUM_EIDS]; 		//!< Next tag to try per EID so tags rotate
 };
 
 /**
@@ -705,6 +1606,9 @@ struct mctp
 	struct mctp_version *mctp_versions;
 
 	int (*handlers[MCMT_MAX]) (struct mctp *m, struct mctp_action *ma);
+	__u8 ic[MCMT_MAX];		//!< Append a Message Integrity Check to transmitted messages of this type
+	unsigned zerocopy;		//!< Send messages of at least this many bytes with MSG_ZEROCOPY. 0 to disable
+	int rxts;				//!< Stamp received packets with the kernel receive time (SO_TIMESTAMPING)
 
 	// Thread control 
 	pthread_mutex_t mtx;
@@ -713,12 +1617,26 @@ struct mctp
 	int use_threads;
 	int wait;
 	int all_threads_started;
+	int threads_running;		//!< Set while any thread started by the Connection Handler may run. Cleared once they are joined
 	int stop_threads;
 	int dummy;
 
-	// Outstanding commands array 
-	struct mctp_action *tags[MCTP_NUM_TAGS];
-	pthread_mutex_t tags_mtx;
+	// Drain control. The marker is passed through the queues in place of a real object
+	int drain;					//!< enum _MCDR
+	struct mctp_action marker;
+	__u32 markers;				//!< Number of markers that reached the Completion Thread
+	pthread_mutex_t drain_mtx;
+	pthread_cond_t drained;		//!< Signaled when a marker reaches the Completion Thread
+	struct mctp_action halt;	//!< Pushed behind the queued objects to stop the threads for a reconnect
+
+	// Outstanding commands table
+	struct mctp_tag_table tags;
+
+	// Shard group this object belongs to. NULL if not sharded
+	struct mctp_shards *group;
+
+	// State received from the previous process. Restored when the threads start
+	struct mctp_handoff *handoff;
 
 	// Thread handles
 	pthread_t pt_ch;		//!< PThread handle for Connection Thread 
@@ -729,6 +1647,7 @@ struct mctp
 	pthread_t pt_sw;		//!< PThread handle for Socket Writer Thread 
 	pthread_t pt_st;		//!< PThread handle for Submission Thread
 	pthread_t pt_ct;		//!< PThread handle for Action Completion Thread
+	pthread_t pt_mx;		//!< PThread handle for Metrics Exporter Thread
 
 	// Thread state
 	struct connection_handler ch;
@@ -761,36 +1680,144 @@ struct mctp
 	struct ptr_queue *tmq;	//!< Transmit Message Queue
 	struct ptr_queue *taq;	//!< Transmit Action Queue
 	struct ptr_queue *acq;	//!< Action Completed Queue
+	struct mctp_pq_count *pq_count;	//!< Objects pushed and popped through mctp_pq_push() and mctp_pq_pop(). pq_local or in the statistics segment
+	struct mctp_pq_count pq_local[MCPQ_MAX];
+	__u64 pq_hwm[MCPQ_MAX];			//!< Highest depth of each pool and queue
+	int pq_debug;					//!< Track the holder of each pool object. Set with mctp_set_pq_debug()
+	struct mctp_pq_track *pq_track;	//!< Pool objects tracked in debug mode. NULL otherwise
+
+	// Per EID and per message type accounting. Kept across connections
+	struct mctp_acct *acct[MCAS_MAX];	//!< Shard of each thread that updates the tables
 
 	// Socket fields
 	int port;
 	int mode;
+	int transport;
+	int reuseport;			//!< Set SO_REUSEPORT on the server socket
+	int cpu;				//!< CPU to pin the threads to. -1 to not pin
 	int sock;
 	int conn;
 	socklen_t client_len;
+
+	// Striped connections. conns[0] is conn
+	int conns[MCTP_MAX_CONNS];
+	__u8 conn_up[MCTP_MAX_CONNS];	//!< Connection has not failed
+	int num_conns;					//!< Number of connections established
+	int max_conns;					//!< Number of connections to open (client) or accept (server)
+	unsigned reconnect;				//!< Maximum client reconnect backoff in msec. 0 to not reconnect
+	__u64 reconnects;				//!< Number of times the client has reconnected
+
+	// Serial transport
+	char serial_dev[MCTP_SERIAL_PATH_MAX];	//!< Path of the UART or pty
+	unsigned baud;							//!< Line rate in bits per second
+
+	// SMBus transport
+	const struct mctp_smbus_ops *smbus_ops;
+	void *smbus_ctx;
+	__u8 smbus_addr;						//!< 7 bit slave address of this endpoint
+	__u8 smbus_peer;						//!< 7 bit slave address to send to
+
+	// Shared memory statistics segment. NULL if not published
+	struct mctp_shm *shm;
+	char shm_name[MCTP_SHM_NAME_MAX];
+
+	// Packet capture
+	int capture;							//!< Packets are being captured
+	struct mctp_capture *cap;				//!< NULL until capture is first started
+	struct mctp_filter *filter;				//!< Packets captured and dumped. NULL for every packet
+	struct mctp_filter *filters;			//!< Every filter installed. Replaced ones are freed once the threads stop
+
+	// Action trace
+	int trace;								//!< Action lifecycle events are being recorded
+	struct mctp_trace *tr;					//!< NULL until tracing is first started
+
+	// Stage watchdog
+	struct mctp_watchdog *wd;				//!< NULL until the watchdog is first started
+
+	// Metrics exporter
+	int metrics_fd;							//!< Listening socket of the exporter. -1 if not running
+	int metrics_stop;						//!< Request the exporter thread to exit
+	char metrics_path[MCTP_METRICS_PATH_MAX];	//!< Unix socket path to unlink on stop. Empty if TCP
 	struct sockaddr_in sa_server;
 	struct sockaddr_in sa_client;
 };
 
+/**
+ * Group of server shards sharing one port with SO_REUSEPORT
+ */
+struct mctp_shards
+{
+	int num;
+	struct mctp *shards[MCTP_MAX_SHARDS];	//!< shards[0] is owned by the caller
+};
+
+/**
+ * Statistics of an mctp object or a shard group
+ *
+ * All fields must be __u64 so groups can sum them
+ */
+struct mctp_stats
+{
+	__u64 rx_packets;
+	__u64 rx_messages;
+	__u64 rx_dropped_packets;		//!< Packets dropped by the Socket Reader or Packet Reader
+	__u64 rx_dropped_responses;		//!< Responses that matched no outstanding action
+	__u64 tx_messages;
+	__u64 tx_packets;
+	__u64 tx_dropped_packets;
+	__u64 completed_actions;
+	__u64 failed_actions;
+	__u64 outstanding_actions;
+	__u64 reconnects;
+};
+
 /* GLOBAL VARIABLES ==========================================================*/
 
+extern struct mctp_clock mctp_clock;
+
 /* PROTOTYPES ================================================================*/
 
+/* Stands in for a USDT probe so its arguments count as used. Never called */
+static inline void mctp_probe_nop(int n, ...) { (void) n; }
+
+/**
+ * Read the time stamp clock
+ *
+ * Inline so a stamp on the data path is one instruction with the TSC, and a
+ * vDSO call otherwise
+ */
+static inline mctp_ticks_t mctp_now()
+{
+	struct timespec ts;
+
+#if defined(__x86_64__)
+	if (__atomic_load_n(&mctp_clock.source, __ATOMIC_ACQUIRE) == MCCK_TSC)
+		return __rdtsc();
+#endif
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (mctp_ticks_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 /* External API */
 struct mctp *mctp_init();
 int mctp_run(struct mctp *m, int port, __u32 address, int mode, int use_threads, int dontblock);
 int mctp_stop(struct mctp *m);
 void mctp_request_stop(struct mctp *m);
 int mctp_free(struct mctp *m);
+void mctp_free_versions(struct mctp *m);
 void mctp_retire(struct mctp* m, struct mctp_action *a);
+int mctp_inject(struct mctp *m, struct mctp_pkt *pkt, int conn);
 
 /**
- * Submit an object for transmission 
+ * Submit an object for transmission to an endpoint
  *
  * Call will pend on a semaphore for a time sepcified in timespec delta if provided. 
  * If delta is not provided, call will submit and return immediately
  *
  * @param m 			struct mctp* 
+ * @param dst 			EID of the endpoint to send the request to
  * @param type  		mctp message type
  * @param obj   		Pointer to serialized data buffer to send 
  * @param len   		Length of object in bytes 
@@ -808,8 +1835,9 @@ void mctp_retire(struct mctp* m, struct mctp_action *a);
  * 3. Prepare action 
  * 4. Submit action	
  */ 
-struct mctp_action *mctp_submit(
+struct mctp_action *mctp_submit_to(
 	struct mctp *m, 
+	__u8 dst,
 	int type, 
 	void *obj, 
 	size_t len,
@@ -821,6 +1849,25 @@ struct mctp_action *mctp_submit(
 	void (*fn_failed)(struct mctp *m, struct mctp_action *a)
 );
 
+/**
+ * Submit an object for transmission to the bus owner
+ *
+ * Same as mctp_submit_to() with dst set to the bus owner EID. This is the
+ * signature mctp_submit() had before the destination EID was a parameter
+ */
+struct mctp_action *mctp_submit(
+	struct mctp *m,
+	int type,
+	void *obj,
+	size_t len,
+	int retry,
+	struct timespec *delta,
+	void *user_data,
+	void (*fn_submitted)(struct mctp *m, struct mctp_action *a),
+	void (*fn_completed)(struct mctp *m, struct mctp_action *a),
+	void (*fn_failed)(struct mctp *m, struct mctp_action *a)
+);
+
 // Verbosity levels 
 void mctp_set_verbosity(struct mctp *m, __u32 level);
 __u32 mctp_get_verbosity(struct mctp *m);
@@ -846,12 +1893,191 @@ int mctp_ctrl_fill_set_eid(struct mctp_ctrl_msg *m, int eid);
 
 int mctp_pkt_count(struct mctp_msg *mm);
 
+/* Message Integrity Check */
+int mctp_set_ic(struct mctp *m, int type, int enable);
+__u32 mctp_crc32c(__u32 crc, const void *buf, size_t len);
+
+/* Transport */
+int mctp_set_transport(struct mctp *m, int transport);
+void *mctp_udp_reader(void *arg);
+void *mctp_udp_writer(void *arg);
+int mctp_set_serial(struct mctp *m, const char *dev, unsigned baud);
+int mctp_serial_open(struct mctp *m);
+__u16 mctp_fcs16(__u16 fcs, const void *buf, size_t len);
+void *mctp_serial_reader(void *arg);
+void *mctp_serial_writer(void *arg);
+int mctp_set_smbus(struct mctp *m, const struct mctp_smbus_ops *ops, void *ctx, __u8 addr, __u8 peer);
+int mctp_smbus_open(struct mctp *m);
+void mctp_smbus_close(struct mctp *m);
+__u8 mctp_pec(__u8 crc, const void *buf, size_t len);
+void *mctp_smbus_reader(void *arg);
+void *mctp_smbus_writer(void *arg);
+struct mctp_smbus_bus *mctp_smbus_bus_init(unsigned hz);
+void mctp_smbus_bus_free(struct mctp_smbus_bus *bus);
+void mctp_smbus_bus_stats(struct mctp_smbus_bus *bus, struct mctp_smbus_stats *stats);
+extern const struct mctp_smbus_ops mctp_smbus_sim;
+
+/* Sharded server */
+struct mctp_shards *mctp_shards_init(struct mctp *m, int num, int pin);
+int mctp_shards_run(struct mctp_shards *g, int port, __u32 address);
+int mctp_shards_stop(struct mctp_shards *g);
+void mctp_shards_free(struct mctp_shards *g);
+void mctp_shards_sync_state(struct mctp *m);
+void mctp_shards_get_stats(struct mctp_shards *g, struct mctp_stats *stats);
+int mctp_shards_get_acct(struct mctp_shards *g, int table, struct mctp_acct_row *rows, int num);
+
+/* Statistics */
+void mctp_get_stats(struct mctp *m, struct mctp_stats *s);
+
+/* Stage watchdog */
+int mctp_watchdog_start(struct mctp *m, unsigned msec, void (*fn)(struct mctp *m, struct mctp_stall *s));
+int mctp_watchdog_stop(struct mctp *m);
+
+/* Per EID and per message type accounting */
+int mctp_acct_init(struct mctp *m);
+void mctp_acct_free(struct mctp *m);
+void mctp_acct_rx_pkt(struct mctp *m, int src, int type, int drop);
+void mctp_acct_rx_msg(struct mctp *m, struct mctp_msg *mm);
+void mctp_acct_drop(struct mctp *m, int shard, int src, int type, int reason);
+void mctp_acct_tx(struct mctp *m, struct mctp_action *ma, struct mctp_pkt_wrapper *head);
+void mctp_acct_retry(struct mctp *m, struct mctp_action *ma);
+void mctp_acct_timeout(struct mctp *m, struct mctp_action *ma);
+void mctp_acct_rtt(struct mctp *m, struct mctp_action *ma, struct mctp_msg *rsp);
+int mctp_get_acct(struct mctp *m, int table, struct mctp_acct_row *rows, int num);
+
+/* Connection striping */
+int mctp_set_connections(struct mctp *m, int num);
+int mctp_conn_pick(struct mctp *m, struct mctp_action *ma);
+int mctp_conn_down(struct mctp *m, int i);
+
+/* Zero copy transmit */
+int mctp_set_zerocopy(struct mctp *m, unsigned threshold);
+
+/* Time stamp clock */
+int mctp_clock_init(int source);
+__u64 mctp_ticks_to_ns(mctp_ticks_t ticks);
+mctp_ticks_t mctp_ns_to_ticks(__u64 ns);
+__u64 mctp_ticks_to_mono(mctp_ticks_t ticks);
+mctp_ticks_t mctp_mono_to_ticks(__u64 mono);
+
+/* Kernel receive timestamps */
+int mctp_set_rxts(struct mctp *m, int enable);
+int mctp_rxts_enable(int fd);
+int mctp_rxts_get(struct socket_reader *self, struct msghdr *msg, mctp_ticks_t *ts);
+
+/* Pool and queue accounting */
+struct ptr_queue *mctp_pq(struct mctp *m, int q);
+int mctp_pq_push(struct mctp *m, int q, void *ptr);
+void *mctp_pq_pop(struct mctp *m, int q, int wait);
+__u64 mctp_pq_depth(struct mctp *m, int q);
+unsigned mctp_pq_size(int q);
+int mctp_set_pq_debug(struct mctp *m, int enable);
+int mctp_pq_track_init(struct mctp *m);
+void mctp_pq_track_free(struct mctp *m);
+void mctp_pq_track(struct mctp *m, int q, void *ptr, int pop);
+int mctp_pq_usage(struct mctp *m, struct mctp_pq_usage *u);
+void mctp_prnt_pq(struct mctp *m);
+
+/* Shared memory statistics segment */
+int mctp_shm_open(struct mctp *m, const char *name);
+void mctp_shm_close(struct mctp *m);
+const struct mctp_shm *mctp_shm_attach(const char *name);
+void mctp_shm_detach(const struct mctp_shm *shm);
+int mctp_shm_read(const void *sect, void *dst, size_t len);
+void mctp_shm_pub_sr(struct socket_reader *self);
+void mctp_shm_pub_pr(struct packet_reader *self);
+void mctp_shm_pub_mh(struct message_handler *self);
+void mctp_shm_pub_pw(struct packet_writer *self);
+void mctp_shm_pub_sw(struct socket_writer *self);
+void mctp_shm_pub_st(struct submission_thread *self);
+void mctp_shm_pub_ct(struct completion_thread *self);
+
+/* Binary log ring */
+void mctp_log(const char *fmt, int n, const __u64 *args);
+void mctp_log_pkt(struct mctp_pkt_wrapper *pw);
+void mctp_log_msg(struct mctp_msg *mm);
+int mctp_log_flush();
+__u64 mctp_log_dropped();
+
+/* Packet capture */
+int mctp_capture_start(struct mctp *m, const char *path, int format, unsigned snaplen, unsigned ring);
+int mctp_capture_stop(struct mctp *m);
+void mctp_capture_pkt(struct mctp *m, int dir, mctp_ticks_t ts, struct mctp_pkt *pkt, int type);
+__u64 mctp_capture_dropped(struct mctp *m);
+
+/* Packet filters */
+int mctp_filter_compile(struct mctp_filter *f, const char *expr);
+int mctp_filter_run(const struct mctp_filter *f, const struct mctp_pkt *pkt, int type);
+int mctp_set_filter(struct mctp *m, const char *expr, int *err);
+void mctp_trim_filters(struct mctp *m);
+void mctp_free_filters(struct mctp *m);
+
+/**
+ * Check if a packet matches the filter of an mctp object
+ *
+ * The filter is read once, as mctp_set_filter() may replace it at any time
+ *
+ * @return 1 if no filter is set or the packet matches it, 0 otherwise
+ */
+static inline int mctp_filter_match(struct mctp *m, const struct mctp_pkt *pkt, int type)
+{
+	const struct mctp_filter *f;
+
+	f = __atomic_load_n(&m->filter, __ATOMIC_ACQUIRE);
+
+	return f == NULL || mctp_filter_run(f, pkt, type);
+}
+
+/* Action trace */
+int mctp_trace_start(struct mctp *m, unsigned ring);
+int mctp_trace_stop(struct mctp *m);
+void mctp_trace_event(struct mctp *m, int ev, const void *ma, int eid, int tag, int num);
+int mctp_trace_export(struct mctp *m, const char *path);
+
+/* Metrics exporter */
+int mctp_metrics_start(struct mctp *m, const char *path, __u16 port);
+int mctp_metrics_stop(struct mctp *m);
+int mctp_metrics_render(struct mctp *m, char *buf, size_t len);
+
+/* Graceful shutdown */
+int mctp_drain(struct mctp *m, unsigned msec);
+void mctp_drain_deadline(struct timespec *ts, unsigned msec);
+int mctp_drain_marker(struct mctp *m, int q, struct timespec *deadline);
+void mctp_drain_finish(struct mctp *m);
+
+/* Hot restart */
+int mctp_handoff_send(struct mctp *m, const char *path, unsigned msec);
+int mctp_handoff_recv(
+	struct mctp *m,
+	const char *path,
+	unsigned msec,
+	void (*fn_completed)(struct mctp *m, struct mctp_action *a),
+	void (*fn_failed)(struct mctp *m, struct mctp_action *a),
+	int dontblock
+);
+int mctp_handoff_restore(struct mctp *m);
+
+/* Client reconnect */
+int mctp_set_reconnect(struct mctp *m, unsigned max_msec);
+int mctp_socket(struct mctp *m);
+int mctp_connect(struct mctp *m);
+
 /* MCTP Control Message Functions */
 int mctp_ctrl_handler(struct mctp *m, struct mctp_action *ma);
 struct mctp_ctrl *mctp_get_ctrl(struct mctp_msg *mm);
 __u8 *mctp_get_ctrl_payload(struct mctp_msg *mm);
 unsigned int mctp_len_ctrl(__u8 *ptr);
 
+/* Outstanding Action Table Functions */
+int mctp_tags_assign(struct mctp *m, struct mctp_action *ma);
+int mctp_tags_insert(struct mctp *m, struct mctp_action *ma);
+struct mctp_action *mctp_tags_lookup(struct mctp *m, __u8 eid, __u8 tag, int *slot, __u64 *word);
+int mctp_tags_lock(struct mctp *m, int slot, __u64 *word);
+void mctp_tags_unlock(struct mctp *m, int slot, __u64 word);
+void mctp_tags_release(struct mctp *m, int slot, __u64 word);
+int mctp_tags_count(struct mctp *m);
+void mctp_tags_trim(struct mctp *m);
+
 /* Thread Functions */
 void *mctp_connection_handler(void *arg);
 void *mctp_socket_reader(void *arg);
@@ -873,6 +2099,7 @@ void mctp_prnt_state(struct mctp_state *ms);
 /* Return a string representation of enum entries */
 const char *mcmt(unsigned u);
 const char *mcrm(unsigned u);
+const char *mcws(unsigned u);
 const char *mccc(unsigned u);
 const char *mccm(unsigned u);
 const char *mcep(unsigned u);
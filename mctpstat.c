@@ -0,0 +1,263 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		mctpstat.c
+ *
+ * @brief 		Code file for the mctpstat tool of the MCTP Transport Library
+ *
+ * @details 	Maps the statistics segment of a running mctp object read only
+ * 				and prints one line of rates per interval, like vmstat. The
+ * 				process being watched is not contacted.
+ *
+ * 				mctpstat [-l] [-i msec] [-c count] [name | pid]
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <linux/types.h>
+
+#include <ptrqueue.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+#define MCTPSTAT_INTERVAL_MSEC 		1000
+#define MCTPSTAT_HEADER_ROWS 		20
+#define MCTPSTAT_SHM_DIR 			"/dev/shm"
+
+/* STRUCTS ===================================================================*/
+
+/**
+ * Consistent copy of every section of a segment
+ */
+struct mctpstat_sample
+{
+	struct timespec ts;
+	struct mctp_shm_sr sr;
+	struct mctp_shm_pr pr;
+	struct mctp_shm_mh mh;
+	struct mctp_shm_pw pw;
+	struct mctp_shm_sw sw;
+	struct mctp_shm_st st;
+	struct mctp_shm_ct ct;
+	__u64 in_use[MCPQ_MAX];
+};
+
+/* PROTOTYPES ================================================================*/
+
+static int list_segments();
+static void sample(const struct mctp_shm *shm, struct mctpstat_sample *s);
+static void print_header();
+static void print_line(const struct mctp_shm *shm, struct mctpstat_sample *a, struct mctpstat_sample *b);
+static void usage(const char *prog);
+
+/* FUNCTIONS =================================================================*/
+
+int main(int argc, char **argv)
+{
+	struct mctpstat_sample s[2];
+	const struct mctp_shm *shm;
+	struct timespec delay;
+	char name[MCTP_SHM_NAME_MAX];
+	long interval, count, i;
+	int opt;
+
+	interval = MCTPSTAT_INTERVAL_MSEC;
+	count = -1;
+
+	while ( (opt = getopt(argc, argv, "lhi:c:")) != -1 )
+	{
+		switch (opt)
+		{
+			case 'l': 	return list_segments();
+			case 'i': 	interval = atol(optarg); 	break;
+			case 'c': 	count = atol(optarg); 		break;
+			default: 	usage(argv[0]); 			return 1;
+		}
+	}
+
+	if (interval <= 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Select the segment: a name, a pid and object number, or the first object of a pid
+	if (optind < argc && argv[optind][0] == '/')
+		snprintf(name, sizeof(name), "%s", argv[optind]);
+	else if (optind < argc && strchr(argv[optind], '.') == NULL)
+		snprintf(name, sizeof(name), "%s%s.0", MCTP_SHM_PREFIX, argv[optind]);
+	else if (optind < argc)
+		snprintf(name, sizeof(name), "%s%s", MCTP_SHM_PREFIX, argv[optind]);
+	else
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	shm = mctp_shm_attach(name);
+	if (shm == NULL)
+	{
+		fprintf(stderr, "mctpstat: %s: %s\n", name, strerror(errno));
+		return 1;
+	}
+
+	delay.tv_sec = interval / 1000;
+	delay.tv_nsec = (interval % 1000) * 1000000L;
+
+	sample(shm, &s[0]);
+	for ( i = 0 ; count < 0 || i < count ; i++ )
+	{
+		nanosleep(&delay, NULL);
+		sample(shm, &s[(i + 1) & 1]);
+
+		if (i % MCTPSTAT_HEADER_ROWS == 0)
+			print_header();
+		print_line(shm, &s[i & 1], &s[(i + 1) & 1]);
+
+		// The segment stays after a crash. Stop once the publisher is gone
+		if (kill(shm->pid, 0) != 0 && errno == ESRCH)
+		{
+			fprintf(stderr, "mctpstat: process %d has exited\n", shm->pid);
+			break;
+		}
+	}
+
+	mctp_shm_detach(shm);
+
+	return 0;
+}
+
+/**
+ * Print the statistics segments present on this host
+ */
+static int list_segments()
+{
+	struct dirent *de;
+	DIR *dir;
+	const struct mctp_shm *shm;
+	char name[NAME_MAX + 2];
+
+	dir = opendir(MCTPSTAT_SHM_DIR);
+	if (dir == NULL)
+	{
+		fprintf(stderr, "mctpstat: %s: %s\n", MCTPSTAT_SHM_DIR, strerror(errno));
+		return 1;
+	}
+
+	while ( (de = readdir(dir)) != NULL )
+	{
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(name, sizeof(name), "/%s", de->d_name);
+		shm = mctp_shm_attach(name);
+		if (shm == NULL)
+			continue;
+
+		printf("%-32s pid %d%s\n", name, shm->pid, (kill(shm->pid, 0) != 0 && errno == ESRCH) ? " (exited)" : "");
+		mctp_shm_detach(shm);
+	}
+
+	closedir(dir);
+
+	return 0;
+}
+
+/**
+ * Copy every section of the segment
+ */
+static void sample(const struct mctp_shm *shm, struct mctpstat_sample *s)
+{
+	__s64 n;
+	int q;
+
+	clock_gettime(CLOCK_MONOTONIC, &s->ts);
+
+	mctp_shm_read(&shm->sr, &s->sr, sizeof(s->sr));
+	mctp_shm_read(&shm->pr, &s->pr, sizeof(s->pr));
+	mctp_shm_read(&shm->mh, &s->mh, sizeof(s->mh));
+	mctp_shm_read(&shm->pw, &s->pw, sizeof(s->pw));
+	mctp_shm_read(&shm->sw, &s->sw, sizeof(s->sw));
+	mctp_shm_read(&shm->st, &s->st, sizeof(s->st));
+	mctp_shm_read(&shm->ct, &s->ct, sizeof(s->ct));
+
+	// Objects in a queue, or checked out of a pool. Same as mctp_pq_depth()
+	for ( q = 0 ; q < MCPQ_MAX ; q++ )
+	{
+		n = __atomic_load_n(&shm->pq_count[q].push, __ATOMIC_RELAXED)
+		  - __atomic_load_n(&shm->pq_count[q].pop, __ATOMIC_RELAXED);
+		if (q <= MCPQ_ACTIONS)
+			n = -n;
+		s->in_use[q] = (n > 0) ? n : 0;
+	}
+}
+
+static void print_header()
+{
+	printf("-------------rate/s-------------- ---------------------drop/s--------------------- tags -----free------ ------------queue-------------\n");
+	printf("  rxpkt  rxmsg  txpkt  txmsg  rsp sock  ver  seq noeom nosom  to   ic unm stale tx       pkts msgs acts   rpq  tpq  rmq  tmq  taq  acq\n");
+}
+
+/**
+ * Print the rates between two samples and the gauges of the second
+ */
+static void print_line(const struct mctp_shm *shm, struct mctpstat_sample *a, struct mctpstat_sample *b)
+{
+	double sec;
+	int q;
+
+#define RATE(f) ((unsigned long long) ((double) (b->f - a->f) / sec + 0.5))
+
+	sec = (b->ts.tv_sec - a->ts.tv_sec) + (b->ts.tv_nsec - a->ts.tv_nsec) / 1e9;
+	if (sec <= 0)
+		sec = 1;
+
+	printf("%7llu%7llu%7llu%7llu%5llu",
+		RATE(sr.packets), RATE(pr.messages), RATE(sw.packets), RATE(pw.messages), RATE(mh.matched));
+	printf("%5llu%5llu%5llu%6llu%6llu%4llu%5llu%4llu%6llu%3llu",
+		RATE(sr.dropped), RATE(pr.dropped_version), RATE(pr.dropped_seqnum), RATE(pr.dropped_noeom),
+		RATE(pr.dropped_nosom), RATE(pr.dropped_wrongto), RATE(pr.dropped_ic),
+		RATE(mh.dropped_unmatched), RATE(mh.dropped_stale), RATE(sw.dropped));
+	printf("%5llu", (unsigned long long) b->st.tags_in_use);
+
+	printf(" ");
+	for ( q = MCPQ_PKTS ; q <= MCPQ_ACTIONS ; q++ )
+		printf("%5llu", (unsigned long long) (shm->pq_size[q] > b->in_use[q] ? shm->pq_size[q] - b->in_use[q] : 0));
+
+	printf(" ");
+	for ( q = MCPQ_RPQ ; q < MCPQ_MAX ; q++ )
+		printf("%5llu", (unsigned long long) b->in_use[q]);
+
+	printf("\n");
+	fflush(stdout);
+
+#undef RATE
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-l] [-i msec] [-c count] <name | pid>\n", prog);
+	printf("  -l        List the statistics segments on this host\n");
+	printf("  -i msec   Interval between lines. Default %d\n", MCTPSTAT_INTERVAL_MSEC);
+	printf("  -c count  Number of lines to print. Default forever\n");
+	printf("  name      Segment name passed to mctp_shm_open(), e.g. /mctp.1234.0\n");
+	printf("  pid       Process that opened its segment with the default name. pid.n for its mctp object n\n");
+}
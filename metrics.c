@@ -0,0 +1,734 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		metrics.c
+ *
+ * @brief 		Code file for the metrics exporter of the MCTP transport library
+ *
+ * @details 	An optional thread serves the counters of an mctp object in the
+ * 				OpenMetrics text format on a Unix socket or a loopback TCP
+ * 				port. A scraper connects, optionally sends an HTTP GET, and
+ * 				reads the exposition until the connection closes.
+ *
+ * 				The counters are written by the pipeline threads without
+ * 				locks. The exporter copies them into a snapshot with relaxed
+ * 				loads and renders the snapshot, so a scrape never stalls the
+ * 				pipeline. Counters of different threads in one snapshot may
+ * 				be a few objects apart.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* errno
+ */
+#include <errno.h>
+
+/* printf()
+ * vsnprintf()
+ */
+#include <stdio.h>
+
+/* va_list
+ * va_start()
+ * va_end()
+ */
+#include <stdarg.h>
+
+/* calloc()
+ * malloc()
+ * free()
+ */
+#include <stdlib.h>
+
+/* memset()
+ * strncpy()
+ * strncmp()
+ * strlen()
+ */
+#include <string.h>
+
+/* close()
+ * unlink()
+ * gettid()
+ */
+#include <unistd.h>
+
+/* pthread_create()
+ * pthread_join()
+ */
+#include <pthread.h>
+
+/* AF_UNIX
+ * AF_INET
+ * SOCK_STREAM
+ * SOL_SOCKET
+ * SO_REUSEADDR
+ * MSG_NOSIGNAL
+ * socket()
+ * setsockopt()
+ * bind()
+ * listen()
+ * accept()
+ * recv()
+ * send()
+ */
+#include <sys/socket.h>
+
+/* struct sockaddr_un
+ */
+#include <sys/un.h>
+
+/* struct sockaddr_in
+ * INADDR_LOOPBACK
+ */
+#include <netinet/in.h>
+
+/* htons()
+ * htonl()
+ */
+#include <arpa/inet.h>
+
+/* struct pollfd
+ * poll()
+ */
+#include <poll.h>
+
+/* __u16
+ * __u64
+ */
+#include <linux/types.h>
+
+#include <ptrqueue.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+//#define MCTP_VERBOSE
+#ifdef MCTP_VERBOSE
+ #define INIT 			unsigned step = 0;
+ #define ENTER 					if (m->verbose & MCTP_VERBOSE_THREADS) 	printf("%d:%s Enter\n", 				gettid(), __FUNCTION__);
+ #define STEP 			step++; if (m->verbose & MCTP_VERBOSE_STEPS) 	printf("%d:%s STEP: %u\n", 				gettid(), __FUNCTION__, step);
+ #define ERR32(k, i)			if (m->verbose & MCTP_VERBOSE_ERROR) 	printf("%d:%s STEP: %u ERR: %s: %d\n",	gettid(), __FUNCTION__, step, k, i);
+ #define EXIT(rc) 				if (m->verbose & MCTP_VERBOSE_THREADS)	printf("%d:%s Exit: %d\n", 				gettid(), __FUNCTION__,rc);
+#else
+ #define INIT
+ #define ENTER
+ #define STEP
+ #define ERR32(k, i)
+ #define EXIT(rc)
+#endif
+
+// Relaxed load of a counter written by another thread
+#define LOAD(x) 						__atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+// Bytes of a scraper request that are read. The rest is ignored
+#define MCTP_METRICS_REQ_SIZE 			1024
+
+#define MCTP_METRICS_HTTP_HDR 			"HTTP/1.0 200 OK\r\n" \
+										"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n" \
+										"Connection: close\r\n" \
+										"\r\n"
+
+/* STRUCTS ===================================================================*/
+
+/**
+ * Copy of the counters of an mctp object taken at one time
+ */
+struct mctp_metrics_snap
+{
+	__u64 rx_packets;
+	__u64 rx_messages;
+	__u64 rx_stamped;
+	__u64 sr_dropped;
+	__u64 pr_dropped[6];			//!< Indexed as mctp_metrics_drop_reasons
+	__u64 mh_matched;
+	__u64 mh_dropped[2];			//!< Unmatched, stale
+	__u64 tx_messages;
+	__u64 tx_packets;
+	__u64 tx_dropped;
+	__u64 tx_zerocopy;
+	__u64 tx_zerocopy_copied;
+	__u64 completed;
+	__u64 successful;
+	__u64 failed;
+	__u64 reconnects;
+	__u64 cap_dropped;
+	__u64 tags;
+	__u64 depth[MCPQ_MAX];
+	__u64 hwm[MCPQ_MAX];
+	__u64 stalls[MCWS_MAX];
+	__u64 stalled[MCWS_MAX];
+	__u64 lat_hist[MCLS_MAX][MCTP_LAT_BUCKETS];
+	__u64 lat_sum[MCLS_MAX];
+};
+
+/* PROTOTYPES ================================================================*/
+
+static void *mctp_metrics_thread(void *arg);
+static void mctp_metrics_acct(char *buf, size_t len, size_t *off, const char *prefix, const char *label, struct mctp_acct_row *rx, struct mctp_acct_row *tx, int num);
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+static const char *mctp_metrics_drop_reasons[] = {
+	"version",
+	"seqnum",
+	"noeom",
+	"nosom",
+	"wrongto",
+	"ic",
+	"unmatched",
+	"stale"
+};
+
+static const char *mctp_metrics_pq_names[] = {
+	[MCPQ_PKTS] 	= "pkts",
+	[MCPQ_MSGS] 	= "msgs",
+	[MCPQ_ACTIONS] 	= "actions",
+	[MCPQ_RPQ] 		= "rpq",
+	[MCPQ_TPQ] 		= "tpq",
+	[MCPQ_RMQ] 		= "rmq",
+	[MCPQ_TMQ] 		= "tmq",
+	[MCPQ_TAQ] 		= "taq",
+	[MCPQ_ACQ] 		= "acq",
+};
+
+static const char *mctp_metrics_stage_names[] = {
+	[MCLS_QUEUE] 	= "queue",
+	[MCLS_WIRE] 	= "wire",
+	[MCLS_TOTAL] 	= "total",
+	[MCLS_RESPOND] 	= "respond",
+};
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Copy the counters of an mctp object
+ */
+static void mctp_metrics_snapshot(struct mctp *m, struct mctp_metrics_snap *s)
+{
+	int i, j;
+
+	s->rx_packets 			= LOAD(m->sr.packet_count);
+	s->rx_messages 			= LOAD(m->pr.message_count);
+	s->rx_stamped 			= LOAD(m->sr.rxts_count);
+	s->sr_dropped 			= LOAD(m->sr.dropped_count);
+	s->pr_dropped[0] 		= LOAD(m->pr.dropped_version);
+	s->pr_dropped[1] 		= LOAD(m->pr.dropped_seqnum);
+	s->pr_dropped[2] 		= LOAD(m->pr.dropped_noeom);
+	s->pr_dropped[3] 		= LOAD(m->pr.dropped_nosom);
+	s->pr_dropped[4] 		= LOAD(m->pr.dropped_wrongto);
+	s->pr_dropped[5] 		= LOAD(m->pr.dropped_ic);
+	s->mh_matched 			= LOAD(m->mh.matched);
+	s->mh_dropped[0] 		= LOAD(m->mh.dropped_unmatched);
+	s->mh_dropped[1] 		= LOAD(m->mh.dropped_stale);
+	s->tx_messages 			= LOAD(m->pw.message_count);
+	s->tx_packets 			= LOAD(m->sw.packet_count);
+	s->tx_dropped 			= LOAD(m->sw.dropped_count);
+	s->tx_zerocopy 			= LOAD(m->sw.zerocopy_count);
+	s->tx_zerocopy_copied 	= LOAD(m->sw.zerocopy_copied);
+	s->completed 			= LOAD(m->ct.completed_actions);
+	s->successful 			= LOAD(m->ct.successful_actions);
+	s->failed 				= LOAD(m->ct.failed_actions);
+	s->reconnects 			= LOAD(m->reconnects);
+	s->cap_dropped 			= mctp_capture_dropped(m);
+	s->tags 				= mctp_tags_count(m);
+
+	for (i = 0 ; i < MCPQ_MAX ; i++)
+	{
+		s->depth[i] = mctp_pq_depth(m, i);
+		s->hwm[i] = LOAD(m->pq_hwm[i]);
+	}
+
+	for (i = 0 ; i < MCWS_MAX ; i++)
+	{
+		s->stalls[i] = (m->wd != NULL) ? LOAD(m->wd->stalls[i]) : 0;
+		s->stalled[i] = (m->wd != NULL) ? LOAD(m->wd->stalled[i]) : 0;
+	}
+
+	for (i = 0 ; i < MCLS_MAX ; i++)
+	{
+		for (j = 0 ; j < MCTP_LAT_BUCKETS ; j++)
+			s->lat_hist[i][j] = LOAD(m->ct.lat_hist[i][j]);
+		s->lat_sum[i] = LOAD(m->ct.lat_sum[i]);
+	}
+}
+
+/**
+ * Append formatted text to the exposition
+ *
+ * Once the buffer is full further text is counted but not written
+ */
+static void __attribute__((format(printf, 4, 5))) mctp_metrics_printf(char *buf, size_t len, size_t *off, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf + ((*off < len) ? *off : len), (*off < len) ? len - *off : 0, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		*off += n;
+}
+
+/**
+ * Append a counter with no labels
+ */
+static void mctp_metrics_counter(char *buf, size_t len, size_t *off, const char *name, const char *help, __u64 val)
+{
+	mctp_metrics_printf(buf, len, off, "# TYPE %s counter\n# HELP %s %s\n%s_total %llu\n",
+		name, name, help, name, (unsigned long long) val);
+}
+
+/**
+ * Append the per EID or per message type counters of the rows with traffic
+ *
+ * @param prefix 	Name prefix of the metric families
+ * @param label 	Name of the label that holds the row index
+ * @param rx 		Rows to take received counts and drops from
+ * @param tx 		Rows to take transmitted counts, retries, timeouts and round trips from
+ */
+static void mctp_metrics_acct(char *buf, size_t len, size_t *off, const char *prefix, const char *label, struct mctp_acct_row *rx, struct mctp_acct_row *tx, int num)
+{
+	__u64 count;
+	int i, j;
+
+	mctp_metrics_printf(buf, len, off, "# TYPE %s_packets counter\n# HELP %s_packets Packets by %s and direction\n", prefix, prefix, label);
+	for (i = 0 ; i < num ; i++)
+	{
+		if (rx[i].rx_packets)
+			mctp_metrics_printf(buf, len, off, "%s_packets_total{%s=\"0x%02x\",dir=\"rx\"} %llu\n", prefix, label, i, (unsigned long long) rx[i].rx_packets);
+		if (tx[i].tx_packets)
+			mctp_metrics_printf(buf, len, off, "%s_packets_total{%s=\"0x%02x\",dir=\"tx\"} %llu\n", prefix, label, i, (unsigned long long) tx[i].tx_packets);
+	}
+
+	mctp_metrics_printf(buf, len, off, "# TYPE %s_messages counter\n# HELP %s_messages Messages by %s and direction\n", prefix, prefix, label);
+	for (i = 0 ; i < num ; i++)
+	{
+		if (rx[i].rx_messages)
+			mctp_metrics_printf(buf, len, off, "%s_messages_total{%s=\"0x%02x\",dir=\"rx\"} %llu\n", prefix, label, i, (unsigned long long) rx[i].rx_messages);
+		if (tx[i].tx_messages)
+			mctp_metrics_printf(buf, len, off, "%s_messages_total{%s=\"0x%02x\",dir=\"tx\"} %llu\n", prefix, label, i, (unsigned long long) tx[i].tx_messages);
+	}
+
+	mctp_metrics_printf(buf, len, off, "# TYPE %s_bytes counter\n# HELP %s_bytes Message payload bytes by %s and direction\n", prefix, prefix, label);
+	for (i = 0 ; i < num ; i++)
+	{
+		if (rx[i].rx_messages)
+			mctp_metrics_printf(buf, len, off, "%s_bytes_total{%s=\"0x%02x\",dir=\"rx\"} %llu\n", prefix, label, i, (unsigned long long) rx[i].rx_bytes);
+		if (tx[i].tx_messages)
+			mctp_metrics_printf(buf, len, off, "%s_bytes_total{%s=\"0x%02x\",dir=\"tx\"} %llu\n", prefix, label, i, (unsigned long long) tx[i].tx_bytes);
+	}
+
+	mctp_metrics_printf(buf, len, off, "# TYPE %s_dropped counter\n# HELP %s_dropped Received packets and messages dropped by %s and reason\n", prefix, prefix, label);
+	for (i = 0 ; i < num ; i++)
+		for (j = 0 ; j < MCAD_MAX ; j++)
+			if (rx[i].dropped[j])
+				mctp_metrics_printf(buf, len, off, "%s_dropped_total{%s=\"0x%02x\",reason=\"%s\"} %llu\n", prefix, label, i, mctp_metrics_drop_reasons[j], (unsigned long long) rx[i].dropped[j]);
+
+	mctp_metrics_printf(buf, len, off, "# TYPE %s_retries counter\n# HELP %s_retries Requests retransmitted after a timeout by %s\n", prefix, prefix, label);
+	for (i = 0 ; i < num ; i++)
+		if (tx[i].retries)
+			mctp_metrics_printf(buf, len, off, "%s_retries_total{%s=\"0x%02x\"} %llu\n", prefix, label, i, (unsigned long long) tx[i].retries);
+
+	mctp_metrics_printf(buf, len, off, "# TYPE %s_timeouts counter\n# HELP %s_timeouts Requests that failed after the last retry timed out by %s\n", prefix, prefix, label);
+	for (i = 0 ; i < num ; i++)
+		if (tx[i].timeouts)
+			mctp_metrics_printf(buf, len, off, "%s_timeouts_total{%s=\"0x%02x\"} %llu\n", prefix, label, i, (unsigned long long) tx[i].timeouts);
+
+	// The histograms are available from mctp_get_acct(). Only their count and sum are rendered to bound the exposition 
+	mctp_metrics_printf(buf, len, off, "# TYPE %s_rtt_seconds summary\n# HELP %s_rtt_seconds Round trip of requests by %s\n# UNIT %s_rtt_seconds seconds\n", prefix, prefix, label, prefix);
+	for (i = 0 ; i < num ; i++)
+	{
+		count = 0;
+		for (j = 0 ; j < MCTP_LAT_BUCKETS ; j++)
+			count += tx[i].rtt_hist[j];
+		if (count == 0)
+			continue;
+
+		mctp_metrics_printf(buf, len, off, "%s_rtt_seconds_count{%s=\"0x%02x\"} %llu\n", prefix, label, i, (unsigned long long) count);
+		mctp_metrics_printf(buf, len, off, "%s_rtt_seconds_sum{%s=\"0x%02x\"} %.9f\n", prefix, label, i, (double) tx[i].rtt_sum / 1000000000.0);
+	}
+}
+
+/**
+ * Render the metrics of an mctp object in the OpenMetrics text format
+ *
+ * @param buf 	Buffer to render into. Always NUL terminated if len > 0
+ * @param len 	Size of buf in bytes
+ * @return 		Length of the exposition, -1 if it did not fit in buf
+ *
+ * STEPS
+ * 1: Take a snapshot of the counters
+ * 2: Render counters
+ * 3: Render pool and queue gauges
+ * 4: Render latency histograms
+ * 5: Render per EID and per message type counters
+ */
+int mctp_metrics_render(struct mctp *m, char *buf, size_t len)
+{
+	struct mctp_metrics_snap s;
+	struct mctp_acct_row *rx, *tx;
+	size_t off;
+	__u64 cum, count;
+	int i, j;
+
+	// STEP 1: Take a snapshot of the counters
+	mctp_metrics_snapshot(m, &s);
+	off = 0;
+
+	// STEP 2: Render counters
+	mctp_metrics_counter(buf, len, &off, "mctp_rx_packets", "Packets read from the socket", s.rx_packets);
+	mctp_metrics_counter(buf, len, &off, "mctp_rx_messages", "Messages reassembled from received packets", s.rx_messages);
+	mctp_metrics_counter(buf, len, &off, "mctp_rx_stamped_packets", "Received packets stamped by the kernel", s.rx_stamped);
+
+	mctp_metrics_printf(buf, len, &off, "# TYPE mctp_rx_dropped_packets counter\n# HELP mctp_rx_dropped_packets Received packets dropped by reason\n");
+	mctp_metrics_printf(buf, len, &off, "mctp_rx_dropped_packets_total{reason=\"socket\"} %llu\n", (unsigned long long) s.sr_dropped);
+	for (i = 0 ; i < 6 ; i++)
+		mctp_metrics_printf(buf, len, &off, "mctp_rx_dropped_packets_total{reason=\"%s\"} %llu\n", mctp_metrics_drop_reasons[i], (unsigned long long) s.pr_dropped[i]);
+
+	mctp_metrics_counter(buf, len, &off, "mctp_rx_matched_responses", "Responses that completed an outstanding action", s.mh_matched);
+
+	mctp_metrics_printf(buf, len, &off, "# TYPE mctp_rx_dropped_responses counter\n# HELP mctp_rx_dropped_responses Responses that completed no action by reason\n");
+	mctp_metrics_printf(buf, len, &off, "mctp_rx_dropped_responses_total{reason=\"unmatched\"} %llu\n", (unsigned long long) s.mh_dropped[0]);
+	mctp_metrics_printf(buf, len, &off, "mctp_rx_dropped_responses_total{reason=\"stale\"} %llu\n", (unsigned long long) s.mh_dropped[1]);
+
+	mctp_metrics_counter(buf, len, &off, "mctp_tx_messages", "Messages split into packets", s.tx_messages);
+	mctp_metrics_counter(buf, len, &off, "mctp_tx_packets", "Packets written to the socket", s.tx_packets);
+	mctp_metrics_counter(buf, len, &off, "mctp_tx_dropped_packets", "Packets that could not be written", s.tx_dropped);
+	mctp_metrics_counter(buf, len, &off, "mctp_tx_zerocopy_messages", "Messages sent with MSG_ZEROCOPY", s.tx_zerocopy);
+	mctp_metrics_counter(buf, len, &off, "mctp_tx_zerocopy_copied", "Zero copy sends the kernel copied anyway", s.tx_zerocopy_copied);
+
+	mctp_metrics_counter(buf, len, &off, "mctp_actions_completed", "Actions that reached the Completion Thread", s.completed);
+	mctp_metrics_counter(buf, len, &off, "mctp_actions_successful", "Actions that completed successfully", s.successful);
+	mctp_metrics_counter(buf, len, &off, "mctp_actions_failed", "Actions that failed", s.failed);
+	mctp_metrics_counter(buf, len, &off, "mctp_reconnects", "Client reconnects", s.reconnects);
+	mctp_metrics_counter(buf, len, &off, "mctp_capture_dropped_packets", "Packets not captured because a capture ring was full", s.cap_dropped);
+
+	// STEP 3: Render pool and queue gauges
+	mctp_metrics_printf(buf, len, &off, "# TYPE mctp_tags_in_use gauge\n# HELP mctp_tags_in_use Outstanding actions holding a tag\nmctp_tags_in_use %llu\n",
+		(unsigned long long) s.tags);
+
+	mctp_metrics_printf(buf, len, &off, "# TYPE mctp_pool_in_use gauge\n# HELP mctp_pool_in_use Objects checked out of a pool\n");
+	for (i = MCPQ_PKTS ; i <= MCPQ_ACTIONS ; i++)
+		mctp_metrics_printf(buf, len, &off, "mctp_pool_in_use{pool=\"%s\"} %llu\n", mctp_metrics_pq_names[i], (unsigned long long) s.depth[i]);
+
+	mctp_metrics_printf(buf, len, &off, "# TYPE mctp_pool_in_use_max gauge\n# HELP mctp_pool_in_use_max Most objects checked out of a pool at once\n");
+	for (i = MCPQ_PKTS ; i <= MCPQ_ACTIONS ; i++)
+		mctp_metrics_printf(buf, len, &off, "mctp_pool_in_use_max{pool=\"%s\"} %llu\n", mctp_metrics_pq_names[i], (unsigned long long) s.hwm[i]);
+
+	mctp_metrics_printf(buf, len, &off, "# TYPE mctp_pool_size gauge\n# HELP mctp_pool_size Objects in a pool\n");
+	for (i = MCPQ_PKTS ; i <= MCPQ_ACTIONS ; i++)
+		mctp_metrics_printf(buf, len, &off, "mctp_pool_size{pool=\"%s\"} %u\n", mctp_metrics_pq_names[i], mctp_pq_size(i));
+
+	mctp_metrics_printf(buf, len, &off, "# TYPE mctp_queue_depth gauge\n# HELP mctp_queue_depth Objects waiting in a queue\n");
+	for (i = MCPQ_RPQ ; i < MCPQ_MAX ; i++)
+		mctp_metrics_printf(buf, len, &off, "mctp_queue_depth{queue=\"%s\"} %llu\n", mctp_metrics_pq_names[i], (unsigned long long) s.depth[i]);
+
+	mctp_metrics_printf(buf, len, &off, "# TYPE mctp_queue_depth_max gauge\n# HELP mctp_queue_depth_max Most objects waiting in a queue at once\n");
+	for (i = MCPQ_RPQ ; i < MCPQ_MAX ; i++)
+		mctp_metrics_printf(buf, len, &off, "mctp_queue_depth_max{queue=\"%s\"} %llu\n", mctp_metrics_pq_names[i], (unsigned long long) s.hwm[i]);
+
+	mctp_metrics_printf(buf, len, &off, "# TYPE mctp_queue_size gauge\n# HELP mctp_queue_size Capacity of a queue\n");
+	for (i = MCPQ_RPQ ; i < MCPQ_MAX ; i++)
+		mctp_metrics_printf(buf, len, &off, "mctp_queue_size{queue=\"%s\"} %u\n", mctp_metrics_pq_names[i], mctp_pq_size(i));
+
+	mctp_metrics_printf(buf, len, &off, "# TYPE mctp_stalls counter\n# HELP mctp_stalls Stalls the watchdog detected by stage\n");
+	for (i = 0 ; i < MCWS_MAX ; i++)
+		mctp_metrics_printf(buf, len, &off, "mctp_stalls_total{stage=\"%s\"} %llu\n", mcws(i), (unsigned long long) s.stalls[i]);
+
+	mctp_metrics_printf(buf, len, &off, "# TYPE mctp_stage_stalled gauge\n# HELP mctp_stage_stalled Stage has input but has not progressed\n");
+	for (i = 0 ; i < MCWS_MAX ; i++)
+		mctp_metrics_printf(buf, len, &off, "mctp_stage_stalled{stage=\"%s\"} %llu\n", mcws(i), (unsigned long long) s.stalled[i]);
+
+	// STEP 4: Render latency histograms. Bucket i of the Completion Thread holds latencies below 2^i usec
+	mctp_metrics_printf(buf, len, &off, "# TYPE mctp_action_latency_seconds histogram\n# HELP mctp_action_latency_seconds Latency of successful actions by stage\n# UNIT mctp_action_latency_seconds seconds\n");
+	for (i = 0 ; i < MCLS_MAX ; i++)
+	{
+		count = 0;
+		for (j = 0 ; j < MCTP_LAT_BUCKETS ; j++)
+			count += s.lat_hist[i][j];
+
+		cum = 0;
+		for (j = 0 ; j < MCTP_LAT_BUCKETS - 1 ; j++)
+		{
+			cum += s.lat_hist[i][j];
+			mctp_metrics_printf(buf, len, &off, "mctp_action_latency_seconds_bucket{stage=\"%s\",le=\"%.6f\"} %llu\n",
+				mctp_metrics_stage_names[i], (double) (1ULL << j) / 1000000.0, (unsigned long long) cum);
+		}
+		mctp_metrics_printf(buf, len, &off, "mctp_action_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+			mctp_metrics_stage_names[i], (unsigned long long) count);
+		mctp_metrics_printf(buf, len, &off, "mctp_action_latency_seconds_count{stage=\"%s\"} %llu\n",
+			mctp_metrics_stage_names[i], (unsigned long long) count);
+		mctp_metrics_printf(buf, len, &off, "mctp_action_latency_seconds_sum{stage=\"%s\"} %.9f\n",
+			mctp_metrics_stage_names[i], (double) s.lat_sum[i] / 1000000000.0);
+	}
+
+	// STEP 5: Render per EID and per message type counters. The tables are too large for the stack of the exporter 
+	rx = calloc(MCTP_NUM_EIDS, sizeof(struct mctp_acct_row));
+	tx = calloc(MCTP_NUM_EIDS, sizeof(struct mctp_acct_row));
+	if (rx != NULL && tx != NULL)
+	{
+		mctp_get_acct(m, MCAT_SRC, rx, MCTP_NUM_EIDS);
+		mctp_get_acct(m, MCAT_DST, tx, MCTP_NUM_EIDS);
+		mctp_metrics_acct(buf, len, &off, "mctp_eid", "eid", rx, tx, MCTP_NUM_EIDS);
+
+		mctp_get_acct(m, MCAT_TYPE, rx, MCTP_ACCT_TYPES);
+		mctp_metrics_acct(buf, len, &off, "mctp_type", "type", rx, rx, MCTP_ACCT_TYPES);
+	}
+	free(rx);
+	free(tx);
+
+	mctp_metrics_printf(buf, len, &off, "# EOF\n");
+
+	if (off >= len)
+		return -1;
+
+	return off;
+}
+
+/**
+ * Serve one scraper connection
+ *
+ * STEPS
+ * 1: Wait briefly for a request
+ * 2: Render the exposition
+ * 3: Send the exposition
+ */
+static void mctp_metrics_serve(struct mctp *m, int fd, char *buf)
+{
+	struct pollfd pfd;
+	char req[MCTP_METRICS_REQ_SIZE];
+	ssize_t n;
+	size_t off, total;
+	int len, http;
+
+	// STEP 1: Wait briefly for a request. A scraper that sends nothing gets the bare exposition
+	http = 0;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, MCTP_METRICS_REQ_MSEC) == 1)
+	{
+		n = recv(fd, req, sizeof(req) - 1, MSG_DONTWAIT);
+		if (n >= 4 && strncmp(req, "GET ", 4) == 0)
+			http = 1;
+	}
+
+	// STEP 2: Render the exposition after the header
+	off = 0;
+	if (http)
+	{
+		off = strlen(MCTP_METRICS_HTTP_HDR);
+		memcpy(buf, MCTP_METRICS_HTTP_HDR, off);
+	}
+
+	len = mctp_metrics_render(m, buf + off, MCTP_METRICS_BUF_SIZE - off);
+	if (len < 0)
+		len = strlen(buf + off);
+	total = off + len;
+
+	// STEP 3: Send the exposition
+	off = 0;
+	while (off < total)
+	{
+		n = send(fd, buf + off, total - off, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		off += n;
+	}
+}
+
+/**
+ * Metrics Exporter Thread
+ *
+ * @param arg This is a void * but will only ever be a struct mctp*
+ *
+ * STEPS
+ * 1: Allocate the exposition buffer
+ * LOOP 1: Wait for a scraper or the stop request
+ * LOOP 2: Accept and serve the scraper
+ */
+static void *mctp_metrics_thread(void *arg)
+{
+	struct mctp *m;
+	struct pollfd pfd;
+	char *buf;
+	int fd;
+
+	m = (struct mctp*) arg;
+
+	// STEP 1: Allocate the exposition buffer
+	buf = malloc(MCTP_METRICS_BUF_SIZE);
+	if (buf == NULL)
+		return NULL;
+
+	pfd.fd = m->metrics_fd;
+	pfd.events = POLLIN;
+
+	while (__atomic_load_n(&m->metrics_stop, __ATOMIC_ACQUIRE) == 0)
+	{
+		// LOOP 1: Wait for a scraper or the stop request
+		if (poll(&pfd, 1, MCTP_METRICS_POLL_MSEC) != 1)
+			continue;
+
+		// LOOP 2: Accept and serve the scraper
+		fd = accept(m->metrics_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+
+		mctp_metrics_serve(m, fd, buf);
+		close(fd);
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+/**
+ * Start serving the metrics of an mctp object
+ *
+ * May be called before or after mctp_run(). Counters read 0 until the threads start
+ *
+ * @param path 	Unix socket path to listen on. NULL to listen on a loopback TCP port
+ * @param port 	TCP port on 127.0.0.1 to listen on if path is NULL
+ * @return 		0 upon success, 1 otherwise and sets errno
+ *
+ * STEPS
+ * 1: Verify input
+ * 2: Open the listening socket
+ * 3: Start the exporter thread
+ */
+int mctp_metrics_start(struct mctp *m, const char *path, __u16 port)
+{
+	INIT
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	int fd, rv, opt;
+
+	ENTER
+
+	// Initialize variables
+	rv = 1;
+	fd = -1;
+
+	STEP // 1: Verify input
+	if (m->metrics_fd >= 0)
+	{
+		errno = EBUSY;
+		goto end;
+	}
+	if (path != NULL && strlen(path) >= sizeof(sun.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		goto end;
+	}
+
+	STEP // 2: Open the listening socket
+	if (path != NULL)
+	{
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			goto end;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+
+		unlink(path);
+		if (bind(fd, (struct sockaddr*) &sun, sizeof(sun)) != 0)
+		{
+			ERR32("bind", errno);
+			goto end_fd;
+		}
+	}
+	else
+	{
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			goto end;
+
+		opt = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sin.sin_port = htons(port);
+
+		if (bind(fd, (struct sockaddr*) &sin, sizeof(sin)) != 0)
+		{
+			ERR32("bind", errno);
+			goto end_fd;
+		}
+	}
+
+	if (listen(fd, 4) != 0)
+		goto end_unlink;
+
+	STEP // 3: Start the exporter thread
+	m->metrics_fd = fd;
+	m->metrics_stop = 0;
+	if (path != NULL)
+		strncpy(m->metrics_path, path, sizeof(m->metrics_path) - 1);
+	else
+		m->metrics_path[0] = 0;
+
+	if (pthread_create(&m->pt_mx, NULL, mctp_metrics_thread, m) != 0)
+	{
+		m->metrics_fd = -1;
+		m->metrics_path[0] = 0;
+		goto end_unlink;
+	}
+
+	rv = 0;
+	goto end;
+
+end_unlink:
+
+	if (path != NULL)
+		unlink(path);
+
+end_fd:
+
+	close(fd);
+
+end:
+
+	EXIT(rv);
+
+	return rv;
+}
+
+/**
+ * Stop the metrics exporter of an mctp object
+ *
+ * @return 0 upon success, 1 if the exporter was not running
+ */
+int mctp_metrics_stop(struct mctp *m)
+{
+	if (m->metrics_fd < 0)
+		return 1;
+
+	__atomic_store_n(&m->metrics_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(m->pt_mx, NULL);
+
+	close(m->metrics_fd);
+	m->metrics_fd = -1;
+
+	if (m->metrics_path[0] != 0)
+	{
+		unlink(m->metrics_path);
+		m->metrics_path[0] = 0;
+	}
+
+	return 0;
+}
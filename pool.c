@@ -0,0 +1,603 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		pool.c
+ *
+ * @brief 		Code file for the pool and queue memory accounting of the MCTP
+ * 				transport library
+ *
+ * @details 	mctp_pq_push() and mctp_pq_pop() count every object and keep a
+ * 				high-water mark of each pool and queue. mctp_pq_usage()
+ * 				reports the memory of each one and splits the objects checked
+ * 				out of a pool by who holds them: a queue, an outstanding
+ * 				action, a zero copy send, an incomplete message or the next
+ * 				read of the Socket Reader. Objects
+ * 				held by none of these once the threads are quiescent have
+ * 				leaked.
+ *
+ * 				In debug mode the address of every pool object is indexed
+ * 				when the pools are created. Each push and pop then records
+ * 				the queue the object is in, or the thread that holds it and
+ * 				since when, so mctp_prnt_pq() can name the stage that leaked
+ * 				each object.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* errno
+ */
+#include <errno.h>
+
+/* printf()
+ */
+#include <stdio.h>
+
+/* calloc()
+ * free()
+ * qsort()
+ * bsearch()
+ */
+#include <stdlib.h>
+
+/* memset()
+ */
+#include <string.h>
+
+/* gettid()
+ */
+#include <unistd.h>
+
+/* __u64
+ */
+#include <linux/types.h>
+
+/* struct ptr_queue
+ * pq_push()
+ * pq_pop()
+ */
+#include <ptrqueue.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+//#define MCTP_VERBOSE
+#ifdef MCTP_VERBOSE
+ #define INIT 			unsigned step = 0;
+ #define ENTER 					if (m->verbose & MCTP_VERBOSE_THREADS) 	printf("%d:%s Enter\n", 				gettid(), __FUNCTION__);
+ #define STEP 			step++; if (m->verbose & MCTP_VERBOSE_STEPS) 	printf("%d:%s STEP: %u\n", 				gettid(), __FUNCTION__, step);
+ #define ERR32(k, i)			if (m->verbose & MCTP_VERBOSE_ERROR) 	printf("%d:%s STEP: %u ERR: %s: %d\n",	gettid(), __FUNCTION__, step, k, i);
+ #define EXIT(rc) 				if (m->verbose & MCTP_VERBOSE_THREADS)	printf("%d:%s Exit: %d\n", 				gettid(), __FUNCTION__,rc);
+#else
+ #define INIT
+ #define ENTER
+ #define STEP
+ #define ERR32(k, i)
+ #define EXIT(rc)
+#endif
+
+// Number of pools. They are the first entries of enum _MCPQ
+#define MCTP_PQ_POOLS 					(MCPQ_ACTIONS + 1)
+
+/* STRUCTS ===================================================================*/
+
+/**
+ * Pool objects with a known holder, sorted by address for lookup
+ */
+struct pq_held
+{
+	void **ptr[MCTP_PQ_POOLS];
+	unsigned num[MCTP_PQ_POOLS];
+};
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+/**
+ * String representations of the pools and queues (MCPQ)
+ */
+static const char *STR_MCPQ[] = {
+	"pkts",
+	"msgs",
+	"actions",
+	"rpq",
+	"tpq",
+	"rmq",
+	"tmq",
+	"taq",
+	"acq",
+};
+
+/**
+ * Size of an object of each pool
+ */
+static const size_t mctp_pq_obj_size[] = {
+	[MCPQ_PKTS] 	= sizeof(struct mctp_pkt_wrapper),
+	[MCPQ_MSGS] 	= sizeof(struct mctp_msg),
+	[MCPQ_ACTIONS] 	= sizeof(struct mctp_action),
+};
+
+/* PROTOTYPES ================================================================*/
+
+static int mctp_pq_cmp_ptr(const void *a, const void *b);
+static int mctp_pq_cmp_obj(const void *a, const void *b);
+static struct mctp_pq_obj *mctp_pq_find(struct mctp *m, int pool, void *ptr);
+static void mctp_pq_held_add(struct pq_held *h, int pool, void *ptr);
+static void mctp_pq_held_action(struct pq_held *h, struct mctp_action *ma);
+static int mctp_pq_held_collect(struct mctp *m, struct pq_held *h, struct pq_held *r);
+static int mctp_pq_held_find(struct pq_held *h, int pool, void *ptr);
+static int mctp_pq_unaccounted(struct mctp *m, int pool, struct mctp_pq_obj *o, struct pq_held *h, struct pq_held *r);
+static const char *mctp_pq_owner(struct mctp *m, pid_t tid);
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Track the holder of each pool object
+ *
+ * Each push and pop then looks up the object, so this is meant for finding
+ * leaks, not for production. Must be called before mctp_run()
+ *
+ * @param enable 	1 to enable, 0 to disable
+ * @return 			0 upon success, 1 if already running
+ */
+int mctp_set_pq_debug(struct mctp *m, int enable)
+{
+	if (m->all_threads_started)
+		return 1;
+
+	m->pq_debug = enable;
+
+	return 0;
+}
+
+/**
+ * Index the objects of the pools of an mctp object
+ *
+ * Called once the pools are created and before any object is checked out
+ *
+ * @return 	0 upon success, 1 otherwise and sets errno
+ *
+ * STEPS
+ * 1: Allocate the index
+ * 2: Take every object out of each pool and put it back in the same order
+ * 3: Sort the objects of each pool by address
+ */
+int mctp_pq_track_init(struct mctp *m)
+{
+	INIT
+	struct mctp_pq_track *t;
+	struct ptr_queue *pq;
+	void *ptr;
+	unsigned i, n;
+	int p;
+
+	ENTER
+
+	STEP // 1: Allocate the index
+	t = calloc(1, sizeof(struct mctp_pq_track));
+	if (t == NULL)
+		goto fail;
+
+	for ( p = 0 ; p < MCTP_PQ_POOLS ; p++ )
+	{
+		t->objs[p] = calloc(mctp_pq_size(p), sizeof(struct mctp_pq_obj));
+		if (t->objs[p] == NULL)
+			goto fail;
+	}
+
+	STEP // 2: Take every object out of each pool and put it back in the same order
+	for ( p = 0 ; p < MCTP_PQ_POOLS ; p++ )
+	{
+		pq = mctp_pq(m, p);
+		n = mctp_pq_size(p);
+		for ( i = 0 ; i < n ; i++ )
+		{
+			ptr = pq_pop(pq, 0);
+			if (ptr == NULL)
+				break;
+
+			t->objs[p][i].ptr = ptr;
+			t->objs[p][i].q = p;
+			pq_push(pq, ptr);
+		}
+		t->num[p] = i;
+	}
+
+	STEP // 3: Sort the objects of each pool by address
+	for ( p = 0 ; p < MCTP_PQ_POOLS ; p++ )
+		qsort(t->objs[p], t->num[p], sizeof(struct mctp_pq_obj), mctp_pq_cmp_obj);
+
+	m->pq_track = t;
+
+	EXIT(0)
+
+	return 0;
+
+fail:
+
+	ERR32("calloc", 0);
+	if (t != NULL)
+		for ( p = 0 ; p < MCTP_PQ_POOLS ; p++ )
+			free(t->objs[p]);
+	free(t);
+	errno = ENOMEM;
+
+	EXIT(1)
+
+	return 1;
+}
+
+/**
+ * Free the pool object index of an mctp object
+ */
+void mctp_pq_track_free(struct mctp *m)
+{
+	int p;
+
+	if (m->pq_track == NULL)
+		return;
+
+	for ( p = 0 ; p < MCTP_PQ_POOLS ; p++ )
+		free(m->pq_track->objs[p]);
+	free(m->pq_track);
+	m->pq_track = NULL;
+}
+
+/**
+ * Record where a pool object went. Called by mctp_pq_push() and mctp_pq_pop() in debug mode
+ *
+ * An object pushed onto a pool or queue is in it. An object popped from one
+ * is held by the calling thread. Objects that are not from a pool, like the
+ * drain marker, are ignored
+ *
+ * @param q 	enum _MCPQ
+ * @param pop 	1 if the object was popped, 0 if it is being pushed
+ */
+void mctp_pq_track(struct mctp *m, int q, void *ptr, int pop)
+{
+	struct mctp_pq_obj *o;
+	int p;
+
+	// A queue can carry objects of any pool
+	o = NULL;
+	if (q < MCTP_PQ_POOLS)
+		o = mctp_pq_find(m, q, ptr);
+	else
+		for ( p = 0 ; p < MCTP_PQ_POOLS && o == NULL ; p++ )
+			o = mctp_pq_find(m, p, ptr);
+
+	if (o == NULL)
+		return;
+
+	o->ts = mctp_now();
+	if (pop)
+	{
+		o->q = -1;
+		o->tid = gettid();
+	}
+	else
+		o->q = q;
+}
+
+/**
+ * Report the memory use of each pool and queue and the objects unaccounted for
+ *
+ * The held counts of the pools are exact once the threads are quiescent. In
+ * debug mode the unaccounted objects are counted one by one, otherwise they
+ * are what remains of the depth of the pool
+ *
+ * @param u 	Array of MCPQ_MAX entries to fill
+ * @return 		0 upon success, 1 otherwise and sets errno. EBUSY if objects
+ * 				are still queued, in which case u is filled but objects carried
+ * 				by queued actions count as unaccounted
+ *
+ * STEPS
+ * 1: Fill the sizes, depths and high-water marks
+ * 2: Count the objects of each pool in the queues
+ * 3: Count the objects held by outstanding actions, zero copy sends, incomplete messages and the next read
+ * 4: Count the objects held by none of them
+ */
+int mctp_pq_usage(struct mctp *m, struct mctp_pq_usage *u)
+{
+	INIT
+	struct pq_held h, r;
+	struct mctp_pq_obj *o;
+	__u64 held;
+	unsigned i;
+	int p, q, busy;
+
+	ENTER
+
+	STEP // 1: Fill the sizes, depths and high-water marks
+	for ( q = 0 ; q < MCPQ_MAX ; q++ )
+	{
+		memset(&u[q], 0, sizeof(struct mctp_pq_usage));
+		u[q].size = mctp_pq_size(q);
+		u[q].bytes = u[q].size * ((q < MCTP_PQ_POOLS) ? mctp_pq_obj_size[q] : sizeof(void*));
+		u[q].depth = mctp_pq_depth(m, q);
+		u[q].hwm = __atomic_load_n(&m->pq_hwm[q], __ATOMIC_RELAXED);
+	}
+
+	STEP // 2: Count the objects of each pool in the queues
+	u[MCPQ_PKTS].queued = u[MCPQ_RPQ].depth;
+	u[MCPQ_MSGS].queued = u[MCPQ_RMQ].depth;
+	u[MCPQ_ACTIONS].queued = u[MCPQ_TAQ].depth + u[MCPQ_TMQ].depth + u[MCPQ_TPQ].depth + u[MCPQ_ACQ].depth;
+
+	busy = 0;
+	for ( q = MCTP_PQ_POOLS ; q < MCPQ_MAX ; q++ )
+		if (u[q].depth > 0)
+			busy = 1;
+
+	STEP // 3: Count the objects held by outstanding actions, zero copy sends, incomplete messages and the next read
+	if (mctp_pq_held_collect(m, &h, &r) != 0)
+	{
+		ERR32("calloc", 0);
+		EXIT(1)
+		return 1;
+	}
+
+	for ( p = 0 ; p < MCTP_PQ_POOLS ; p++ )
+		u[p].outstanding = h.num[p];
+	u[MCPQ_MSGS].reassembly = r.num[MCPQ_MSGS];
+	u[MCPQ_PKTS].reading = m->sr.rx_buffers;
+
+	STEP // 4: Count the objects held by none of them
+	for ( p = 0 ; p < MCTP_PQ_POOLS ; p++ )
+	{
+		if (m->pq_track != NULL)
+		{
+			for ( i = 0 ; i < m->pq_track->num[p] ; i++ )
+			{
+				o = &m->pq_track->objs[p][i];
+				if (mctp_pq_unaccounted(m, p, o, &h, &r))
+					u[p].unaccounted++;
+			}
+			continue;
+		}
+
+		held = u[p].queued + u[p].outstanding + u[p].reassembly + u[p].reading;
+		u[p].unaccounted = (u[p].depth > held) ? u[p].depth - held : 0;
+	}
+
+	for ( p = 0 ; p < MCTP_PQ_POOLS ; p++ )
+	{
+		free(h.ptr[p]);
+		free(r.ptr[p]);
+	}
+
+	if (busy)
+	{
+		errno = EBUSY;
+		EXIT(1)
+		return 1;
+	}
+
+	EXIT(0)
+
+	return 0;
+}
+
+/**
+ * Print the memory use of each pool and queue
+ *
+ * In debug mode each unaccounted object is listed with the stage that holds
+ * it and for how long
+ */
+void mctp_prnt_pq(struct mctp *m)
+{
+	struct mctp_pq_usage u[MCPQ_MAX];
+	struct pq_held h, r;
+	struct mctp_pq_obj *o;
+	mctp_ticks_t now;
+	unsigned i;
+	int p, q, rv;
+
+	rv = mctp_pq_usage(m, u);
+	if (rv != 0 && errno != EBUSY)
+		return;
+
+	printf("Pool/Queue     Size      Bytes   Depth     HWM  Queued Outstanding Reassembly Reading Unaccounted\n");
+	for ( q = 0 ; q < MCPQ_MAX ; q++ )
+	{
+		printf("%-10s %8llu %10llu %7llu %7llu", STR_MCPQ[q],
+			(unsigned long long) u[q].size, (unsigned long long) u[q].bytes,
+			(unsigned long long) u[q].depth, (unsigned long long) u[q].hwm);
+		if (q < MCTP_PQ_POOLS)
+			printf(" %7llu %11llu %10llu %7llu %11llu", (unsigned long long) u[q].queued,
+				(unsigned long long) u[q].outstanding, (unsigned long long) u[q].reassembly,
+				(unsigned long long) u[q].reading, (unsigned long long) u[q].unaccounted);
+		printf("\n");
+	}
+
+	if (rv != 0)
+		printf("Objects are still queued. Unaccounted counts are not final\n");
+
+	if (m->pq_track == NULL || mctp_pq_held_collect(m, &h, &r) != 0)
+		return;
+
+	now = mctp_now();
+	for ( p = 0 ; p < MCTP_PQ_POOLS ; p++ )
+	{
+		for ( i = 0 ; i < m->pq_track->num[p] ; i++ )
+		{
+			o = &m->pq_track->objs[p][i];
+			if (!mctp_pq_unaccounted(m, p, o, &h, &r))
+				continue;
+
+			printf("Unaccounted %-7s %p held by %s (%d) for %llu ms\n", STR_MCPQ[p], o->ptr,
+				mctp_pq_owner(m, o->tid), o->tid, (unsigned long long) (mctp_ticks_to_ns(now - o->ts) / 1000000));
+		}
+		free(h.ptr[p]);
+		free(r.ptr[p]);
+	}
+}
+
+/**
+ * Compare two pointers for qsort() and bsearch()
+ */
+static int mctp_pq_cmp_ptr(const void *a, const void *b)
+{
+	const void *x = *(void* const*) a;
+	const void *y = *(void* const*) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Compare two tracked objects by address for qsort() and bsearch()
+ */
+static int mctp_pq_cmp_obj(const void *a, const void *b)
+{
+	return mctp_pq_cmp_ptr(&((const struct mctp_pq_obj*) a)->ptr, &((const struct mctp_pq_obj*) b)->ptr);
+}
+
+/**
+ * Find the tracked object of a pool at an address
+ *
+ * @return 	NULL if the address is not an object of the pool
+ */
+static struct mctp_pq_obj *mctp_pq_find(struct mctp *m, int pool, void *ptr)
+{
+	struct mctp_pq_obj key;
+
+	key.ptr = ptr;
+
+	return bsearch(&key, m->pq_track->objs[pool], m->pq_track->num[pool], sizeof(struct mctp_pq_obj), mctp_pq_cmp_obj);
+}
+
+/**
+ * Add an object to a set of held objects
+ */
+static void mctp_pq_held_add(struct pq_held *h, int pool, void *ptr)
+{
+	if (ptr == NULL || h->num[pool] >= mctp_pq_size(pool))
+		return;
+
+	h->ptr[pool][h->num[pool]++] = ptr;
+}
+
+/**
+ * Add an action and the messages and packets it carries to a set of held objects
+ */
+static void mctp_pq_held_action(struct pq_held *h, struct mctp_action *ma)
+{
+	struct mctp_pkt_wrapper *pw;
+
+	mctp_pq_held_add(h, MCPQ_ACTIONS, ma);
+	mctp_pq_held_add(h, MCPQ_MSGS, ma->req);
+	mctp_pq_held_add(h, MCPQ_MSGS, ma->rsp);
+	for ( pw = ma->pw ; pw != NULL ; pw = pw->next )
+		mctp_pq_held_add(h, MCPQ_PKTS, pw);
+}
+
+/**
+ * Collect the pool objects that are held for a reason
+ *
+ * Read without locking. The result is exact once the threads are quiescent
+ *
+ * @param h 	Filled with the objects of outstanding actions, the actions
+ * 				waiting for a tag and zero copy sends
+ * @param r 	Filled with the messages of incomplete reassemblies
+ * @return 		0 upon success, 1 otherwise and sets errno. Nothing is allocated upon failure
+ */
+static int mctp_pq_held_collect(struct mctp *m, struct pq_held *h, struct pq_held *r)
+{
+	struct mctp_tag_slot *s;
+	struct mctp_pkt_wrapper *pw;
+	struct mctp_action *ma;
+	__u32 i;
+	int p, c, t;
+
+	memset(h, 0, sizeof(struct pq_held));
+	memset(r, 0, sizeof(struct pq_held));
+
+	for ( p = 0 ; p < MCTP_PQ_POOLS ; p++ )
+	{
+		h->ptr[p] = calloc(mctp_pq_size(p), sizeof(void*));
+		r->ptr[p] = calloc(mctp_pq_size(p), sizeof(void*));
+		if (h->ptr[p] == NULL || r->ptr[p] == NULL)
+		{
+			for ( ; p >= 0 ; p-- )
+			{
+				free(h->ptr[p]);
+				free(r->ptr[p]);
+			}
+			errno = ENOMEM;
+			return 1;
+		}
+	}
+
+	// Outstanding actions and the actions waiting for a tag
+	for ( i = 0 ; i < MCTP_TAG_TABLE_SIZE ; i++ )
+	{
+		s = &m->tags.slots[i];
+		if (__atomic_load_n(&s->word, __ATOMIC_ACQUIRE) & MCTP_TAG_BUSY)
+			mctp_pq_held_action(h, s->ma);
+	}
+
+	for ( i = 0 ; i < MCTP_NUM_EIDS ; i++ )
+		for ( ma = m->st.deferred[i] ; ma != NULL ; ma = ma->next )
+			mctp_pq_held_action(h, ma);
+
+	// Packets the kernel has not released from a zero copy send
+	for ( i = m->sw.zc_tail ; i != m->sw.zc_head ; i++ )
+		for ( pw = m->sw.zc_ring[i % MCTP_ZC_RING_SIZE].pw ; pw != NULL ; pw = pw->next )
+			mctp_pq_held_add(h, MCPQ_PKTS, pw);
+
+	// Messages the Packet Reader is still reassembling
+	for ( c = 0 ; c < MCTP_MAX_CONNS ; c++ )
+		for ( t = 0 ; t < MCTP_NUM_TAGS ; t++ )
+			mctp_pq_held_add(r, MCPQ_MSGS, m->pr.tags[c][t]);
+
+	for ( p = 0 ; p < MCTP_PQ_POOLS ; p++ )
+	{
+		qsort(h->ptr[p], h->num[p], sizeof(void*), mctp_pq_cmp_ptr);
+		qsort(r->ptr[p], r->num[p], sizeof(void*), mctp_pq_cmp_ptr);
+	}
+
+	return 0;
+}
+
+/**
+ * Test if an object is in a set of held objects
+ */
+static int mctp_pq_held_find(struct pq_held *h, int pool, void *ptr)
+{
+	return bsearch(&ptr, h->ptr[pool], h->num[pool], sizeof(void*), mctp_pq_cmp_ptr) != NULL;
+}
+
+/**
+ * Test if a tracked object is held by a thread for no known reason
+ *
+ * The Socket Reader only holds empty packets for its next read
+ */
+static int mctp_pq_unaccounted(struct mctp *m, int pool, struct mctp_pq_obj *o, struct pq_held *h, struct pq_held *r)
+{
+	if (o->q != -1 || o->tid == m->sr.threadid)
+		return 0;
+
+	return !mctp_pq_held_find(h, pool, o->ptr) && !mctp_pq_held_find(r, pool, o->ptr);
+}
+
+/**
+ * Name the stage of the thread that holds an object
+ */
+static const char *mctp_pq_owner(struct mctp *m, pid_t tid)
+{
+	if (tid == 0) 				return "none";
+	if (tid == m->ch.threadid) 	return "connection handler";
+	if (tid == m->sr.threadid) 	return "socket reader";
+	if (tid == m->pr.threadid) 	return "packet reader";
+	if (tid == m->mh.threadid) 	return "message handler";
+	if (tid == m->pw.threadid) 	return "packet writer";
+	if (tid == m->sw.threadid) 	return "socket writer";
+	if (tid == m->st.threadid) 	return "submission thread";
+	if (tid == m->ct.threadid) 	return "completion thread";
+	return "application";
+}
@@ -0,0 +1,915 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		replay.c
+ *
+ * @brief 		Code file for the replay tool of the MCTP Transport Library
+ *
+ * @details 	Reads the packets of a pcap or pcapng capture with link type
+ * 				LINKTYPE_MCTP and sends them to a server, paced as they were
+ * 				recorded, scaled, or as fast as possible. The responses are
+ * 				matched to the requests by EID and tag to measure latency. The sender
+ * 				keeps at most a window of requests awaiting a response.
+ *
+ * 				By default the packets are written to a TCP connection to a
+ * 				running server. With -r the tool runs a server itself and
+ * 				injects the packets straight into its Receive Packet Queue,
+ * 				which removes the socket from the measurement.
+ *
+ * 				replay [-r] [-a addr] [-p port] [-s speed] [-n loops]
+ * 				       [-f filter] [-e eid] [-t msec] [-w num] file
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <byteswap.h>
+#include <linux/types.h>
+
+#include <ptrqueue.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+#define REPLAY_PORT 				2508
+#define REPLAY_WAIT_MSEC 			1000
+#define REPLAY_FILTER 				"owner"
+
+// Requests awaiting a response before the sender waits. The server holds each
+// one in an mctp_msg, so a window beyond its pool starves the handlers of
+// mctp_msgs for the responses
+#define REPLAY_WINDOW 				(MCTP_MSG_POOL_SIZE / 2)
+
+// Requests of each EID and tag that can await a response
+#define REPLAY_TAG_DEPTH 			4096
+
+// Packets written with one send() when not pacing
+#define REPLAY_BATCH 				64
+
+// Nanoseconds before a deadline that the sender stops sleeping and spins
+#define REPLAY_SPIN_NSEC 			50000
+
+// Interfaces of a pcapng file that are tracked
+#define REPLAY_IFACE_MAX 			16
+
+#define PCAP_MAGIC_USEC 			0xA1B2C3D4
+#define PCAP_MAGIC_NSEC 			0xA1B23C4D
+#define PCAPNG_SHB 					0x0A0D0D0A
+#define PCAPNG_IDB 					0x00000001
+#define PCAPNG_EPB 					0x00000006
+#define PCAPNG_BYTE_ORDER 			0x1A2B3C4D
+#define PCAPNG_OPT_IF_TSRESOL 		9
+
+/* STRUCTS ===================================================================*/
+
+/**
+ * Packet read from the capture
+ */
+struct replay_pkt
+{
+	__u64 ns; 					//!< Time stamp of the capture in ns
+	struct mctp_pkt pkt;
+};
+
+/**
+ * Packets of a capture and what was not loaded
+ */
+struct replay_file
+{
+	struct replay_pkt *pkts;
+	size_t num;
+	size_t cap;
+	__u64 other_link; 			//!< Packets of another link type
+	__u64 truncated; 			//!< Packets shorter than an MCTP packet
+	__u64 filtered; 			//!< Packets that did not match the filter
+};
+
+/**
+ * Interface of a pcapng file
+ */
+struct replay_iface
+{
+	__u16 linktype;
+	__u64 div; 					//!< Divide a time stamp by div ...
+	__u64 mul; 					//!< ... and multiply by mul to get ns
+};
+
+/**
+ * Send times of the requests to one EID with one tag, oldest first
+ */
+struct replay_fifo
+{
+	__u64 sent[REPLAY_TAG_DEPTH];
+	unsigned head;
+	unsigned tail;
+};
+
+/**
+ * State shared by the sender and the receiver
+ */
+struct replay
+{
+	int fd;
+	int stop;
+	int closed; 				//!< Set by the receiver when the server closes the connection
+	pthread_mutex_t mtx;
+
+	// Requests awaiting a response, per EID the request was sent to and tag. Allocated on first use
+	struct replay_fifo *fifo[256][8];
+
+	// Latencies of the matched responses in ns
+	__u64 *lat;
+	size_t lat_num;
+	size_t lat_cap;
+
+	__u64 packets; 				//!< Packets sent or injected
+	__u64 requests; 			//!< Request EOM packets sent
+	__u64 untracked; 			//!< Requests not tracked because their EID and tag had too many outstanding
+	__u64 responses; 			//!< Response EOM packets received
+	__u64 unmatched; 			//!< Responses with no request outstanding on their EID and tag
+	__u64 send_errors; 			//!< Packets that could not be written
+	__u64 retries; 				//!< Times the Receive Packet Queue or packet pool was full
+	__u64 inject_drops; 		//!< Packets not injected within the wait time
+	__u64 expired; 				//!< Requests given up on to reopen the window
+};
+
+/* PROTOTYPES ================================================================*/
+
+static int load(const char *path, const char *filter, struct replay_file *rf);
+static int load_pcap(const __u8 *buf, size_t len, struct mctp_filter *f, struct replay_file *rf);
+static int load_pcapng(const __u8 *buf, size_t len, struct mctp_filter *f, struct replay_file *rf);
+static void add_pkt(struct replay_file *rf, struct mctp_filter *f, __u64 ns, const __u8 *data, __u32 caplen);
+static void *receiver(void *arg);
+static void track(struct replay *r, struct mctp_pkt *pkt, __u64 now);
+static void expire(struct replay *r);
+static unsigned wait_window(struct replay *r, unsigned window, int wait_msec);
+static int send_all(int fd, const void *buf, size_t len);
+static int inject(struct replay *r, struct mctp *m, struct mctp_pkt *pkt, int wait_msec);
+static void wait_until(__u64 ns);
+static __u64 now_ns();
+static int cmp_u64(const void *a, const void *b);
+static void report(struct replay *r, struct replay_file *rf, __u64 ns, struct mctp_stats *s);
+static void usage(const char *prog);
+
+/* FUNCTIONS =================================================================*/
+
+int main(int argc, char **argv)
+{
+	struct replay_file rf;
+	struct replay r;
+	struct mctp *m;
+	struct mctp_stats stats;
+	struct sockaddr_in sin;
+	struct timeval tv;
+	struct mctp_pkt pkt;
+	pthread_t pt;
+	const char *filter;
+	__u8 batch[REPLAY_BATCH * sizeof(struct mctp_pkt)];
+	__u64 start, end, base, loop_start, deadline;
+	double speed;
+	long loops, l;
+	size_t i, n, k;
+	unsigned window, slack, reqs;
+	int opt, rpq, port, eid, wait_msec, one;
+	__u32 addr;
+
+	memset(&rf, 0, sizeof(rf));
+	memset(&r, 0, sizeof(r));
+	pthread_mutex_init(&r.mtx, NULL);
+	m = NULL;
+	rpq = 0;
+	port = REPLAY_PORT;
+	addr = htonl(INADDR_LOOPBACK);
+	speed = 1.0;
+	loops = 1;
+	filter = REPLAY_FILTER;
+	eid = -1;
+	wait_msec = REPLAY_WAIT_MSEC;
+	window = REPLAY_WINDOW;
+
+	while ( (opt = getopt(argc, argv, "hra:p:s:n:f:e:t:w:")) != -1 )
+	{
+		switch (opt)
+		{
+			case 'r': 	rpq = 1; 									break;
+			case 'a': 	addr = inet_addr(optarg); 					break;
+			case 'p': 	port = atoi(optarg); 						break;
+			case 's': 	speed = atof(optarg); 						break;
+			case 'n': 	loops = atol(optarg); 						break;
+			case 'f': 	filter = optarg; 							break;
+			case 'e': 	eid = strtol(optarg, NULL, 0); 				break;
+			case 't': 	wait_msec = atoi(optarg); 					break;
+			case 'w': 	window = atoi(optarg); 						break;
+			default: 	usage(argv[0]); 							return 1;
+		}
+	}
+
+	if (optind >= argc || speed < 0 || loops < 1 || eid > 255)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (load(argv[optind], filter, &rf) != 0)
+		return 1;
+
+	if (rf.num == 0)
+	{
+		fprintf(stderr, "replay: no packets to replay\n");
+		return 1;
+	}
+
+	// Run a server to inject into. It sends its responses to the connection opened below
+	if (rpq)
+	{
+		m = mctp_init();
+		if (m == NULL || mctp_run(m, port, htonl(INADDR_LOOPBACK), MCRM_SERVER, 1, 1) != 0)
+		{
+			fprintf(stderr, "replay: server on port %d: %s\n", port, strerror(errno));
+			return 1;
+		}
+		addr = htonl(INADDR_LOOPBACK);
+	}
+
+	r.fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = addr;
+	sin.sin_port = htons(port);
+	for ( i = 0 ; connect(r.fd, (struct sockaddr*) &sin, sizeof(sin)) != 0 ; i++ )
+	{
+		if (!rpq || i == 100)
+		{
+			fprintf(stderr, "replay: connect to port %d: %s\n", port, strerror(errno));
+			return 1;
+		}
+		usleep(10000);
+	}
+	one = 1;
+	setsockopt(r.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	// Give up on a send after the wait time so a stalled server cannot hang the tool
+	tv.tv_sec = wait_msec / 1000;
+	tv.tv_usec = (wait_msec % 1000) * 1000;
+	setsockopt(r.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	for ( i = 0 ; rpq && m->num_conns == 0 && i < 100 ; i++ )
+		usleep(10000);
+
+	pthread_create(&pt, NULL, receiver, &r);
+
+	// Send the packets
+	start = now_ns();
+	loop_start = start;
+	for ( l = 0 ; l < loops && !r.closed ; l++ )
+	{
+		base = rf.pkts[0].ns;
+		for ( i = 0 ; i < rf.num ; i += n )
+		{
+			if (__atomic_load_n(&r.closed, __ATOMIC_ACQUIRE))
+			{
+				fprintf(stderr, "replay: connection closed by the server\n");
+				break;
+			}
+
+			if (speed > 0)
+			{
+				deadline = loop_start + (__u64) ((rf.pkts[i].ns - base) / speed);
+				wait_until(deadline);
+			}
+
+			// Requests that may be sent before the window is full
+			slack = (window > 0) ? wait_window(&r, window, wait_msec) : REPLAY_BATCH;
+
+			// Gather the packets due now. Only one at a time when pacing
+			for ( n = 0, reqs = 0 ; i + n < rf.num && n < REPLAY_BATCH ; n++ )
+			{
+				memcpy(&pkt, &rf.pkts[i + n].pkt, sizeof(pkt));
+				if (pkt.hdr.eom && pkt.hdr.owner && reqs++ == slack)
+					break;
+				if (eid >= 0)
+					pkt.hdr.dest = eid;
+				memcpy(&batch[n * sizeof(pkt)], &pkt, sizeof(pkt));
+				if (speed > 0)
+				{
+					n++;
+					break;
+				}
+			}
+
+			// Track before sending so a fast response finds its request
+			for ( k = 0 ; k < n ; k++ )
+				track(&r, (struct mctp_pkt*) &batch[k * sizeof(pkt)], now_ns());
+
+			if (rpq)
+			{
+				for ( k = 0 ; k < n ; k++ )
+					if (inject(&r, m, (struct mctp_pkt*) &batch[k * sizeof(pkt)], wait_msec) != 0)
+						r.inject_drops++;
+			}
+			else if (send_all(r.fd, batch, n * sizeof(pkt)) != 0)
+			{
+				// Part of a packet may have been written, so nothing more can be sent on the stream
+				fprintf(stderr, "replay: send: %s\n", strerror(errno));
+				r.send_errors += n;
+				__atomic_store_n(&r.closed, 1, __ATOMIC_RELEASE);
+				shutdown(r.fd, SHUT_RDWR);
+				break;
+			}
+
+			r.packets += n;
+		}
+
+		loop_start = now_ns();
+	}
+	end = now_ns();
+
+	// Wait for the responses that are still outstanding
+	deadline = now_ns() + wait_msec * 1000000ULL;
+	while (now_ns() < deadline && !__atomic_load_n(&r.closed, __ATOMIC_ACQUIRE))
+	{
+		pthread_mutex_lock(&r.mtx);
+		n = r.lat_num + r.untracked + r.expired;
+		pthread_mutex_unlock(&r.mtx);
+		if (n >= r.requests)
+			break;
+		usleep(1000);
+	}
+
+	// The server resets its counters once the connection closes
+	if (m != NULL)
+		mctp_get_stats(m, &stats);
+
+	__atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+	shutdown(r.fd, SHUT_RDWR);
+	pthread_join(pt, NULL);
+
+	report(&r, &rf, end - start, (m != NULL) ? &stats : NULL);
+
+	close(r.fd);
+	if (m != NULL)
+	{
+		mctp_stop(m);
+		mctp_free(m);
+	}
+
+	return 0;
+}
+
+/**
+ * Read a capture file into memory, keeping the packets that match the filter
+ */
+static int load(const char *path, const char *filter, struct replay_file *rf)
+{
+	struct mctp_filter f;
+	struct stat st;
+	__u8 *buf;
+	FILE *fp;
+	__u32 magic;
+	int rv;
+
+	if (mctp_filter_compile(&f, filter) != 0)
+	{
+		fprintf(stderr, "replay: filter error at offset %d: %s\n", f.err, filter);
+		return 1;
+	}
+
+	fp = fopen(path, "r");
+	if (fp == NULL || fstat(fileno(fp), &st) != 0)
+	{
+		fprintf(stderr, "replay: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	buf = malloc(st.st_size + 1);
+	if (buf == NULL || fread(buf, 1, st.st_size, fp) != (size_t) st.st_size || st.st_size < 4)
+	{
+		fprintf(stderr, "replay: %s: could not read\n", path);
+		fclose(fp);
+		return 1;
+	}
+	fclose(fp);
+
+	memcpy(&magic, buf, sizeof(magic));
+	if (magic == PCAPNG_SHB)
+		rv = load_pcapng(buf, st.st_size, &f, rf);
+	else
+		rv = load_pcap(buf, st.st_size, &f, rf);
+
+	if (rv != 0)
+		fprintf(stderr, "replay: %s: not a pcap or pcapng file of LINKTYPE_MCTP packets\n", path);
+
+	free(buf);
+
+	return rv;
+}
+
+/**
+ * Parse a classic pcap file
+ */
+static int load_pcap(const __u8 *buf, size_t len, struct mctp_filter *f, struct replay_file *rf)
+{
+	__u32 magic, linktype, sec, frac, caplen;
+	size_t off;
+	int swap, nsec;
+
+#define U32(p) (swap ? bswap_32(*(const __u32*) (p)) : *(const __u32*) (p))
+
+	if (len < 24)
+		return 1;
+
+	memcpy(&magic, buf, sizeof(magic));
+	swap = 0;
+	if (magic == bswap_32(PCAP_MAGIC_USEC) || magic == bswap_32(PCAP_MAGIC_NSEC))
+	{
+		swap = 1;
+		magic = bswap_32(magic);
+	}
+	if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC)
+		return 1;
+	nsec = (magic == PCAP_MAGIC_NSEC);
+
+	linktype = U32(buf + 20) & 0x0FFFFFFF;
+	if (linktype != MCTP_LINKTYPE)
+		return 1;
+
+	for ( off = 24 ; off + 16 <= len ; off += 16 + caplen )
+	{
+		sec = U32(buf + off);
+		frac = U32(buf + off + 4);
+		caplen = U32(buf + off + 8);
+		if (off + 16 + caplen > len)
+			break;
+
+		add_pkt(rf, f, sec * 1000000000ULL + (nsec ? frac : frac * 1000ULL), buf + off + 16, caplen);
+	}
+
+#undef U32
+
+	return 0;
+}
+
+/**
+ * Parse a pcapng file. Enhanced Packet Blocks of LINKTYPE_MCTP interfaces are loaded
+ */
+static int load_pcapng(const __u8 *buf, size_t len, struct mctp_filter *f, struct replay_file *rf)
+{
+	struct replay_iface ifaces[REPLAY_IFACE_MAX];
+	struct replay_iface *ifc;
+	__u32 type, blen, iface, caplen, order;
+	__u64 ts;
+	size_t off, o;
+	unsigned num_ifaces, code, olen, res, k;
+	int swap;
+
+#define U16(p) (swap ? bswap_16(*(const __u16*) (p)) : *(const __u16*) (p))
+#define U32(p) (swap ? bswap_32(*(const __u32*) (p)) : *(const __u32*) (p))
+
+	swap = 0;
+	num_ifaces = 0;
+
+	for ( off = 0 ; off + 12 <= len ; off += blen )
+	{
+		memcpy(&type, buf + off, sizeof(type));
+
+		// A Section Header Block sets the byte order of the blocks after it
+		if (type == PCAPNG_SHB)
+		{
+			memcpy(&order, buf + off + 8, sizeof(order));
+			if (order == PCAPNG_BYTE_ORDER)
+				swap = 0;
+			else if (order == bswap_32(PCAPNG_BYTE_ORDER))
+				swap = 1;
+			else
+				return 1;
+			num_ifaces = 0;
+		}
+
+		type = U32(buf + off);
+		blen = U32(buf + off + 4);
+		if (blen < 12 || (blen & 3) != 0 || off + blen > len)
+			break;
+
+		if (type == PCAPNG_IDB && blen >= 20 && num_ifaces < REPLAY_IFACE_MAX)
+		{
+			ifc = &ifaces[num_ifaces++];
+			ifc->linktype = U16(buf + off + 8);
+			ifc->div = 1000;
+			ifc->mul = 1;
+
+			// Options follow the fixed fields. Only the time stamp resolution matters
+			for ( o = off + 16 ; o + 4 <= off + blen - 4 ; o += 4 + ((olen + 3) & ~3u) )
+			{
+				code = U16(buf + o);
+				olen = U16(buf + o + 2);
+				if (code == 0)
+					break;
+				if (code != PCAPNG_OPT_IF_TSRESOL || olen < 1)
+					continue;
+
+				res = buf[o + 4];
+				ifc->div = 1;
+				ifc->mul = 1;
+				if (res & 0x80)
+				{
+					// Negative power of 2. Approximated with a divide
+					ifc->div = 1ULL << ((res & 0x7F) < 63 ? (res & 0x7F) : 63);
+					ifc->mul = 1000000000ULL;
+				}
+				else if (res <= 9)
+					for ( k = res ; k < 9 ; k++ )
+						ifc->mul *= 10;
+				else
+					for ( k = 9 ; k < res && k < 18 ; k++ )
+						ifc->div *= 10;
+			}
+		}
+		else if (type == PCAPNG_EPB && blen >= 32)
+		{
+			iface = U32(buf + off + 8);
+			ts = ((__u64) U32(buf + off + 12) << 32) | U32(buf + off + 16);
+			caplen = U32(buf + off + 20);
+			if (28 + caplen > blen)
+				continue;
+
+			if (iface >= num_ifaces || ifaces[iface].linktype != MCTP_LINKTYPE)
+			{
+				rf->other_link++;
+				continue;
+			}
+
+			ifc = &ifaces[iface];
+			add_pkt(rf, f, (ifc->div > 1) ? ts / ifc->div * ifc->mul : ts * ifc->mul, buf + off + 28, caplen);
+		}
+	}
+
+#undef U16
+#undef U32
+
+	return 0;
+}
+
+/**
+ * Keep a packet if it is whole and matches the filter
+ */
+static void add_pkt(struct replay_file *rf, struct mctp_filter *f, __u64 ns, const __u8 *data, __u32 caplen)
+{
+	static __s16 types[256][8];
+	static int init;
+	struct mctp_pkt *pkt;
+	struct replay_pkt *p;
+	int type;
+
+	if (!init)
+	{
+		memset(types, 0xFF, sizeof(types));
+		init = 1;
+	}
+
+	if (caplen < sizeof(struct mctp_pkt))
+	{
+		rf->truncated++;
+		return;
+	}
+
+	// Remember the type of each message so the filter can see it in every packet
+	pkt = (struct mctp_pkt*) data;
+	if (pkt->hdr.som)
+		types[pkt->hdr.src][pkt->hdr.tag] = MCTP_PKT_TYPE(pkt);
+	type = types[pkt->hdr.src][pkt->hdr.tag];
+
+	if (!mctp_filter_run(f, pkt, type))
+	{
+		rf->filtered++;
+		return;
+	}
+
+	if (rf->num == rf->cap)
+	{
+		rf->cap = (rf->cap == 0) ? 4096 : rf->cap * 2;
+		p = realloc(rf->pkts, rf->cap * sizeof(struct replay_pkt));
+		if (p == NULL)
+		{
+			rf->cap = rf->num;
+			return;
+		}
+		rf->pkts = p;
+	}
+
+	p = &rf->pkts[rf->num++];
+	p->ns = ns;
+	memcpy(&p->pkt, data, sizeof(struct mctp_pkt));
+}
+
+/**
+ * Read the responses from the server and match them to the requests
+ */
+static void *receiver(void *arg)
+{
+	struct replay *r = arg;
+	struct mctp_pkt pkt;
+	struct replay_fifo *f;
+	__u64 now, t;
+	size_t got;
+	ssize_t rv;
+
+	while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE))
+	{
+		for ( got = 0 ; got < sizeof(pkt) ; got += rv )
+		{
+			rv = recv(r->fd, (__u8*) &pkt + got, sizeof(pkt) - got, 0);
+			if (rv <= 0)
+			{
+				__atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+				return NULL;
+			}
+		}
+		now = now_ns();
+
+		if (!pkt.hdr.eom || pkt.hdr.owner)
+			continue;
+
+		// A response comes from the EID the request was sent to
+		pthread_mutex_lock(&r->mtx);
+		r->responses++;
+		f = r->fifo[pkt.hdr.src][pkt.hdr.tag];
+		if (f == NULL || f->head == f->tail)
+		{
+			r->unmatched++;
+		}
+		else
+		{
+			t = f->sent[f->tail++ % REPLAY_TAG_DEPTH];
+			if (r->lat_num == r->lat_cap)
+			{
+				r->lat_cap = (r->lat_cap == 0) ? 4096 : r->lat_cap * 2;
+				r->lat = realloc(r->lat, r->lat_cap * sizeof(__u64));
+			}
+			if (r->lat != NULL)
+				r->lat[r->lat_num++] = now - t;
+		}
+		pthread_mutex_unlock(&r->mtx);
+	}
+
+	return NULL;
+}
+
+/**
+ * Record the send time of a request once its last packet is sent
+ */
+static void track(struct replay *r, struct mctp_pkt *pkt, __u64 now)
+{
+	struct replay_fifo **f;
+
+	if (!pkt->hdr.eom || !pkt->hdr.owner)
+		return;
+
+	f = &r->fifo[pkt->hdr.dest][pkt->hdr.tag];
+
+	pthread_mutex_lock(&r->mtx);
+	r->requests++;
+	if (*f == NULL)
+		*f = calloc(1, sizeof(struct replay_fifo));
+	if (*f == NULL || (*f)->head - (*f)->tail >= REPLAY_TAG_DEPTH)
+		r->untracked++;
+	else
+		(*f)->sent[(*f)->head++ % REPLAY_TAG_DEPTH] = now;
+	pthread_mutex_unlock(&r->mtx);
+}
+
+/**
+ * Give up on the oldest request awaiting a response
+ *
+ * It is removed so a late response to it is counted as unmatched instead of
+ * being matched to a later request on its EID and tag. Called with r->mtx held
+ */
+static void expire(struct replay *r)
+{
+	struct replay_fifo *f, *oldest;
+	unsigned eid, tag;
+
+	oldest = NULL;
+	for ( eid = 0 ; eid < 256 ; eid++ )
+	{
+		for ( tag = 0 ; tag < 8 ; tag++ )
+		{
+			f = r->fifo[eid][tag];
+			if (f == NULL || f->head == f->tail)
+				continue;
+			if (oldest == NULL || f->sent[f->tail % REPLAY_TAG_DEPTH] < oldest->sent[oldest->tail % REPLAY_TAG_DEPTH])
+				oldest = f;
+		}
+	}
+
+	if (oldest != NULL)
+		oldest->tail++;
+	r->expired++;
+}
+
+/**
+ * Wait until fewer than window requests await a response
+ *
+ * A request that has waited longer than wait_msec is given up on so a server
+ * that drops requests does not stop the replay
+ *
+ * @return 	Number of requests that may be sent
+ */
+static unsigned wait_window(struct replay *r, unsigned window, int wait_msec)
+{
+	__u64 deadline, done;
+	unsigned out;
+
+	deadline = now_ns() + wait_msec * 1000000ULL;
+	while (1)
+	{
+		pthread_mutex_lock(&r->mtx);
+		done = r->lat_num + r->untracked + r->expired;
+		out = (r->requests > done) ? r->requests - done : 0;
+		if (out >= window && now_ns() >= deadline)
+		{
+			expire(r);
+			deadline = now_ns() + wait_msec * 1000000ULL;
+		}
+		pthread_mutex_unlock(&r->mtx);
+
+		if (out < window || __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+			return (out < window) ? window - out : 1;
+
+		sched_yield();
+	}
+}
+
+/**
+ * Write all of a buffer to a stream socket
+ *
+ * @return 	0 upon success, -1 if the connection failed or a write timed out and sets errno
+ */
+static int send_all(int fd, const void *buf, size_t len)
+{
+	ssize_t rv;
+	size_t off;
+
+	for ( off = 0 ; off < len ; off += rv )
+	{
+		rv = send(fd, (const __u8*) buf + off, len - off, MSG_NOSIGNAL);
+		if (rv < 0 && errno == EINTR)
+			rv = 0;
+		else if (rv <= 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Put a packet on the Receive Packet Queue, retrying while the queue or pool is full
+ *
+ * @return 	0 upon success, 1 if the packet could not be injected within wait_msec
+ */
+static int inject(struct replay *r, struct mctp *m, struct mctp_pkt *pkt, int wait_msec)
+{
+	__u64 deadline;
+
+	deadline = now_ns() + wait_msec * 1000000ULL;
+	while (mctp_inject(m, pkt, 0) != 0)
+	{
+		if (errno != ENOBUFS || now_ns() >= deadline)
+			return 1;
+		r->retries++;
+		usleep(10);
+	}
+
+	return 0;
+}
+
+/**
+ * Sleep, then spin, until CLOCK_MONOTONIC reaches ns
+ */
+static void wait_until(__u64 ns)
+{
+	struct timespec ts;
+	__u64 now;
+
+	now = now_ns();
+	if (ns > now + REPLAY_SPIN_NSEC)
+	{
+		ts.tv_sec = (ns - REPLAY_SPIN_NSEC) / 1000000000ULL;
+		ts.tv_nsec = (ns - REPLAY_SPIN_NSEC) % 1000000000ULL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	while (now_ns() < ns);
+}
+
+static __u64 now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	__u64 x = *(const __u64*) a, y = *(const __u64*) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Print throughput, latency distribution and drops
+ */
+static void report(struct replay *r, struct replay_file *rf, __u64 ns, struct mctp_stats *s)
+{
+	static const double pct[] = { 50, 90, 99, 99.9 };
+	__u64 hist[MCTP_LAT_BUCKETS];
+	__u64 sum, us;
+	double sec;
+	size_t i;
+	int b;
+
+	sec = ns / 1e9;
+	if (sec <= 0)
+		sec = 1e-9;
+
+	printf("loaded     %zu packets, skipped %llu other link type, %llu truncated, %llu filtered\n",
+		rf->num, (unsigned long long) rf->other_link, (unsigned long long) rf->truncated, (unsigned long long) rf->filtered);
+	printf("sent       %llu packets in %.3f s: %.0f pkt/s %.0f req/s %.2f MB/s\n",
+		(unsigned long long) r->packets, sec, r->packets / sec, r->requests / sec, r->packets * sizeof(struct mctp_pkt) / sec / 1e6);
+	printf("requests   %llu, responses %llu, lost %llu, unmatched %llu, untracked %llu\n",
+		(unsigned long long) r->requests, (unsigned long long) r->responses,
+		(unsigned long long) (r->requests > r->lat_num + r->untracked ? r->requests - r->lat_num - r->untracked : 0),
+		(unsigned long long) r->unmatched, (unsigned long long) r->untracked);
+	printf("drops      %llu send errors, %llu not injected, %llu queue full retries, %llu expired in the window\n",
+		(unsigned long long) r->send_errors, (unsigned long long) r->inject_drops,
+		(unsigned long long) r->retries, (unsigned long long) r->expired);
+
+	if (r->lat_num > 0)
+	{
+		qsort(r->lat, r->lat_num, sizeof(__u64), cmp_u64);
+
+		sum = 0;
+		memset(hist, 0, sizeof(hist));
+		for ( i = 0 ; i < r->lat_num ; i++ )
+		{
+			sum += r->lat[i];
+			us = r->lat[i] / 1000;
+			for ( b = 0 ; b < MCTP_LAT_BUCKETS - 1 && us >= (1ULL << b) ; b++ );
+			hist[b]++;
+		}
+
+		printf("latency us min %.1f", r->lat[0] / 1e3);
+		for ( i = 0 ; i < sizeof(pct) / sizeof(pct[0]) ; i++ )
+			printf(" p%g %.1f", pct[i], r->lat[(size_t) ((r->lat_num - 1) * pct[i] / 100)] / 1e3);
+		printf(" max %.1f mean %.1f\n", r->lat[r->lat_num - 1] / 1e3, sum / r->lat_num / 1e3);
+
+		for ( b = 0 ; b < MCTP_LAT_BUCKETS ; b++ )
+			if (hist[b] > 0)
+				printf("  < %8llu us %10llu\n", (unsigned long long) (1ULL << b), (unsigned long long) hist[b]);
+	}
+
+	if (s != NULL)
+	{
+		printf("server     rx %llu messages, %llu dropped packets, tx %llu packets, %llu dropped\n",
+			(unsigned long long) s->rx_messages, (unsigned long long) s->rx_dropped_packets,
+			(unsigned long long) s->tx_packets, (unsigned long long) s->tx_dropped_packets);
+	}
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-r] [-a addr] [-p port] [-s speed] [-n loops] [-f filter] [-e eid] [-t msec] [-w num] file\n", prog);
+	printf("  -r         Run a server and inject into its Receive Packet Queue\n");
+	printf("  -a addr    Address of the server. Default 127.0.0.1\n");
+	printf("  -p port    Port of the server. Default %d\n", REPLAY_PORT);
+	printf("  -s speed   1 as recorded, 2 twice as fast, 0 as fast as possible. Default 1\n");
+	printf("  -n loops   Times to replay the capture. Default 1\n");
+	printf("  -f filter  Packets to replay. Default \"%s\" (requests). \"1\" for every packet\n", REPLAY_FILTER);
+	printf("  -e eid     Rewrite the destination EID of every packet\n");
+	printf("  -t msec    Time to wait for a response, send or injection. Default %d\n", REPLAY_WAIT_MSEC);
+	printf("  -w num     Requests awaiting a response before waiting. 0 for no limit. Default %d\n", REPLAY_WINDOW);
+	printf("  file       pcap or pcapng capture of LINKTYPE_MCTP packets\n");
+}
+
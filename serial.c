@@ -0,0 +1,677 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		serial.c
+ *
+ * @brief 		Code file for the serial transport of the MCTP transport library
+ *
+ * @details 	Implements the MCTP Serial Transport Binding (DSP0253) over a
+ * 				UART or pty. Each MCTP packet is carried in its own frame:
+ *
+ * 				Flag | Revision | Byte Count | MCTP Packet | FCS high | FCS low | Flag
+ *
+ * 				Flag and escape bytes inside a frame are sent as the escape
+ * 				byte followed by the byte XOR 0x20. The FCS is the FCS-16 of
+ * 				RFC 1662 computed over the revision, byte count and packet
+ * 				before escaping.
+ *
+ * 				The escape scan finds the next flag or escape byte 16 bytes at
+ * 				a time with SSE2, so runs of ordinary bytes are copied with
+ * 				memcpy(). The FCS uses slicing-by-8 tables. A frame is only 72
+ * 				bytes, which is too short to amortize carry-less multiply
+ * 				folding.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* pid_t
+ */
+#include <sys/types.h>
+
+/* read()
+ * write()
+ * gettid()
+ */
+#include <unistd.h>
+
+/* open()
+ * O_RDWR
+ * O_NOCTTY
+ */
+#include <fcntl.h>
+
+/* memcpy()
+ * strlen()
+ * strncpy()
+ */
+#include <string.h>
+
+/* errno
+ */
+#include <errno.h>
+
+/* struct termios
+ * tcgetattr()
+ * tcsetattr()
+ * cfmakeraw()
+ * cfsetspeed()
+ */
+#include <termios.h>
+
+/* struct pollfd
+ * poll()
+ */
+#include <poll.h>
+
+/* pthread_once_t
+ * pthread_once()
+ */
+#include <pthread.h>
+
+/* __u8
+ * __u16
+ * __u64
+ */
+#include <linux/types.h>
+
+#if defined(__x86_64__)
+/* _mm_loadu_si128()
+ * _mm_cmpeq_epi8()
+ * _mm_movemask_epi8()
+ */
+ #include <emmintrin.h>
+#endif
+
+#include <timeutils.h>
+#include <ptrqueue.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+//#define MCTP_VERBOSE
+#ifdef MCTP_VERBOSE
+ #define TINIT 			 self->loop=0; self->threadid = gettid();
+ #define TENTER 		              if (self->m->verbose & MCTP_VERBOSE_THREADS) 	MCTP_LOG("%d:%s Enter\n", 				self->threadid, __FUNCTION__);
+ #define TLOOP(i) 		self->loop=i; if (self->m->verbose & MCTP_VERBOSE_STEPS)    MCTP_LOG("%d:%s LOOP: %u\n", 				self->threadid, __FUNCTION__, self->loop);
+ #define TINT32(k, i)                 if (self->m->verbose & MCTP_VERBOSE_STEPS)    MCTP_LOG("%d:%s LOOP: %u %s: %d\n",		self->threadid, __FUNCTION__, self->loop, k, i);
+ #define TEXIT(rc) 			  		  if (self->m->verbose & MCTP_VERBOSE_THREADS) 	MCTP_LOG("%d:%s Exit: %d\n", 				self->threadid, __FUNCTION__,rc);
+ #define TERR(k, i)                   if (self->m->verbose & MCTP_VERBOSE_ERROR)    MCTP_LOG("%d:%s LOOP: %u ERR: %s: %d\n",	self->threadid, __FUNCTION__, self->loop, k, i);
+#else
+ #define TINIT 			self->loop = 0;	self->threadid = gettid();
+ #define TENTER
+ #define TLOOP(i) 		 self->loop=i;
+ #define TINT32(m,i)
+ #define TERR(k, i)
+ #define TEXIT(rc)
+#endif // MCTP_VERBOSE
+
+// DSP0253 framing bytes
+#define SERIAL_FLAG 					0x7E
+#define SERIAL_ESC 						0x7D
+#define SERIAL_XOR 						0x20
+#define SERIAL_REVISION 				0x01
+
+// Reflected FCS-16 polynomial (x^16 + x^12 + x^5 + 1)
+#define FCS16_POLY 						0x8408
+
+// Revision, byte count, packet and FCS of a frame before escaping
+#define SERIAL_FRAME_LEN 				(2 + MCLN_PKT + 2)
+// Both flags and every byte between them escaped
+#define SERIAL_FRAME_MAX 				(2 + 2 * SERIAL_FRAME_LEN)
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+static __u16 fcs16_table[8][256];
+
+// Builds the tables once, even when the first calls race
+static pthread_once_t fcs16_once = PTHREAD_ONCE_INIT;
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Build the FCS-16 slicing-by-8 tables
+ */
+static void mctp_fcs16_init()
+{
+	__u16 fcs;
+	int i, j;
+
+	for ( i = 0 ; i < 256 ; i++ )
+	{
+		fcs = i;
+		for ( j = 0 ; j < 8 ; j++ )
+			fcs = (fcs & 1) ? (fcs >> 1) ^ FCS16_POLY : (fcs >> 1);
+		fcs16_table[0][i] = fcs;
+	}
+
+	for ( i = 0 ; i < 256 ; i++ )
+		for ( j = 1 ; j < 8 ; j++ )
+			fcs16_table[j][i] = fcs16_table[0][fcs16_table[j-1][i] & 0xFF] ^ (fcs16_table[j-1][i] >> 8);
+}
+
+/**
+ * Compute the FCS-16 (RFC 1662) of a buffer
+ *
+ * The FCS can be computed incrementally by passing the value returned for
+ * the prior part of the frame as fcs. Use 0 for the first part.
+ *
+ * @param fcs 	FCS of the preceding data, 0 to start
+ * @param buf 	Data to add to the FCS
+ * @param len 	Length of data in bytes
+ * @return 		FCS-16 of all data so far
+ */
+__u16 mctp_fcs16(__u16 fcs, const void *buf, size_t len)
+{
+	const __u8 *p;
+	__u64 w;
+
+	pthread_once(&fcs16_once, mctp_fcs16_init);
+
+	p = (const __u8*) buf;
+	fcs = ~fcs;
+
+	while (len >= 8)
+	{
+		memcpy(&w, p, 8);
+		w ^= fcs;
+		fcs = fcs16_table[7][ w        & 0xFF] ^ fcs16_table[6][(w >>  8) & 0xFF]
+			^ fcs16_table[5][(w >> 16) & 0xFF] ^ fcs16_table[4][(w >> 24) & 0xFF]
+			^ fcs16_table[3][(w >> 32) & 0xFF] ^ fcs16_table[2][(w >> 40) & 0xFF]
+			^ fcs16_table[1][(w >> 48) & 0xFF] ^ fcs16_table[0][ w >> 56        ];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		fcs = fcs16_table[0][(fcs ^ *p++) & 0xFF] ^ (fcs >> 8);
+
+	return ~fcs;
+}
+
+/**
+ * Find the first flag or escape byte in a buffer
+ *
+ * @return index of the byte, len if there is none
+ */
+static size_t mctp_serial_scan(const __u8 *buf, size_t len)
+{
+	size_t i;
+
+	i = 0;
+
+#if defined(__x86_64__)
+	{
+		__m128i flag, esc, v;
+		int mask;
+
+		flag = _mm_set1_epi8(SERIAL_FLAG);
+		esc = _mm_set1_epi8(SERIAL_ESC);
+
+		for ( ; i + 16 <= len ; i += 16 )
+		{
+			v = _mm_loadu_si128((const __m128i*) (buf + i));
+			mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc)));
+			if (mask != 0)
+				return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+
+	for ( ; i < len ; i++ )
+		if (buf[i] == SERIAL_FLAG || buf[i] == SERIAL_ESC)
+			return i;
+
+	return len;
+}
+
+/**
+ * Copy a buffer and escape its flag and escape bytes
+ *
+ * @param dst 	Must hold 2 * len bytes
+ * @return 		Number of bytes written to dst
+ */
+static size_t mctp_serial_stuff(__u8 *dst, const __u8 *src, size_t len)
+{
+	size_t i, n, o;
+
+	i = 0;
+	o = 0;
+	while (i < len)
+	{
+		n = mctp_serial_scan(src + i, len - i);
+		memcpy(dst + o, src + i, n);
+		o += n;
+		i += n;
+
+		if (i < len)
+		{
+			dst[o++] = SERIAL_ESC;
+			dst[o++] = src[i++] ^ SERIAL_XOR;
+		}
+	}
+
+	return o;
+}
+
+/**
+ * Write one frame carrying a packet
+ *
+ * @param dst 	Must hold SERIAL_FRAME_MAX bytes
+ * @return 		Number of bytes written to dst
+ */
+static size_t mctp_serial_frame(__u8 *dst, struct mctp_pkt *pkt)
+{
+	__u8 hdr[2], fcs[2];
+	__u16 f;
+	size_t o;
+
+	hdr[0] = SERIAL_REVISION;
+	hdr[1] = sizeof(struct mctp_pkt);
+
+	f = mctp_fcs16(0, hdr, sizeof(hdr));
+	f = mctp_fcs16(f, pkt, sizeof(struct mctp_pkt));
+	fcs[0] = f >> 8;
+	fcs[1] = f & 0xFF;
+
+	o = 0;
+	dst[o++] = SERIAL_FLAG;
+	o += mctp_serial_stuff(dst + o, hdr, sizeof(hdr));
+	o += mctp_serial_stuff(dst + o, (__u8*) pkt, sizeof(struct mctp_pkt));
+	o += mctp_serial_stuff(dst + o, fcs, sizeof(fcs));
+	dst[o++] = SERIAL_FLAG;
+
+	return o;
+}
+
+/**
+ * Check a received frame and return its packet
+ *
+ * @param frame Unescaped bytes between the flags
+ * @return 		Pointer to the packet in frame, NULL if the frame is invalid
+ */
+static struct mctp_pkt *mctp_serial_check(__u8 *frame, size_t len)
+{
+	__u16 fcs;
+
+	if (len != SERIAL_FRAME_LEN || frame[0] != SERIAL_REVISION || frame[1] != sizeof(struct mctp_pkt))
+		return NULL;
+
+	fcs = mctp_fcs16(0, frame, len - 2);
+	if ( (frame[len - 2] != (fcs >> 8)) || (frame[len - 1] != (fcs & 0xFF)) )
+		return NULL;
+
+	return (struct mctp_pkt*) (frame + 2);
+}
+
+/**
+ * Write all of a buffer to a serial line
+ *
+ * @return 0 upon success, 1 upon error
+ */
+static int mctp_serial_write(int fd, const __u8 *buf, size_t len)
+{
+	ssize_t rv;
+
+	while (len > 0)
+	{
+		rv = write(fd, buf, len);
+		if (rv < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (rv <= 0)
+			return 1;
+
+		buf += rv;
+		len -= rv;
+	}
+
+	return 0;
+}
+
+/**
+ * Select the serial transport and the device it uses
+ *
+ * Both ends of a serial line may run as either server or client. The port and
+ * address passed to mctp_run() are not used. Must be called before mctp_run()
+ *
+ * @param m 	struct mctp*
+ * @param dev 	Path of the UART or pty
+ * @param baud 	Line rate in bits per second. 0 for MCTP_SERIAL_DEFAULT_BAUD
+ * @return 		0 upon success, 1 if invalid or already running
+ */
+int mctp_set_serial(struct mctp *m, const char *dev, unsigned baud)
+{
+	if (m->all_threads_started || dev == NULL || strlen(dev) >= MCTP_SERIAL_PATH_MAX)
+		return 1;
+
+	strncpy(m->serial_dev, dev, MCTP_SERIAL_PATH_MAX - 1);
+	m->baud = baud ? baud : MCTP_SERIAL_DEFAULT_BAUD;
+
+	return mctp_set_transport(m, MCTR_SERIAL);
+}
+
+/**
+ * Open the serial device of an mctp object as m->sock
+ *
+ * The line is set to raw 8N1 at the configured rate. A device that is not a
+ * terminal is used as is.
+ *
+ * @return 0 upon success, 1 upon error
+ */
+int mctp_serial_open(struct mctp *m)
+{
+	struct termios tio;
+	speed_t speed;
+
+	switch (m->baud)
+	{
+		case 9600: 		speed = B9600; 		break;
+		case 19200: 	speed = B19200; 	break;
+		case 38400: 	speed = B38400; 	break;
+		case 57600: 	speed = B57600; 	break;
+		case 115200: 	speed = B115200; 	break;
+		case 230400: 	speed = B230400; 	break;
+		case 460800: 	speed = B460800; 	break;
+		case 921600: 	speed = B921600; 	break;
+		case 1000000: 	speed = B1000000; 	break;
+		case 2000000: 	speed = B2000000; 	break;
+		case 3000000: 	speed = B3000000; 	break;
+		case 4000000: 	speed = B4000000; 	break;
+		default:
+			errno = EINVAL;
+			return 1;
+	}
+
+	m->sock = open(m->serial_dev, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (m->sock < 0)
+		return 1;
+
+	if (tcgetattr(m->sock, &tio) != 0)
+		return 0;
+
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
+	cfsetspeed(&tio, speed);
+
+	if (tcsetattr(m->sock, TCSANOW, &tio) != 0)
+	{
+		close(m->sock);
+		m->sock = -1;
+		return 1;
+	}
+
+	tcflush(m->sock, TCIOFLUSH);
+
+	return 0;
+}
+
+/**
+ * Serial Socket Reader Thread
+ *
+ * Replaces mctp_socket_reader() when the serial transport is selected
+ *
+ * @param arg This is a void * but will only ever be a struct socket_reader*
+ *
+ * STEPS
+ * 1: Wait for bytes from the line
+ * 2: Read the bytes from the line
+ * 3: Unescape the bytes into the current frame
+ * 4: Post the packet of each valid frame to the Receive Packet Queue (RPQ)
+ */
+void *mctp_serial_reader(void *arg)
+{
+	struct socket_reader *self;
+	struct mctp_pkt_wrapper *pw;
+	struct mctp_pkt *pkt;
+	struct pollfd pfd;
+	__u8 rx[MCTP_SERIAL_RX_SIZE];
+	__u8 frame[SERIAL_FRAME_LEN];
+	size_t i, n, run, len;
+	int rv, esc, hunt;
+
+	// Initialize variables
+	self = (struct socket_reader*) arg;
+	TINIT
+	len = 0;
+	esc = 0;
+
+	// Bytes before the first flag are the tail of a frame sent before we started
+	hunt = 1;
+
+	TENTER
+
+	// Thread Loop
+	do
+	{
+		mctp_shm_pub_sr(self);
+
+		TLOOP(1) // STEP 1: Wait for bytes from the line
+		// A read() of a serial line is not woken by shutdown(). Check for a stop periodically
+		pfd.fd = self->m->conn;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		rv = poll(&pfd, 1, MCTP_SERIAL_POLL_MSEC);
+		if (rv < 0 && errno != EINTR)
+			goto end_thread;
+		if (rv <= 0)
+			continue;
+
+		TLOOP(2) // STEP 2: Read the bytes from the line
+		rv = read(self->m->conn, rx, sizeof(rx));
+		if (rv <= 0)
+		{
+			TINT32("read() returned rv", rv);
+			if (rv < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			goto end_thread;
+		}
+		n = rv;
+
+		TLOOP(3) // STEP 3: Unescape the bytes into the current frame
+		i = 0;
+		while (i < n)
+		{
+			// Skip to the next flag after a framing error
+			if (hunt)
+			{
+				run = mctp_serial_scan(rx + i, n - i);
+				i += run;
+				if (i < n && rx[i] == SERIAL_FLAG)
+					hunt = 0;
+				if (i < n)
+					i++;
+				len = 0;
+				esc = 0;
+				continue;
+			}
+
+			// A flag ends the current frame and starts the next. Empty frames are idle fill
+			if (rx[i] == SERIAL_FLAG)
+			{
+				i++;
+				if (len == 0)
+					continue;
+
+				TLOOP(4) // STEP 4: Post the packet of each valid frame to the Receive Packet Queue (RPQ)
+				pkt = esc ? NULL : mctp_serial_check(frame, len);
+				len = 0;
+				esc = 0;
+				if (pkt == NULL)
+				{
+					self->dropped_count++;
+					continue;
+				}
+
+				pw = mctp_pq_pop(self->m, MCPQ_PKTS, self->m->wait);
+				if (pw == NULL)
+					goto end_thread;
+
+				memcpy(&pw->pkt, pkt, sizeof(struct mctp_pkt));
+				pw->ts = mctp_now();
+				pw->conn = 0;
+				self->packet_count++;
+
+				if (mctp_pq_push(self->m, MCPQ_RPQ, pw) != 0)
+				{
+					self->dropped_count++;
+					mctp_pq_push(self->m, MCPQ_PKTS, pw);
+				}
+				continue;
+			}
+
+			if (rx[i] == SERIAL_ESC)
+			{
+				esc = 1;
+				i++;
+				continue;
+			}
+
+			// Copy the run of ordinary bytes. The first is unescaped if it follows an escape byte
+			run = mctp_serial_scan(rx + i, n - i);
+			if (len + run > sizeof(frame))
+			{
+				self->dropped_count++;
+				hunt = 1;
+				continue;
+			}
+
+			memcpy(frame + len, rx + i, run);
+			if (esc)
+				frame[len] ^= SERIAL_XOR;
+			esc = 0;
+			len += run;
+			i += run;
+		}
+
+	} while (self->m->stop_threads == 0);
+
+end_thread:
+
+	TEXIT( (self->m->stop_threads == 0) && (self->m->use_threads == 1) );
+
+	// If thread exited abnormally, request other threads to stop
+	if ( (self->m->stop_threads == 0) && (self->m->use_threads == 1) )
+		mctp_request_stop(self->m);
+
+	return NULL;
+}
+
+/**
+ * Serial Socket Writer Thread
+ *
+ * Replaces mctp_socket_writer() when the serial transport is selected
+ *
+ * @param arg This is a void * but will only ever be a struct socket_writer*
+ *
+ * STEPS
+ * 1: Get an mctp_action from the Transmit Packet Queue (TPQ)
+ * 2: Frame the packets of the action and write them to the line
+ * 3: Push completed mctp_actions onto the Action Completion Queue
+ */
+void *mctp_serial_writer(void *arg)
+{
+	struct socket_writer *self;
+	struct mctp_action *ma;
+	struct mctp_pkt_wrapper *pw, *head, *next;
+	__u8 tx[MCTP_ZC_IOV_MAX * SERIAL_FRAME_MAX];
+	size_t len;
+	int rv, req;
+
+	// Initialize variables
+	self = (struct socket_writer*) arg;
+	TINIT
+
+	TENTER
+
+	// Thread Loop
+	do
+	{
+		mctp_shm_pub_sw(self);
+
+	 	TLOOP(1) // LOOP 1: Get an mctp_action from the Transmit Packet Queue (TPQ)
+		ma = mctp_pq_pop(self->m, MCPQ_TPQ, self->m->wait);
+		if (ma == NULL)
+			goto end_thread;
+
+		// Pass a drain marker on to the Completion Thread, or exit if the threads are stopping
+		if (MCTP_IS_MARKER(self->m, ma))
+		{
+			if (self->m->drain >= MCDR_STOP)
+				goto end_thread;
+			mctp_pq_push(self->m, MCPQ_ACQ, ma);
+			continue;
+		}
+
+		// Take the packets from the action. They are returned to the pool once framed
+		head = ma->pw;
+		ma->pw = NULL;
+		req = (ma->rsp == NULL);
+		MCTP_TRACE(self->m, MCTE_WIRE, ma, head->pkt.hdr.dest, head->pkt.hdr.tag, req);
+		mctp_acct_tx(self->m, ma, head);
+
+		TLOOP(2) // LOOP 2: Frame the packets of the action and write them to the line
+		len = 0;
+		for ( pw = head ; pw != NULL ; pw = next )
+		{
+			next = pw->next;
+			len += mctp_serial_frame(tx + len, &pw->pkt);
+			self->packet_count++;
+			MCTP_PROBE(pkt_tx, 0, pw->pkt.hdr.dest, pw->pkt.hdr.src, MCTP_HDR_FLAGS(&pw->pkt.hdr));
+			MCTP_CAPTURE(self->m, MCCD_TX, mctp_now(), &pw->pkt, MCTP_PKT_TYPE(&head->pkt));
+
+			pw->next = NULL;
+			mctp_pq_push(self->m, MCPQ_PKTS, pw);
+		}
+
+		// A request may be completed by its response as soon as it is sent. Do not touch it after this
+		if (req)
+			__atomic_store_n(&ma->inflight, 0, __ATOMIC_RELEASE);
+
+		rv = mctp_serial_write(self->m->conn, tx, len);
+		if (rv != 0)
+		{
+			TERR("write() failed. errno:", errno);
+
+			// Fail a response and end. A request is resent by the Submission Thread
+			if (!req)
+			{
+				ma->completion_code = 1;
+				mctp_pq_push(self->m, MCPQ_ACQ, ma);
+			}
+			goto end_thread;
+		}
+		self->copied_count++;
+
+		TLOOP(3) // LOOP 3: Push mctp_action onto the Action Completion Queue
+		if (!req)
+		{
+			// Set time of mctp_action completion
+			ma->completed = mctp_now();
+
+			rv = mctp_pq_push(self->m, MCPQ_ACQ, ma);
+			if (rv != 0)
+				goto end_thread;
+		}
+
+	} while (self->m->stop_threads == 0);
+
+end_thread:
+
+	TEXIT( (self->m->stop_threads == 0) && (self->m->use_threads == 1) );
+
+	// If thread exited abnormally, request other threads to stop
+	if ( (self->m->stop_threads == 0) && (self->m->use_threads == 1) )
+		mctp_request_stop(self->m);
+
+	return NULL;
+}
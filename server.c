@@ -136,7 +136,7 @@ int fmapi_handler(struct mctp *m, struct mctp_action *ma)
 	mm = ma->req;
 
 	// : Get mctp_msg buffer for the response
-	mr = pq_pop(m->msgs, 1);
+	mr = mctp_pq_pop(m, MCPQ_MSGS, 1);
 	if (mr == NULL)  
 		goto end;
 
@@ -184,7 +184,7 @@ send:
 
 	ma->rsp = mr;
 
-	pq_push(m->tmq, ma);
+	mctp_pq_push(m, MCPQ_TMQ, ma);
 
 end:
 	return ret ;
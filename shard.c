@@ -0,0 +1,295 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		shard.c
+ *
+ * @brief 		Code file for the sharded server mode of the MCTP transport library
+ *
+ * @details 	A shard group runs N independent server pipelines on the same
+ * 				port. Each shard binds its own SO_REUSEPORT listener and owns its
+ * 				own pools, queues and threads, so the kernel spreads incoming
+ * 				connections across shards and no lock is shared between them.
+ *
+ * 				The first shard is the mctp object configured by the caller.
+ * 				The other shards copy its handlers and settings and share its
+ * 				version list, which is read only while running. Endpoint state
+ * 				changed by a Set Endpoint ID command is copied to every shard.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+/* errno
+ */
+#include <errno.h>
+
+/* calloc()
+ * free()
+ */
+#include <stdlib.h>
+
+/* memcpy()
+ * memset()
+ */
+#include <string.h>
+
+/* sysconf()
+ */
+#include <unistd.h>
+
+/* __u32
+ * __u64
+ */
+#include <linux/types.h>
+
+#include "main.h"
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Create a group of server shards
+ *
+ * @param m 	Configured struct mctp used as the first shard. Still owned by the caller
+ * @param num 	Number of shards. 0 for one per online CPU
+ * @param pin 	1 to pin the threads of shard i to CPU i, 0 to not pin
+ * @return 		struct mctp_shards* or NULL upon error
+ *
+ * STEPS
+ * 1: Allocate the group
+ * 2: Create the other shards
+ */
+struct mctp_shards *mctp_shards_init(struct mctp *m, int num, int pin)
+{
+	struct mctp_shards *g;
+	long ncpu;
+	int i;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+
+	if (num <= 0)
+		num = ncpu;
+
+	if (m == NULL || num > MCTP_MAX_SHARDS)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// STEP 1: Allocate the group
+	g = (struct mctp_shards*) calloc(1, sizeof(struct mctp_shards));
+	if (g == NULL)
+		return NULL;
+
+	g->num = num;
+	g->shards[0] = m;
+
+	// STEP 2: Create the other shards
+	for ( i = 1 ; i < num ; i++ )
+	{
+		g->shards[i] = mctp_init();
+		if (g->shards[i] == NULL)
+			goto fail;
+	}
+
+	for ( i = 0 ; i < num ; i++ )
+	{
+		g->shards[i]->group = g;
+		g->shards[i]->reuseport = 1;
+		g->shards[i]->cpu = pin ? (int) (i % ncpu) : -1;
+	}
+
+	return g;
+
+fail:
+
+	while (--i > 0)
+		mctp_free(g->shards[i]);
+	free(g);
+
+	return NULL;
+}
+
+/**
+ * Start all shards of the group as servers on the same port
+ *
+ * Copies the handlers and settings of the first shard to the others. The
+ * first shard must not be reconfigured while the group is running.
+ *
+ * @return 	0 upon success, otherwise the return value of mctp_run() for the failing shard
+ */
+int mctp_shards_run(struct mctp_shards *g, int port, __u32 address)
+{
+	struct mctp *m, *s;
+	int i, rv;
+
+	m = g->shards[0];
+
+	for ( i = 1 ; i < g->num ; i++ )
+	{
+		s = g->shards[i];
+
+		// Discard the default versions from mctp_init() and share the versions of the first shard
+		if (s->mctp_versions != m->mctp_versions)
+		{
+			mctp_free_versions(s);
+			s->mctp_versions = m->mctp_versions;
+		}
+
+		memcpy(s->handlers, m->handlers, sizeof(m->handlers));
+		memcpy(s->ic, m->ic, sizeof(m->ic));
+		memcpy(s->uuid, m->uuid, sizeof(uuid_t));
+		memcpy(&s->state, &m->state, sizeof(struct mctp_state));
+		s->verbose = m->verbose;
+		s->zerocopy = m->zerocopy;
+		s->rxts = m->rxts;
+		s->max_conns = m->max_conns;
+		s->reconnect = m->reconnect;
+		s->pq_debug = m->pq_debug;
+		s->fn_mh = m->fn_mh;
+		mctp_set_transport(s, m->transport);
+	}
+
+	for ( i = 0 ; i < g->num ; i++ )
+	{
+		rv = mctp_run(g->shards[i], port, address, MCRM_SERVER, 1, 1);
+		if (rv != 0)
+		{
+			while (--i >= 0)
+				mctp_stop(g->shards[i]);
+			return rv;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Stop all shards of the group
+ */
+int mctp_shards_stop(struct mctp_shards *g)
+{
+	int i;
+
+	for ( i = 0 ; i < g->num ; i++ )
+		mctp_stop(g->shards[i]);
+
+	return 0;
+}
+
+/**
+ * Free the shards created by the group and the group itself
+ *
+ * The first shard is not freed. It belongs to the caller
+ */
+void mctp_shards_free(struct mctp_shards *g)
+{
+	int i;
+
+	if (g == NULL)
+		return;
+
+	for ( i = 1 ; i < g->num ; i++ )
+	{
+		// The version list belongs to the first shard
+		if (g->shards[i]->mctp_versions == g->shards[0]->mctp_versions)
+			g->shards[i]->mctp_versions = NULL;
+		mctp_free(g->shards[i]);
+	}
+
+	g->shards[0]->group = NULL;
+	g->shards[0]->reuseport = 0;
+	g->shards[0]->cpu = -1;
+
+	free(g);
+}
+
+/**
+ * Copy the endpoint state of one shard to the others in its group
+ *
+ * Called after the endpoint state has been changed by an MCTP Control command
+ */
+void mctp_shards_sync_state(struct mctp *m)
+{
+	struct mctp_shards *g;
+	int i;
+
+	g = m->group;
+	if (g == NULL)
+		return;
+
+	for ( i = 0 ; i < g->num ; i++ )
+	{
+		if (g->shards[i] == m)
+			continue;
+
+		g->shards[i]->state.eid = m->state.eid;
+		g->shards[i]->state.bus_owner_eid = m->state.bus_owner_eid;
+	}
+}
+
+/**
+ * Sum the statistics of all shards in the group
+ */
+void mctp_shards_get_stats(struct mctp_shards *g, struct mctp_stats *stats)
+{
+	struct mctp_stats s;
+	__u64 *dst, *src;
+	unsigned i, j;
+
+	memset(stats, 0, sizeof(struct mctp_stats));
+
+	dst = (__u64*) stats;
+	src = (__u64*) &s;
+
+	for ( i = 0 ; i < (unsigned) g->num ; i++ )
+	{
+		mctp_get_stats(g->shards[i], &s);
+		for ( j = 0 ; j < sizeof(struct mctp_stats) / sizeof(__u64) ; j++ )
+			dst[j] += src[j];
+	}
+}
+
+/**
+ * Sum an accounting table (MCAT) of all shards in the group
+ *
+ * @return 	0 upon success, 1 otherwise and sets errno
+ */
+int mctp_shards_get_acct(struct mctp_shards *g, int table, struct mctp_acct_row *rows, int num)
+{
+	struct mctp_acct_row *tmp;
+	__u64 *dst, *src;
+	unsigned j;
+	int i, rv;
+
+	rv = mctp_get_acct(g->shards[0], table, rows, num);
+	if (rv != 0 || num <= 0)
+		return rv;
+
+	tmp = calloc(num, sizeof(struct mctp_acct_row));
+	if (tmp == NULL)
+	{
+		errno = ENOMEM;
+		return 1;
+	}
+
+	dst = (__u64*) rows;
+	src = (__u64*) tmp;
+
+	for ( i = 1 ; i < g->num ; i++ )
+	{
+		mctp_get_acct(g->shards[i], table, tmp, num);
+		for ( j = 0 ; j < num * sizeof(struct mctp_acct_row) / sizeof(__u64) ; j++ )
+			dst[j] += src[j];
+	}
+
+	free(tmp);
+
+	return 0;
+}
+
@@ -0,0 +1,450 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		shm.c
+ *
+ * @brief 		Code file for the shared memory statistics segment of the MCTP
+ * 				transport library
+ *
+ * @details 	An mctp object can publish its counters in a named POSIX shared
+ * 				memory segment that any process may map read only, such as the
+ * 				mctpstat tool. Nothing is sent to the publishing process and it
+ * 				does no work on behalf of a reader.
+ *
+ * 				Each pipeline thread owns one section of the segment. At the
+ * 				top of every loop it copies its counters into the section under
+ * 				a sequence lock, so the section is current before the thread
+ * 				waits for more work. The section is on its own cache line and
+ * 				only that thread writes it. The pool and queue counters are not
+ * 				copied. mctp_pq_push() and mctp_pq_pop() count directly into
+ * 				the segment once it is open.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* errno
+ */
+#include <errno.h>
+
+/* printf()
+ * snprintf()
+ */
+#include <stdio.h>
+
+/* memset()
+ * memcpy()
+ * strlen()
+ * strncpy()
+ */
+#include <string.h>
+
+/* close()
+ * ftruncate()
+ * getpid()
+ * gettid()
+ */
+#include <unistd.h>
+
+/* O_CREAT
+ * O_RDWR
+ * O_RDONLY
+ * O_TRUNC
+ */
+#include <fcntl.h>
+
+/* shm_open()
+ * shm_unlink()
+ * mmap()
+ * munmap()
+ */
+#include <sys/mman.h>
+
+/* struct stat
+ * fstat()
+ */
+#include <sys/stat.h>
+
+/* __u32
+ * __u64
+ */
+#include <linux/types.h>
+
+#include <ptrqueue.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+//#define MCTP_VERBOSE
+#ifdef MCTP_VERBOSE
+ #define INIT 			unsigned step = 0;
+ #define ENTER 					if (m->verbose & MCTP_VERBOSE_THREADS) 	printf("%d:%s Enter\n", 				gettid(), __FUNCTION__);
+ #define STEP 			step++; if (m->verbose & MCTP_VERBOSE_STEPS) 	printf("%d:%s STEP: %u\n", 				gettid(), __FUNCTION__, step);
+ #define ERR32(k, i)			if (m->verbose & MCTP_VERBOSE_ERROR) 	printf("%d:%s STEP: %u ERR: %s: %d\n",	gettid(), __FUNCTION__, step, k, i);
+ #define EXIT(rc) 				if (m->verbose & MCTP_VERBOSE_THREADS)	printf("%d:%s Exit: %d\n", 				gettid(), __FUNCTION__,rc);
+#else
+ #define INIT
+ #define ENTER
+ #define STEP
+ #define ERR32(k, i)
+ #define EXIT(rc)
+#endif
+
+// Make the sequence odd before the section is written
+#define SEQ_BEGIN(s) 					__atomic_store_n(&(s)->seq, (s)->seq + 1, __ATOMIC_RELAXED); \
+										__atomic_thread_fence(__ATOMIC_RELEASE);
+
+// Make the sequence even after the section is written
+#define SEQ_END(s) 						__atomic_store_n(&(s)->seq, (s)->seq + 1, __ATOMIC_RELEASE);
+
+// Store one counter of a section
+#define PUT(dst, src) 					__atomic_store_n(&(dst), (src), __ATOMIC_RELAXED);
+
+// Attempts mctp_shm_read() makes before it returns a section that may be torn
+#define MCTP_SHM_READ_RETRY 			10000
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+/**
+ * Number of segments opened with the default name by this process
+ */
+static unsigned mctp_shm_instances;
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Publish the counters of an mctp object in a named shared memory segment
+ *
+ * Call before mctp_run(). The pool and queue counters move into the segment
+ *
+ * @param name 	Name of the segment starting with '/'. NULL for MCTP_SHM_PREFIX, the pid and a count of the segments of this process
+ * @return 		0 upon success, 1 otherwise and sets errno
+ *
+ * STEPS
+ * 1: Verify input
+ * 2: Create the segment
+ * 3: Fill the header
+ * 4: Move the pool and queue counters into the segment
+ */
+int mctp_shm_open(struct mctp *m, const char *name)
+{
+	INIT
+	struct mctp_shm *shm;
+	int fd, rv, i;
+
+	ENTER
+
+	// Initialize variables
+	rv = 1;
+
+	STEP // 1: Verify input
+	if (m->shm != NULL)
+	{
+		errno = EBUSY;
+		goto end;
+	}
+
+	if (name == NULL)
+		snprintf(m->shm_name, sizeof(m->shm_name), "%s%d.%u", MCTP_SHM_PREFIX, getpid(), __atomic_fetch_add(&mctp_shm_instances, 1, __ATOMIC_RELAXED));
+	else if (name[0] != '/' || strlen(name) >= sizeof(m->shm_name))
+	{
+		errno = EINVAL;
+		goto end;
+	}
+	else
+		strncpy(m->shm_name, name, sizeof(m->shm_name) - 1);
+
+	STEP // 2: Create the segment
+	// Never share the segment of another mctp object 
+	fd = shm_open(m->shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0)
+	{
+		ERR32("shm_open", errno);
+		m->shm_name[0] = 0;
+		goto end;
+	}
+
+	if (ftruncate(fd, sizeof(struct mctp_shm)) != 0)
+	{
+		ERR32("ftruncate", errno);
+		close(fd);
+		goto end_unlink;
+	}
+
+	shm = mmap(NULL, sizeof(struct mctp_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+	{
+		ERR32("mmap", errno);
+		goto end_unlink;
+	}
+
+	STEP // 3: Fill the header
+	shm->version = MCTP_SHM_VERSION;
+	shm->size = sizeof(struct mctp_shm);
+	shm->pid = getpid();
+	for ( i = 0 ; i < MCPQ_MAX ; i++ )
+		shm->pq_size[i] = mctp_pq_size(i);
+
+	STEP // 4: Move the pool and queue counters into the segment
+	memcpy(shm->pq_count, m->pq_local, sizeof(shm->pq_count));
+	m->pq_count = shm->pq_count;
+	m->shm = shm;
+
+	// Readers check the magic last
+	__atomic_store_n(&shm->magic, MCTP_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	rv = 0;
+	goto end;
+
+end_unlink:
+
+	shm_unlink(m->shm_name);
+	m->shm_name[0] = 0;
+
+end:
+
+	EXIT(rv);
+
+	return rv;
+}
+
+/**
+ * Remove the statistics segment of an mctp object
+ *
+ * Call after mctp_stop(). Readers that still have it mapped keep the last values
+ */
+void mctp_shm_close(struct mctp *m)
+{
+	if (m->shm == NULL)
+		return;
+
+	memcpy(m->pq_local, m->shm->pq_count, sizeof(m->pq_local));
+	m->pq_count = m->pq_local;
+
+	munmap(m->shm, sizeof(struct mctp_shm));
+	m->shm = NULL;
+
+	shm_unlink(m->shm_name);
+	m->shm_name[0] = 0;
+}
+
+/**
+ * Map the statistics segment of another process read only
+ *
+ * @param name 	Name of the segment starting with '/'
+ * @return 		Pointer to the segment, NULL upon error and sets errno
+ */
+const struct mctp_shm *mctp_shm_attach(const char *name)
+{
+	struct mctp_shm *shm;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct mctp_shm))
+	{
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	shm = mmap(NULL, sizeof(struct mctp_shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != MCTP_SHM_MAGIC
+		|| shm->version != MCTP_SHM_VERSION
+		|| shm->size != sizeof(struct mctp_shm))
+	{
+		munmap(shm, sizeof(struct mctp_shm));
+		errno = EPROTO;
+		return NULL;
+	}
+
+	return shm;
+}
+
+/**
+ * Unmap a segment mapped with mctp_shm_attach()
+ */
+void mctp_shm_detach(const struct mctp_shm *shm)
+{
+	munmap((void*) shm, sizeof(struct mctp_shm));
+}
+
+/**
+ * Copy one section of a statistics segment
+ *
+ * Retries while the writer is updating the section. If the writer stopped in
+ * the middle of an update the last copy is kept after MCTP_SHM_READ_RETRY tries
+ *
+ * @param sect 	Section of the segment, e.g. &shm->pr
+ * @param dst 	Buffer of the same section type
+ * @param len 	sizeof the section type. A multiple of 8
+ * @return 		0 upon success, 1 if the copy may be torn
+ */
+int mctp_shm_read(const void *sect, void *dst, size_t len)
+{
+	const __u64 *src;
+	__u64 *out;
+	__u32 s0, s1;
+	size_t i;
+	int n;
+
+	src = (const __u64*) sect;
+	out = (__u64*) dst;
+
+	for ( n = 0 ; n < MCTP_SHM_READ_RETRY ; n++ )
+	{
+		s0 = __atomic_load_n((const __u32*) sect, __ATOMIC_ACQUIRE);
+
+		for ( i = 0 ; i < len / sizeof(__u64) ; i++ )
+			out[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s1 = __atomic_load_n((const __u32*) sect, __ATOMIC_RELAXED);
+		if ( (s0 & 1) == 0 && s0 == s1 )
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Publish the counters of the Socket Reader
+ */
+void mctp_shm_pub_sr(struct socket_reader *self)
+{
+	struct mctp_shm_sr *s;
+
+	if (self->m->shm == NULL)
+		return;
+
+	s = &self->m->shm->sr;
+	SEQ_BEGIN(s)
+	PUT(s->packets, 	self->packet_count)
+	PUT(s->dropped, 	self->dropped_count)
+	PUT(s->stamped, 	self->rxts_count)
+	SEQ_END(s)
+}
+
+/**
+ * Publish the counters of the Packet Reader
+ */
+void mctp_shm_pub_pr(struct packet_reader *self)
+{
+	struct mctp_shm_pr *s;
+
+	if (self->m->shm == NULL)
+		return;
+
+	s = &self->m->shm->pr;
+	SEQ_BEGIN(s)
+	PUT(s->messages, 		self->message_count)
+	PUT(s->dropped_version, self->dropped_version)
+	PUT(s->dropped_seqnum, 	self->dropped_seqnum)
+	PUT(s->dropped_noeom, 	self->dropped_noeom)
+	PUT(s->dropped_nosom, 	self->dropped_nosom)
+	PUT(s->dropped_wrongto, self->dropped_wrongto)
+	PUT(s->dropped_ic, 		self->dropped_ic)
+	SEQ_END(s)
+}
+
+/**
+ * Publish the counters of the Message Handler
+ */
+void mctp_shm_pub_mh(struct message_handler *self)
+{
+	struct mctp_shm_mh *s;
+
+	if (self->m->shm == NULL)
+		return;
+
+	s = &self->m->shm->mh;
+	SEQ_BEGIN(s)
+	PUT(s->matched, 			self->matched)
+	PUT(s->dropped_unmatched, 	self->dropped_unmatched)
+	PUT(s->dropped_stale, 		self->dropped_stale)
+	SEQ_END(s)
+}
+
+/**
+ * Publish the counters of the Packet Writer
+ */
+void mctp_shm_pub_pw(struct packet_writer *self)
+{
+	struct mctp_shm_pw *s;
+
+	if (self->m->shm == NULL)
+		return;
+
+	s = &self->m->shm->pw;
+	SEQ_BEGIN(s)
+	PUT(s->messages, 	self->message_count)
+	PUT(s->packets, 	self->packet_count)
+	SEQ_END(s)
+}
+
+/**
+ * Publish the counters of the Socket Writer
+ */
+void mctp_shm_pub_sw(struct socket_writer *self)
+{
+	struct mctp_shm_sw *s;
+
+	if (self->m->shm == NULL)
+		return;
+
+	s = &self->m->shm->sw;
+	SEQ_BEGIN(s)
+	PUT(s->packets, 	self->packet_count)
+	PUT(s->dropped, 	self->dropped_count)
+	PUT(s->zerocopy, 	self->zerocopy_count)
+	SEQ_END(s)
+}
+
+/**
+ * Publish the counters of the Submission Thread
+ */
+void mctp_shm_pub_st(struct submission_thread *self)
+{
+	struct mctp_shm_st *s;
+
+	if (self->m->shm == NULL)
+		return;
+
+	s = &self->m->shm->st;
+	SEQ_BEGIN(s)
+	PUT(s->tags_in_use, self->tags_in_use)
+	SEQ_END(s)
+}
+
+/**
+ * Publish the counters of the Completion Thread
+ */
+void mctp_shm_pub_ct(struct completion_thread *self)
+{
+	struct mctp_shm_ct *s;
+
+	if (self->m->shm == NULL)
+		return;
+
+	s = &self->m->shm->ct;
+	SEQ_BEGIN(s)
+	PUT(s->completed, 	self->completed_actions)
+	PUT(s->successful, 	self->successful_actions)
+	PUT(s->failed, 		self->failed_actions)
+	SEQ_END(s)
+}
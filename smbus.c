@@ -0,0 +1,765 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		smbus.c
+ *
+ * @brief 		Code file for the SMBus transport of the MCTP transport library
+ *
+ * @details 	Implements the MCTP SMBus/I2C Transport Binding (DSP0237). Each
+ * 				MCTP packet is sent as one SMBus Block Write:
+ *
+ * 				Dest Addr | Command 0x0F | Byte Count | Source Addr | MCTP Packet | PEC
+ *
+ * 				The PEC is the SMBus CRC-8 over every byte before it, computed
+ * 				with slicing-by-8 tables.
+ *
+ * 				The bytes are carried by a pluggable struct mctp_smbus_ops. A
+ * 				simulated multi-drop bus is provided. It delivers each block
+ * 				write only after the time the transfer would take at the
+ * 				configured SCL clock. Masters that start at the same time
+ * 				arbitrate as on a wired-AND bus, where the frame with the lowest
+ * 				bytes wins. This gives SMBus-class bandwidth without hardware.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* pid_t
+ */
+#include <sys/types.h>
+
+/* gettid()
+ */
+#include <unistd.h>
+
+/* calloc()
+ * free()
+ */
+#include <stdlib.h>
+
+/* memcpy()
+ * memcmp()
+ * memset()
+ */
+#include <string.h>
+
+/* errno
+ */
+#include <errno.h>
+
+/* pthread_mutex_t
+ * pthread_cond_t
+ * pthread_once_t
+ * pthread_once()
+ */
+#include <pthread.h>
+
+/* clock_nanosleep()
+ */
+#include <time.h>
+
+/* __u8
+ * __u64
+ */
+#include <linux/types.h>
+
+#include <timeutils.h>
+#include <ptrqueue.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+//#define MCTP_VERBOSE
+#ifdef MCTP_VERBOSE
+ #define TINIT 			 self->loop=0; self->threadid = gettid();
+ #define TENTER 		              if (self->m->verbose & MCTP_VERBOSE_THREADS) 	MCTP_LOG("%d:%s Enter\n", 				self->threadid, __FUNCTION__);
+ #define TLOOP(i) 		self->loop=i; if (self->m->verbose & MCTP_VERBOSE_STEPS)    MCTP_LOG("%d:%s LOOP: %u\n", 				self->threadid, __FUNCTION__, self->loop);
+ #define TINT32(k, i)                 if (self->m->verbose & MCTP_VERBOSE_STEPS)    MCTP_LOG("%d:%s LOOP: %u %s: %d\n",		self->threadid, __FUNCTION__, self->loop, k, i);
+ #define TEXIT(rc) 			  		  if (self->m->verbose & MCTP_VERBOSE_THREADS) 	MCTP_LOG("%d:%s Exit: %d\n", 				self->threadid, __FUNCTION__,rc);
+ #define TERR(k, i)                   if (self->m->verbose & MCTP_VERBOSE_ERROR)    MCTP_LOG("%d:%s LOOP: %u ERR: %s: %d\n",	self->threadid, __FUNCTION__, self->loop, k, i);
+#else
+ #define TINIT 			self->loop = 0;	self->threadid = gettid();
+ #define TENTER
+ #define TLOOP(i) 		 self->loop=i;
+ #define TINT32(m,i)
+ #define TERR(k, i)
+ #define TEXIT(rc)
+#endif // MCTP_VERBOSE
+
+// DSP0237 command code of an MCTP Block Write
+#define SMBUS_CMD_MCTP 					0x0F
+
+// SMBus CRC-8 polynomial (x^8 + x^2 + x + 1)
+#define PEC_POLY 						0x07
+
+// Destination address, command code and byte count
+#define SMBUS_HDR_LEN 					3
+// Source address and packet counted by the byte count
+#define SMBUS_COUNT 					(1 + MCLN_PKT)
+
+// Number of 7 bit slave addresses
+#define SMBUS_NUM_ADDRS 				128
+
+/* STRUCTS ===================================================================*/
+
+/**
+ * A device attached to the simulated bus
+ */
+struct mctp_smbus_node
+{
+	pthread_cond_t cond;				//!< Signaled when a block write is received
+	__u8 rx[MCTP_SMBUS_RX_FRAMES][MCTP_SMBUS_FRAME_MAX];
+	size_t len[MCTP_SMBUS_RX_FRAMES];
+	__u32 head;
+	__u32 tail;
+};
+
+/**
+ * Simulated multi-drop SMBus
+ */
+struct mctp_smbus_bus
+{
+	pthread_mutex_t mtx;
+	pthread_cond_t idle;				//!< Signaled when the bus becomes idle
+	unsigned hz;						//!< SCL clock
+
+	int owner;							//!< A master holds the bus
+	const __u8 *arb[MCTP_SMBUS_MAX_MASTERS];	//!< Frames of the masters waiting for the bus
+	int num_arb;
+
+	struct mctp_smbus_node *nodes[SMBUS_NUM_ADDRS];
+	struct mctp_smbus_stats stats;
+};
+
+/* PROTOTYPES ================================================================*/
+
+static int mctp_smbus_sim_attach(void *ctx, __u8 addr);
+static void mctp_smbus_sim_detach(void *ctx, __u8 addr);
+static int mctp_smbus_sim_write(void *ctx, __u8 addr, const __u8 *buf, size_t len);
+static int mctp_smbus_sim_read(void *ctx, __u8 addr, __u8 *buf, size_t len, int msec);
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+static __u8 pec_table[8][256];
+
+// Builds the tables once, even when the first calls race
+static pthread_once_t pec_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Byte transport of the simulated bus. ctx is a struct mctp_smbus_bus*
+ */
+const struct mctp_smbus_ops mctp_smbus_sim = {
+	.attach = mctp_smbus_sim_attach,
+	.detach = mctp_smbus_sim_detach,
+	.write = mctp_smbus_sim_write,
+	.read = mctp_smbus_sim_read,
+};
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Build the PEC slicing-by-8 tables
+ *
+ * pec_table[k][b] is the CRC of byte b followed by k zero bytes
+ */
+static void mctp_pec_init()
+{
+	__u8 crc;
+	int i, j;
+
+	for ( i = 0 ; i < 256 ; i++ )
+	{
+		crc = i;
+		for ( j = 0 ; j < 8 ; j++ )
+			crc = (crc & 0x80) ? (crc << 1) ^ PEC_POLY : (crc << 1);
+		pec_table[0][i] = crc;
+	}
+
+	for ( i = 0 ; i < 256 ; i++ )
+		for ( j = 1 ; j < 8 ; j++ )
+			pec_table[j][i] = pec_table[0][pec_table[j-1][i]];
+}
+
+/**
+ * Compute the SMBus Packet Error Code (CRC-8) of a buffer
+ *
+ * The PEC can be computed incrementally by passing the value returned for
+ * the prior part of the transfer as crc. Use 0 for the first part.
+ *
+ * @param crc 	PEC of the preceding data, 0 to start
+ * @param buf 	Data to add to the PEC
+ * @param len 	Length of data in bytes
+ * @return 		PEC of all data so far
+ */
+__u8 mctp_pec(__u8 crc, const void *buf, size_t len)
+{
+	const __u8 *p;
+
+	pthread_once(&pec_once, mctp_pec_init);
+
+	p = (const __u8*) buf;
+
+	while (len >= 8)
+	{
+		crc = pec_table[7][p[0] ^ crc] ^ pec_table[6][p[1]] ^ pec_table[5][p[2]] ^ pec_table[4][p[3]]
+			^ pec_table[3][p[4]] ^ pec_table[2][p[5]] ^ pec_table[1][p[6]] ^ pec_table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = pec_table[0][crc ^ *p++];
+
+	return crc;
+}
+
+/**
+ * Select the SMBus transport and the byte transport it uses
+ *
+ * The port and address passed to mctp_run() are not used. Must be called
+ * before mctp_run()
+ *
+ * @param m 	struct mctp*
+ * @param ops 	Byte transport. &mctp_smbus_sim for the simulated bus
+ * @param ctx 	Passed to each function of ops. A struct mctp_smbus_bus* for the simulated bus
+ * @param addr 	7 bit slave address of this endpoint
+ * @param peer 	7 bit slave address of the endpoint to send to
+ * @return 		0 upon success, 1 if invalid or already running
+ */
+int mctp_set_smbus(struct mctp *m, const struct mctp_smbus_ops *ops, void *ctx, __u8 addr, __u8 peer)
+{
+	if (m->all_threads_started || ops == NULL || addr >= SMBUS_NUM_ADDRS || peer >= SMBUS_NUM_ADDRS)
+		return 1;
+
+	m->smbus_ops = ops;
+	m->smbus_ctx = ctx;
+	m->smbus_addr = addr;
+	m->smbus_peer = peer;
+
+	return mctp_set_transport(m, MCTR_SMBUS);
+}
+
+/**
+ * Claim the slave address of an mctp object on its bus
+ *
+ * @return 0 upon success, 1 upon error
+ */
+int mctp_smbus_open(struct mctp *m)
+{
+	m->sock = -1;
+
+	if (m->smbus_ops == NULL)
+	{
+		errno = EINVAL;
+		return 1;
+	}
+
+	return (m->smbus_ops->attach(m->smbus_ctx, m->smbus_addr) != 0);
+}
+
+/**
+ * Release the slave address of an mctp object
+ */
+void mctp_smbus_close(struct mctp *m)
+{
+	if (m->smbus_ops != NULL)
+		m->smbus_ops->detach(m->smbus_ctx, m->smbus_addr);
+}
+
+/**
+ * SMBus Socket Reader Thread
+ *
+ * Replaces mctp_socket_reader() when the SMBus transport is selected
+ *
+ * @param arg This is a void * but will only ever be a struct socket_reader*
+ *
+ * STEPS
+ * 1: Wait for a block write addressed to this endpoint
+ * 2: Check the framing and PEC
+ * 3: Post the packet to the Receive Packet Queue (RPQ)
+ */
+void *mctp_smbus_reader(void *arg)
+{
+	struct socket_reader *self;
+	struct mctp_pkt_wrapper *pw;
+	__u8 frame[MCTP_SMBUS_FRAME_MAX];
+	int rv;
+
+	// Initialize variables
+	self = (struct socket_reader*) arg;
+	TINIT
+
+	TENTER
+
+	// Thread Loop
+	do
+	{
+		mctp_shm_pub_sr(self);
+
+		TLOOP(1) // STEP 1: Wait for a block write addressed to this endpoint
+		// Check for a stop periodically
+		rv = self->m->smbus_ops->read(self->m->smbus_ctx, self->m->smbus_addr, frame, sizeof(frame), MCTP_SMBUS_POLL_MSEC);
+		if (rv < 0)
+		{
+			TINT32("read() returned rv", rv);
+			goto end_thread;
+		}
+		if (rv == 0)
+			continue;
+
+		TLOOP(2) // STEP 2: Check the framing and PEC
+		if ( (rv != SMBUS_HDR_LEN + SMBUS_COUNT + 1)
+			|| (frame[0] != (self->m->smbus_addr << 1))
+			|| (frame[1] != SMBUS_CMD_MCTP)
+			|| (frame[2] != SMBUS_COUNT)
+			|| ((frame[3] & 0x01) == 0)
+			|| (mctp_pec(0, frame, rv - 1) != frame[rv - 1]) )
+		{
+			self->dropped_count++;
+			continue;
+		}
+
+		TLOOP(3) // STEP 3: Post the packet to the Receive Packet Queue (RPQ)
+		pw = mctp_pq_pop(self->m, MCPQ_PKTS, self->m->wait);
+		if (pw == NULL)
+			goto end_thread;
+
+		memcpy(&pw->pkt, &frame[SMBUS_HDR_LEN + 1], sizeof(struct mctp_pkt));
+		pw->ts = mctp_now();
+		pw->conn = 0;
+		self->packet_count++;
+
+		if (mctp_pq_push(self->m, MCPQ_RPQ, pw) != 0)
+		{
+			self->dropped_count++;
+			mctp_pq_push(self->m, MCPQ_PKTS, pw);
+		}
+
+	} while (self->m->stop_threads == 0);
+
+end_thread:
+
+	TEXIT( (self->m->stop_threads == 0) && (self->m->use_threads == 1) );
+
+	// If thread exited abnormally, request other threads to stop
+	if ( (self->m->stop_threads == 0) && (self->m->use_threads == 1) )
+		mctp_request_stop(self->m);
+
+	return NULL;
+}
+
+/**
+ * SMBus Socket Writer Thread
+ *
+ * Replaces mctp_socket_writer() when the SMBus transport is selected
+ *
+ * A block write that is not acknowledged is tried MCTP_SMBUS_NACK_RETRY more
+ * times. If it still fails, the rest of the message is dropped and the action
+ * retry recovers it.
+ *
+ * @param arg This is a void * but will only ever be a struct socket_writer*
+ *
+ * STEPS
+ * 1: Get an mctp_action from the Transmit Packet Queue (TPQ)
+ * 2: Send each packet of the action as a block write
+ * 3: Push completed mctp_actions onto the Action Completion Queue
+ */
+void *mctp_smbus_writer(void *arg)
+{
+	struct socket_writer *self;
+	struct mctp_action *ma;
+	struct mctp_pkt_wrapper *pw, *head;
+	__u8 frame[MCTP_SMBUS_FRAME_MAX];
+	size_t len;
+	int rv, req, i;
+
+	// Initialize variables
+	self = (struct socket_writer*) arg;
+	TINIT
+
+	// The header of every frame is the same
+	frame[0] = self->m->smbus_peer << 1;
+	frame[1] = SMBUS_CMD_MCTP;
+	frame[2] = SMBUS_COUNT;
+	frame[3] = (self->m->smbus_addr << 1) | 0x01;
+	len = SMBUS_HDR_LEN + SMBUS_COUNT + 1;
+
+	TENTER
+
+	// Thread Loop
+	do
+	{
+		mctp_shm_pub_sw(self);
+
+	 	TLOOP(1) // LOOP 1: Get an mctp_action from the Transmit Packet Queue (TPQ)
+		ma = mctp_pq_pop(self->m, MCPQ_TPQ, self->m->wait);
+		if (ma == NULL)
+			goto end_thread;
+
+		// Pass a drain marker on to the Completion Thread, or exit if the threads are stopping
+		if (MCTP_IS_MARKER(self->m, ma))
+		{
+			if (self->m->drain >= MCDR_STOP)
+				goto end_thread;
+			mctp_pq_push(self->m, MCPQ_ACQ, ma);
+			continue;
+		}
+
+		// Take the packets from the action. They are returned to the pool once sent
+		head = ma->pw;
+		ma->pw = NULL;
+		req = (ma->rsp == NULL);
+		MCTP_TRACE(self->m, MCTE_WIRE, ma, head->pkt.hdr.dest, head->pkt.hdr.tag, req);
+		mctp_acct_tx(self->m, ma, head);
+
+		// A request may be completed by its response as soon as it is sent. Do not touch it after this
+		if (req)
+			__atomic_store_n(&ma->inflight, 0, __ATOMIC_RELEASE);
+
+		TLOOP(2) // LOOP 2: Send each packet of the action as a block write
+		rv = 0;
+		for ( pw = head ; pw != NULL ; pw = pw->next )
+		{
+			memcpy(&frame[SMBUS_HDR_LEN + 1], &pw->pkt, sizeof(struct mctp_pkt));
+			frame[len - 1] = mctp_pec(0, frame, len - 1);
+
+			for ( i = 0 ; i <= MCTP_SMBUS_NACK_RETRY ; i++ )
+			{
+				rv = self->m->smbus_ops->write(self->m->smbus_ctx, self->m->smbus_peer, frame, len);
+				if (rv == 0)
+					break;
+			}
+
+			if (rv != 0)
+			{
+				TERR("Block write not acknowledged. rv:", rv);
+				self->dropped_count++;
+				break;
+			}
+			self->packet_count++;
+			MCTP_PROBE(pkt_tx, 0, pw->pkt.hdr.dest, pw->pkt.hdr.src, MCTP_HDR_FLAGS(&pw->pkt.hdr));
+			MCTP_CAPTURE(self->m, MCCD_TX, mctp_now(), &pw->pkt, MCTP_PKT_TYPE(&head->pkt));
+		}
+
+		// Check the packets back into the pool
+		while (head != NULL)
+		{
+			pw = head;
+			head = head->next;
+			pw->next = NULL;
+			mctp_pq_push(self->m, MCPQ_PKTS, pw);
+		}
+
+		TLOOP(3) // LOOP 3: Push mctp_action onto the Action Completion Queue
+		if (!req)
+		{
+			// Set time of mctp_action completion
+			ma->completed = mctp_now();
+			if (rv != 0)
+				ma->completion_code = 1;
+
+			rv = mctp_pq_push(self->m, MCPQ_ACQ, ma);
+			if (rv != 0)
+				goto end_thread;
+		}
+
+	} while (self->m->stop_threads == 0);
+
+end_thread:
+
+	TEXIT( (self->m->stop_threads == 0) && (self->m->use_threads == 1) );
+
+	// If thread exited abnormally, request other threads to stop
+	if ( (self->m->stop_threads == 0) && (self->m->use_threads == 1) )
+		mctp_request_stop(self->m);
+
+	return NULL;
+}
+
+/**
+ * Create a simulated SMBus
+ *
+ * @param hz 	SCL clock in Hz. 0 for MCTP_SMBUS_DEFAULT_HZ
+ * @return 		struct mctp_smbus_bus* or NULL upon error
+ */
+struct mctp_smbus_bus *mctp_smbus_bus_init(unsigned hz)
+{
+	struct mctp_smbus_bus *bus;
+
+	bus = calloc(1, sizeof(struct mctp_smbus_bus));
+	if (bus == NULL)
+		return NULL;
+
+	bus->hz = hz ? hz : MCTP_SMBUS_DEFAULT_HZ;
+	pthread_mutex_init(&bus->mtx, NULL);
+	pthread_cond_init(&bus->idle, NULL);
+
+	return bus;
+}
+
+/**
+ * Free a simulated SMBus and the devices still attached to it
+ */
+void mctp_smbus_bus_free(struct mctp_smbus_bus *bus)
+{
+	int i;
+
+	if (bus == NULL)
+		return;
+
+	for ( i = 0 ; i < SMBUS_NUM_ADDRS ; i++ )
+		mctp_smbus_sim_detach(bus, i);
+
+	pthread_mutex_destroy(&bus->mtx);
+	pthread_cond_destroy(&bus->idle);
+	free(bus);
+}
+
+/**
+ * Get the transfer statistics of a simulated SMBus
+ */
+void mctp_smbus_bus_stats(struct mctp_smbus_bus *bus, struct mctp_smbus_stats *stats)
+{
+	pthread_mutex_lock(&bus->mtx);
+	memcpy(stats, &bus->stats, sizeof(struct mctp_smbus_stats));
+	pthread_mutex_unlock(&bus->mtx);
+}
+
+/**
+ * Attach a device with a slave address to the simulated bus
+ *
+ * @return 0 upon success, 1 if the address is in use
+ */
+static int mctp_smbus_sim_attach(void *ctx, __u8 addr)
+{
+	struct mctp_smbus_bus *bus;
+	struct mctp_smbus_node *node;
+	int rv;
+
+	bus = (struct mctp_smbus_bus*) ctx;
+	rv = 1;
+
+	pthread_mutex_lock(&bus->mtx);
+	{
+		if (bus->nodes[addr] != NULL)
+		{
+			errno = EADDRINUSE;
+			goto end;
+		}
+
+		node = calloc(1, sizeof(struct mctp_smbus_node));
+		if (node == NULL)
+			goto end;
+
+		pthread_cond_init(&node->cond, NULL);
+		bus->nodes[addr] = node;
+		rv = 0;
+	}
+end:
+	pthread_mutex_unlock(&bus->mtx);
+
+	return rv;
+}
+
+/**
+ * Remove a device from the simulated bus
+ */
+static void mctp_smbus_sim_detach(void *ctx, __u8 addr)
+{
+	struct mctp_smbus_bus *bus;
+	struct mctp_smbus_node *node;
+
+	bus = (struct mctp_smbus_bus*) ctx;
+
+	pthread_mutex_lock(&bus->mtx);
+	{
+		node = bus->nodes[addr];
+		bus->nodes[addr] = NULL;
+	}
+	pthread_mutex_unlock(&bus->mtx);
+
+	if (node == NULL)
+		return;
+
+	pthread_cond_destroy(&node->cond);
+	free(node);
+}
+
+/**
+ * Return the index of the frame that wins arbitration
+ *
+ * Masters drive each bit of their frame onto a wired-AND bus and stop when
+ * they read back a 0 after sending a 1, so the frame with the lowest bytes wins.
+ */
+static int mctp_smbus_sim_arbitrate(struct mctp_smbus_bus *bus)
+{
+	int i, w;
+
+	w = 0;
+	for ( i = 1 ; i < bus->num_arb ; i++ )
+		if (memcmp(bus->arb[i], bus->arb[w], SMBUS_HDR_LEN + SMBUS_COUNT) < 0)
+			w = i;
+
+	return w;
+}
+
+/**
+ * Send a block write on the simulated bus as a master
+ *
+ * Waits for the bus to be idle and for this master to win arbitration. The
+ * block write reaches the slave once the transfer time at the bus clock has
+ * passed.
+ *
+ * @return 0 upon success, -1 if the slave did not acknowledge
+ *
+ * STEPS
+ * 1: Wait for the bus to be idle and win arbitration
+ * 2: Hold the bus for the time of the transfer
+ * 3: Deliver the block write to the slave
+ */
+static int mctp_smbus_sim_write(void *ctx, __u8 addr, const __u8 *buf, size_t len)
+{
+	struct mctp_smbus_bus *bus;
+	struct mctp_smbus_node *node;
+	struct timespec ts;
+	__u64 nsec;
+	int i, rv, cs;
+
+	bus = (struct mctp_smbus_bus*) ctx;
+	rv = -1;
+
+	if (len > MCTP_SMBUS_FRAME_MAX || len < SMBUS_HDR_LEN + SMBUS_COUNT)
+		return -1;
+
+	// A thread cancelled while waiting would leave the bus locked
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+
+	// Start, 9 clocks per byte for the data and acknowledge bits, stop
+	nsec = ((__u64) len * 9 + 2) * 1000000000ULL / bus->hz;
+
+	pthread_mutex_lock(&bus->mtx);
+
+	// STEP 1: Wait for the bus to be idle and win arbitration
+	while (bus->num_arb >= MCTP_SMBUS_MAX_MASTERS)
+		pthread_cond_wait(&bus->idle, &bus->mtx);
+	bus->arb[bus->num_arb++] = buf;
+
+	while (1)
+	{
+		while (bus->owner)
+			pthread_cond_wait(&bus->idle, &bus->mtx);
+
+		i = mctp_smbus_sim_arbitrate(bus);
+		if (bus->arb[i] == buf)
+			break;
+
+		// Lost. Retry when the winner is done
+		pthread_cond_wait(&bus->idle, &bus->mtx);
+	}
+
+	bus->owner = 1;
+	bus->stats.arb_lost += bus->num_arb - 1;
+	bus->arb[i] = bus->arb[--bus->num_arb];
+
+	// STEP 2: Hold the bus for the time of the transfer
+	pthread_mutex_unlock(&bus->mtx);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += nsec / 1000000000ULL;
+	ts.tv_nsec += nsec % 1000000000ULL;
+	if (ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+
+	pthread_mutex_lock(&bus->mtx);
+
+	// STEP 3: Deliver the block write to the slave
+	bus->stats.busy_nsec += nsec;
+	node = bus->nodes[addr];
+	if (node == NULL || node->head - node->tail >= MCTP_SMBUS_RX_FRAMES)
+	{
+		// No device has the address, or it has no room for the block write
+		bus->stats.nacks++;
+	}
+	else
+	{
+		memcpy(node->rx[node->head % MCTP_SMBUS_RX_FRAMES], buf, len);
+		node->len[node->head % MCTP_SMBUS_RX_FRAMES] = len;
+		node->head++;
+		pthread_cond_signal(&node->cond);
+
+		bus->stats.frames++;
+		bus->stats.bytes += len;
+		rv = 0;
+	}
+
+	bus->owner = 0;
+	pthread_cond_broadcast(&bus->idle);
+
+	pthread_mutex_unlock(&bus->mtx);
+
+	pthread_setcancelstate(cs, NULL);
+
+	return rv;
+}
+
+/**
+ * Receive the next block write sent to a slave address of the simulated bus
+ *
+ * @return length of the block write, 0 if none arrived within msec, -1 upon error
+ */
+static int mctp_smbus_sim_read(void *ctx, __u8 addr, __u8 *buf, size_t len, int msec)
+{
+	struct mctp_smbus_bus *bus;
+	struct mctp_smbus_node *node;
+	struct timespec deadline;
+	int rv, cs;
+
+	bus = (struct mctp_smbus_bus*) ctx;
+	rv = 0;
+
+	mctp_drain_deadline(&deadline, msec);
+
+	// A thread cancelled while waiting would leave the bus locked
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+
+	pthread_mutex_lock(&bus->mtx);
+	{
+		node = bus->nodes[addr];
+		if (node == NULL)
+		{
+			rv = -1;
+			goto end;
+		}
+
+		while (node->head == node->tail && rv != ETIMEDOUT)
+			rv = pthread_cond_timedwait(&node->cond, &bus->mtx, &deadline);
+
+		rv = 0;
+		if (node->head == node->tail)
+			goto end;
+
+		rv = node->len[node->tail % MCTP_SMBUS_RX_FRAMES];
+		if ((size_t) rv > len)
+			rv = len;
+		memcpy(buf, node->rx[node->tail % MCTP_SMBUS_RX_FRAMES], rv);
+		node->tail++;
+	}
+end:
+	pthread_mutex_unlock(&bus->mtx);
+
+	pthread_setcancelstate(cs, NULL);
+
+	return rv;
+}
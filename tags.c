@@ -0,0 +1,347 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		tags.c
+ *
+ * @brief 		Code file for the outstanding action table of the MCTP transport library
+ *
+ * @details 	Outstanding actions are tracked in an open addressed hash table
+ * 				keyed by (peer EID, tag). Each slot is claimed with a compare and
+ * 				swap on a single 64 bit word so that no mutex is needed to match a
+ * 				response to its action.
+ *
+ * 				Only the Submission Thread inserts into the table. A released
+ * 				slot is marked used so probe sequences continue past it. The
+ * 				Submission Thread returns used slots to the empty state when
+ * 				no probe sequence can pass through them, so misses stay short
+ * 				however many (EID, tag) pairs have been used. The generation of
+ * 				a slot is kept when it is emptied.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+/* __u8
+ * __u16
+ * __u64
+ */
+#include <linux/types.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+#define TAG_MASK 						(MCTP_TAG_TABLE_SIZE - 1)
+
+#define TAG_KEY(eid, tag) 				((__u16) (((eid) << 3) | ((tag) & 0x07)))
+#define TAG_WORD(gen, key, bits) 		(((__u64)(gen) << 32) | ((__u64)(key) << 2) | (bits))
+#define TAG_WORD_GEN(w) 				((__u32) ((w) >> 32))
+#define TAG_WORD_KEY(w) 				((__u16) (((w) >> 2) & 0xFFFF))
+#define TAG_WORD_EMPTY(w) 				(((w) & (MCTP_TAG_BUSY | MCTP_TAG_USED)) == 0)
+
+#if defined(__x86_64__) || defined(__i386__)
+ #define TAG_PAUSE() 					__builtin_ia32_pause()
+#else
+ #define TAG_PAUSE()
+#endif
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Compute the home slot of a key
+ */
+static inline unsigned tag_hash(__u16 key)
+{
+	return ((key * 0x9E3779B1u) >> (32 - MCTP_TAG_TABLE_BITS)) & TAG_MASK;
+}
+
+/**
+ * Return the next generation number. Generation 0 is reserved for empty slots
+ */
+static inline __u32 tag_next_gen(__u64 word)
+{
+	__u32 gen = TAG_WORD_GEN(word) + 1;
+	return (gen == 0) ? 1 : gen;
+}
+
+/**
+ * Probe for the busy slot of a key
+ *
+ * @param end 	Set to the empty slot that ended the probe, or -1 if the whole table was probed. May be NULL
+ * @return 		Index of the slot, or -1 if the key is not in use
+ */
+static int tag_find(struct mctp *m, __u16 key, __u64 *word, int *end)
+{
+	unsigned i, idx;
+	__u64 w;
+
+	idx = tag_hash(key);
+
+	for ( i = 0 ; i < MCTP_TAG_TABLE_SIZE ; i++, idx = (idx + 1) & TAG_MASK )
+	{
+		w = __atomic_load_n(&m->tags.slots[idx].word, __ATOMIC_ACQUIRE);
+
+		// An empty slot terminates the probe sequence
+		if (TAG_WORD_EMPTY(w))
+		{
+			if (end != NULL)
+				*end = idx;
+			return -1;
+		}
+
+		if ( (w & MCTP_TAG_BUSY) && (TAG_WORD_KEY(w) == key) )
+		{
+			*word = w;
+			return idx;
+		}
+	}
+
+	if (end != NULL)
+		*end = -1;
+
+	return -1;
+}
+
+/**
+ * Return the used slots just before an empty slot to the empty state
+ *
+ * No probe sequence continues past an empty slot, so a used slot followed
+ * by one is not passed through by any key. Only the inserting thread may
+ * call this, as it is the only thread that turns an empty slot into a busy one
+ *
+ * @param end 	Index of an empty slot
+ */
+static void tag_trim(struct mctp *m, int end)
+{
+	struct mctp_tag_slot *s;
+	unsigned i, idx;
+	__u64 w;
+
+	idx = end;
+
+	for ( i = 1 ; i < MCTP_TAG_TABLE_SIZE ; i++ )
+	{
+		idx = (idx - 1) & TAG_MASK;
+		s = &m->tags.slots[idx];
+		w = __atomic_load_n(&s->word, __ATOMIC_ACQUIRE);
+
+		if ( (w & MCTP_TAG_BUSY) || !(w & MCTP_TAG_USED) )
+			break;
+
+		// Released slots are not touched by other threads until they are busy again
+		__atomic_store_n(&s->word, TAG_WORD(TAG_WORD_GEN(w), 0, 0), __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Return every used slot that no probe sequence passes through to the empty state
+ *
+ * Walks the table backwards from an empty slot once. Only the inserting
+ * thread may call this
+ */
+void mctp_tags_trim(struct mctp *m)
+{
+	struct mctp_tag_slot *s;
+	unsigned i, idx;
+	int empty;
+	__u64 w;
+
+	// Find an empty slot to start from. Without one nothing can be returned 
+	for ( idx = 0 ; idx < MCTP_TAG_TABLE_SIZE ; idx++ )
+		if (TAG_WORD_EMPTY(__atomic_load_n(&m->tags.slots[idx].word, __ATOMIC_ACQUIRE)))
+			break;
+
+	if (idx == MCTP_TAG_TABLE_SIZE)
+		return;
+
+	// empty is set while the slot after idx is empty 
+	empty = 1;
+	for ( i = 1 ; i < MCTP_TAG_TABLE_SIZE ; i++ )
+	{
+		idx = (idx - 1) & TAG_MASK;
+		s = &m->tags.slots[idx];
+		w = __atomic_load_n(&s->word, __ATOMIC_ACQUIRE);
+
+		if ( empty && !(w & MCTP_TAG_BUSY) && (w & MCTP_TAG_USED) )
+			__atomic_store_n(&s->word, TAG_WORD(TAG_WORD_GEN(w), 0, 0), __ATOMIC_RELEASE);
+		else
+			empty = TAG_WORD_EMPTY(w);
+	}
+}
+
+/**
+ * Find the outstanding action for a (peer EID, tag) pair
+ *
+ * @param m 	struct mctp*
+ * @param eid 	EID of the peer endpoint (the destination of the request)
+ * @param tag 	Message tag
+ * @param slot 	Set to the index of the slot if found. May be NULL
+ * @param word 	Set to the slot word observed if found. May be NULL
+ * @return 		struct mctp_action* or NULL if there is no outstanding action
+ */
+struct mctp_action *mctp_tags_lookup(struct mctp *m, __u8 eid, __u8 tag, int *slot, __u64 *word)
+{
+	int idx;
+	__u64 w;
+
+	idx = tag_find(m, TAG_KEY(eid, tag), &w, NULL);
+	if (idx < 0)
+		return NULL;
+
+	if (slot != NULL)
+		*slot = idx;
+	if (word != NULL)
+		*word = w;
+
+	return __atomic_load_n(&m->tags.slots[idx].ma, __ATOMIC_RELAXED);
+}
+
+/**
+ * Insert an action using the tag already set in ma->req->tag
+ *
+ * Must only be called by the single inserting thread, and only when the
+ * (EID, tag) pair is not already in use.
+ *
+ * @return 0 upon success, 1 if the table is full
+ */
+int mctp_tags_insert(struct mctp *m, struct mctp_action *ma)
+{
+	struct mctp_tag_slot *s;
+	unsigned i, idx;
+	__u16 key;
+	__u64 w;
+
+	key = TAG_KEY(ma->req->dst, ma->req->tag);
+	idx = tag_hash(key);
+
+	for ( i = 0 ; i < MCTP_TAG_TABLE_SIZE ; i++, idx = (idx + 1) & TAG_MASK )
+	{
+		s = &m->tags.slots[idx];
+		w = __atomic_load_n(&s->word, __ATOMIC_ACQUIRE);
+
+		if (w & MCTP_TAG_BUSY)
+			continue;
+
+		// Publish the action before the word that makes it visible
+		__atomic_store_n(&s->ma, ma, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->word, TAG_WORD(tag_next_gen(w), key, MCTP_TAG_BUSY), __ATOMIC_RELEASE);
+		MCTP_PROBE(tag_alloc, ma->req->dst, ma->req->tag, ma, ma->tagged);
+		MCTP_TRACE(m, MCTE_TAGGED, ma, ma->req->dst, ma->req->tag, 0);
+
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Assign a free tag for the destination EID of an action and insert it
+ *
+ * Tags rotate per EID so a tag is not immediately reused after a response,
+ * which keeps late responses to a prior request from matching a new one.
+ *
+ * @return 0 upon success, 1 if all tags for this EID are in use or the table is full
+ */
+int mctp_tags_assign(struct mctp *m, struct mctp_action *ma)
+{
+	__u8 eid, tag, start;
+	__u64 w;
+	int i, end;
+
+	eid = ma->req->dst;
+	start = m->tags.next[eid];
+
+	for ( i = 0 ; i < MCTP_NUM_TAGS ; i++ )
+	{
+		tag = (start + i) % MCTP_NUM_TAGS;
+
+		if (tag_find(m, TAG_KEY(eid, tag), &w, &end) >= 0)
+			continue;
+
+		// Shorten the probe sequences that ended where this miss did 
+		if (end >= 0)
+			tag_trim(m, end);
+
+		ma->req->tag = tag;
+		ma->tagged = mctp_now();
+
+		if (mctp_tags_insert(m, ma) != 0)
+			return 1;
+
+		m->tags.next[eid] = (tag + 1) % MCTP_NUM_TAGS;
+
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Take exclusive ownership of a busy slot
+ *
+ * The caller must either release or unlock the slot afterwards.
+ *
+ * @param word 	In: word returned by lookup. Out: the locked word
+ * @return 		0 upon success, 1 if the slot was released or reused by another thread
+ */
+int mctp_tags_lock(struct mctp *m, int slot, __u64 *word)
+{
+	struct mctp_tag_slot *s;
+	__u64 expected, w;
+
+	s = &m->tags.slots[slot];
+	expected = *word & ~((__u64) MCTP_TAG_LOCK);
+
+	while (1)
+	{
+		w = expected;
+		if (__atomic_compare_exchange_n(&s->word, &w, expected | MCTP_TAG_LOCK, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			*word = expected | MCTP_TAG_LOCK;
+			return 0;
+		}
+
+		// Another thread holds the slot briefly. Spin unless it has moved on
+		if (w != (expected | MCTP_TAG_LOCK))
+			return 1;
+
+		TAG_PAUSE();
+	}
+}
+
+/**
+ * Return a locked slot to the busy state without removing the action
+ */
+void mctp_tags_unlock(struct mctp *m, int slot, __u64 word)
+{
+	__atomic_store_n(&m->tags.slots[slot].word, word & ~((__u64) MCTP_TAG_LOCK), __ATOMIC_RELEASE);
+}
+
+/**
+ * Remove the action from a locked slot, freeing the (EID, tag) pair
+ */
+void mctp_tags_release(struct mctp *m, int slot, __u64 word)
+{
+	__atomic_store_n(&m->tags.slots[slot].word, TAG_WORD(tag_next_gen(word), TAG_WORD_KEY(word), MCTP_TAG_USED), __ATOMIC_RELEASE);
+	MCTP_PROBE(tag_free, TAG_WORD_KEY(word) >> 3, TAG_WORD_KEY(word) & 0x07);
+}
+
+/**
+ * Count the number of outstanding actions
+ */
+int mctp_tags_count(struct mctp *m)
+{
+	int i, count;
+
+	count = 0;
+	for ( i = 0 ; i < MCTP_TAG_TABLE_SIZE ; i++ )
+		if (__atomic_load_n(&m->tags.slots[i].word, __ATOMIC_RELAXED) & MCTP_TAG_BUSY)
+			count++;
+
+	return count;
+}
+
@@ -30,6 +30,8 @@
  * pthread_create()
  * pthread_join()
  * pthread_getthreadid_np()
+ * pthread_setaffinity_np()
+ * pthread_timedjoin_np()
  */
 #include <pthread.h>
 
@@ -44,10 +46,6 @@
  */
 #include <stdlib.h>
 
-/* printf()
- */
-#include <stdio.h>
-
 /* memset()
  * memcpy()
  */
@@ -65,11 +63,27 @@
  * bind()
  * listen()
  * accept()
+ * connect()
+ * recvfrom()
  * recv()
  * send()
+ * sendmsg()
+ * recvmsg()
  */
 #include <sys/socket.h>
 
+/* struct pollfd
+ * poll()
+ */
+#include <poll.h>
+
+/* struct sock_extended_err
+ * struct scm_timestamping
+ * SO_EE_ORIGIN_ZEROCOPY
+ * SO_EE_CODE_ZEROCOPY_COPIED
+ */
+#include <linux/errqueue.h>
+
 /* INADDR_ANY
  * ntohl()
  * htonl()
@@ -83,6 +97,7 @@
 #include <linux/types.h>
 
 /* be32toh()
+ * htobe32()
  */
 #include <endian.h>
 
@@ -106,19 +121,19 @@
 //#define MCTP_VERBOSE
 #ifdef MCTP_VERBOSE
  #define INIT 			unsigned step = 0;
- #define ENTER 					if (m->verbose & MCTP_VERBOSE_THREADS) 	printf("%d:%s Enter\n", 			gettid(), __FUNCTION__);
- #define STEP 			step++; if (m->verbose & MCTP_VERBOSE_STEPS) 	printf("%d:%s STEP: %u\n", 			gettid(), __FUNCTION__, step);
- #define HEX32(m, i)			if (m->verbose & MCTP_VERBOSE_STEPS) 	printf("%d:%s STEP: %u %s: 0x%x\n",	gettid(), __FUNCTION__, step, m, i);
- #define INT32(m, i)			if (m->verbose & MCTP_VERBOSE_STEPS) 	printf("%d:%s STEP: %u %s: %d\n",	gettid(), __FUNCTION__, step, m, i);
- #define EXIT(rc) 				if (m->verbose & MCTP_VERBOSE_THREADS)	printf("%d:%s Exit: %d\n", 			gettid(), __FUNCTION__,rc);
+ #define ENTER 					if (m->verbose & MCTP_VERBOSE_THREADS) 	MCTP_LOG("%d:%s Enter\n", 			gettid(), __FUNCTION__);
+ #define STEP 			step++; if (m->verbose & MCTP_VERBOSE_STEPS) 	MCTP_LOG("%d:%s STEP: %u\n", 			gettid(), __FUNCTION__, step);
+ #define HEX32(m, i)			if (m->verbose & MCTP_VERBOSE_STEPS) 	MCTP_LOG("%d:%s STEP: %u %s: 0x%x\n",	gettid(), __FUNCTION__, step, m, i);
+ #define INT32(m, i)			if (m->verbose & MCTP_VERBOSE_STEPS) 	MCTP_LOG("%d:%s STEP: %u %s: %d\n",	gettid(), __FUNCTION__, step, m, i);
+ #define EXIT(rc) 				if (m->verbose & MCTP_VERBOSE_THREADS)	MCTP_LOG("%d:%s Exit: %d\n", 			gettid(), __FUNCTION__,rc);
 
  #define TINIT 			 self->loop=0; self->threadid = gettid(); 
- #define TENTER 		              if (self->m->verbose & MCTP_VERBOSE_THREADS) 	printf("%d:%s Enter\n", 				self->threadid, __FUNCTION__);
- #define TLOOP(i) 		self->loop=i; if (self->m->verbose & MCTP_VERBOSE_STEPS)    printf("%d:%s LOOP: %u\n", 				self->threadid, __FUNCTION__, self->loop);
- #define TINT32(k, i)                 if (self->m->verbose & MCTP_VERBOSE_STEPS)    printf("%d:%s LOOP: %u %s: %d\n",		self->threadid, __FUNCTION__, self->loop, k, i);
- #define TEXIT(rc) 			  		  if (self->m->verbose & MCTP_VERBOSE_THREADS) 	printf("%d:%s Exit: %d\n", 				self->threadid, __FUNCTION__,rc);
- #define TERR(k, i)                   if (self->m->verbose & MCTP_VERBOSE_ERROR)    printf("%d:%s LOOP: %u ERR: %s: %d\n",	self->threadid, __FUNCTION__, self->loop, k, i);
- #define TMSG(k)                      if (self->m->verbose & MCTP_VERBOSE_THREADS)  printf("%d:%s LOOP: %u MSG: %s\n",		self->threadid, __FUNCTION__, self->loop, k);
+ #define TENTER 		              if (self->m->verbose & MCTP_VERBOSE_THREADS) 	MCTP_LOG("%d:%s Enter\n", 				self->threadid, __FUNCTION__);
+ #define TLOOP(i) 		self->loop=i; if (self->m->verbose & MCTP_VERBOSE_STEPS)    MCTP_LOG("%d:%s LOOP: %u\n", 				self->threadid, __FUNCTION__, self->loop);
+ #define TINT32(k, i)                 if (self->m->verbose & MCTP_VERBOSE_STEPS)    MCTP_LOG("%d:%s LOOP: %u %s: %d\n",		self->threadid, __FUNCTION__, self->loop, k, i);
+ #define TEXIT(rc) 			  		  if (self->m->verbose & MCTP_VERBOSE_THREADS) 	MCTP_LOG("%d:%s Exit: %d\n", 				self->threadid, __FUNCTION__,rc);
+ #define TERR(k, i)                   if (self->m->verbose & MCTP_VERBOSE_ERROR)    MCTP_LOG("%d:%s LOOP: %u ERR: %s: %d\n",	self->threadid, __FUNCTION__, self->loop, k, i);
+ #define TMSG(k)                      if (self->m->verbose & MCTP_VERBOSE_THREADS)  MCTP_LOG("%d:%s LOOP: %u MSG: %s\n",		self->threadid, __FUNCTION__, self->loop, k);
 
 #else
  #define INIT 
@@ -139,40 +154,111 @@
 
 //#define IFV(u) 							if (opts[CLOP_VERBOSITY].u64 & u) 
 
+// Older C libraries do not define the zero copy socket flags 
+#ifndef SO_ZEROCOPY
+ #define SO_ZEROCOPY 					60
+#endif
+#ifndef MSG_ZEROCOPY
+ #define MSG_ZEROCOPY 					0x4000000
+#endif
+
+/* Packet Reader decision table index bits (PRI) */
+#define PRI_VER_OK 						(0x01 << 0)
+#define PRI_SEQ_OK 						(0x01 << 1)
+#define PRI_SOM 						(0x01 << 2)
+#define PRI_EOM 						(0x01 << 3)
+#define PRI_INPROC 						(0x01 << 4)
+#define PRI_OWNER_OK 					(0x01 << 5)
+
+/* Packet Reader actions (PRA) */
+#define PRA_CANCEL 						(0x01 << 0)
+#define PRA_RESYNC 						(0x01 << 1)
+#define PRA_START 						(0x01 << 2)
+#define PRA_APPEND 						(0x01 << 3)
+#define PRA_FINISH 						(0x01 << 4)
+
 /* ENUMERATIONS ==============================================================*/
 
+/**
+ * Packet Reader drop counters (PRD)
+ */
+enum _PRD 
+{
+	PRD_NONE 		= 0,
+	PRD_VERSION 	= 1,
+	PRD_SEQNUM 		= 2,
+	PRD_NOEOM 		= 3,
+	PRD_NOSOM 		= 4,
+	PRD_WRONGTO 	= 5,
+	PRD_MAX
+};
+
 /* STRUCTS ===================================================================*/
 
 /* GLOBAL VARIABLES ==========================================================*/
 
 /* PROTOTYPES ================================================================*/
 
-static int mctp_configure(struct mctp *m);
+static int mctp_configure(struct mctp *m, int keep);
+static void mctp_reclaim(struct mctp *m);
+static int mctp_reconnect(struct connection_handler *self);
+static int mctp_halt(struct connection_handler *self);
+static int mctp_join(pthread_t *pt, struct timespec *deadline);
+static void mctp_pr_table_init(struct packet_reader *self);
+static int mctp_sr_poll(struct socket_reader *self);
+static int mctp_zc_reap(struct socket_writer *self, int timeout);
+static int mctp_zc_send(struct socket_writer *self, struct mctp_pkt_wrapper *head);
+static void mctp_pkts_free(struct mctp *m, struct mctp_pkt_wrapper *pw);
+static int mctp_is_stale(struct mctp_action *ma, struct mctp_msg *mm);
+static void mctp_st_defer(struct submission_thread *self, struct mctp_action *ma);
+static void mctp_st_send(struct submission_thread *self, struct mctp_action *ma);
+static void mctp_latency_add(struct completion_thread *self, int stage, mctp_ticks_t start, mctp_ticks_t end);
+static void mctp_latency(struct completion_thread *self, struct mctp_action *ma);
 
 /* FUNCTIONS =================================================================*/
 
 /**
  * Configure an mctp object prior to calling run()
  *
+ * @param keep 	1 to keep the queued and outstanding actions of a client that 
+ * 				reconnected, 0 to start over with empty queues and pools
+ *
  * STEPS
- * 1: Reset mctp state 
+ * 1: Reset mctp state and outstanding action table
  * 2: Zero out variables	
  * 3: Clear existing queues
  * 4: Create queues
  * 5: Prepare data structures for threads
  */
-static int mctp_configure(struct mctp *m)
+static int mctp_configure(struct mctp *m, int keep)
 {
 	INIT
 
 	ENTER 
 
-	STEP // 1: Reset mctp state 
+	// Only the per connection state is reset when reconnecting 
+	if (keep) 
+	{
+		mctp_reclaim(m);
+		m->state.bus_owner_eid = 0;
+
+		// mctp_stop() may have been called since the reconnect. The new threads then stop at once
+		pthread_mutex_lock(&m->mtx);
+		if (m->stop_threads != 1)
+			m->stop_threads = 0;
+		pthread_mutex_unlock(&m->mtx);
+		EXIT(0)
+		return 0;
+	}
+
+	STEP // 1: Reset mctp state and outstanding action table
 	m->all_threads_started = 0;
 	m->stop_threads = 0;
 	memset( &m->sa_client, 0, sizeof(struct sockaddr_in));
 	m->client_len = sizeof(struct sockaddr_in);
 	m->state.bus_owner_eid = 0;
+	m->reconnects = 0;
+	memset(&m->tags, 0, sizeof(struct mctp_tag_table));
 
 	STEP // 2: Zero out variables	
 	memset(&m->sr, 0, sizeof(struct socket_reader));
@@ -215,6 +301,8 @@ static int mctp_configure(struct mctp *m)
 	m->pkts    = pq_init(MCTP_PKT_POOL_SIZE,    sizeof(struct mctp_pkt_wrapper)); 
 	m->msgs    = pq_init(MCTP_MSG_POOL_SIZE,    sizeof(struct mctp_msg)); 
 	m->actions = pq_init(MCTP_ACTION_POOL_SIZE, sizeof(struct mctp_action)); 
+	memset(m->pq_count, 0, MCPQ_MAX * sizeof(struct mctp_pq_count));
+	memset(m->pq_hwm, 0, sizeof(m->pq_hwm));
 
 	// Fail if any of the queues / pools failed to be created 
 	if ( !m->rpq || !m->tpq || !m->rmq || !m->tmq || !m->taq || !m->pkts || !m->msgs || !m->actions ) 
@@ -223,6 +311,11 @@ static int mctp_configure(struct mctp *m)
 		goto end_queue;
 	}
 
+	// Index the objects of the new pools to track their holders 
+	mctp_pq_track_free(m);
+	if (m->pq_debug && mctp_pq_track_init(m) != 0)
+		goto end_queue;
+
 	STEP // 5: Prepare data structures for threads
 	// Set values for socket reader
 	m->sr.m = m;
@@ -243,8 +336,7 @@ static int mctp_configure(struct mctp *m)
 	m->st.m = m;
 	m->st.thread_delta.tv_sec = 0;
 	m->st.thread_delta.tv_nsec = MCTP_THREAD_SUBMIT_NSLEEP;
-	m->st.action_delta.tv_sec = MCTP_ACTION_DELTA_SEC; 
-	m->st.action_delta.tv_nsec = MCTP_ACTION_DELTA_NSEC;
+	m->st.action_delta = mctp_ns_to_ticks(MCTP_ACTION_DELTA_SEC * 1000000000ULL + MCTP_ACTION_DELTA_NSEC);
 
 	// Set values for completion thread
 	m->ct.m = m;
@@ -274,6 +366,306 @@ end_queue:
 	return 1;
 }
 
+/**
+ * Return the objects held by the stopped threads of a client that reconnected
+ *
+ * The pools, the TAQ, the ACQ and the outstanding action table are kept. 
+ * Everything between them is dropped and the outstanding requests are queued 
+ * again so they are sent on the new connection. Retransmitting them does not 
+ * count against their retry limit.
+ *
+ * STEPS
+ * 1: Remove the halt markers the Completion Thread did not reach
+ * 2: Return received packets and messages to the pools
+ * 3: Return packets of actions waiting to be sent
+ * 4: Return packets the kernel held for zero copy sends
+ * 5: Reset per connection thread state
+ * 6: Queue the outstanding requests for transmission
+ */
+static void mctp_reclaim(struct mctp *m)
+{
+	INIT
+	struct mctp_pkt_wrapper *pw;
+	struct mctp_action *ma;
+	struct mctp_msg *mm;
+	int q[2];
+	__u64 word, n;
+	int i, j;
+
+	ENTER
+
+	STEP // 1: Remove the halt markers the Completion Thread did not reach
+	// The ACQ is kept, so rotate it once to keep the order of the actions
+	for ( n = mctp_pq_depth(m, MCPQ_ACQ) ; n > 0 ; n-- )
+	{
+		ma = mctp_pq_pop(m, MCPQ_ACQ, 0);
+		if (ma == NULL)
+			break;
+		if (!MCTP_IS_HALT(m, ma))
+			mctp_pq_push(m, MCPQ_ACQ, ma);
+	}
+
+	STEP // 2: Return received packets and messages to the pools
+	// A drain marker is passed straight to the Completion Thread so the drain can continue
+	while ( (pw = mctp_pq_pop(m, MCPQ_RPQ, 0)) != NULL ) 
+	{
+		if (MCTP_IS_HALT(m, pw))
+			continue;
+		if (MCTP_IS_MARKER(m, pw))
+			mctp_pq_push(m, MCPQ_ACQ, &m->marker);
+		else 
+			mctp_pkts_free(m, pw);
+	}
+
+	while ( (mm = mctp_pq_pop(m, MCPQ_RMQ, 0)) != NULL ) 
+	{
+		if (MCTP_IS_HALT(m, mm))
+			continue;
+		if (MCTP_IS_MARKER(m, mm))
+			mctp_pq_push(m, MCPQ_ACQ, &m->marker);
+		else 
+			mctp_pq_push(m, MCPQ_MSGS, mm);
+	}
+
+	for ( i = 0 ; i < MCTP_MAX_CONNS ; i++ ) 
+	{
+		for ( j = 0 ; j < MCTP_NUM_TAGS ; j++ ) 
+		{
+			if (m->pr.tags[i][j] != NULL) 
+				mctp_pq_push(m, MCPQ_MSGS, m->pr.tags[i][j]);
+			m->pr.tags[i][j] = NULL;
+		}
+	}
+
+	STEP // 3: Return packets of actions waiting to be sent
+	// Requests are in the outstanding action table and are queued again in step 5. Responses fail
+	q[0] = MCPQ_TMQ;
+	q[1] = MCPQ_TPQ;
+	for ( i = 0 ; i < 2 ; i++ ) 
+	{
+		while ( (ma = mctp_pq_pop(m, q[i], 0)) != NULL ) 
+		{
+			if (MCTP_IS_HALT(m, ma))
+				continue;
+			if (MCTP_IS_MARKER(m, ma))
+			{
+				mctp_pq_push(m, MCPQ_ACQ, ma);
+				continue;
+			}
+
+			mctp_pkts_free(m, ma->pw);
+			ma->pw = NULL;
+			if (ma->rsp != NULL) 
+			{
+				ma->completion_code = 1;
+				mctp_pq_push(m, MCPQ_ACQ, ma);
+			}
+		}
+	}
+
+	STEP // 4: Return packets the kernel held for zero copy sends
+	while (m->sw.zc_tail != m->sw.zc_head)
+	{
+		mctp_pkts_free(m, m->sw.zc_ring[m->sw.zc_tail % MCTP_ZC_RING_SIZE].pw);
+		m->sw.zc_ring[m->sw.zc_tail % MCTP_ZC_RING_SIZE].pw = NULL;
+		m->sw.zc_tail++;
+	}
+
+	STEP // 5: Reset per connection thread state
+	// Counters are kept so statistics span reconnects 
+	memset(m->pr.pkt_seq, 0, sizeof(m->pr.pkt_seq));
+	memset(m->pr.crc, 0, sizeof(m->pr.crc));
+	memset(m->pr.ic, 0, sizeof(m->pr.ic));
+	memset(m->pw.pkt_seq, 0, sizeof(m->pw.pkt_seq));
+	m->sr.next = 0;
+	m->sw.zc_head = 0;
+	m->sw.zc_tail = 0;
+	m->sw.zc_next = 0;
+
+	STEP // 6: Queue the outstanding requests for transmission
+	for ( i = 0 ; i < MCTP_TAG_TABLE_SIZE ; i++ )
+	{
+		word = m->tags.slots[i].word;
+		if ( (word & MCTP_TAG_BUSY) == 0 ) 
+			continue;
+
+		ma = m->tags.slots[i].ma;
+		ma->inflight = 1;
+		ma->conn = mctp_conn_pick(m, ma);
+		ma->submitted = mctp_now();
+		mctp_pq_push(m, MCPQ_TMQ, ma);
+	}
+
+	EXIT(0)
+}
+
+/**
+ * Open a new connection to the server after the connection of a client dropped 
+ *
+ * Waits with exponential backoff between attempts. Returns early if 
+ * mctp_stop() is called.
+ *
+ * @return 0 when connected, 1 if the mctp object was stopped 
+ */
+static int mctp_reconnect(struct connection_handler *self)
+{
+	struct mctp *m;
+	struct timespec ts;
+	unsigned delay;
+	int rv;
+
+	m = self->m;
+	delay = MCTP_RECONNECT_MIN_MSEC;
+
+	while (1)
+	{
+		// Wait for the backoff delay or until told to stop
+		pthread_mutex_lock(&m->mtx);
+		{
+			timespec_get(&ts, TIME_UTC);
+			ts.tv_sec += delay / 1000;
+			ts.tv_nsec += (delay % 1000) * 1000000L;
+			if (ts.tv_nsec >= 1000000000L)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+
+			rv = 0;
+			while (m->stop_threads != 1 && rv != ETIMEDOUT)
+				rv = pthread_cond_timedwait(&m->cond, &m->mtx, &ts);
+
+			if (m->stop_threads == 1)
+			{
+				pthread_mutex_unlock(&m->mtx);
+				return 1;
+			}
+		}
+		pthread_mutex_unlock(&m->mtx);
+
+		if (mctp_socket(m) == 0) 
+		{
+			if (mctp_connect(m) == 0) 
+				break;
+			close(m->sock);
+			m->sock = -1;
+		}
+
+		TERR("Reconnect failed. Next delay in msec:", delay * 2);
+
+		// Double the delay up to the limit 
+		delay *= 2;
+		if (delay > m->reconnect)
+			delay = m->reconnect;
+	}
+
+	// mctp_stop() may have been called while connecting
+	pthread_mutex_lock(&m->mtx);
+	{
+		if (m->stop_threads == 1) 
+		{
+			while (m->num_conns > 0)
+				close(m->conns[--m->num_conns]);
+			m->sock = -1;
+			pthread_mutex_unlock(&m->mtx);
+			return 1;
+		}
+	}
+	pthread_mutex_unlock(&m->mtx);
+
+	m->reconnects++;
+	TMSG("Reconnected");
+
+	return 0;
+}
+
+/**
+ * Join a thread, cancelling it if it has not exited by the deadline
+ *
+ * @return 1 if the thread was cancelled, 0 otherwise
+ */
+static int mctp_join(pthread_t *pt, struct timespec *deadline)
+{
+	int rv;
+
+	rv = 0;
+	if (*pt == 0)
+		return rv;
+
+	if (pthread_timedjoin_np(*pt, NULL, deadline) != 0)
+	{
+		pthread_cancel(*pt);
+		pthread_join(*pt, NULL);
+		rv = 1;
+	}
+	*pt = 0;
+
+	return rv;
+}
+
+/**
+ * Stop the threads of a client so the queues can be kept for a reconnect
+ *
+ * A halt marker is queued behind the objects in each queue and each thread
+ * exits when it pops one, so no thread holds the lock of a queue or of a tag
+ * slot. A thread that has not exited by MCTP_HALT_MSEC, e.g. one waiting on
+ * an empty pool, is cancelled. Called with m->mtx held
+ *
+ * @return 0 if every thread exited, 1 if one was cancelled
+ *
+ * STEPS
+ * 1: Queue a halt marker to each thread that reads a queue
+ * 2: Wake the Submission Thread to see stop_threads
+ * 3: Join the threads
+ */
+static int mctp_halt(struct connection_handler *self)
+{
+	struct mctp *m;
+	struct timespec deadline, now;
+	int q[] = { MCPQ_RPQ, MCPQ_RMQ, MCPQ_TMQ, MCPQ_TPQ, MCPQ_ACQ };
+	int pending, cancelled, i;
+
+	m = self->m;
+	cancelled = 0;
+	mctp_drain_deadline(&deadline, MCTP_HALT_MSEC);
+
+	// STEP 1: Queue a halt marker to each thread that reads a queue
+	// A full queue takes the marker once its thread has made room
+	pending = (1 << 5) - 1;
+	while (pending)
+	{
+		for ( i = 0 ; i < 5 ; i++ )
+			if ( (pending & (1 << i)) && mctp_pq_push(m, q[i], &m->halt) == 0 )
+				pending &= ~(1 << i);
+
+		timespec_get(&now, TIME_UTC);
+		if (pending == 0 || now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+			break;
+		usleep(1000);
+	}
+
+	// STEP 2: Wake the Submission Thread to see stop_threads
+	pthread_mutex_lock(&m->st.mtx);
+	m->st.wake = 1;
+	pthread_cond_signal(&m->st.cond);
+	pthread_mutex_unlock(&m->st.mtx);
+
+	// STEP 3: Join the threads
+	cancelled += mctp_join(&m->pt_sr, &deadline);
+	cancelled += mctp_join(&m->pt_pr, &deadline);
+	cancelled += mctp_join(&m->pt_mh, &deadline);
+	cancelled += mctp_join(&m->pt_pw, &deadline);
+	cancelled += mctp_join(&m->pt_sw, &deadline);
+	cancelled += mctp_join(&m->pt_st, &deadline);
+	cancelled += mctp_join(&m->pt_ct, &deadline);
+	if (cancelled > 0)
+	{
+		TERR("Threads did not stop for the reconnect and were cancelled:", cancelled);
+	}
+
+	return cancelled > 0;
+}
+
 /**
  * Connection Handler Loop that listens for a TCP connection to be established
  *
@@ -286,23 +678,61 @@ end_queue:
  * 5: Close connection if still connected
  * 6: Stop threads
  * 7: Unlock the mutex now that the threads have been stopped
+ * 8: Reconnect a client that lost its connection
  */
 void *mctp_connection_handler(void *arg)
 {
 	struct connection_handler *self;
-	int rv;
+	struct sockaddr sa;
+	cpu_set_t cpus;
+	__u8 byte;
+	int rv, i, keep, again, adopted, reconnecting, ready, locked;
 
 	// Initialize variables 
 	self = (struct connection_handler *) arg;	
+	keep = 0;
+	again = 0;
+	adopted = 0;
+	reconnecting = 0;
+	ready = 0;
+	locked = 0;
 	TINIT
 
 	TENTER
 
+	// Pin this thread to a CPU. The threads it starts inherit the affinity
+	if (self->m->cpu >= 0) 
+	{
+		CPU_ZERO(&cpus);
+		CPU_SET(self->m->cpu, &cpus);
+		rv = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (rv != 0) 
+		{
+			TERR("Could not set CPU affinity rv:", rv);
+		}
+	}
+
 	// Thread Loop
 	do 	
 	{
 		TLOOP(1) // LOOP 1: Configure threads for the new connection 
-		mctp_configure(self->m);
+		if (mctp_configure(self->m, keep) != 0) 
+		{
+			TERR("Could not configure threads", 1);
+			goto end_fail;
+		}
+
+		// Restore the state received from the previous process once the pools exist
+		if (self->m->handoff != NULL) 
+		{
+			if (mctp_handoff_restore(self->m) != 0) 
+			{
+				TERR("Could not restore handoff state", 1);
+				goto end_fail;
+			}
+			adopted = 1;
+		}
+		ready = 1;
 
 		// Send signal to caller that queues & threads are ready 
 		if (self->sem != NULL)
@@ -312,7 +742,34 @@ void *mctp_connection_handler(void *arg)
 		}
 
 		TLOOP(2) // LOOP 2: Accept a connection
-		if (self->m->mode == MCRM_SERVER) 
+		if (adopted) 
+		{
+			// The connections were received from the previous process
+		}
+		else if (self->m->transport == MCTR_SERIAL || self->m->transport == MCTR_SMBUS) 
+		{
+			// A serial line or SMBus is ready once the device is open
+		}
+		else if (self->m->mode == MCRM_SERVER && self->m->transport == MCTR_UDP) 
+		{
+			// Wait for the first datagram and only accept datagrams from its sender
+			self->m->client_len = sizeof(struct sockaddr_in);
+			rv = recvfrom(self->m->sock, &byte, 1, MSG_PEEK, (struct sockaddr *) &self->m->sa_client, &self->m->client_len);
+			if (rv < 0) 
+			{
+				TERR("recvfrom() returned with error rv:", rv);
+				goto end_sock;
+			}
+
+			rv = connect(self->m->sock, (struct sockaddr *) &self->m->sa_client, self->m->client_len);
+			if (rv < 0) 
+			{
+				TERR("connect() returned with error rv:", rv);
+				goto end_sock;
+			}
+			self->m->conn = self->m->sock;
+		}
+		else if (self->m->mode == MCRM_SERVER) 
 		{
 			self->m->conn = accept(self->m->sock, (struct sockaddr *) &self->m->sa_client, &self->m->client_len);
 			if (self->m->conn < 0) 
@@ -322,11 +779,22 @@ void *mctp_connection_handler(void *arg)
 			}
 		}
 
+		// A server starts with the first connection. The Socket Reader accepts the rest 
+		if (self->m->mode == MCRM_SERVER && !adopted) 
+		{
+			self->m->conns[0] = self->m->conn;
+			self->m->conn_up[0] = 1;
+			self->m->num_conns = 1;
+		}
+		adopted = 0;
+
 		TLOOP(3) // STEP 3: Start threads 
 		if (self->m->use_threads) 
 		{
 			// Lock mutex before starting any threads 
 			pthread_mutex_lock(&self->m->mtx);
+			locked = 1;
+			__atomic_store_n(&self->m->threads_running, 1, __ATOMIC_RELEASE);
 
 			rv = pthread_create( &self->m->pt_sw, NULL, self->m->fn_sw, (void*) &self->m->sw);
 			if ( rv != 0 ) 
@@ -384,23 +852,79 @@ void *mctp_connection_handler(void *arg)
 				pthread_cond_wait(&self->m->cond, &self->m->mtx);
 
 			TLOOP(5) // LOOP 5: Close connection if still connected
-			close(self->m->conn);	
+			// The queues of a client that reconnects are kept, so its threads are not cancelled
+			reconnecting = (self->m->mode == MCRM_CLIENT && self->m->transport == MCTR_TCP && self->m->reconnect > 0 && self->m->stop_threads != 1);
+			again = 0;
+			if (self->m->drain == MCDR_STOP || reconnecting)
+			{
+				// Wake the Socket Reader. The connections are closed once it has exited
+				for ( i = 0 ; i < self->m->num_conns ; i++ ) 
+					shutdown(self->m->conns[i], SHUT_RDWR);
+			}
+			else if (self->m->drain == MCDR_HANDOFF) 
+			{
+				// The Socket Reader has already been stopped. The connections are passed on open
+			}
+			else if (self->m->transport == MCTR_UDP && self->m->mode == MCRM_SERVER) 
+			{
+				// Keep the bound socket but forget the peer so the next one can be learned
+				memset(&sa, 0, sizeof(sa));
+				sa.sa_family = AF_UNSPEC;
+				connect(self->m->sock, &sa, sizeof(sa));
+			}
+			else 
+			{
+				for ( i = 0 ; i < self->m->num_conns ; i++ ) 
+					close(self->m->conns[i]);	
+				self->m->num_conns = 0;
+			}
 
 			TLOOP(6) // LOOP 6: Stop threads
-			pthread_cancel(self->m->pt_sr);
-			pthread_cancel(self->m->pt_pr);
-			pthread_cancel(self->m->pt_mh);
-			pthread_cancel(self->m->pt_pw);
-			pthread_cancel(self->m->pt_sw);
-			pthread_cancel(self->m->pt_st);
-			pthread_cancel(self->m->pt_ct);
-			pthread_join(self->m->pt_sr, NULL);
-			pthread_join(self->m->pt_pr, NULL);
-			pthread_join(self->m->pt_mh, NULL);
-			pthread_join(self->m->pt_pw, NULL);
-			pthread_join(self->m->pt_sw, NULL);
-			pthread_join(self->m->pt_st, NULL);
-			pthread_join(self->m->pt_ct, NULL);
+			if (self->m->drain >= MCDR_STOP) 
+			{
+				// The queues are empty. Each thread exits when the marker reaches it 
+				mctp_pq_push(self->m, MCPQ_RPQ, &self->m->marker);
+				mctp_pq_push(self->m, MCPQ_RMQ, &self->m->marker);
+				mctp_pq_push(self->m, MCPQ_TMQ, &self->m->marker);
+				mctp_pq_push(self->m, MCPQ_TPQ, &self->m->marker);
+				mctp_pq_push(self->m, MCPQ_ACQ, &self->m->marker);
+
+				// The Submission Thread only needs to wake up to see stop_threads
+				pthread_mutex_lock(&self->m->st.mtx);
+				self->m->st.wake = 1;
+				pthread_cond_signal(&self->m->st.cond);
+				pthread_mutex_unlock(&self->m->st.mtx);
+			}
+			else if (reconnecting)
+			{
+				// The queues can only be kept if no thread was cancelled while it could hold a lock
+				keep = (mctp_halt(self) == 0);
+			}
+			else 
+			{
+				if (self->m->pt_sr != 0)
+					pthread_cancel(self->m->pt_sr);
+				pthread_cancel(self->m->pt_pr);
+				pthread_cancel(self->m->pt_mh);
+				pthread_cancel(self->m->pt_pw);
+				pthread_cancel(self->m->pt_sw);
+				pthread_cancel(self->m->pt_st);
+				pthread_cancel(self->m->pt_ct);
+			}
+			if (self->m->pt_sr != 0)
+				pthread_join(self->m->pt_sr, NULL);
+			if (self->m->pt_pr != 0)
+				pthread_join(self->m->pt_pr, NULL);
+			if (self->m->pt_mh != 0)
+				pthread_join(self->m->pt_mh, NULL);
+			if (self->m->pt_pw != 0)
+				pthread_join(self->m->pt_pw, NULL);
+			if (self->m->pt_sw != 0)
+				pthread_join(self->m->pt_sw, NULL);
+			if (self->m->pt_st != 0)
+				pthread_join(self->m->pt_st, NULL);
+			if (self->m->pt_ct != 0)
+				pthread_join(self->m->pt_ct, NULL);
 			self->m->pt_sr = 0;
 			self->m->pt_pr = 0;
 			self->m->pt_mh = 0;
@@ -409,15 +933,41 @@ void *mctp_connection_handler(void *arg)
 			self->m->pt_st = 0;
 			self->m->pt_ct = 0;
 
+			// No thread can still be running a filter that was replaced 
+			mctp_trim_filters(self->m);
+
+			if (self->m->drain == MCDR_STOP || reconnecting)
+			{
+				for ( i = 0 ; i < self->m->num_conns ; i++ ) 
+					close(self->m->conns[i]);	
+				self->m->num_conns = 0;
+			}
+
 			TLOOP(7) // LOOP 7: Unlock the mutex now that the threads have been stopped
+			__atomic_store_n(&self->m->threads_running, 0, __ATOMIC_RELEASE);
 			pthread_mutex_unlock(&self->m->mtx);
+			locked = 0;
+
+			TLOOP(8) // LOOP 8: Reconnect a client that lost its connection. A UDP server only answers the peer it learned first
+			if (reconnecting)
+			{
+				if (mctp_reconnect(self) != 0)
+					goto end_thread;
+
+				// Keep the queued and outstanding actions for the new connection, unless a thread had to be cancelled
+				if (!keep)
+				{
+					TERR("Queues rebuilt after a cancelled thread. Queued and outstanding actions were dropped", 1);
+				}
+				again = 1;
+			}
 		}
 		else {
 			// If we are not using threads, loop through and call each thread function
 			// TODO 
 		}
 
-	} while (self->m->stop_threads != 1 && self->m->mode == MCRM_SERVER);
+	} while (self->m->stop_threads != 1 && ((self->m->mode == MCRM_SERVER && self->m->transport != MCTR_SERIAL && self->m->transport != MCTR_SMBUS) || again));
 
 end_thread:
 
@@ -436,17 +986,197 @@ end_thread:
 	if (self->m->pt_ct != 0)
 		pthread_cancel(self->m->pt_ct);
 
+	// A cancelled thread may be waiting for the mutex in mctp_request_stop() 
+	if (locked)
+		pthread_mutex_unlock(&self->m->mtx);
+
+	if (self->m->pt_sr != 0)
+		pthread_join(self->m->pt_sr, NULL);
+	if (self->m->pt_pr != 0)
+		pthread_join(self->m->pt_pr, NULL);
+	if (self->m->pt_mh != 0)
+		pthread_join(self->m->pt_mh, NULL);
+	if (self->m->pt_pw != 0)
+		pthread_join(self->m->pt_pw, NULL);
+	if (self->m->pt_sw != 0)
+		pthread_join(self->m->pt_sw, NULL);
+	if (self->m->pt_st != 0)
+		pthread_join(self->m->pt_st, NULL);
+	if (self->m->pt_ct != 0)
+		pthread_join(self->m->pt_ct, NULL);
+	self->m->pt_sr = 0;
+	self->m->pt_pr = 0;
+	self->m->pt_mh = 0;
+	self->m->pt_pw = 0;
+	self->m->pt_sw = 0;
+	self->m->pt_st = 0;
+	self->m->pt_ct = 0;
+	__atomic_store_n(&self->m->threads_running, 0, __ATOMIC_RELEASE);
+
 end_sock:
 
 	// Destroy per thread mutexes
 	pthread_mutex_destroy(&self->m->st.mtx);
 	pthread_cond_destroy(&self->m->st.cond);
 
-	close(self->m->sock);
+	// The sockets of a handoff are closed once they have been passed on 
+	if (self->m->transport == MCTR_SMBUS)
+		mctp_smbus_close(self->m);
+	else if (self->m->drain != MCDR_HANDOFF)
+		close(self->m->sock);
 
 	TEXIT(self->m->stop_threads == 0 && self->m->mode == MCRM_SERVER);
 
 	return NULL;
+
+end_fail:
+
+	// Once mctp_run() has returned this thread owns the socket. Before that it is closed by mctp_run() 
+	if (ready)
+		goto end_sock;
+
+	// The connections received from a previous process are not passed on to anyone 
+	for ( i = 0 ; i < self->m->num_conns ; i++ ) 
+		if (self->m->conns[i] != self->m->sock)
+			close(self->m->conns[i]);
+	self->m->num_conns = 0;
+
+	self->status = 1;
+	if (self->sem != NULL)
+	{
+		sem_post(self->sem);
+		self->sem = NULL;
+	}
+
+	TEXIT(1);
+
+	return NULL;
+}
+
+/**
+ * Wait until one of the striped connections has data to read 
+ *
+ * A server also accepts additional connections here until it has max_conns.
+ * Connections are served round robin so one busy connection cannot starve 
+ * the others.
+ *
+ * @return index of a readable connection, -1 if no connection is up 
+ */
+static int mctp_sr_poll(struct socket_reader *self)
+{
+	struct mctp *m;
+	struct pollfd pfd[MCTP_MAX_CONNS + 1];
+	int idx[MCTP_MAX_CONNS + 1];
+	int rv, i, c, n, num, fd;
+
+	m = self->m;
+
+	while (1)
+	{
+		num = __atomic_load_n(&m->num_conns, __ATOMIC_ACQUIRE);
+
+		// Build the poll set starting after the last connection served
+		n = 0;
+		for ( i = 0 ; i < num ; i++ )
+		{
+			c = (self->next + i) % num;
+			if (!__atomic_load_n(&m->conn_up[c], __ATOMIC_ACQUIRE))
+				continue;
+			pfd[n].fd = m->conns[c];
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			idx[n++] = c;
+		}
+		if (n == 0)
+			return -1;
+
+		// Listen for more connections from the client 
+		if (m->mode == MCRM_SERVER && num < m->max_conns)
+		{
+			pfd[n].fd = m->sock;
+			pfd[n].events = POLLIN;
+			pfd[n].revents = 0;
+			idx[n++] = -1;
+		}
+
+		rv = poll(pfd, n, -1);
+		if (rv < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for ( i = 0 ; i < n ; i++ )
+		{
+			if (pfd[i].revents == 0)
+				continue;
+
+			if (idx[i] >= 0)
+			{
+				self->next = idx[i] + 1;
+				return idx[i];
+			}
+
+			// Add the new connection. Publish it only after its entry is filled 
+			fd = accept(m->sock, NULL, NULL);
+			if (fd < 0)
+				continue;
+			m->conns[num] = fd;
+			m->conn_up[num] = 1;
+			__atomic_store_n(&m->num_conns, num + 1, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/**
+ * Get the kernel receive timestamp of a read as a time stamp
+ *
+ * The kernel stamps packets with CLOCK_REALTIME. The time stamp clock is 
+ * read together with CLOCK_REALTIME again every MCTP_RXTS_SYNC stamps so a 
+ * step of the wall clock is picked up without reading both clocks per read.
+ *
+ * @param self 	struct socket_reader* 
+ * @param msg 	struct msghdr* returned by recvmsg()
+ * @param ts 	Set to the receive time 
+ * @return 		0 upon success, 1 if the read has no timestamp 
+ */
+int mctp_rxts_get(struct socket_reader *self, struct msghdr *msg, mctp_ticks_t *ts)
+{
+	struct cmsghdr *cm;
+	struct scm_timestamping *st;
+	struct timespec real;
+	__s64 delta;
+
+	for ( cm = CMSG_FIRSTHDR(msg) ; cm != NULL ; cm = CMSG_NXTHDR(msg, cm) )
+	{
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_TIMESTAMPING)
+			continue;
+
+		// The software timestamp is the first of the three 
+		st = (struct scm_timestamping*) CMSG_DATA(cm);
+		if (st->ts[0].tv_sec == 0 && st->ts[0].tv_nsec == 0)
+			return 1;
+
+		if (self->rxts_reads++ % MCTP_RXTS_SYNC == 0)
+		{
+			self->rxts_ref = mctp_now();
+			clock_gettime(CLOCK_REALTIME, &real);
+			self->rxts_real = real.tv_sec * 1000000000ULL + real.tv_nsec;
+		}
+
+		// Nanoseconds between the reference and the stamp. The stamp is usually earlier 
+		delta = (__s64) (st->ts[0].tv_sec * 1000000000ULL + st->ts[0].tv_nsec - self->rxts_real);
+		if (delta >= 0)
+			*ts = self->rxts_ref + mctp_ns_to_ticks(delta);
+		else 
+			*ts = self->rxts_ref - mctp_ns_to_ticks(-delta);
+
+		self->rxts_count++;
+		return 0;
+	}
+
+	return 1;
 }
 
 /**
@@ -463,49 +1193,83 @@ void *mctp_socket_reader(void *arg)
 {
 	struct socket_reader *self;
 	struct mctp_pkt_wrapper *pw;
-	int rv;
+	struct msghdr msg;
+	struct iovec iov;
+	__u8 control[MCTP_RXTS_CMSG_LEN] __attribute__((aligned(8)));
+	int rv, c;
 
 	// Initialize variables
 	self = (struct socket_reader*) arg;
 	TINIT
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	iov.iov_len = sizeof(struct mctp_pkt);
 
 	TENTER
 
 	// Thread Loop
 	do
 	{
+		mctp_shm_pub_sr(self);
+
 	 	TLOOP(1) // STEP 1: Get pkt from free pool
-		pw = pq_pop(self->m->pkts, self->m->wait);			
+		pw = mctp_pq_pop(self->m, MCPQ_PKTS, self->m->wait);			
 		if (pw == NULL) 
 			goto end_thread;
+		self->rx_buffers = 1;
 
 		TLOOP(2) // STEP 2: Read MCTP packet from socket connection
-		rv = recv(self->m->conn, &pw->pkt, sizeof(struct mctp_pkt), 0);
+		// With one connection block in recv(). Otherwise wait for any connection to be readable
+		c = 0;
+		if (self->m->max_conns > 1) 
+		{
+			c = mctp_sr_poll(self);
+			if (c < 0)
+			{
+				mctp_pq_push(self->m, MCPQ_PKTS, pw);			
+				self->rx_buffers = 0;
+				goto end_thread;
+			}
+		}
+
+		// Only ask for control messages when the kernel stamps packets 
+		iov.iov_base = &pw->pkt;
+		msg.msg_control = self->m->rxts ? control : NULL;
+		msg.msg_controllen = self->m->rxts ? sizeof(control) : 0;
+		rv = recvmsg(self->m->conns[c], &msg, 0);
+		self->rx_buffers = 0;
 		if (rv <= 0) 
 		{
-			TINT32("recv() returned rv", rv);
+			TINT32("recvmsg() returned rv", rv);
 
 			// Put mctp_pkt back to the free pool
-			pq_push(self->m->pkts, pw);			
+			mctp_pq_push(self->m, MCPQ_PKTS, pw);			
+
+			// Keep running on the remaining connections 
+			if (mctp_conn_down(self->m, c) > 0)
+				continue;
 
 			goto end_thread;
 		}
-		TINT32("recv() returned rv", rv);
+		TINT32("recvmsg() returned rv", rv);
 
 		// Increment packet counter 
 		self->packet_count++;
 
 		// Set the time when this packet was received 
-		timespec_get(&pw->ts, CLOCK_MONOTONIC);
+		if (!self->m->rxts || mctp_rxts_get(self, &msg, &pw->ts) != 0)
+			pw->ts = mctp_now();
+		pw->conn = c;
 
 		TLOOP(3) // STEP 3: Post mctp_packet to the Receive Packet Queue (RPQ)
-		rv = pq_push(self->m->rpq, pw);
+		rv = mctp_pq_push(self->m, MCPQ_RPQ, pw);
 		if (rv != 0) 
 		{
 			self->dropped_count++;
 	
 			// Put the mctp_packet back into the pool
-			pq_push(self->m->pkts, pw);			
+			mctp_pq_push(self->m, MCPQ_PKTS, pw);			
 
 			continue;
 		}
@@ -523,197 +1287,314 @@ end_thread:
 	return NULL;
 }
 
+/**
+ * Build the packet reader decision table
+ *
+ * The table is indexed by the PRI_* bits computed for each received packet 
+ * and returns the PRA_* actions to take and the PRD_* drop counter to 
+ * increment. This keeps the checks of the header in one place so that the 
+ * per packet path is a table lookup instead of a chain of branches.
+ *
+ * @param self 	struct packet_reader* to fill 
+ */
+static void mctp_pr_table_init(struct packet_reader *self)
+{
+	unsigned i, act, drop;
+
+	for ( i = 0 ; i < MCTP_PR_TABLE_SIZE ; i++ )
+	{
+		act = 0;
+		drop = PRD_NONE;
+
+		// Unsupported header version. Drop the packet and leave the in process message alone 
+		if ( !(i & PRI_VER_OK) )
+		{
+			drop = PRD_VERSION;
+		}
+		// A packet was lost. Cancel the in process message. Keep the packet only if it starts a new message
+		else if ( !(i & PRI_SEQ_OK) )
+		{
+			drop = PRD_SEQNUM;
+			if (i & PRI_INPROC)
+				act |= PRA_CANCEL;
+			if (i & PRI_SOM)
+				act |= PRA_RESYNC | PRA_START;
+		}
+		// A new message while one was in process means we lost the EOM packet of the prior message 
+		else if (i & PRI_SOM)
+		{
+			if (i & PRI_INPROC)
+			{
+				act |= PRA_CANCEL;
+				drop = PRD_NOEOM;
+			}
+			act |= PRA_START;
+		}
+		// A middle or last packet with no SOM received for this tag 
+		else if ( !(i & PRI_INPROC) )
+		{
+			drop = PRD_NOSOM;
+		}
+		// Tag owner does not match the in process message 
+		else if ( !(i & PRI_OWNER_OK) )
+		{
+			act |= PRA_CANCEL;
+			drop = PRD_WRONGTO;
+		}
+		else 
+		{
+			act |= PRA_APPEND;
+		}
+
+		// Complete the message if this packet was kept and is the EOM packet 
+		if ( (act & (PRA_START | PRA_APPEND)) && (i & PRI_EOM) )
+			act |= PRA_FINISH;
+
+		self->actions[i] = (drop << 8) | act;
+	}
+}
+
 /**
  * Packet Reader Thread
  *
  * @param arg This is a void * but will only ever be a struct packet_reader*
  *
  * STEPS
- *  1: Get an mctp_packet from the Receive Packet Queue 
- *  2: Verify the MCTP header version. Drop packet if unsupported
- *  3: Verify Destination ID 
- *  4: Verify sequence number
- *  5: If SOM, verify completion of prior message 
- *  6: If not SOM, verify the SOM has been received for this tag 
- *  7: Verify Tag Owner field matches
- *  8: If SOM, check out a new message buffer from the pool
- *  9: Copy data from the packet into the message
- * 10: Determine if the entire packet has been received
- * 11: Entire msg has been received. Posting to Receive Message Queue (RMQ)
- * 12: Increment the expected packet sequence number 
- * 13: Return the packet buffer back to the pool
+ *  1: Get a batch of mctp_packets from the Receive Packet Queue 
+ *  2: Decode the headers of the batch
+ *  3: Look up the action for each packet from the header, sequence number and in process message 
+ *  4: Cancel the in process message if needed
+ *  5: If SOM, check out a new message buffer from the pool
+ *  6: Copy data from the packet into the message
+ *  7: If EOM, verify the integrity check and post the message to the Receive Message Queue (RMQ)
+ *  8: Increment the expected packet sequence number 
+ *  9: Return the packet buffer back to the pool
  */  
 void *mctp_packet_reader(void *arg)
 {
 	struct packet_reader *self;
-	struct mctp_pkt_wrapper *pw;
-	//struct mctp_pkt *mp;
+	struct mctp_pkt_wrapper *pw, *batch[MCTP_PR_BATCH];
 	struct mctp_msg *mm;
-	__u8 tag;
-	int rv;
+	struct mctp_type *mt;
+	__u8 bits[MCTP_PR_BATCH], flags[MCTP_PR_BATCH];
+	__u64 unused, *drops[PRD_MAX];
+	__u8 *hdr, tag, owner, seq;
+	__u32 crc;
+	int rv, len, i, n, act, idx, c, marker, halt;
 
 	// Initialize variables
 	self = (struct packet_reader*) arg;
 	TINIT
+	i = 0;
+	n = 0;
+
+	// Map each drop reason to its counter 
+	drops[PRD_NONE]    = &unused;
+	drops[PRD_VERSION] = &self->dropped_version;
+	drops[PRD_SEQNUM]  = &self->dropped_seqnum;
+	drops[PRD_NOEOM]   = &self->dropped_noeom;
+	drops[PRD_NOSOM]   = &self->dropped_nosom;
+	drops[PRD_WRONGTO] = &self->dropped_wrongto;
+
+	mctp_pr_table_init(self);
 
 	TENTER
 	
 	// Thread Loop
 	do 
 	{
-	 	TLOOP(1) // LOOP 1: Get an mctp_packet from the Receive Packet Queue (RPQ)
-		pw = pq_pop(self->m->rpq, self->m->wait);
+		mctp_shm_pub_pr(self);
+
+	 	TLOOP(1) // LOOP 1: Get a batch of mctp_packets from the Receive Packet Queue (RPQ)
+		pw = mctp_pq_pop(self->m, MCPQ_RPQ, self->m->wait);
 		if (pw == NULL) 
 			goto end_thread;
 
-		// Increment the packet counter 
-		self->packet_count++;
-
-		// Print the packet
-		if (self->m->verbose & MCTP_VERBOSE_PACKET)
-			mctp_prnt_pkt_wrapper(pw);
-
-		TLOOP(2) // LOOP 2: Verify the MCTP header version. Drop packet if unsupported
-		if (pw->pkt.hdr.ver != 1) 
-		{
-			self->dropped_version++;
-			goto drop;
-		}
-
-		// Extract values for convenience 
-		tag = pw->pkt.hdr.tag;
-
-		TLOOP(3) // LOOP 3: Verify Destination ID 
-		// TBD
-
-		TLOOP(4) // LOOP 4: Verify sequence number
-
-		// If new pkt seq num doesn't match the expected value then a pkt has been lost
-		if (self->pkt_seq != pw->pkt.hdr.seq) 
+		// A drain or halt marker ends the batch. It takes effect once the packets ahead of it are processed
+		marker = 0;
+		halt = 0;
+		for ( n = 0 ; pw != NULL ; pw = mctp_pq_pop(self->m, MCPQ_RPQ, 0) )
 		{
-			// Cancel in process message for this message tag if there is one 
-			if (self->tags[tag] != NULL) 
+			if (MCTP_IS_HALT(self->m, pw))
 			{
-				// Return in process message buffer to the pool
-				pq_push(self->m->msgs, self->tags[tag]);
-
-				// Set the in process message to NULL
-				self->tags[tag] = NULL;
+				halt = 1;
+				break;
+			}
+			if (MCTP_IS_MARKER(self->m, pw))
+			{
+				marker = 1;
+				break;
 			}
 
-			self->dropped_seqnum++;
-
-			// If this isn't a SOM packet then we drop it until we get a SOM packet
-			if (pw->pkt.hdr.som == 0) 
-				goto drop;
-			// If this is a SOM packet we can keep it and reset the expected seq number and the expected msg tag 
-			else 
-				self->pkt_seq = pw->pkt.hdr.seq;
+			batch[n++] = pw;
+			if (n == MCTP_PR_BATCH)
+				break;
 		}
 
-		TLOOP(5) // LOOP 5: If SOM, verify completion of prior message 
-
-		// If new packet is SOM, then the in process message for this tag should be NULL,
-		// If the in process msg for this tag isn't NULL, then we lost the EOM packet for the prior message 
-		// then we need to cancel the prior in process message
-		if ( (pw->pkt.hdr.som == 1) && (self->tags[tag] != NULL) ) 
+		TLOOP(2) // LOOP 2: Decode the headers of the batch
+		// Only the bits that do not depend on prior packets are computed here 
+		for ( i = 0 ; i < n ; i++ )
 		{
-				// Return in process message buffer to the pool
-				pq_push(self->m->msgs, self->tags[tag]);
-
-				// Set the in process message to NULL
-				self->tags[tag] = NULL;
-
-				// increment dropped packets counter, but we really don't know how many packets have been lost
-				self->dropped_noeom++; 
+			hdr = (__u8*) &batch[i]->pkt.hdr;
+			flags[i] = hdr[3];
+			bits[i] = ((hdr[0] & 0x0F) == 1) * PRI_VER_OK 
+					| ((hdr[3] >> 7) & 0x01) * PRI_SOM 
+					| ((hdr[3] >> 6) & 0x01) * PRI_EOM;
 		}
 
-		TLOOP(6) // LOOP 6: If not SOM, verify the SOM has been received for this tag 
-		if ( (pw->pkt.hdr.som == 0)	&& (self->tags[tag] == NULL) ) 
+		for ( i = 0 ; i < n ; i++ )
 		{
-				// increment dropped packets counter, but we really don't know how many packets have been lost
-				self->dropped_nosom++;
-		mm->len += MCLN_BTU;
-
-				// drop this packet
-				goto drop;
-		}
+			pw = batch[i];
 
-		TLOOP(7) // LOOP 7: Verify Tag Owner field matches
-		// If they don't match, drop the in process message 
-		if ( (self->tags[tag] != NULL) && (pw->pkt.hdr.owner != self->tags[tag]->owner) ) 
-		{
+			// Increment the packet counter 
+			self->packet_count++;
+			MCTP_PROBE(pkt_rx, pw->conn, pw->pkt.hdr.src, pw->pkt.hdr.dest, flags[i], pw->ts);
+
+			// Extract values for convenience. Sequence numbers and in process messages are per connection 
+			c     = pw->conn;
+			tag   =  flags[i]       & 0x07;
+			owner = (flags[i] >> 3) & 0x01;
+			seq   = (flags[i] >> 4) & 0x03;
+			mm    = self->tags[c][tag];
+
+			// Capture and print the packet. A packet after the SOM takes the type of the message in process 
+			MCTP_CAPTURE(self->m, MCCD_RX, pw->ts, &pw->pkt, (mm != NULL) ? mm->type : -1);
+			if ( (self->m->verbose & MCTP_VERBOSE_PACKET) && mctp_filter_match(self->m, &pw->pkt, (mm != NULL) ? mm->type : -1) )
+				mctp_log_pkt(pw);
+
+			TLOOP(3) // LOOP 3: Look up the action for this packet
+			idx = bits[i] 
+				| (seq == self->pkt_seq[c]) * PRI_SEQ_OK
+				| (mm != NULL) * PRI_INPROC
+				| ( (mm != NULL) && (mm->owner == owner) ) * PRI_OWNER_OK;
+			act = self->actions[idx];
+
+			(*drops[act >> 8])++;
+
+			// A packet after the SOM is counted against the type of the message in process 
+			mctp_acct_rx_pkt(self->m, pw->pkt.hdr.src, (flags[i] & 0x80) ? MCTP_PKT_TYPE(&pw->pkt) : ((mm != NULL) ? mm->type : -1), act >> 8);
+
+			TLOOP(4) // LOOP 4: Cancel the in process message 
+			if (act & PRA_CANCEL) 
+			{
 				// Return in process message buffer to the pool
-				pq_push(self->m->msgs, self->tags[tag]);
+				mctp_pq_push(self->m, MCPQ_MSGS, mm);
 
 				// Set the in process message to NULL
-				self->tags[tag] = NULL;
-
-				// increment dropped packets counter, but we really don't know how many packets have been lost
-				self->dropped_wrongto++;
-		}
-
-		TLOOP(8) // LOOP 8: If SOM, check out a new message buffer from the pool
-		if ( pw->pkt.hdr.som == 1 ) 
-		{
-			TLOOP(9) // Get new message buffer from the pool
-			mm = pq_pop(self->m->msgs, self->m->wait);
-			if (mm == NULL) 
-				goto end_thread;
+				self->tags[c][tag] = NULL;
+			}
 
-			// Set mctp_msg header fields
-			mm->dst   = pw->pkt.hdr.dest;
-			mm->src   = pw->pkt.hdr.src;
-			mm->owner = pw->pkt.hdr.owner;
-			mm->tag   = pw->pkt.hdr.tag;
-			mm->type  = pw->pkt.payload[0];
-			mm->len   = 0;
-			timespec_copy(&mm->ts, &pw->ts);
+			// Reset the expected seq number to that of this SOM packet
+			if (act & PRA_RESYNC) 
+				self->pkt_seq[c] = seq;
 
-			memcpy(&mm->payload[mm->len], &pw->pkt.payload[1], MCLN_BTU-1);
-			mm->len += (MCLN_BTU-1);
+			if (act & PRA_START) 
+			{
+				TLOOP(5) // LOOP 5: Get new message buffer from the pool
+				mm = mctp_pq_pop(self->m, MCPQ_MSGS, self->m->wait);
+				if (mm == NULL) 
+					goto end_thread;
+
+				// Set mctp_msg header fields
+				mt = (struct mctp_type*) &pw->pkt.payload[0];
+				mm->dst   = pw->pkt.hdr.dest;
+				mm->src   = pw->pkt.hdr.src;
+				mm->owner = owner;
+				mm->tag   = tag;
+				mm->conn  = c;
+				mm->type  = mt->type;
+				mm->len   = 0;
+				mm->ts = pw->ts;
+
+				// Start the running integrity check if the sender requested one
+				self->ic[c][tag] = mt->IC;
+				self->crc[c][tag] = 0;
+
+				memcpy(&mm->payload[mm->len], &pw->pkt.payload[1], MCLN_BTU-1);
+				mm->len += (MCLN_BTU-1);
+
+				// Insert new message buffer into in process array 
+				self->tags[c][tag] = mm;
+			}
+			else if (act & PRA_APPEND)
+			{
+				TLOOP(6) // LOOP 6: Copy data from the packet into the message
+				memcpy(&mm->payload[mm->len], pw->pkt.payload, MCLN_BTU);
+				mm->len += MCLN_BTU;
+			}
+			else 
+				goto drop;
 
-			// Insert new message buffer into in process array 
-			self->tags[tag] = mm;
-		}
-		else
-		{
-			TLOOP(10) // LOOP 9: Copy data from the packet into the message
-			mm = self->tags[tag];
-			memcpy(&mm->payload[mm->len], pw->pkt.payload, MCLN_BTU);
-			mm->len += MCLN_BTU;
-		}
-		
-		TLOOP(11) // LOOP 10: Determine if the entire packet has been received
-		// If it has, post message buffer to message thread queue and clear the in process message
-		if ( pw->pkt.hdr.eom == 1 ) 
-		{
-			if (self->m->verbose & MCTP_VERBOSE_MESSAGE)
-				mctp_prnt_msg(mm);
+			// Add this packet to the running integrity check. The check value is in the last bytes of the EOM packet 
+			if (self->ic[c][tag]) 
+			{
+				len = (act & PRA_FINISH) ? (MCLN_BTU - MCLN_IC) : MCLN_BTU;
+				self->crc[c][tag] = mctp_crc32c(self->crc[c][tag], pw->pkt.payload, len);
+			}
+			
+			// If the entire message has been received, post message buffer to message thread queue and clear the in process message
+			if (act & PRA_FINISH) 
+			{
+				TLOOP(7) // LOOP 7: Verify the Message Integrity Check and remove it from the message 
+				if (self->ic[c][tag]) 
+				{
+					memcpy(&crc, &pw->pkt.payload[MCLN_BTU - MCLN_IC], MCLN_IC);
+					if (be32toh(crc) != self->crc[c][tag])
+					{
+						mctp_acct_drop(self->m, MCAS_PR, mm->src, mm->type, MCAD_IC);
+						mctp_pq_push(self->m, MCPQ_MSGS, mm);
+						self->tags[c][tag] = NULL;
+						self->dropped_ic++;
+						goto drop;
+					}
+					mm->len -= MCLN_IC;
+				}
 
-			TLOOP(12) // LOOP 11: Entire msg has been received. Posting to Receive Message Queue (RMQ)
-			rv = pq_push(self->m->rmq, mm);
-			if ( rv != 0 )
-				goto end_thread;
+				if (self->m->verbose & MCTP_VERBOSE_MESSAGE)
+					mctp_log_msg(mm);
 
-			// Set the in process message to NULL
-			self->tags[tag] = NULL;
+				// Entire msg has been received. Posting to Receive Message Queue (RMQ)
+				MCTP_PROBE(msg_rx, c, mm->src, mm->dst, mm->tag, mm->owner, mm->type, mm->len, mm->ts);
+				mctp_acct_rx_msg(self->m, mm);
+				rv = mctp_pq_push(self->m, MCPQ_RMQ, mm);
+				if ( rv != 0 )
+					goto end_thread;
 
-			self->message_count++;
-		}
+				// Set the in process message to NULL
+				self->tags[c][tag] = NULL;
+
+				self->message_count++;
+			}
 	
 drop:
 
-		TLOOP(13) // LOOP 12: Increment the expected packet sequence number 
-		self->pkt_seq = (self->pkt_seq + 1) % 4;
+			TLOOP(8) // LOOP 8: Increment the expected packet sequence number 
+			self->pkt_seq[c] = (self->pkt_seq[c] + 1) % 4;
+
+			TLOOP(9) // LOOP 9: Return the packet back to the pool
+			mctp_pq_push(self->m, MCPQ_PKTS, pw);	
+		}
+
+		// Pass a drain marker on to the Message Handler, or exit if the threads are stopping 
+		if (marker)
+		{
+			if (self->m->drain >= MCDR_STOP)
+				goto end_thread;
+			mctp_pq_push(self->m, MCPQ_RMQ, &self->m->marker);
+		}
 
-		TLOOP(14) // LOOP 13: Return the packet back to the pool
-		pq_push(self->m->pkts, pw);	
+		// Exit for a reconnect
+		if (halt)
+			goto end_thread;
 
 	} while (self->m->stop_threads == 0);
 
 end_thread:
 
+	// Return any packets of the batch that were not processed 
+	for ( ; i < n ; i++ )
+		mctp_pq_push(self->m, MCPQ_PKTS, batch[i]);
+
 	TEXIT( (self->m->stop_threads == 0) && (self->m->use_threads == 1) );
 
 	// If thread exited abnormally, request other threads to stop
@@ -731,12 +1612,16 @@ end_thread:
  * STEPS
  * 1: Get an mctp_msg from the Receive Message Queue (RMQ)
  * 2: Get the message handler function and call it
+ * 3: A response. Claim the action for (EID, tag) and call completion function / handler
  */
 void *mctp_message_handler(void *arg)
 {
 	struct message_handler *self;
 	struct mctp_msg *mm;
 	struct mctp_action *ma;
+	int slot, rv;
+	__u64 word;
+	__u8 src, tag, type;
 
 	// Initialize variables
 	self = (struct message_handler*) arg;
@@ -747,58 +1632,99 @@ void *mctp_message_handler(void *arg)
 	// Thread Loop
 	do 
 	{
+		mctp_shm_pub_mh(self);
+
 	 	TLOOP(1) // LOOP 1: Get an mctp_msg from the Receive Message Queue (RMQ)
-		mm = pq_pop(self->m->rmq, self->m->wait);
+		mm = mctp_pq_pop(self->m, MCPQ_RMQ, self->m->wait);
 		if (mm == NULL)  
 			goto end_thread;
 
+		// Exit for a reconnect
+		if (MCTP_IS_HALT(self->m, mm))
+			goto end_thread;
+
+		// Pass a drain marker on behind the responses already queued, or exit if the threads are stopping 
+		if (MCTP_IS_MARKER(self->m, mm))
+		{
+			if (self->m->drain >= MCDR_STOP)
+				goto end_thread;
+			mctp_pq_push(self->m, MCPQ_TMQ, mm);
+			continue;
+		}
+
 		if (mm->owner == 1)
 		{
 			TLOOP(2) // LOOP 2: New MSG request. Get the message handler function and call it
 			
 			// Check out a new mctp_action 
-			ma = pq_pop(self->m->actions, 1);
+			ma = mctp_pq_pop(self->m, MCPQ_ACTIONS, 1);
 			if (ma == NULL)
 				goto end_thread;
 
-			// Put new message into the action with other data
+			// Put new message into the action with other data. The response goes out on the same connection 
 			ma->req = mm;
-			timespec_copy(&ma->created, &mm->ts);
-
-			// Call action handler for this message type 
-			self->m->handlers[mm->type](self->m, ma);	
+			ma->conn = mm->conn;
+			ma->created = mm->ts;
+
+			// Call action handler for this message type. The message may be retired before the handler returns 
+			src = mm->src;
+			tag = mm->tag;
+			type = mm->type;
+			MCTP_PROBE(handler_entry, src, tag, type, mm->len, ma);
+			MCTP_TRACE(self->m, MCTE_HANDLER_BEGIN, ma, src, tag, 0);
+			rv = self->m->handlers[type](self->m, ma);	
+			MCTP_TRACE(self->m, MCTE_HANDLER_END, ma, src, tag, 0);
+			MCTP_PROBE(handler_return, src, tag, type, rv);
 		}
 		else 
 		{
 			TLOOP(3) // LOOP 3: A MSG response. Find action in tags and call completion function / handler
 
-			// Lock mutex for tags array 
-			pthread_mutex_lock(&self->m->tags_mtx);
-			{ 
-				// Get action for this tag from tags array
-				ma = self->m->tags[mm->tag];
+			// The response comes from the EID the request was sent to 
+			ma = mctp_tags_lookup(self->m, mm->src, mm->tag, &slot, &word);
+
+			// Take ownership of the slot so the Submission Thread cannot retire it underneath us
+			if (ma != NULL && mctp_tags_lock(self->m, slot, &word) != 0)
+				ma = NULL;
 
-				// Clear entry in the tags array
-				self->m->tags[mm->tag] = NULL;
-			}
-			pthread_mutex_unlock(&self->m->tags_mtx);
-			
 			// There was no outstanding mctp_action that corresponded to this tag, silently drop the message 
 			if (ma == NULL)
 			{
-				pq_push(self->m->msgs, mm);
+				self->dropped_unmatched++;
+				mctp_acct_drop(self->m, MCAS_MH, mm->src, mm->type, MCAD_UNMATCHED);
+				mctp_pq_push(self->m, MCPQ_MSGS, mm);
+				continue;
+			}
+
+			// A late response to a prior user of this tag, leave the action outstanding 
+			if (mctp_is_stale(ma, mm))
+			{
+				mctp_tags_unlock(self->m, slot, word);
+				self->dropped_stale++;
+				mctp_acct_drop(self->m, MCAS_MH, mm->src, mm->type, MCAD_STALE);
+				mctp_pq_push(self->m, MCPQ_MSGS, mm);
 				continue;
 			}
 
+			// Clear entry in the tags table
+			mctp_tags_release(self->m, slot, word);
+			self->matched++;
+
 			// Put response message into the action with other data
 			ma->rsp = mm;
-			timespec_get(&ma->completed, CLOCK_MONOTONIC);
+			ma->completed = mctp_now();
+			mctp_latency(&self->m->ct, ma);
+			mctp_acct_rtt(self->m, ma, mm);
+			MCTP_PROBE(action_completed, ma, mm->src, mm->tag, mm->type, ma->created, ma->completed);
+			MCTP_TRACE(self->m, MCTE_RESPONSE, ma, mm->src, mm->tag, 0);
+			MCTP_TRACE(self->m, MCTE_CB_BEGIN, ma, mm->src, mm->tag, 0);
 
 			// If the action has a unique completion handler, call it, otherwise call regular handler
 			if (ma->fn_completed != NULL)
 				ma->fn_completed(self->m, ma);
 			else 
 				self->m->handlers[mm->type](self->m, ma);	
+			MCTP_TRACE(self->m, MCTE_CB_END, ma, 0, 0, 0);
 		}
 		
 	} while (self->m->stop_threads == 0);
@@ -829,10 +1755,11 @@ end_thread:
 void *mctp_packet_writer(void *arg)
 {
 	struct packet_writer *self;
-	int rv, i, num_pkts;
+	int rv, i, num_pkts, ic;
 	struct mctp_action *ma;
 	struct mctp_msg *mm;
 	struct mctp_pkt_wrapper *pw, *prev;
+	__u32 crc;
 
 	// Initialize variables
 	self = (struct packet_writer*) arg;
@@ -843,11 +1770,26 @@ void *mctp_packet_writer(void *arg)
 	// Thread Loop
 	do
 	{
+		mctp_shm_pub_pw(self);
+
 	 	TLOOP(1) // LOOP 1: Get an mctp_action from the Transmit Message Queue
-		ma = pq_pop(self->m->tmq, self->m->wait);
+		ma = mctp_pq_pop(self->m, MCPQ_TMQ, self->m->wait);
 		if (ma == NULL) 
 			goto end_thread;
 
+		// Exit for a reconnect
+		if (MCTP_IS_HALT(self->m, ma))
+			goto end_thread;
+
+		// Pass a drain marker on to the Socket Writer, or exit if the threads are stopping 
+		if (MCTP_IS_MARKER(self->m, ma))
+		{
+			if (self->m->drain >= MCDR_STOP)
+				goto end_thread;
+			mctp_pq_push(self->m, MCPQ_TPQ, ma);
+			continue;
+		}
+
 		// Determine which message we are sending, the request or the response
 		if (ma->rsp != NULL)
 			mm = ma->rsp;
@@ -855,19 +1797,24 @@ void *mctp_packet_writer(void *arg)
 			mm = ma->req;
 
 		if (self->m->verbose & MCTP_VERBOSE_MESSAGE)
-			mctp_prnt_msg(mm);
+			mctp_log_msg(mm);
 
 		// Increment the message counter 
 		self->message_count++;
 
 		TLOOP(2) // LOOP 2: Determine length of message
-		num_pkts = mctp_pkt_count(mm);
+		ic = (mm->type < MCMT_MAX) && self->m->ic[mm->type];
+		if (ic) 
+			num_pkts = (MCLN_TYPE + mm->len + MCLN_IC + MCLN_BTU - 1) / MCLN_BTU;
+		else 
+			num_pkts = mctp_pkt_count(mm);
+		crc = 0;
 
 		TLOOP(3) // LOOP 3: Breakup mctp_msg into mctp_packets
 		for ( i = 0 ; i < num_pkts ; i++ ) 
 		{
 			TLOOP(4) // 4: Check out mctp_pkt_wrapper 
-			pw = pq_pop(self->m->pkts, self->m->wait);
+			pw = mctp_pq_pop(self->m, MCPQ_PKTS, self->m->wait);
 			if (pw == NULL)
 				goto end_thread;
 
@@ -896,20 +1843,20 @@ void *mctp_packet_writer(void *arg)
 			pw->pkt.hdr.tag   = mm->tag;
 
 			// Determine if this is the End of Message Packet
-			if (i == (num_pkts - 1))
-				pw->pkt.hdr.eom = 1;
+			pw->pkt.hdr.eom = (i == (num_pkts - 1));
+			pw->pkt.hdr.som = (i == 0);
 
 			// Set packet sequence
-			pw->pkt.hdr.seq = self->pkt_seq;
+			pw->pkt.hdr.seq = self->pkt_seq[ma->conn];
 
 			// Increment Packet Sequence for next packet
-			self->pkt_seq = (self->pkt_seq + 1) % 4;
+			self->pkt_seq[ma->conn] = (self->pkt_seq[ma->conn] + 1) % 4;
 
 			// Determine if this is the Start of Message Packet
 			if (i == 0)
 			{
-				pw->pkt.hdr.som = 1;
 				pw->pkt.payload[0] = mm->type;
+				((struct mctp_type*) &pw->pkt.payload[0])->IC = ic;
 				memcpy(&pw->pkt.payload[1], &mm->payload, MCLN_BTU-1);
 			}
 			else
@@ -917,10 +1864,22 @@ void *mctp_packet_writer(void *arg)
 				// Copy data from mctp_msg data buffer to this mctp_packet data buffer
 				memcpy(pw->pkt.payload, &mm->payload[(i*MCLN_BTU)-1], MCLN_BTU);
 			}
+
+			// Compute the integrity check as each packet is filled. Store it in the last bytes of the EOM packet
+			if (ic)
+			{
+				if (pw->pkt.hdr.eom)
+				{
+					crc = htobe32(mctp_crc32c(crc, pw->pkt.payload, MCLN_BTU - MCLN_IC));
+					memcpy(&pw->pkt.payload[MCLN_BTU - MCLN_IC], &crc, MCLN_IC);
+				}
+				else 
+					crc = mctp_crc32c(crc, pw->pkt.payload, MCLN_BTU);
+			}
 		}
 
 		TLOOP(5) // LOOP 5: Submit mctp_action to Transmit Packet Queue (TPQ)
-		rv = pq_push(self->m->tpq, ma);
+		rv = mctp_pq_push(self->m, MCPQ_TPQ, ma);
 		if ( rv != 0 ) 
 			goto end_thread;
 
@@ -937,6 +1896,176 @@ end_thread:
 	return NULL;
 }
 
+/**
+ * Return packets of zero copy sends that the kernel has released
+ *
+ * Completions are read from the socket error queue. Each notification covers
+ * a range of send ids. TCP completes sends in order so every pending message 
+ * with a last id at or before the end of the range can be returned to the pool.
+ *
+ * @param self 		struct socket_writer*
+ * @param timeout 	Milliseconds to wait for a completion. 0 to not wait
+ * @return 			0 upon success, 1 if the socket reported an error 
+ */
+static int mctp_zc_reap(struct socket_writer *self, int timeout)
+{
+	struct sock_extended_err *ee;
+	struct mctp_zc_pending *zp;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	struct pollfd pfd;
+	char control[128];
+	int rv;
+
+	if (timeout > 0)
+	{
+		pfd.fd = self->m->conn;
+		pfd.events = 0;
+		pfd.revents = 0;
+		rv = poll(&pfd, 1, timeout);
+		if (rv <= 0)
+			return 0;
+	}
+
+	while (1)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		rv = recvmsg(self->m->conn, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (rv < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : 1;
+
+		for ( cm = CMSG_FIRSTHDR(&msg) ; cm != NULL ; cm = CMSG_NXTHDR(&msg, cm) )
+		{
+			ee = (struct sock_extended_err*) CMSG_DATA(cm);
+			if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0)
+				continue;
+
+			// Count sends that the kernel copied instead of pinning the pages
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				self->zerocopy_copied += ee->ee_data - ee->ee_info + 1;
+
+			// Return every message whose last send is covered by this notification 
+			while (self->zc_tail != self->zc_head)
+			{
+				zp = &self->zc_ring[self->zc_tail % MCTP_ZC_RING_SIZE];
+				if ((__s32) (zp->id - ee->ee_data) > 0)
+					break;
+
+				mctp_pkts_free(self->m, zp->pw);
+				zp->pw = NULL;
+				self->zc_tail++;
+			}
+		}
+	}
+}
+
+/**
+ * Return a linked list of packets to the pool
+ */
+static void mctp_pkts_free(struct mctp *m, struct mctp_pkt_wrapper *pw)
+{
+	struct mctp_pkt_wrapper *next;
+
+	for ( ; pw != NULL ; pw = next )
+	{
+		next = pw->next;
+		pw->next = NULL;
+		mctp_pq_push(m, MCPQ_PKTS, pw);
+	}
+}
+
+/**
+ * Send a linked list of packets in one sendmsg() call without copying them 
+ *
+ * The packets are held until the kernel reports that it no longer references 
+ * them. If the send fails they are returned to the pool.
+ *
+ * @return 0 upon success, 1 upon error 
+ */
+static int mctp_zc_send(struct socket_writer *self, struct mctp_pkt_wrapper *head)
+{
+	struct iovec iov[MCTP_ZC_IOV_MAX];
+	struct mctp_pkt_wrapper *pw;
+	struct mctp_zc_pending *zp;
+	struct msghdr msg;
+	size_t skip;
+	int rv, n, i;
+
+	// Wait for room to hold the packets until the kernel is done with them
+	while ( (self->zc_head - self->zc_tail) >= MCTP_ZC_RING_SIZE )
+		if (mctp_zc_reap(self, MCTP_ZC_REAP_MSEC) != 0)
+			goto fail;
+
+	pw = head;
+	while (pw != NULL)
+	{
+		// Gather as many packets as fit in one call 
+		for ( n = 0 ; n < MCTP_ZC_IOV_MAX && pw != NULL ; n++, pw = pw->next )
+		{
+			iov[n].iov_base = &pw->pkt;
+			iov[n].iov_len = sizeof(struct mctp_pkt);
+			MCTP_PROBE(pkt_tx, 0, pw->pkt.hdr.dest, pw->pkt.hdr.src, MCTP_HDR_FLAGS(&pw->pkt.hdr));
+			MCTP_CAPTURE(self->m, MCCD_TX, mctp_now(), &pw->pkt, MCTP_PKT_TYPE(&head->pkt));
+		}
+		self->packet_count += n;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		// A stream socket may accept part of the data. Send the rest
+		while (msg.msg_iovlen > 0)
+		{
+			rv = sendmsg(self->m->conn, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+			if (rv <= 0)
+			{
+				if (rv < 0 && errno == ENOBUFS)
+				{
+					// Out of locked memory for pinned pages. Wait for a completion and retry
+					if (mctp_zc_reap(self, MCTP_ZC_REAP_MSEC) != 0)
+						goto fail;
+					continue;
+				}
+				goto fail;
+			}
+
+			// Each successful call uses one notification id
+			self->zc_next++;
+
+			skip = rv;
+			for ( i = 0 ; i < (int) msg.msg_iovlen && skip >= msg.msg_iov[i].iov_len ; i++ )
+				skip -= msg.msg_iov[i].iov_len;
+
+			msg.msg_iov += i;
+			msg.msg_iovlen -= i;
+			if (msg.msg_iovlen > 0)
+			{
+				msg.msg_iov[0].iov_base = (__u8*) msg.msg_iov[0].iov_base + skip;
+				msg.msg_iov[0].iov_len -= skip;
+			}
+		}
+	}
+
+	// Hold the packets until the last id of this message completes 
+	zp = &self->zc_ring[self->zc_head % MCTP_ZC_RING_SIZE];
+	zp->id = self->zc_next - 1;
+	zp->pw = head;
+	self->zc_head++;
+
+	self->zerocopy_count++;
+
+	// Return packets of prior sends that have completed 
+	return mctp_zc_reap(self, 0);
+
+fail:
+
+	mctp_pkts_free(self->m, head);
+	return 1;
+}
+
 /**
  * Socket Writer Thread
  *
@@ -951,60 +2080,166 @@ void *mctp_socket_writer(void *arg)
 {
 	struct socket_writer *self;
 	struct mctp_action *ma;
-	struct mctp_pkt_wrapper *pw;
-	int rv;
+	struct mctp_pkt_wrapper *pw, *head;
+	unsigned zerocopy, len;
+	int rv, one, req, fd, conn;
 
 	// Initialize variables
 	self = (struct socket_writer*) arg;
 	TINIT
+	one = 1;
+
+	// Enable zero copy transmit on this connection if requested. Not used when striping 
+	zerocopy = (self->m->max_conns == 1) ? self->m->zerocopy : 0;
+	if (zerocopy > 0)
+	{
+		rv = setsockopt(self->m->conn, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+		if (rv != 0) 
+		{
+			TERR("Could not enable zero copy. rv:", rv);
+			zerocopy = 0;
+		}
+	}
 
 	TENTER 
 
 	// Thread Loop 
 	do 
 	{
+		mctp_shm_pub_sw(self);
+
 	 	TLOOP(1) // LOOP 1: Get an mctp_action from the Transmit Packet Queue (TPQ)
-		ma = pq_pop(self->m->tpq, self->m->wait);
-		if (ma == NULL) 
+		// Do not sleep on the queue while the kernel still holds packets. Poll for their completion instead 
+		if (self->zc_head != self->zc_tail)
+		{
+			ma = mctp_pq_pop(self->m, MCPQ_TPQ, 0);
+			if (ma == NULL) 
+			{
+				if (mctp_zc_reap(self, MCTP_ZC_REAP_MSEC) != 0)
+					goto end_thread;
+				continue;
+			}
+		}
+		else 
+		{
+			ma = mctp_pq_pop(self->m, MCPQ_TPQ, self->m->wait);
+			if (ma == NULL) 
+				goto end_thread;
+		}
+
+		// Exit for a reconnect
+		if (MCTP_IS_HALT(self->m, ma))
 			goto end_thread;
 
-		pw = ma->pw;
-		// loop through the packet linked list and send each packet
-		while (pw != NULL)
+		// Pass a drain marker on to the Completion Thread, or exit if the threads are stopping 
+		if (MCTP_IS_MARKER(self->m, ma))
 		{
-			// Increment the packet counter 
-			self->packet_count++;
+			if (self->m->drain >= MCDR_STOP)
+				goto end_thread;
+			mctp_pq_push(self->m, MCPQ_ACQ, ma);
+			continue;
+		}
+
+		// Take the packets from the action. They are returned to the pool once sent 
+		head = ma->pw;
+		ma->pw = NULL;
+		req = (ma->rsp == NULL);
+		conn = ma->conn;
+		fd = self->m->conns[conn];
+		MCTP_TRACE(self->m, MCTE_WIRE, ma, head->pkt.hdr.dest, head->pkt.hdr.tag, req);
+		mctp_acct_tx(self->m, ma, head);
+
+		// Count the bytes of the message to choose the send path 
+		len = 0;
+		for ( pw = head ; pw != NULL ; pw = pw->next )
+			len += sizeof(struct mctp_pkt);
+
+		// A request may be completed by its response as soon as it is sent. Do not touch it after this 
+		if (req)
+			__atomic_store_n(&ma->inflight, 0, __ATOMIC_RELEASE);
+
+		TLOOP(2) // LOOP 2: Send mctp_packet using socket connection
+		if ( (zerocopy > 0) && (len >= zerocopy) ) 
+		{
+			self->packet_count += len / sizeof(struct mctp_pkt);
 
-			TLOOP(2) // LOOP 2: Send mctp_packet using socket connection
-			rv = send(self->m->conn, &pw->pkt, sizeof(struct mctp_pkt), 0);
-			if (rv <= 0) 
+			rv = mctp_zc_send(self, head);
+			if (rv != 0) 
+				goto send_error;
+		}
+		else 
+		{
+			pw = head;
+			// loop through the packet linked list and send each packet
+			while (pw != NULL)
 			{
-				// If there was an error, put the mctp_action into the action completion queue and end 
-				ma->completion_code = 1;
-				pq_push(self->m->acq, ma);			
-				goto end_thread;
+				// Increment the packet counter 
+				self->packet_count++;
+
+				rv = send(fd, &pw->pkt, sizeof(struct mctp_pkt), MSG_NOSIGNAL);
+				if (rv <= 0) 
+				{
+					mctp_pkts_free(self->m, head);
+
+					// Fail over to the remaining connections. A request is resent by the Submission Thread
+					if (mctp_conn_down(self->m, conn) == 0)
+						goto send_error;
+					if (!req)
+					{
+						ma->completion_code = 1;
+						mctp_pq_push(self->m, MCPQ_ACQ, ma);
+					}
+					goto next;
+				}
+				MCTP_PROBE(pkt_tx, conn, pw->pkt.hdr.dest, pw->pkt.hdr.src, MCTP_HDR_FLAGS(&pw->pkt.hdr));
+				MCTP_CAPTURE(self->m, MCCD_TX, mctp_now(), &pw->pkt, MCTP_PKT_TYPE(&head->pkt));
+
+				// Get next mctp_pkt_wrapper in the linked list
+				pw = pw->next;
 			}
 
-			// Get next mctp_pkt_wrapper in the linked list
-			pw = pw->next;
+			// Check the packets back into the pool 
+			mctp_pkts_free(self->m, head);
+
+			self->copied_count++;
 		}
 		
-		// Set time of mctp_action completion 
-		timespec_get(&ma->completed, CLOCK_MONOTONIC);
-
 		// If the response is not null, then we need to complete the action here 
-		if (ma->rsp != NULL) 
+		if (!req) 
 		{
+			// Set time of mctp_action completion 
+			ma->completed = mctp_now();
+
 			TLOOP(3) // LOOP 3: Push mctp_action onto the Action Completion Queue
-			rv = pq_push(self->m->acq, ma);
+			rv = mctp_pq_push(self->m, MCPQ_ACQ, ma);
 			if (rv != 0) 
 				goto end_thread;
 		}
 
+next:
+		;
 	} while (self->m->stop_threads == 0);
 
+	goto end_thread;
+
+send_error:
+
+	// If there was an error, fail a response and end. A request stays outstanding and is resent after a reconnect
+	if (!req)
+	{
+		ma->completion_code = 1;
+		mctp_pq_push(self->m, MCPQ_ACQ, ma);			
+	}
+
 end_thread:
 
+	// Return packets still held for zero copy sends. The connection is closing 
+	while (self->zc_tail != self->zc_head)
+	{
+		mctp_pkts_free(self->m, self->zc_ring[self->zc_tail % MCTP_ZC_RING_SIZE].pw);
+		self->zc_tail++;
+	}
+
 	TEXIT( (self->m->stop_threads == 0) && (self->m->use_threads == 1) );
 
 	// If thread exited abnormally, request other threads to stop
@@ -1019,17 +2254,23 @@ end_thread:
  *
  * @param arg This is a void * but will only ever be a struct submission_thread*
  *
+ * An action whose EID has all of its tags in use waits on a list of that EID.
+ * Actions for other EIDs keep being taken from the TAQ behind it
+ *
  * STEPS
- * 1: Loop through tag array and check if any out standing messages need to be resubmitted or retired 
- * 2: Loop through tag array and check for empty slots 
+ * 1: Loop through tag table and check if any out standing messages need to be resubmitted or retired 
+ * 2: Assign tags to new actions from the Transmit Action Queue (TAQ)
  * 3: Put thread to sleep 
  */
 void *mctp_submission_thread(void *arg)
 {
 	struct submission_thread *self;
+	struct mctp_tag_slot *s;
 	struct mctp_action *ma;
-	struct timespec ts;
-	int i, rv;
+	mctp_ticks_t now;
+	__u64 word;
+	int i, rv, busy;
+	__u8 eid;
 
 	// Initialize variables
 	self = (struct submission_thread*) arg;
@@ -1040,77 +2281,140 @@ void *mctp_submission_thread(void *arg)
 	// Thread Loop 
 	do 
 	{
-		pthread_mutex_lock(&self->m->tags_mtx);
+		mctp_shm_pub_st(self);
+
+ 		//TLOOP(1) // LOOP 1: Loop through tag table and check if any out standing messages need to be resubmitted or retired 
+		// One clock read serves the whole pass
+		now = mctp_now();
+		busy = 0;
+		for ( i = 0 ; i < MCTP_TAG_TABLE_SIZE ; i++ )
 		{
-	 		//TLOOP(1) // LOOP 1: Loop through tag array and check if any out standing messages need to be resubmitted or retired 
-			for ( i = 0 ; i < MCTP_NUM_TAGS ; i++ )
-			{
-				ma = self->m->tags[i];
+			s = &self->m->tags.slots[i];
+			word = __atomic_load_n(&s->word, __ATOMIC_ACQUIRE);
 
-				// If this slot is NULL skip it 
-				if (ma == NULL) 
-					continue; 
+			// If this slot is not in use skip it 
+			if ( (word & MCTP_TAG_BUSY) == 0 ) 
+				continue; 
 
-				// Test if timeout has elapsed, if not skip
-				timespec_add(&ma->submitted, &self->action_delta, &ts);
-				rv = timespec_elapsed(&ts, CLOCK_MONOTONIC);
-				if (rv == 0) 
-					continue;
+			busy++;
 
-				// if we have exceeded the retry count, retire action 
-				if (ma->num >= ma->max) 
-				{
-					// If action has a retire function call it
-					if (ma->fn_failed != NULL) 
-						ma->fn_failed(self->m, ma);
-					else 
-						mctp_retire(self->m, ma);
-
-					// Set the current tag to NULL to clear it 
-					self->m->tags[i] = NULL;
-				}
+			// Take ownership of the slot. If a response claimed it first skip it
+			if (mctp_tags_lock(self->m, i, &word) != 0)
+				continue;
+
+			ma = s->ma;
+
+			// Test if timeout has elapsed, if not skip. An action still waiting to be sent is never resubmitted 
+			if ((__s64) (now - ma->submitted) < (__s64) self->action_delta || __atomic_load_n(&ma->inflight, __ATOMIC_ACQUIRE)) 
+			{
+				mctp_tags_unlock(self->m, i, word);
+				continue;
+			}
+
+			// if we have exceeded the retry count, retire action 
+			if (ma->num >= ma->max) 
+			{
+				// Clear the tag before the action is handed back
+				mctp_tags_release(self->m, i, word);
+				MCTP_PROBE(action_failed, ma, ma->req->dst, ma->req->tag, ma->num, ma->created, now);
+				MCTP_TRACE(self->m, MCTE_FAILED, ma, ma->req->dst, ma->req->tag, ma->num);
+				mctp_acct_timeout(self->m, ma);
+				MCTP_TRACE(self->m, MCTE_CB_BEGIN, ma, ma->req->dst, ma->req->tag, 0);
+
+				// If action has a retire function call it
+				if (ma->fn_failed != NULL) 
+					ma->fn_failed(self->m, ma);
 				else 
-				{
-					// Increment the message submission count 
-					ma->num++;
+					mctp_retire(self->m, ma);
+				MCTP_TRACE(self->m, MCTE_CB_END, ma, 0, 0, 0);
+			}
+			else 
+			{
+				// Increment the message submission count 
+				ma->num++;
 
-					// Set the submission time to now 
-					timespec_get(&ma->submitted, CLOCK_MONOTONIC);
+				// Set the submission time to now 
+				ma->submitted = now;
 
-					// Resubmit the mctp_action
-					pq_push(self->m->tmq, ma);
-				}
+				// Responses are not accepted until the Socket Writer is done with the action
+				__atomic_store_n(&ma->inflight, 1, __ATOMIC_RELAXED);
+
+				// Move to another connection if the one used before has failed
+				ma->conn = mctp_conn_pick(self->m, ma);
+				MCTP_PROBE(action_retried, ma, ma->req->dst, ma->req->tag, ma->num, ma->created, now);
+				MCTP_TRACE(self->m, MCTE_SENT, ma, ma->req->dst, ma->req->tag, ma->num);
+				mctp_acct_retry(self->m, ma);
+
+				mctp_tags_unlock(self->m, i, word);
+
+				// Resubmit the mctp_action
+				mctp_pq_push(self->m, MCPQ_TMQ, ma);
 			}
-			
-	 		//TLOOP(2) // LOOP 2: Loop through tag array and check for empty slots 
-			for ( i = 0 ; i < MCTP_NUM_TAGS ; i++ )
+		}
+		self->tags_in_use = busy;
+
+		// Keep misses short as (EID, tag) pairs are used and released 
+		mctp_tags_trim(self->m);
+		
+ 		//TLOOP(2) // LOOP 2: Assign tags to new actions from the Transmit Action Queue (TAQ)
+		// Retry the actions that could not get a tag, oldest first for each EID
+		for ( i = 0 ; i < MCTP_NUM_EIDS && self->deferred_num > 0 ; i++ )
+		{
+			while ( (ma = self->deferred[i]) != NULL )
 			{
-				ma = self->m->tags[i];
+				if (mctp_tags_assign(self->m, ma) != 0)
+					break;
 
-				// If this slot is not NULL skip it 
-				if (ma != NULL) 
-					continue; 
+				self->deferred[i] = ma->next;
+				if (self->deferred[i] == NULL)
+					self->deferred_tail[i] = NULL;
+				ma->next = NULL;
+				self->deferred_num--;
 
-				// If there is no action in this tag slot check if there is a new command to issue 
-				ma = pq_pop(self->m->taq, 0);	
+				mctp_st_send(self, ma);
+			}
+		}
 
-				// If ma is NULL then there are no actions in the submission queue 
-				if (ma == NULL) 
-					continue;
-				
-				// Fill out action 
-				ma->num = 1;
-				timespec_get(&ma->submitted, CLOCK_MONOTONIC);
+		// Every action queued ahead of a held drain marker now has a tag. Pass it on
+		if (self->marker != NULL && self->deferred_num == 0)
+		{
+			mctp_pq_push(self->m, MCPQ_TMQ, self->marker);
+			self->marker = NULL;
+		}
+
+		// Take no new actions while a drain marker is held 
+		while (self->marker == NULL)
+		{
+			// Check if there is a new command to issue 
+			ma = mctp_pq_pop(self->m, MCPQ_TAQ, 0);	
 
-				// Set tag in msg 
-				ma->req->tag = i;
-				self->m->tags[i] = ma;
+			// If ma is NULL then there are no actions in the submission queue 
+			if (ma == NULL) 
+				break;
 
-				// submit mctp_action to tmq
-				rv = pq_push(self->m->tmq, ma);
+			// Pass a drain marker on once every action queued ahead of it has a tag
+			if (MCTP_IS_MARKER(self->m, ma))
+			{
+				if (self->deferred_num > 0)
+					self->marker = ma;
+				else
+					mctp_pq_push(self->m, MCPQ_TMQ, ma);
+				continue;
+			}
+			
+			// Responses are not accepted until the Socket Writer is done with the action
+			ma->inflight = 1;
+
+			// All tags for this EID are in use, or older actions of the EID are waiting. Hold the action until one frees up 
+			eid = ma->req->dst;
+			if (self->deferred[eid] != NULL || mctp_tags_assign(self->m, ma) != 0)
+			{
+				mctp_st_defer(self, ma);
+				continue;
 			}
+
+			mctp_st_send(self, ma);
 		}
-		pthread_mutex_unlock(&self->m->tags_mtx);
 
 		//TLOOP(3) // LOOP 3: Put thread to sleep 
 		pthread_mutex_lock(&self->mtx);
@@ -1141,6 +2445,50 @@ void *mctp_submission_thread(void *arg)
 	return NULL;
 }
 
+/**
+ * Add a latency to a histogram of the Completion Thread 
+ *
+ * Requests are recorded by the Message Handler and responses by the Completion 
+ * Thread, so each stage has one writer. Read without locking by the metrics exporter 
+ */
+static void mctp_latency_add(struct completion_thread *self, int stage, mctp_ticks_t start, mctp_ticks_t end)
+{
+	__u64 ns, us;
+	int i;
+
+	if (start == 0 || end < start)
+		return;
+
+	ns = mctp_ticks_to_ns(end - start);
+	us = ns / 1000;
+
+	i = (us == 0) ? 0 : 64 - __builtin_clzll(us);
+	if (i >= MCTP_LAT_BUCKETS)
+		i = MCTP_LAT_BUCKETS - 1;
+
+	__atomic_store_n(&self->lat_hist[stage][i], self->lat_hist[stage][i] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->lat_sum[stage], self->lat_sum[stage] + ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * Record the stage latencies of a successful action 
+ *
+ * An action with a tag is a request this endpoint sent. Otherwise it is a 
+ * request this endpoint received and responded to
+ */
+static void mctp_latency(struct completion_thread *self, struct mctp_action *ma)
+{
+	if (ma->tagged != 0)
+	{
+		mctp_latency_add(self, MCLS_QUEUE, ma->created, ma->tagged);
+		if (ma->rsp != NULL)
+			mctp_latency_add(self, MCLS_WIRE, ma->submitted, ma->rsp->ts);
+		mctp_latency_add(self, MCLS_TOTAL, ma->created, ma->completed);
+	}
+	else 
+		mctp_latency_add(self, MCLS_RESPOND, ma->created, ma->completed);
+}
+
 /**
  * Action Completion Thread 
  *
@@ -1162,38 +2510,67 @@ void *mctp_completion_thread(void *arg)
 	// Thread Loop 
 	do 
 	{
+		mctp_shm_pub_ct(self);
+
 		TLOOP(1) // LOOP 1: Pop an action off of the Action Completion Queue (ACQ)
-		ma = pq_pop(self->m->acq, 1);
+		ma = mctp_pq_pop(self->m, MCPQ_ACQ, 1);
 		if (ma == NULL) 
 			goto end_thread;
 
+		// Exit for a reconnect
+		if (MCTP_IS_HALT(self->m, ma))
+			goto end_thread;
+
+		// A drain marker has passed every queue. Tell mctp_drain(), or exit if the threads are stopping 
+		if (MCTP_IS_MARKER(self->m, ma))
+		{
+			if (self->m->drain >= MCDR_STOP)
+				goto end_thread;
+
+			pthread_mutex_lock(&self->m->drain_mtx);
+			self->m->markers++;
+			pthread_cond_broadcast(&self->m->drained);
+			pthread_mutex_unlock(&self->m->drain_mtx);
+			continue;
+		}
+
 		// Set completion time 
-		timespec_get(&ma->completed, CLOCK_MONOTONIC);
+		ma->completed = mctp_now();
 
 		// Increment completed action counter 
 		self->completed_actions++;
 
+		if (ma->completion_code == 0)
+			mctp_latency(self, ma);
+
 		if (ma->completion_code != 0)
 		{
 			TLOOP(2) // LOOP 2: Increment failed action counter 
 			self->failed_actions++;
+			MCTP_PROBE(action_failed, ma, ma->req->src, ma->req->tag, ma->num, ma->created, ma->completed);
+			MCTP_TRACE(self->m, MCTE_FAILED, ma, ma->req->src, ma->req->tag, ma->num);
+			MCTP_TRACE(self->m, MCTE_CB_BEGIN, ma, ma->req->src, ma->req->tag, 0);
 
 			// If the action has a fail handler call it
 			if (ma->fn_failed != NULL)
 				ma->fn_failed(self->m, ma);
 			else 
 				mctp_retire(self->m, ma);	
+			MCTP_TRACE(self->m, MCTE_CB_END, ma, 0, 0, 0);
 		}
 		else 
 		{
 			TLOOP(3) // LOOP 3: Increment successful action counter 
 			self->successful_actions++;
+			MCTP_PROBE(action_completed, ma, ma->req->src, ma->req->tag, ma->req->type, ma->created, ma->completed);
+			MCTP_TRACE(self->m, MCTE_CB_BEGIN, ma, ma->req->src, ma->req->tag, 0);
 
 			// If the action has a completed handler call it
 			if (ma->fn_completed != NULL)
 				ma->fn_completed(self->m, ma);
 			else 
 				mctp_retire(self->m, ma);	
+			MCTP_TRACE(self->m, MCTE_CB_END, ma, 0, 0, 0);
 		}
 
 	} while (self->m->stop_threads == 0);
@@ -1209,3 +2586,70 @@ end_thread:
 	return NULL;
 }
 
+/**
+ * Hold an action that could not get a tag behind the other actions of its EID
+ */
+static void mctp_st_defer(struct submission_thread *self, struct mctp_action *ma)
+{
+	__u8 eid;
+
+	eid = ma->req->dst;
+	ma->next = NULL;
+
+	if (self->deferred_tail[eid] != NULL)
+		self->deferred_tail[eid]->next = ma;
+	else
+		self->deferred[eid] = ma;
+	self->deferred_tail[eid] = ma;
+	self->deferred_num++;
+}
+
+/**
+ * Send the first transmission of an action that was assigned a tag
+ */
+static void mctp_st_send(struct submission_thread *self, struct mctp_action *ma)
+{
+	// Fill out action 
+	ma->num = 1;
+	ma->conn = mctp_conn_pick(self->m, ma);
+	ma->submitted = mctp_now();
+	MCTP_TRACE(self->m, MCTE_SENT, ma, ma->req->dst, ma->req->tag, ma->num);
+
+	// submit mctp_action to tmq
+	mctp_pq_push(self->m, MCPQ_TMQ, ma);
+}
+
+/**
+ * Determine if a response belongs to a prior user of the (EID, tag) pair
+ *
+ * A response whose first packet arrived before the tag was assigned to this 
+ * action cannot be for it. For MCTP Control messages the Instance ID and 
+ * Command must also match the request.
+ *
+ * @return 1 if the response is stale, 0 otherwise
+ */
+static int mctp_is_stale(struct mctp_action *ma, struct mctp_msg *mm)
+{
+	struct mctp_ctrl *req, *rsp;
+
+	// The request is still queued for transmit so this cannot be its response 
+	if (__atomic_load_n(&ma->inflight, __ATOMIC_ACQUIRE))
+		return 1;
+
+	if (mm->ts < ma->tagged)
+		return 1;
+
+	if (mm->type != ma->req->type)
+		return 1;
+
+	if (mm->type == MCMT_CONTROL)
+	{
+		req = (struct mctp_ctrl*) ma->req->payload;
+		rsp = (struct mctp_ctrl*) mm->payload;
+		if ( (req->inst != rsp->inst) || (req->cmd != rsp->cmd) )
+			return 1;
+	}
+
+	return 0;
+}
+
@@ -0,0 +1,568 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		trace.c
+ *
+ * @brief 		Code file for the action trace of the MCTP transport library
+ *
+ * @details 	While tracing runs, each stage an action passes through records
+ * 				an event in a ring shared by the threads of the mctp object:
+ * 				queued, tag assigned, each transmission, handed to the
+ * 				transport, response matched, and the callback. A received
+ * 				request records its handler instead.
+ *
+ * 				mctp_trace_export() writes the ring as Chrome trace event
+ * 				JSON, which chrome://tracing and ui.perfetto.dev open. Each
+ * 				thread and each (EID, tag) pair gets a track, and each
+ * 				action gets a lane that spans its lifetime.
+ *
+ * 				Recording takes no lock. A record is claimed with an atomic
+ * 				add and is overwritten once the ring wraps.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* errno
+ */
+#include <errno.h>
+
+/* FILE
+ * fopen()
+ * fprintf()
+ * fclose()
+ */
+#include <stdio.h>
+
+/* calloc()
+ * free()
+ * qsort()
+ */
+#include <stdlib.h>
+
+/* memcpy()
+ */
+#include <string.h>
+
+/* gettid()
+ */
+#include <unistd.h>
+
+/* __u8
+ * __u32
+ * __u64
+ */
+#include <linux/types.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+//#define MCTP_VERBOSE
+#ifdef MCTP_VERBOSE
+ #define INIT 			unsigned step = 0;
+ #define ENTER 					if (m->verbose & MCTP_VERBOSE_THREADS) 	printf("%d:%s Enter\n", 				gettid(), __FUNCTION__);
+ #define STEP 			step++; if (m->verbose & MCTP_VERBOSE_STEPS) 	printf("%d:%s STEP: %u\n", 				gettid(), __FUNCTION__, step);
+ #define ERR32(k, i)			if (m->verbose & MCTP_VERBOSE_ERROR) 	printf("%d:%s STEP: %u ERR: %s: %d\n",	gettid(), __FUNCTION__, step, k, i);
+ #define EXIT(rc) 				if (m->verbose & MCTP_VERBOSE_THREADS)	printf("%d:%s Exit: %d\n", 				gettid(), __FUNCTION__,rc);
+#else
+ #define INIT
+ #define ENTER
+ #define STEP
+ #define ERR32(k, i)
+ #define EXIT(rc)
+#endif
+
+// Process ids of the groups of tracks in the exported file
+#define TRACE_PID_THREADS 				1
+#define TRACE_PID_TAGS 					2
+#define TRACE_PID_ACTIONS 				3
+
+// Track of an (EID, tag) pair. Track 0 is avoided
+#define TRACE_TAG_TRACK(eid, tag) 		(((eid) << 3 | (tag)) + 1)
+
+/* STRUCTS ===================================================================*/
+
+/**
+ * State of an action while its events are exported
+ */
+struct trace_action
+{
+	__u64 id;
+	int open; 						//!< Its lane has begun and not ended
+	int tagged; 					//!< Holds a tag
+	mctp_ticks_t tagged_ts;
+	__u8 eid;
+	__u8 tag;
+};
+
+/**
+ * Thread seen in the exported events
+ */
+struct trace_thread
+{
+	__u32 tid;
+	const char *name; 				//!< NULL until an event names its role
+};
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+/**
+ * String representations of the trace events (MCTE)
+ */
+static const char *STR_MCTE[] = {
+	"queued",
+	"tagged",
+	"sent",
+	"wire",
+	"response",
+	"failed",
+	"callback",
+	"callback end",
+	"handler",
+	"handler end",
+};
+
+/* PROTOTYPES ================================================================*/
+
+static size_t mctp_trace_snapshot(struct mctp_trace *tr, struct mctp_trace_rec **out);
+static int mctp_trace_cmp(const void *a, const void *b);
+static struct trace_action *mctp_trace_action(struct trace_action *tbl, size_t mask, __u64 id);
+static const char *mctp_trace_role(int ev);
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Start recording the lifecycle events of the actions of an mctp object
+ *
+ * May be called before or after mctp_run(). A thread may still be writing 
+ * to the ring right after mctp_trace_stop(), so the ring is only cleared or 
+ * replaced by one of another size while the threads are stopped. Records 
+ * left from a prior run are otherwise kept and overwritten as usual
+ *
+ * @param ring 	Records in the ring. 0 for MCTP_TRACE_RING_SIZE. Rounded up to a power of 2
+ * @return 		0 upon success, 1 otherwise and sets errno. EINVAL if the size differs while the threads run
+ *
+ * STEPS
+ * 1: Verify input
+ * 2: Allocate the ring the first time or when its size changes
+ * 3: Clear the ring if the threads are stopped
+ * 4: Start recording
+ */
+int mctp_trace_start(struct mctp *m, unsigned ring)
+{
+	INIT
+	struct mctp_trace *tr;
+	__u64 size, i;
+	int rv;
+
+	ENTER
+
+	// Initialize variables
+	rv = 1;
+
+	STEP // 1: Verify input
+	if (m->trace)
+	{
+		errno = EBUSY;
+		goto end;
+	}
+	if (ring == 0)
+		ring = MCTP_TRACE_RING_SIZE;
+	for ( size = 1 ; size < ring ; size <<= 1 );
+
+	STEP // 2: Allocate the ring the first time or when its size changes
+	if (m->tr != NULL && m->tr->mask != size - 1)
+	{
+		if (__atomic_load_n(&m->threads_running, __ATOMIC_ACQUIRE))
+		{
+			errno = EINVAL;
+			goto end;
+		}
+		free(m->tr->recs);
+		free(m->tr);
+		m->tr = NULL;
+	}
+	if (m->tr == NULL)
+	{
+		tr = calloc(1, sizeof(struct mctp_trace));
+		if (tr == NULL)
+			goto end;
+
+		tr->recs = calloc(size, sizeof(struct mctp_trace_rec));
+		if (tr->recs == NULL)
+		{
+			free(tr);
+			goto end;
+		}
+		tr->mask = size - 1;
+		m->tr = tr;
+	}
+	tr = m->tr;
+
+	STEP // 3: Clear the ring if the threads are stopped
+	if (!__atomic_load_n(&m->threads_running, __ATOMIC_ACQUIRE))
+	{
+		for ( i = 0 ; i <= tr->mask ; i++ )
+			__atomic_store_n(&tr->recs[i].seq, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&tr->head, 0, __ATOMIC_RELEASE);
+	}
+
+	STEP // 4: Start recording
+	__atomic_store_n(&m->trace, 1, __ATOMIC_RELEASE);
+
+	rv = 0;
+
+end:
+
+	EXIT(rv);
+
+	return rv;
+}
+
+/**
+ * Stop recording. The records are kept for mctp_trace_export()
+ *
+ * @return 		0 upon success, 1 if tracing was not running
+ */
+int mctp_trace_stop(struct mctp *m)
+{
+	if (!m->trace)
+		return 1;
+
+	__atomic_store_n(&m->trace, 0, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * Record a lifecycle event of an action. Called through MCTP_TRACE()
+ *
+ * @param ev 	enum _MCTE
+ * @param ma 	Action the event belongs to. Only its address is recorded
+ * @param eid 	EID the request was sent to or received from
+ * @param num 	Transmission attempt of MCTE_SENT, 1 for a request in MCTE_WIRE
+ */
+void mctp_trace_event(struct mctp *m, int ev, const void *ma, int eid, int tag, int num)
+{
+	static __thread __u32 tid;
+	struct mctp_trace *tr;
+	struct mctp_trace_rec *rec;
+	__u64 i;
+
+	if (tid == 0)
+		tid = gettid();
+
+	tr = m->tr;
+	i = __atomic_fetch_add(&tr->head, 1, __ATOMIC_RELAXED);
+	rec = &tr->recs[i & tr->mask];
+
+	// Readers skip the record until its sequence number is stored again
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec->ts = mctp_now();
+	rec->id = (__u64) (uintptr_t) ma;
+	rec->tid = tid;
+	rec->ev = ev;
+	rec->eid = eid;
+	rec->tag = tag;
+	rec->num = num;
+
+	__atomic_store_n(&rec->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write the recorded events to a file as Chrome trace event JSON
+ *
+ * May be called while tracing runs. Events recorded during the export may
+ * be left out
+ *
+ * @param path 	File to create or truncate
+ * @return 		0 upon success, 1 otherwise and sets errno
+ *
+ * STEPS
+ * 1: Verify input
+ * 2: Copy the records out of the ring and sort them by time
+ * 3: Allocate the action table and thread list
+ * 4: Open the file and name the track groups
+ * 5: Write each event to its thread track, tag track and action lane
+ * 6: Name the thread tracks
+ * 7: Close the file
+ */
+int mctp_trace_export(struct mctp *m, const char *path)
+{
+	INIT
+	struct mctp_trace_rec *recs, *r;
+	struct trace_action *tbl, *a;
+	struct trace_thread *threads;
+	__u8 *named;
+	FILE *fp;
+	mctp_ticks_t t0;
+	double ts;
+	size_t n, i, k, mask, num_threads;
+	int rv;
+
+	ENTER
+
+	// Initialize variables
+	rv = 1;
+	recs = NULL;
+	tbl = NULL;
+	threads = NULL;
+	named = NULL;
+	fp = NULL;
+
+	STEP // 1: Verify input
+	if (path == NULL || m->tr == NULL)
+	{
+		errno = EINVAL;
+		goto end;
+	}
+
+	STEP // 2: Copy the records out of the ring and sort them by time
+	n = mctp_trace_snapshot(m->tr, &recs);
+	if (recs == NULL)
+		goto end;
+	qsort(recs, n, sizeof(struct mctp_trace_rec), mctp_trace_cmp);
+	t0 = (n > 0) ? recs[0].ts : 0;
+
+	STEP // 3: Allocate the action table and thread list
+	for ( mask = 1 ; mask < 2 * n ; mask <<= 1 );
+	tbl = calloc(mask, sizeof(struct trace_action));
+	threads = calloc(n + 1, sizeof(struct trace_thread));
+	named = calloc(MCTP_NUM_EIDS * MCTP_NUM_TAGS, 1);
+	if (tbl == NULL || threads == NULL || named == NULL)
+		goto end;
+	mask--;
+	num_threads = 0;
+
+	STEP // 4: Open the file and name the track groups
+	fp = fopen(path, "w");
+	if (fp == NULL)
+	{
+		ERR32("fopen", errno);
+		goto end;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(fp, "{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\",\"args\":{\"name\":\"Threads\"}},\n", TRACE_PID_THREADS);
+	fprintf(fp, "{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\",\"args\":{\"name\":\"Tags\"}},\n", TRACE_PID_TAGS);
+	fprintf(fp, "{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\",\"args\":{\"name\":\"Actions\"}}", TRACE_PID_ACTIONS);
+
+	STEP // 5: Write each event to its thread track, tag track and action lane
+	for ( i = 0 ; i < n ; i++ )
+	{
+		r = &recs[i];
+		ts = mctp_ticks_to_ns(r->ts - t0) / 1000.0;
+
+		// Remember the thread and name it after the first event that shows its role
+		for ( k = 0 ; k < num_threads && threads[k].tid != r->tid ; k++ );
+		if (k == num_threads)
+			threads[num_threads++].tid = r->tid;
+		if (threads[k].name == NULL)
+			threads[k].name = mctp_trace_role(r->ev);
+
+		// Thread track. Callbacks and handlers are spans, the rest are instants
+		switch (r->ev)
+		{
+			case MCTE_CB_BEGIN:
+			case MCTE_HANDLER_BEGIN:
+				fprintf(fp, ",\n{\"ph\":\"B\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"name\":\"%s\",\"args\":{\"action\":\"0x%llx\"}}",
+					TRACE_PID_THREADS, r->tid, ts, STR_MCTE[r->ev], (unsigned long long) r->id);
+				break;
+
+			case MCTE_CB_END:
+			case MCTE_HANDLER_END:
+				fprintf(fp, ",\n{\"ph\":\"E\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f}", TRACE_PID_THREADS, r->tid, ts);
+				break;
+
+			default:
+				fprintf(fp, ",\n{\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"name\":\"%s\","
+					"\"args\":{\"action\":\"0x%llx\",\"eid\":%u,\"tag\":%u,\"num\":%u}}",
+					TRACE_PID_THREADS, r->tid, ts, STR_MCTE[r->ev], (unsigned long long) r->id, r->eid, r->tag, r->num);
+				break;
+		}
+
+		// Action lane. Begins when the action is queued or its request received, ends after its callback
+		a = mctp_trace_action(tbl, mask, r->id);
+		if (r->ev == MCTE_QUEUED || (r->ev == MCTE_HANDLER_BEGIN && !a->open))
+		{
+			if (a->open)
+				fprintf(fp, ",\n{\"ph\":\"e\",\"cat\":\"action\",\"id\":\"0x%llx\",\"pid\":%d,\"tid\":0,\"ts\":%.3f,\"name\":\"action\"}",
+					(unsigned long long) r->id, TRACE_PID_ACTIONS, ts);
+			a->open = 1;
+			a->tagged = 0;
+			fprintf(fp, ",\n{\"ph\":\"b\",\"cat\":\"action\",\"id\":\"0x%llx\",\"pid\":%d,\"tid\":0,\"ts\":%.3f,\"name\":\"action\","
+				"\"args\":{\"eid\":%u,\"%s\":1}}",
+				(unsigned long long) r->id, TRACE_PID_ACTIONS, ts, r->eid, (r->ev == MCTE_QUEUED) ? "request" : "response");
+		}
+		if (a->open)
+		{
+			fprintf(fp, ",\n{\"ph\":\"n\",\"cat\":\"action\",\"id\":\"0x%llx\",\"pid\":%d,\"tid\":0,\"ts\":%.3f,\"name\":\"%s\"}",
+				(unsigned long long) r->id, TRACE_PID_ACTIONS, ts, STR_MCTE[r->ev]);
+			if (r->ev == MCTE_CB_END)
+			{
+				fprintf(fp, ",\n{\"ph\":\"e\",\"cat\":\"action\",\"id\":\"0x%llx\",\"pid\":%d,\"tid\":0,\"ts\":%.3f,\"name\":\"action\"}",
+					(unsigned long long) r->id, TRACE_PID_ACTIONS, ts);
+				a->open = 0;
+			}
+		}
+
+		// Tag track. Spans the time a request holds its tag, with its transmissions
+		switch (r->ev)
+		{
+			case MCTE_TAGGED:
+				a->tagged = 1;
+				a->tagged_ts = r->ts;
+				a->eid = r->eid;
+				a->tag = r->tag;
+				k = TRACE_TAG_TRACK(r->eid, r->tag & 0x07) - 1;
+				if (!named[k])
+				{
+					named[k] = 1;
+					fprintf(fp, ",\n{\"ph\":\"M\",\"pid\":%d,\"tid\":%zu,\"name\":\"thread_name\",\"args\":{\"name\":\"EID 0x%02x tag %u\"}}",
+						TRACE_PID_TAGS, k + 1, r->eid, r->tag & 0x07);
+				}
+				break;
+
+			case MCTE_SENT:
+			case MCTE_WIRE:
+				if (!a->tagged || (r->ev == MCTE_WIRE && r->num == 0))
+					break;
+				fprintf(fp, ",\n{\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"name\":\"%s\",\"args\":{\"action\":\"0x%llx\",\"num\":%u}}",
+					TRACE_PID_TAGS, TRACE_TAG_TRACK(a->eid, a->tag & 0x07), ts, STR_MCTE[r->ev], (unsigned long long) r->id, r->num);
+				break;
+
+			case MCTE_RESPONSE:
+			case MCTE_FAILED:
+				if (!a->tagged)
+					break;
+				fprintf(fp, ",\n{\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"name\":\"%s\",\"args\":{\"action\":\"0x%llx\"}}",
+					TRACE_PID_TAGS, TRACE_TAG_TRACK(a->eid, a->tag & 0x07), mctp_ticks_to_ns(a->tagged_ts - t0) / 1000.0,
+					mctp_ticks_to_ns(r->ts - a->tagged_ts) / 1000.0, STR_MCTE[r->ev], (unsigned long long) r->id);
+				a->tagged = 0;
+				break;
+		}
+	}
+
+	STEP // 6: Name the thread tracks
+	for ( k = 0 ; k < num_threads ; k++ )
+		fprintf(fp, ",\n{\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":\"%s %u\"}}",
+			TRACE_PID_THREADS, threads[k].tid, (threads[k].name != NULL) ? threads[k].name : "Completion Thread", threads[k].tid);
+
+	fprintf(fp, "\n]}\n");
+
+	STEP // 7: Close the file
+	if (ferror(fp))
+	{
+		errno = EIO;
+		fclose(fp);
+		goto end;
+	}
+	if (fclose(fp) != 0)
+		goto end;
+
+	rv = 0;
+
+end:
+
+	free(recs);
+	free(tbl);
+	free(threads);
+	free(named);
+
+	EXIT(rv);
+
+	return rv;
+}
+
+/**
+ * Copy the whole records of the ring, oldest first
+ *
+ * @param out 	Set to an array of the records. NULL if it could not be allocated
+ * @return 		Number of records copied
+ */
+static size_t mctp_trace_snapshot(struct mctp_trace *tr, struct mctp_trace_rec **out)
+{
+	struct mctp_trace_rec *recs, *rec;
+	__u64 head, first, i, seq;
+	size_t n;
+
+	head = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE);
+	first = (head > tr->mask + 1) ? head - tr->mask - 1 : 0;
+
+	recs = malloc((head - first + 1) * sizeof(struct mctp_trace_rec));
+	*out = recs;
+	if (recs == NULL)
+		return 0;
+
+	n = 0;
+	for ( i = first ; i < head ; i++ )
+	{
+		rec = &tr->recs[i & tr->mask];
+
+		// Skip a record being written, or one overwritten while it was copied
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if (seq != i + 1)
+			continue;
+		memcpy(&recs[n], rec, sizeof(struct mctp_trace_rec));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * Order records by time, then by the order they were claimed
+ */
+static int mctp_trace_cmp(const void *a, const void *b)
+{
+	const struct mctp_trace_rec *x = a, *y = b;
+
+	if (x->ts != y->ts)
+		return (x->ts < y->ts) ? -1 : 1;
+
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/**
+ * Find or insert the export state of an action
+ */
+static struct trace_action *mctp_trace_action(struct trace_action *tbl, size_t mask, __u64 id)
+{
+	size_t i;
+
+	for ( i = (id >> 4) & mask ; tbl[i].id != 0 && tbl[i].id != id ; i = (i + 1) & mask );
+	tbl[i].id = id;
+
+	return &tbl[i];
+}
+
+/**
+ * Name of the thread that records an event. NULL if more than one thread does
+ */
+static const char *mctp_trace_role(int ev)
+{
+	switch (ev)
+	{
+		case MCTE_QUEUED: 			return "Caller";
+		case MCTE_TAGGED: 			return "Submission Thread";
+		case MCTE_SENT: 			return "Submission Thread";
+		case MCTE_WIRE: 			return "Socket Writer";
+		case MCTE_RESPONSE: 		return "Message Handler";
+		case MCTE_HANDLER_BEGIN: 	return "Message Handler";
+		case MCTE_HANDLER_END: 		return "Message Handler";
+		default: 					return NULL;
+	}
+}
+
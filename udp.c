@@ -0,0 +1,457 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		udp.c
+ *
+ * @brief 		Code file for the UDP transport of the MCTP transport library
+ *
+ * @details 	Each MCTP packet is carried in its own datagram. Packets are
+ * 				received in batches with recvmmsg() and transmitted with one
+ * 				UDP_SEGMENT (GSO) sendmsg() call per batch when the kernel
+ * 				supports it, or sendmmsg() when it does not.
+ *
+ * 				Lost datagrams are detected by the Packet Reader sequence number
+ * 				check and recovered by the action retry machinery.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* pid_t
+ */
+#include <sys/types.h>
+
+/* gettid()
+ */
+#include <unistd.h>
+
+/* memset()
+ */
+#include <string.h>
+
+/* errno
+ */
+#include <errno.h>
+
+/* struct mmsghdr
+ * struct msghdr
+ * struct cmsghdr
+ * recvmmsg()
+ * sendmmsg()
+ * sendmsg()
+ */
+#include <sys/socket.h>
+
+/* struct iovec
+ */
+#include <sys/uio.h>
+
+/* IPPROTO_UDP
+ */
+#include <netinet/in.h>
+
+/* __u8
+ * __u16
+ * __u32
+ * __u64
+ */
+#include <linux/types.h>
+
+#include <timeutils.h>
+#include <ptrqueue.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+//#define MCTP_VERBOSE
+#ifdef MCTP_VERBOSE
+ #define TINIT 			 self->loop=0; self->threadid = gettid();
+ #define TENTER 		              if (self->m->verbose & MCTP_VERBOSE_THREADS) 	MCTP_LOG("%d:%s Enter\n", 				self->threadid, __FUNCTION__);
+ #define TLOOP(i) 		self->loop=i; if (self->m->verbose & MCTP_VERBOSE_STEPS)    MCTP_LOG("%d:%s LOOP: %u\n", 				self->threadid, __FUNCTION__, self->loop);
+ #define TINT32(k, i)                 if (self->m->verbose & MCTP_VERBOSE_STEPS)    MCTP_LOG("%d:%s LOOP: %u %s: %d\n",		self->threadid, __FUNCTION__, self->loop, k, i);
+ #define TEXIT(rc) 			  		  if (self->m->verbose & MCTP_VERBOSE_THREADS) 	MCTP_LOG("%d:%s Exit: %d\n", 				self->threadid, __FUNCTION__,rc);
+ #define TERR(k, i)                   if (self->m->verbose & MCTP_VERBOSE_ERROR)    MCTP_LOG("%d:%s LOOP: %u ERR: %s: %d\n",	self->threadid, __FUNCTION__, self->loop, k, i);
+#else
+ #define TINIT 			self->loop = 0;	self->threadid = gettid();
+ #define TENTER
+ #define TLOOP(i) 		 self->loop=i;
+ #define TINT32(m,i)
+ #define TERR(k, i)
+ #define TEXIT(rc)
+#endif // MCTP_VERBOSE
+
+// Older C libraries do not define the UDP GSO socket option
+#ifndef SOL_UDP
+ #define SOL_UDP 						17
+#endif
+#ifndef UDP_SEGMENT
+ #define UDP_SEGMENT 					103
+#endif
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Send a batch of packets as one datagram each
+ *
+ * @param self 	struct socket_writer*
+ * @param iov 	Array of packets to send
+ * @param n 	Number of packets
+ * @return 		0 upon success, 1 upon error
+ */
+static int mctp_udp_send(struct socket_writer *self, struct iovec *iov, int n)
+{
+	struct mmsghdr mmsg[MCTP_UDP_BATCH];
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	char control[CMSG_SPACE(sizeof(__u16))];
+	int rv, i, sent, count;
+
+	sent = 0;
+	while (sent < n)
+	{
+		count = n - sent;
+
+		// Let the kernel split one buffer list into datagrams
+		if (self->gso)
+		{
+			if (count > MCTP_UDP_GSO_SEGS)
+				count = MCTP_UDP_GSO_SEGS;
+
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = &iov[sent];
+			msg.msg_iovlen = count;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			cm = CMSG_FIRSTHDR(&msg);
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(__u16));
+			*((__u16*) CMSG_DATA(cm)) = sizeof(struct mctp_pkt);
+
+			rv = sendmsg(self->m->conn, &msg, 0);
+			if (rv >= 0)
+			{
+				sent += count;
+				continue;
+			}
+
+			// Fall back to one datagram per packet if the kernel or device cannot segment
+			if (errno == EINVAL || errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
+			{
+				TERR("UDP_SEGMENT not supported. errno:", errno);
+				self->gso = 0;
+				continue;
+			}
+		}
+		else
+		{
+			if (count > MCTP_UDP_BATCH)
+				count = MCTP_UDP_BATCH;
+
+			memset(mmsg, 0, count * sizeof(struct mmsghdr));
+			for ( i = 0 ; i < count ; i++ )
+			{
+				mmsg[i].msg_hdr.msg_iov = &iov[sent + i];
+				mmsg[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			rv = sendmmsg(self->m->conn, mmsg, count, 0);
+			if (rv > 0)
+			{
+				sent += rv;
+				continue;
+			}
+		}
+
+		// The peer is not listening yet or the socket buffer is full. The datagrams are lost and the action will be retried
+		if (errno == ECONNREFUSED || errno == ENOBUFS)
+		{
+			self->dropped_count += n - sent;
+			return 0;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * UDP Socket Reader Thread
+ *
+ * Replaces mctp_socket_reader() when the UDP transport is selected
+ *
+ * @param arg This is a void * but will only ever be a struct socket_reader*
+ *
+ * STEPS
+ * 1: Fill the batch with pkts from the free pool
+ * 2: Read a batch of datagrams from the socket
+ * 3: Post received packets to Receive Packet Queue (RPQ)
+ */
+void *mctp_udp_reader(void *arg)
+{
+	struct socket_reader *self;
+	struct mctp_pkt_wrapper *pw[MCTP_UDP_BATCH];
+	struct mmsghdr mmsg[MCTP_UDP_BATCH];
+	struct iovec iov[MCTP_UDP_BATCH];
+	__u8 control[MCTP_UDP_BATCH][MCTP_RXTS_CMSG_LEN] __attribute__((aligned(8)));
+	mctp_ticks_t ts;
+	int rv, i, n;
+
+	// Initialize variables
+	self = (struct socket_reader*) arg;
+	TINIT
+	memset(pw, 0, sizeof(pw));
+	n = 0;
+	ts = 0;
+
+	TENTER
+
+	// Thread Loop
+	do
+	{
+		mctp_shm_pub_sr(self);
+
+	 	TLOOP(1) // STEP 1: Fill the batch with pkts from the free pool
+		// Wait for at least one packet. Take the rest only if available
+		for ( ; n < MCTP_UDP_BATCH ; n++ )
+		{
+			pw[n] = mctp_pq_pop(self->m, MCPQ_PKTS, (n == 0) ? self->m->wait : 0);
+			if (pw[n] == NULL)
+				break;
+		}
+		if (n == 0)
+			goto end_thread;
+		self->rx_buffers = n;
+
+		memset(mmsg, 0, n * sizeof(struct mmsghdr));
+		for ( i = 0 ; i < n ; i++ )
+		{
+			iov[i].iov_base = &pw[i]->pkt;
+			iov[i].iov_len = sizeof(struct mctp_pkt);
+			mmsg[i].msg_hdr.msg_iov = &iov[i];
+			mmsg[i].msg_hdr.msg_iovlen = 1;
+
+			// The kernel stamps each datagram within the one system call
+			if (self->m->rxts)
+			{
+				mmsg[i].msg_hdr.msg_control = control[i];
+				mmsg[i].msg_hdr.msg_controllen = MCTP_RXTS_CMSG_LEN;
+			}
+		}
+
+		TLOOP(2) // STEP 2: Read a batch of datagrams from the socket
+		rv = recvmmsg(self->m->conn, mmsg, n, MSG_WAITFORONE, NULL);
+		if (rv <= 0)
+		{
+			TINT32("recvmmsg() returned rv", rv);
+
+			// A prior datagram was refused by the peer. This is not fatal for a datagram socket
+			if (rv < 0 && (errno == ECONNREFUSED || errno == EINTR))
+				continue;
+
+			goto end_thread;
+		}
+		TINT32("recvmmsg() returned rv", rv);
+
+		// Set the time when this batch was received unless the kernel stamps each datagram
+		if (!self->m->rxts)
+			ts = mctp_now();
+
+		TLOOP(3) // STEP 3: Post mctp_packets to the Receive Packet Queue (RPQ)
+		for ( i = 0 ; i < rv ; i++ )
+		{
+			// Each datagram must hold exactly one packet. Keep the buffer for the next read
+			if ( (mmsg[i].msg_len != sizeof(struct mctp_pkt)) || (mmsg[i].msg_hdr.msg_flags & MSG_TRUNC) )
+			{
+				self->dropped_count++;
+				continue;
+			}
+
+			self->packet_count++;
+			if (!self->m->rxts)
+				pw[i]->ts = ts;
+			else if (mctp_rxts_get(self, &mmsg[i].msg_hdr, &pw[i]->ts) != 0)
+				pw[i]->ts = mctp_now();
+
+			if (mctp_pq_push(self->m, MCPQ_RPQ, pw[i]) != 0)
+			{
+				self->dropped_count++;
+				continue;
+			}
+			pw[i] = NULL;
+		}
+
+		// Compact the unused buffers to the front of the batch
+		for ( i = 0, rv = 0 ; i < n ; i++ )
+			if (pw[i] != NULL)
+				pw[rv++] = pw[i];
+		n = rv;
+		self->rx_buffers = n;
+
+	 } while (self->m->stop_threads == 0);
+
+end_thread:
+
+	// Return unused buffers to the pool
+	for ( i = 0 ; i < n ; i++ )
+		mctp_pq_push(self->m, MCPQ_PKTS, pw[i]);
+	self->rx_buffers = 0;
+
+	TEXIT( (self->m->stop_threads == 0) && (self->m->use_threads == 1) );
+
+	// If thread exited abnormally, request other threads to stop
+	if ( (self->m->stop_threads == 0) && (self->m->use_threads == 1) )
+		mctp_request_stop(self->m);
+
+	return NULL;
+}
+
+/**
+ * UDP Socket Writer Thread
+ *
+ * Replaces mctp_socket_writer() when the UDP transport is selected
+ *
+ * @param arg This is a void * but will only ever be a struct socket_writer*
+ *
+ * STEPS
+ * 1: Get a batch of mctp_actions from the Transmit Packet Queue (TPQ)
+ * 2: Send the packets of the batch using the socket
+ * 3: Push completed mctp_actions onto the Action Completion Queue
+ */
+void *mctp_udp_writer(void *arg)
+{
+	struct socket_writer *self;
+	struct mctp_action *ma[MCTP_UDP_BATCH];
+	struct mctp_pkt_wrapper *pw[MCTP_UDP_BATCH + MCTP_ZC_IOV_MAX], *p;
+	struct iovec iov[MCTP_UDP_BATCH + MCTP_ZC_IOV_MAX];
+	int rv, i, n, count, marker, req[MCTP_UDP_BATCH];
+
+	// Initialize variables
+	self = (struct socket_writer*) arg;
+	TINIT
+	self->gso = 1;
+
+	TENTER
+
+	// Thread Loop
+	do
+	{
+		mctp_shm_pub_sw(self);
+
+	 	TLOOP(1) // LOOP 1: Get a batch of mctp_actions from the Transmit Packet Queue (TPQ)
+		ma[0] = mctp_pq_pop(self->m, MCPQ_TPQ, self->m->wait);
+		if (ma[0] == NULL)
+			goto end_thread;
+
+		// Gather the packets of as many queued actions as fit in the batch. A drain marker ends the batch
+		count = 0;
+		marker = 0;
+		for ( n = 0 ; n < MCTP_UDP_BATCH ; )
+		{
+			if (MCTP_IS_MARKER(self->m, ma[n]))
+			{
+				marker = 1;
+				break;
+			}
+
+			// Take the packets from the action. They are returned to the pool once sent
+			MCTP_TRACE(self->m, MCTE_WIRE, ma[n], ma[n]->pw->pkt.hdr.dest, ma[n]->pw->pkt.hdr.tag, ma[n]->rsp == NULL);
+			mctp_acct_tx(self->m, ma[n], ma[n]->pw);
+			for ( p = ma[n]->pw ; p != NULL ; p = p->next )
+			{
+				pw[count] = p;
+				iov[count].iov_base = &p->pkt;
+				iov[count].iov_len = sizeof(struct mctp_pkt);
+				MCTP_PROBE(pkt_tx, ma[n]->conn, p->pkt.hdr.dest, p->pkt.hdr.src, MCTP_HDR_FLAGS(&p->pkt.hdr));
+				MCTP_CAPTURE(self->m, MCCD_TX, mctp_now(), &p->pkt, MCTP_PKT_TYPE(&ma[n]->pw->pkt));
+				count++;
+			}
+			ma[n]->pw = NULL;
+			req[n] = (ma[n]->rsp == NULL);
+			n++;
+
+			if ( (n == MCTP_UDP_BATCH) || (count > MCTP_UDP_BATCH) )
+				break;
+
+			ma[n] = mctp_pq_pop(self->m, MCPQ_TPQ, 0);
+			if (ma[n] == NULL)
+				break;
+		}
+		self->packet_count += count;
+
+		// A request may be completed by its response as soon as it is sent. Do not touch it after this
+		for ( i = 0 ; i < n ; i++ )
+			if (req[i])
+				__atomic_store_n(&ma[i]->inflight, 0, __ATOMIC_RELEASE);
+
+		TLOOP(2) // LOOP 2: Send the packets of the batch using the socket
+		rv = mctp_udp_send(self, iov, count);
+
+		// Check the packets back into the pool
+		for ( i = 0 ; i < count ; i++ )
+		{
+			pw[i]->next = NULL;
+			mctp_pq_push(self->m, MCPQ_PKTS, pw[i]);
+		}
+
+		if (rv != 0)
+		{
+			// If there was an error, fail the responses and end. Requests are resent by the Submission Thread
+			for ( i = 0 ; i < n ; i++ )
+			{
+				if (req[i])
+					continue;
+				ma[i]->completion_code = 1;
+				mctp_pq_push(self->m, MCPQ_ACQ, ma[i]);
+			}
+			goto end_thread;
+		}
+
+		TLOOP(3) // LOOP 3: Push mctp_actions onto the Action Completion Queue
+		for ( i = 0 ; i < n ; i++ )
+		{
+			// If the response is not null, then we need to complete the action here
+			if (!req[i])
+			{
+				// Set time of mctp_action completion
+				ma[i]->completed = mctp_now();
+
+				rv = mctp_pq_push(self->m, MCPQ_ACQ, ma[i]);
+				if (rv != 0)
+					goto end_thread;
+			}
+		}
+
+		// Pass a drain marker on to the Completion Thread, or exit if the threads are stopping
+		if (marker)
+		{
+			if (self->m->drain >= MCDR_STOP)
+				goto end_thread;
+			mctp_pq_push(self->m, MCPQ_ACQ, &self->m->marker);
+		}
+
+	} while (self->m->stop_threads == 0);
+
+end_thread:
+
+	TEXIT( (self->m->stop_threads == 0) && (self->m->use_threads == 1) );
+
+	// If thread exited abnormally, request other threads to stop
+	if ( (self->m->stop_threads == 0) && (self->m->use_threads == 1) )
+		mctp_request_stop(self->m);
+
+	return NULL;
+}
+
@@ -0,0 +1,336 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/**
+ * @file 		watchdog.c
+ *
+ * @brief 		Code file for the stage watchdog of the MCTP transport library
+ *
+ * @details 	An optional thread samples the pipeline every
+ * 				MCTP_WATCHDOG_POLL_MSEC and reports a stage that has input
+ * 				but has not made progress for longer than a threshold.
+ *
+ * 				A thread stage makes progress when it pops from its input
+ * 				queue, and has input while that queue is not empty. A pool
+ * 				stalls when every object is checked out and none is
+ * 				returned. The counters of mctp_pq_push() and mctp_pq_pop()
+ * 				are read without locks, so sampling costs the pipeline
+ * 				nothing. The loop step of a stalled thread (TLOOP) shows
+ * 				where it is stuck.
+ *
+ * 				Each stall and each recovery is passed to a callback and
+ * 				fires the stage_stall probe.
+ *
+ * @copyright 	Copyright (C) 2024 Jackrabbit Founders LLC. All rights reserved.
+ *
+ * @date 		Apr 2024
+ * @author 		Barrett Edwards <code@jrlabs.io>
+ *
+ */
+
+/* INCLUDES ==================================================================*/
+
+#define _GNU_SOURCE
+
+/* errno
+ */
+#include <errno.h>
+
+/* printf()
+ */
+#include <stdio.h>
+
+/* calloc()
+ */
+#include <stdlib.h>
+
+/* memset()
+ */
+#include <string.h>
+
+/* usleep()
+ * gettid()
+ */
+#include <unistd.h>
+
+/* pthread_create()
+ * pthread_join()
+ */
+#include <pthread.h>
+
+/* __u64
+ */
+#include <linux/types.h>
+
+#include "main.h"
+
+/* MACROS ====================================================================*/
+
+//#define MCTP_VERBOSE
+#ifdef MCTP_VERBOSE
+ #define INIT 			unsigned step = 0;
+ #define ENTER 					if (m->verbose & MCTP_VERBOSE_THREADS) 	printf("%d:%s Enter\n", 				gettid(), __FUNCTION__);
+ #define STEP 			step++; if (m->verbose & MCTP_VERBOSE_STEPS) 	printf("%d:%s STEP: %u\n", 				gettid(), __FUNCTION__, step);
+ #define ERR32(k, i)			if (m->verbose & MCTP_VERBOSE_ERROR) 	printf("%d:%s STEP: %u ERR: %s: %d\n",	gettid(), __FUNCTION__, step, k, i);
+ #define EXIT(rc) 				if (m->verbose & MCTP_VERBOSE_THREADS)	printf("%d:%s Exit: %d\n", 				gettid(), __FUNCTION__,rc);
+#else
+ #define INIT
+ #define ENTER
+ #define STEP
+ #define ERR32(k, i)
+ #define EXIT(rc)
+#endif
+
+#define LOAD(x) 						__atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/* GLOBAL VARIABLES ==========================================================*/
+
+/**
+ * Queue each stage takes its input from, or the pool of a pool stage (MCWS)
+ */
+static const int mctp_watchdog_q[] = {
+	[MCWS_PR] 		= MCPQ_RPQ,
+	[MCWS_MH] 		= MCPQ_RMQ,
+	[MCWS_PW] 		= MCPQ_TMQ,
+	[MCWS_SW] 		= MCPQ_TPQ,
+	[MCWS_ST] 		= MCPQ_TAQ,
+	[MCWS_CT] 		= MCPQ_ACQ,
+	[MCWS_PKTS] 	= MCPQ_PKTS,
+	[MCWS_MSGS] 	= MCPQ_MSGS,
+	[MCWS_ACTIONS] 	= MCPQ_ACTIONS,
+};
+
+/* PROTOTYPES ================================================================*/
+
+static void *mctp_watchdog_thread(void *arg);
+
+/* FUNCTIONS =================================================================*/
+
+/**
+ * Get the loop step and thread id of a thread stage. Both are 0 for a pool
+ */
+static void mctp_watchdog_where(struct mctp *m, int stage, __u32 *loop, pid_t *tid)
+{
+	switch (stage)
+	{
+		case MCWS_PR: 	*loop = LOAD(m->pr.loop); *tid = m->pr.threadid; break;
+		case MCWS_MH: 	*loop = LOAD(m->mh.loop); *tid = m->mh.threadid; break;
+		case MCWS_PW: 	*loop = LOAD(m->pw.loop); *tid = m->pw.threadid; break;
+		case MCWS_SW: 	*loop = LOAD(m->sw.loop); *tid = m->sw.threadid; break;
+		case MCWS_ST: 	*loop = LOAD(m->st.loop); *tid = m->st.threadid; break;
+		case MCWS_CT: 	*loop = LOAD(m->ct.loop); *tid = m->ct.threadid; break;
+		default: 		*loop = 0; *tid = 0; break;
+	}
+}
+
+/**
+ * Report a stall or a recovery of a stage
+ */
+static void mctp_watchdog_emit(struct mctp *m, int stage, int stalled, __u64 backlog, mctp_ticks_t now)
+{
+	struct mctp_watchdog *wd;
+	struct mctp_stall s;
+
+	wd = m->wd;
+
+	memset(&s, 0, sizeof(s));
+	s.stage = stage;
+	s.q = mctp_watchdog_q[stage];
+	s.stalled = stalled;
+	s.backlog = backlog;
+	s.msec = mctp_ticks_to_ns(now - wd->since[stage]) / 1000000;
+	mctp_watchdog_where(m, stage, &s.loop, &s.tid);
+
+	MCTP_PROBE(stage_stall, s.stage, s.q, s.stalled, s.loop, s.backlog, s.msec);
+
+	if (wd->fn != NULL)
+		wd->fn(m, &s);
+	else if (m->verbose & MCTP_VERBOSE_ERROR)
+		printf("%d:%s Stage %s %s: backlog: %llu loop: %u tid: %d msec: %llu\n", gettid(), __FUNCTION__,
+			mcws(stage), stalled ? "stalled" : "recovered", (unsigned long long) s.backlog, s.loop, s.tid,
+			(unsigned long long) s.msec);
+}
+
+/**
+ * Sample the progress and backlog of each stage
+ *
+ * STEPS
+ * 1: Read the progress counter and backlog of the stage
+ * 2: Restart the stall timer if the stage progressed or has no input
+ * 3: Report the stage once it has gone without progress for too long
+ */
+static void mctp_watchdog_sample(struct mctp *m)
+{
+	struct mctp_watchdog *wd;
+	mctp_ticks_t now, limit;
+	__u64 seen, backlog;
+	int i, q;
+
+	wd = m->wd;
+	now = mctp_now();
+	limit = mctp_ns_to_ticks(wd->msec * 1000000ULL);
+
+	for ( i = 0 ; i < MCWS_MAX ; i++ )
+	{
+		// STEP 1: Read the progress counter and backlog of the stage
+		q = mctp_watchdog_q[i];
+		backlog = mctp_pq_depth(m, q);
+		if (q <= MCPQ_ACTIONS)
+		{
+			seen = LOAD(m->pq_count[q].push);
+			if (backlog < mctp_pq_size(q))
+				backlog = 0;
+		}
+		else
+			seen = LOAD(m->pq_count[q].pop);
+
+		// STEP 2: Restart the stall timer if the stage progressed or has no input
+		if (seen != wd->seen[i] || backlog == 0)
+		{
+			if (wd->stalled[i])
+			{
+				wd->stalled[i] = 0;
+				mctp_watchdog_emit(m, i, 0, backlog, now);
+			}
+			wd->seen[i] = seen;
+			wd->since[i] = now;
+			continue;
+		}
+
+		// STEP 3: Report the stage once it has gone without progress for too long
+		if (!wd->stalled[i] && now - wd->since[i] >= limit)
+		{
+			wd->stalled[i] = 1;
+			__atomic_store_n(&wd->stalls[i], wd->stalls[i] + 1, __ATOMIC_RELAXED);
+			mctp_watchdog_emit(m, i, 1, backlog, now);
+		}
+	}
+}
+
+/**
+ * Watchdog thread
+ *
+ * Stages are only sampled while the pipeline threads run. A stage stalled
+ * when the threads stop is not reported as recovered
+ */
+static void *mctp_watchdog_thread(void *arg)
+{
+	struct mctp *m;
+	struct mctp_watchdog *wd;
+	int i, running;
+
+	m = (struct mctp*) arg;
+	wd = m->wd;
+	running = 0;
+
+	while (__atomic_load_n(&wd->stop, __ATOMIC_ACQUIRE) == 0)
+	{
+		// LOOP 1: Wait for the next sample
+		usleep(MCTP_WATCHDOG_POLL_MSEC * 1000);
+
+		// LOOP 2: Restart every stall timer when the threads start
+		if (!__atomic_load_n(&m->all_threads_started, __ATOMIC_ACQUIRE) || __atomic_load_n(&m->stop_threads, __ATOMIC_ACQUIRE))
+		{
+			running = 0;
+			continue;
+		}
+		if (!running)
+		{
+			for ( i = 0 ; i < MCWS_MAX ; i++ )
+			{
+				wd->seen[i] = ~0ULL;
+				wd->stalled[i] = 0;
+			}
+			running = 1;
+		}
+
+		// LOOP 3: Sample the stages
+		mctp_watchdog_sample(m);
+	}
+
+	return NULL;
+}
+
+/**
+ * Start the stage watchdog of an mctp object
+ *
+ * May be called before or after mctp_run(). Stages are sampled while the
+ * threads run. The callback is called from the watchdog thread and must not
+ * block
+ *
+ * @param msec 	Milliseconds a stage with input may go without progress. 0 for MCTP_WATCHDOG_MSEC
+ * @param fn 	Called on each stall and recovery. NULL to print them if MCTP_VERBOSE_ERROR is set
+ * @return 		0 upon success, 1 otherwise and sets errno
+ *
+ * STEPS
+ * 1: Verify input
+ * 2: Allocate the watchdog the first time
+ * 3: Start the watchdog thread
+ */
+int mctp_watchdog_start(struct mctp *m, unsigned msec, void (*fn)(struct mctp *m, struct mctp_stall *s))
+{
+	INIT
+	struct mctp_watchdog *wd;
+	int rv;
+
+	ENTER
+
+	// Initialize variables
+	rv = 1;
+
+	STEP // 1: Verify input
+	if (m->wd != NULL && m->wd->running)
+	{
+		errno = EBUSY;
+		goto end;
+	}
+	if (msec == 0)
+		msec = MCTP_WATCHDOG_MSEC;
+
+	STEP // 2: Allocate the watchdog the first time
+	if (m->wd == NULL)
+	{
+		m->wd = calloc(1, sizeof(struct mctp_watchdog));
+		if (m->wd == NULL)
+			goto end;
+	}
+	wd = m->wd;
+
+	STEP // 3: Start the watchdog thread
+	wd->msec = msec;
+	wd->fn = fn;
+	wd->stop = 0;
+	memset(wd->stalled, 0, sizeof(wd->stalled));
+
+	if (pthread_create(&wd->pt, NULL, mctp_watchdog_thread, m) != 0)
+	{
+		ERR32("pthread_create", errno);
+		goto end;
+	}
+	wd->running = 1;
+
+	rv = 0;
+
+end:
+
+	EXIT(rv);
+
+	return rv;
+}
+
+/**
+ * Stop the stage watchdog of an mctp object
+ *
+ * The stall counters are kept until mctp_free()
+ *
+ * @return 0 upon success, 1 if the watchdog was not running
+ */
+int mctp_watchdog_stop(struct mctp *m)
+{
+	if (m->wd == NULL || !m->wd->running)
+		return 1;
+
+	__atomic_store_n(&m->wd->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(m->wd->pt, NULL);
+	m->wd->running = 0;
+
+	return 0;
+}